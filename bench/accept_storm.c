@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Accept-storm benchmark: many threads connect, read the first reply
+   (welcome prompt or "Server full"/"Server busy") and close, as fast as possible.
+
+   Usage: ./bench/accept_storm [-h host] [-p port] [-u unix-path] [-t threads] [-d seconds]
+*/
+
+#define DEFAULT_PORT 5555
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 5
+
+typedef struct {
+    unsigned long attempts;
+    unsigned long connected;
+    unsigned long rejected;      // Server full / busy
+    unsigned long failed;        // connect() errors
+    double connect_us_total;
+} StormStats;
+
+struct sockaddr_storage target;  // sockaddr_in, or sockaddr_un with -u
+socklen_t target_len;
+volatile int storm_running = 1;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void *storm_worker(void *arg) {
+    StormStats *st = arg;
+    char reply[256];
+
+    while (storm_running) {
+        st->attempts++;
+
+        int fd = socket(target.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            st->failed++;
+            continue;
+        }
+
+        /* Bound the wait for a reply so a silent server cannot stall the run */
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        double t0 = now_us();
+        if (connect(fd, (struct sockaddr *)&target, target_len) < 0) {
+            st->failed++;
+            close(fd);
+            continue;
+        }
+        st->connect_us_total += now_us() - t0;
+        st->connected++;
+
+        /* Rejections are written immediately; admitted sessions wait for a username */
+        struct timeval quick = { 0, 2000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &quick, sizeof(quick));
+        ssize_t n = recv(fd, reply, sizeof(reply) - 1, 0);
+        if (n > 0) {
+            reply[n] = '\0';
+            if (strstr(reply, "Server full") || strstr(reply, "Server busy")) {
+                st->rejected++;
+            }
+        }
+
+        close(fd);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    const char *unix_path = NULL;
+    int port = DEFAULT_PORT;
+    int threads = DEFAULT_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:u:t:d:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'u': unix_path = optarg; break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-h host] [-p port] [-u unix-path] [-t threads] [-d seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+
+    memset(&target, 0, sizeof(target));
+    if (unix_path) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&target;
+        if (strlen(unix_path) >= sizeof(sun->sun_path)) {
+            fprintf(stderr, "Unix socket path too long: %s\n", unix_path);
+            return 1;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, unix_path);
+        target_len = sizeof(*sun);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&target;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &sin->sin_addr) != 1) {
+            fprintf(stderr, "Invalid host: %s\n", host);
+            return 1;
+        }
+        target_len = sizeof(*sin);
+    }
+
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    StormStats *stats = calloc(threads, sizeof(StormStats));
+
+    printf("=== NetChat Accept Storm ===\n");
+    if (unix_path) {
+        printf("Target %s, %d threads, %d s\n", unix_path, threads, seconds);
+    } else {
+        printf("Target %s:%d, %d threads, %d s\n", host, port, threads, seconds);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, storm_worker, &stats[i]);
+    }
+    sleep(seconds);
+    storm_running = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    StormStats total = { 0, 0, 0, 0, 0 };
+    for (int i = 0; i < threads; i++) {
+        total.attempts += stats[i].attempts;
+        total.connected += stats[i].connected;
+        total.rejected += stats[i].rejected;
+        total.failed += stats[i].failed;
+        total.connect_us_total += stats[i].connect_us_total;
+    }
+
+    printf("Attempts:      %lu\n", total.attempts);
+    printf("Connected:     %lu (%.0f connects/sec)\n", total.connected, total.connected / elapsed);
+    printf("  admitted:    %lu\n", total.connected - total.rejected);
+    printf("  rejected:    %lu (server full/busy)\n", total.rejected);
+    printf("Failed:        %lu\n", total.failed);
+    if (total.connected > 0) {
+        printf("Avg connect(): %.1f us\n", total.connect_us_total / total.connected);
+    }
+
+    free(tids);
+    free(stats);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../server/msg_crypt.h"
+
+/* Encryption benchmark: the server.js-compatible message cipher in server/msg_crypt.c.
+
+   Reports the scrypt key derivation (cold) against a key-cache hit, then
+   encrypt and decrypt throughput in plaintext MB/s for each message size,
+   one message per call and in batches, on AES-NI and on the table fallback.
+
+   Usage: ./bench/crypto_bench [-s sizes] [-b batch] [-d seconds]
+          sizes is a comma-separated list of plaintext lengths, e.g. -s 64,1024
+*/
+
+#define DEFAULT_SIZES "32,256,1024,4096"
+#define DEFAULT_BATCH 16
+#define DEFAULT_SECONDS 0.5      // Per measurement
+#define MAX_LIST 16
+#define MAX_BATCH 256
+#define PASSPHRASE "your_encryption_key_min_32_chars_long"  // server.js ENCRYPTION_KEY default
+
+typedef struct {
+    double encrypt_mbps;
+    double decrypt_mbps;
+    int failures;
+} Result;
+
+double seconds_per_run = DEFAULT_SECONDS;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int parse_list(const char *arg, int *out) {
+    int n = 0;
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", arg);
+    for (char *tok = strtok(copy, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) {
+        if (atoi(tok) > 0) out[n++] = atoi(tok);
+    }
+    return n;
+}
+
+/* batch messages of size bytes per call, repeated for the configured time */
+Result measure(const MsgKey *key, int size, int batch) {
+    Result r = { 0, 0, 0 };
+    size_t wire_cap = MSG_CRYPT_WIRE_LEN((size_t)size) + 1;
+    char *plain = malloc((size_t)size);
+    char *wire = malloc(wire_cap * (size_t)batch);
+    char *back = malloc(((size_t)size + 1) * (size_t)batch);
+    MsgCryptJob enc[MAX_BATCH], dec[MAX_BATCH];
+
+    for (int i = 0; i < size; i++) plain[i] = (char)('a' + i % 26);
+    for (int i = 0; i < batch; i++) {
+        enc[i] = (MsgCryptJob){ plain, (size_t)size, wire + i * wire_cap, wire_cap, -1 };
+    }
+
+    unsigned long calls = 0;
+    double t0 = now_us();
+    double elapsed;
+    do {
+        msg_encrypt_batch(key, enc, (size_t)batch);
+        calls++;
+    } while ((elapsed = now_us() - t0) < seconds_per_run * 1e6);
+    r.encrypt_mbps = (double)calls * batch * size / elapsed;  // bytes/us = MB/s
+
+    for (int i = 0; i < batch; i++) {
+        dec[i] = (MsgCryptJob){ enc[i].out, (size_t)enc[i].out_len, back + i * (size_t)(size + 1),
+                                (size_t)size + 1, -1 };
+    }
+    calls = 0;
+    t0 = now_us();
+    do {
+        msg_decrypt_batch(key, dec, (size_t)batch);
+        calls++;
+    } while ((elapsed = now_us() - t0) < seconds_per_run * 1e6);
+    r.decrypt_mbps = (double)calls * batch * size / elapsed;
+
+    for (int i = 0; i < batch; i++) {
+        if (dec[i].out_len != size || memcmp(dec[i].out, plain, (size_t)size) != 0) r.failures++;
+    }
+    free(plain);
+    free(wire);
+    free(back);
+    return r;
+}
+
+int main(int argc, char **argv) {
+    int sizes[MAX_LIST];
+    int size_count = parse_list(DEFAULT_SIZES, sizes);
+    int batch = DEFAULT_BATCH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:d:")) != -1) {
+        switch (opt) {
+            case 's': size_count = parse_list(optarg, sizes); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'd': seconds_per_run = atof(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-s sizes] [-b batch] [-d seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (batch < 1) batch = 1;
+    if (batch > MAX_BATCH) batch = MAX_BATCH;
+    if (seconds_per_run <= 0) seconds_per_run = DEFAULT_SECONDS;
+
+    printf("=== NetChat Message Encryption ===\n");
+    printf("AES-256-CBC, scrypt N=%d r=%d p=%d, batches of %d\n\n",
+           MSG_CRYPT_SCRYPT_N, MSG_CRYPT_SCRYPT_R, MSG_CRYPT_SCRYPT_P, batch);
+
+    MsgKey key;
+    double t0 = now_us();
+    if (msg_crypt_key(PASSPHRASE, &key) < 0) {
+        fprintf(stderr, "Key derivation failed\n");
+        return 1;
+    }
+    double cold_us = now_us() - t0;
+    t0 = now_us();
+    for (int i = 0; i < 1000; i++) msg_crypt_key(PASSPHRASE, &key);
+    double warm_us = (now_us() - t0) / 1000;
+    printf("%-22s %12.2f ms\n", "Key derivation", cold_us / 1e3);
+    printf("%-22s %12.2f us\n", "Cached key", warm_us);
+
+    /* AES-NI first: forcing the fallback cannot be undone */
+    const char *engines[2] = { msg_crypt_engine(), "portable" };
+    int engine_count = strcmp(engines[0], "portable") == 0 ? 1 : 2;
+    int failures = 0;
+    for (int e = 0; e < engine_count; e++) {
+        if (e == 1) msg_crypt_force_portable();
+        printf("\n[%s] MB/s of plaintext\n", engines[e]);
+        printf("%8s %12s %12s %12s %12s\n", "bytes", "enc x1", "enc batch", "dec x1", "dec batch");
+        for (int s = 0; s < size_count; s++) {
+            Result one = measure(&key, sizes[s], 1);
+            Result many = measure(&key, sizes[s], batch);
+            printf("%8d %12.1f %12.1f %12.1f %12.1f\n", sizes[s], one.encrypt_mbps, many.encrypt_mbps,
+                   one.decrypt_mbps, many.decrypt_mbps);
+            failures += one.failures + many.failures;
+        }
+    }
+    if (failures > 0) printf("\n%d messages did not decrypt back to their plaintext\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "../server/fanout_pool.h"
+
+/* Fan-out benchmark: time from the start of one room broadcast until the last
+   member's send() has returned, for a range of room sizes and sender-pool sizes.
+   Members are socketpairs; the far ends are drained between rounds, untimed.
+
+   Usage: ./bench/fanout_bench [-n sizes] [-t threads] [-r rounds] [-s bytes] [-c chunk]
+          sizes and threads are comma-separated lists, e.g. -n 1000,10000 -t 1,2,4
+*/
+
+#define DEFAULT_SIZES "100,1000,5000,50000"
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_BYTES 128
+#define DEFAULT_CHUNK 64
+#define MAX_LIST 16
+
+typedef struct {
+    const char *msg;
+    size_t len;
+    unsigned long failed;
+} Broadcast;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int parse_list(const char *arg, int *out) {
+    int n = 0;
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", arg);
+    for (char *tok = strtok(copy, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) {
+        if (atoi(tok) > 0) out[n++] = atoi(tok);
+    }
+    return n;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void send_one(int fd, void *arg) {
+    Broadcast *b = arg;
+    if (send(fd, b->msg, b->len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)b->len) {
+        __atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void drain(const int *readers, int count) {
+    char sink[65536];
+    for (int i = 0; i < count; i++) {
+        while (recv(readers[i], sink, sizeof(sink), MSG_DONTWAIT) > 0) {
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int sizes[MAX_LIST], threads[MAX_LIST];
+    int size_count = parse_list(DEFAULT_SIZES, sizes);
+    int thread_count = parse_list(DEFAULT_THREADS, threads);
+    int rounds = DEFAULT_ROUNDS;
+    size_t bytes = DEFAULT_BYTES;
+    size_t chunk = DEFAULT_CHUNK;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:r:s:c:")) != -1) {
+        switch (opt) {
+            case 'n': size_count = parse_list(optarg, sizes); break;
+            case 't': thread_count = parse_list(optarg, threads); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 's': bytes = (size_t)atoi(optarg); break;
+            case 'c': chunk = (size_t)atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n sizes] [-t threads] [-r rounds] [-s bytes] [-c chunk]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 1) rounds = 1;
+    if (bytes < 1) bytes = 1;
+
+    /* Two descriptors per member: take every one the hard limit allows */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    int max_members = rl.rlim_cur > 64 ? (int)((rl.rlim_cur - 64) / 2) : 0;
+
+    char *msg = malloc(bytes);
+    memset(msg, 'x', bytes);
+    msg[bytes - 1] = '\n';
+
+    printf("=== NetChat Room Fan-out ===\n");
+    printf("%zu-byte message, %d rounds, %zu recipients per chunk, %ld CPUs\n",
+           bytes, rounds, chunk, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %8s %12s %12s %12s %8s\n", "members", "senders", "median ms", "max ms", "sends/sec", "steals");
+
+    double *samples = calloc((size_t)rounds, sizeof(double));
+    for (int s = 0; s < size_count; s++) {
+        int members = sizes[s];
+        if (members > max_members) {
+            printf("%8d  skipped: needs %d descriptors, limit is %llu\n",
+                   members, members * 2, (unsigned long long)rl.rlim_cur);
+            continue;
+        }
+
+        int *writers = malloc(sizeof(int) * (size_t)members);
+        int *readers = malloc(sizeof(int) * (size_t)members);
+        int made = 0;
+        for (; made < members; made++) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) break;
+            fcntl(sv[0], F_SETFL, O_NONBLOCK);
+            writers[made] = sv[0];
+            readers[made] = sv[1];
+        }
+        if (made < members) {
+            printf("%8d  skipped: socketpair failed after %d (%s)\n", members, made, strerror(errno));
+        }
+
+        for (int t = 0; made == members && t < thread_count; t++) {
+            FanoutPool *pool = fanout_pool_create(threads[t]);
+            Broadcast b = { msg, bytes, 0 };
+            unsigned long steals_before = fanout_pool_steals(pool);
+            double total_us = 0;
+
+            for (int r = 0; r < rounds; r++) {
+                double t0 = now_us();
+                fanout_pool_run(pool, writers, (size_t)members, chunk, send_one, &b);
+                samples[r] = now_us() - t0;
+                total_us += samples[r];
+                drain(readers, members);
+            }
+
+            qsort(samples, (size_t)rounds, sizeof(double), cmp_double);
+            printf("%8d %8d %12.3f %12.3f %12.0f %8lu\n", members, fanout_pool_threads(pool),
+                   samples[rounds / 2] / 1e3, samples[rounds - 1] / 1e3,
+                   (double)members * rounds / (total_us / 1e6),
+                   fanout_pool_steals(pool) - steals_before);
+            if (b.failed > 0) printf("         %lu sends failed\n", b.failed);
+            fanout_pool_destroy(pool);
+        }
+
+        for (int i = 0; i < made; i++) {
+            close(writers[i]);
+            close(readers[i]);
+        }
+        free(writers);
+        free(readers);
+    }
+
+    free(samples);
+    free(msg);
+    return 0;
+}
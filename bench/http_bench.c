@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Static HTTP benchmark: keep-alive clients fetching one path from the web UI port
+   of server_enhanced (NETCHAT_HTTP_PORT, 5557 by default) as fast as it answers.
+
+   Each client is a thread with one connection and a pipeline of requests in flight;
+   responses are framed by Content-Length, so the body is read and dropped, never
+   parsed. -z asks for gzip and -e sends back the ETag of the first response as
+   If-None-Match, which measures 304 revalidation instead of transfer.
+
+   Usage: ./bench/http_bench [-p port] [-c clients] [-d seconds] [-u path]
+                             [-w pipeline] [-z] [-e]
+*/
+
+#define DEFAULT_PORT 5557
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_SECONDS 4
+#define DEFAULT_PIPELINE 1
+#define DEFAULT_PATH "/chat.js"
+#define MAX_SAMPLES 200000       // Per client
+#define READ_BUF 65536
+
+typedef struct {
+    pthread_t tid;
+    unsigned long responses;
+    unsigned long bytes;         // Body bytes
+    unsigned long errors;
+    unsigned long status_200;
+    unsigned long status_304;
+    unsigned long status_other;
+    double *samples;
+    size_t sample_count;
+} Client;
+
+int port = DEFAULT_PORT;
+int seconds = DEFAULT_SECONDS;
+int pipeline = DEFAULT_PIPELINE;
+const char *path = DEFAULT_PATH;
+int want_gzip = 0;
+int revalidate = 0;
+char etag[128];                  // Filled in by the probe when -e is given
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int build_request(char *buf, size_t size) {
+    char inm[160] = "";
+    if (revalidate && etag[0]) snprintf(inm, sizeof(inm), "If-None-Match: %s\r\n", etag);
+    return snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n%s%s\r\n",
+                    path, want_gzip ? "Accept-Encoding: gzip\r\n" : "", inm);
+}
+
+/* Reads one response off fd; buf/len carry bytes already received across calls.
+   Returns the status code, or -1 if the connection failed. */
+int read_response(int fd, char *buf, size_t *len, unsigned long *body_bytes, char *etag_out) {
+    char *end;
+    while (!(end = memmem(buf, *len, "\r\n\r\n", 4))) {
+        if (*len == READ_BUF) return -1;
+        ssize_t n = read(fd, buf + *len, READ_BUF - *len);
+        if (n <= 0) return -1;
+        *len += (size_t)n;
+    }
+    size_t head = (size_t)(end - buf) + 4;
+    int status = atoi(buf + 9);
+
+    size_t body = 0;
+    char *cl = strcasestr(buf, "\r\nContent-Length:");
+    if (cl && cl < end) body = (size_t)strtoul(cl + 17, NULL, 10);
+    if (etag_out) {
+        char *et = strcasestr(buf, "\r\nETag:");
+        if (et && et < end) sscanf(et + 7, " %127[^\r]", etag_out);
+    }
+
+    /* Drop the header, then the body as it arrives */
+    size_t have = *len - head;
+    if (have >= body) {
+        memmove(buf, buf + head + body, have - body);
+        *len = have - body;
+    } else {
+        size_t left = body - have;
+        *len = 0;
+        while (left > 0) {
+            ssize_t n = read(fd, buf, left < READ_BUF ? left : READ_BUF);
+            if (n <= 0) return -1;
+            left -= (size_t)n;
+        }
+    }
+    *body_bytes += body;
+    return status;
+}
+
+void *client_thread(void *arg) {
+    Client *c = arg;
+    char *buf = malloc(READ_BUF);
+    char req[512];
+    int req_len = build_request(req, sizeof(req));
+    double *sent_at = calloc((size_t)pipeline, sizeof(double));
+    double deadline = now_us() + seconds * 1e6;
+
+    int fd = connect_server();
+    size_t len = 0;
+    while (fd >= 0 && now_us() < deadline) {
+        /* Fill the pipeline, then take the answers in order */
+        char batch[512 * 16];
+        int batch_len = 0;
+        for (int i = 0; i < pipeline; i++) {
+            memcpy(batch + batch_len, req, (size_t)req_len);
+            batch_len += req_len;
+        }
+        double t0 = now_us();
+        for (int i = 0; i < pipeline; i++) sent_at[i] = t0;
+        if (write(fd, batch, (size_t)batch_len) != batch_len) {
+            c->errors++;
+            break;
+        }
+        for (int i = 0; i < pipeline; i++) {
+            int status = read_response(fd, buf, &len, &c->bytes, NULL);
+            if (status < 0) {
+                c->errors++;
+                close(fd);
+                fd = connect_server();  // The server may close; carry on with a new connection
+                len = 0;
+                break;
+            }
+            if (status == 200) c->status_200++;
+            else if (status == 304) c->status_304++;
+            else c->status_other++;
+            c->responses++;
+            if (c->sample_count < MAX_SAMPLES) c->samples[c->sample_count++] = now_us() - sent_at[i];
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(sent_at);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int clients = DEFAULT_CLIENTS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:c:d:u:w:ze")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'c': clients = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'u': path = optarg; break;
+            case 'w': pipeline = atoi(optarg); break;
+            case 'z': want_gzip = 1; break;
+            case 'e': revalidate = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-c clients] [-d seconds] [-u path] "
+                                "[-w pipeline] [-z] [-e]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (clients < 1) clients = 1;
+    if (clients > 512) clients = 512;
+    if (seconds < 1) seconds = 1;
+    if (pipeline < 1) pipeline = 1;
+    if (pipeline > 16) pipeline = 16;
+    if (strlen(path) > 256 || path[0] != '/') {
+        fprintf(stderr, "Path must start with / and fit in 256 bytes: %s\n", path);
+        return 1;
+    }
+
+    /* One request first: is anything there, and what ETag to send back */
+    int fd = connect_server();
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    char req[512];
+    char *buf = malloc(READ_BUF);
+    size_t len = 0;
+    unsigned long probe_bytes = 0;
+    int req_len = build_request(req, sizeof(req));
+    int status = -1;
+    if (write(fd, req, (size_t)req_len) == req_len) status = read_response(fd, buf, &len, &probe_bytes, etag);
+    close(fd);
+    free(buf);
+    if (status != 200) {
+        fprintf(stderr, "GET %s returned %d\n", path, status);
+        return 1;
+    }
+
+    printf("=== NetChat Static HTTP Benchmark ===\n");
+    printf("GET %s on 127.0.0.1:%d: %lu-byte body%s, %d clients, pipeline %d, %d s%s\n\n",
+           path, port, probe_bytes, want_gzip ? " (gzip)" : "", clients, pipeline, seconds,
+           revalidate ? ", If-None-Match" : "");
+
+    Client *all = calloc((size_t)clients, sizeof(Client));
+    for (int i = 0; i < clients; i++) {
+        all[i].samples = malloc(MAX_SAMPLES * sizeof(double));
+        pthread_create(&all[i].tid, NULL, client_thread, &all[i]);
+    }
+
+    Client total;
+    memset(&total, 0, sizeof(total));
+    size_t sample_total = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(all[i].tid, NULL);
+        total.responses += all[i].responses;
+        total.bytes += all[i].bytes;
+        total.errors += all[i].errors;
+        total.status_200 += all[i].status_200;
+        total.status_304 += all[i].status_304;
+        total.status_other += all[i].status_other;
+        sample_total += all[i].sample_count;
+    }
+
+    double *samples = malloc((sample_total ? sample_total : 1) * sizeof(double));
+    size_t count = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(samples + count, all[i].samples, all[i].sample_count * sizeof(double));
+        count += all[i].sample_count;
+        free(all[i].samples);
+    }
+    qsort(samples, count, sizeof(double), compare_double);
+
+    printf("%-22s %14lu\n", "Responses", total.responses);
+    printf("%-22s %14lu\n", "  200", total.status_200);
+    printf("%-22s %14lu\n", "  304", total.status_304);
+    printf("%-22s %14lu\n", "  other", total.status_other);
+    printf("%-22s %14lu\n", "Errors", total.errors);
+    printf("%-22s %14.0f\n", "Requests/s", total.responses / (double)seconds);
+    printf("%-22s %14.2f\n", "Body (MB/s)", total.bytes / (double)seconds / (1024.0 * 1024.0));
+    if (count > 0) {
+        printf("%-22s %14.1f\n", "p50 latency (us)", samples[count / 2]);
+        printf("%-22s %14.1f\n", "p99 latency (us)", samples[(size_t)(count * 0.99)]);
+    }
+
+    free(samples);
+    free(all);
+    return total.errors > total.responses / 100 ? 1 : 0;
+}
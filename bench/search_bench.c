@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../server/search_index.h"
+
+/* Search benchmark: the full-text index in server/search_index.c.
+
+   Feeds a synthetic chat history through the writer thread - words drawn
+   from a Zipf distribution over a made-up vocabulary, spread over rooms and
+   users - then times queries of different selectivity through a reader, as
+   a /search in a child process would run them.
+
+   Usage: ./bench/search_bench [-n messages] [-r rooms] [-u users] [-v vocabulary]
+                               [-q queries] [-D dir] [-k]
+          -k keeps the index already in dir and only runs the queries
+*/
+
+#define DEFAULT_MESSAGES 1000000
+#define DEFAULT_ROOMS 50
+#define DEFAULT_USERS 500
+#define DEFAULT_VOCAB 50000
+#define DEFAULT_QUERIES 200
+#define DEFAULT_DIR "/tmp/netchat_search_bench"
+#define SYNC_EVERY 32768         // Stay well under the writer's queue limit
+#define HITS 20                  // As many as /search shows
+
+typedef struct {
+    const char *name;
+    double *samples;
+    int count;
+    unsigned long hits;
+} QueryKind;
+
+int vocab_size = DEFAULT_VOCAB;
+char (*vocab)[12];
+double *zipf_cdf;
+unsigned long long rng = 88172645463325252ULL;
+
+unsigned long long next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Vocabulary rank r: a pronounceable made-up word, different for every rank */
+void build_vocabulary() {
+    static const char consonants[] = "bcdfghjklmnprstvwz";
+    static const char vowels[] = "aeiou";
+    vocab = malloc((size_t)vocab_size * sizeof(*vocab));
+    zipf_cdf = malloc((size_t)vocab_size * sizeof(double));
+    for (int r = 0; r < vocab_size; r++) {
+        int v = r, n = 0;
+        do {
+            vocab[r][n++] = consonants[v % 18];
+            v /= 18;
+            vocab[r][n++] = vowels[v % 5];
+            v /= 5;
+        } while (v > 0 && n < 10);
+        vocab[r][n] = '\0';
+    }
+    double sum = 0;
+    for (int r = 0; r < vocab_size; r++) sum += 1.0 / (r + 1);
+    double acc = 0;
+    for (int r = 0; r < vocab_size; r++) {
+        acc += 1.0 / (r + 1) / sum;
+        zipf_cdf[r] = acc;
+    }
+}
+
+int zipf_word() {
+    double u = (double)(next_random() % 1000000007ULL) / 1000000007.0;
+    int lo = 0, hi = vocab_size - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+unsigned long long dir_bytes(const char *dir) {
+    unsigned long long total = 0;
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) total += (unsigned long long)st.st_size;
+    }
+    if (d) closedir(d);
+    return total;
+}
+
+void clear_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (de->d_name[0] != '.') unlink(path);
+    }
+    if (d) closedir(d);
+}
+
+void run_query(SearchReader *reader, QueryKind *kind, const SearchQuery *q, SearchHit *hits) {
+    double t0 = now_us();
+    int n = search_run(reader, q, hits, HITS);
+    kind->samples[kind->count++] = (now_us() - t0) / 1000.0;
+    if (n > 0) kind->hits += (unsigned long)n;
+}
+
+int main(int argc, char **argv) {
+    int messages = DEFAULT_MESSAGES;
+    int rooms = DEFAULT_ROOMS;
+    int users = DEFAULT_USERS;
+    int queries = DEFAULT_QUERIES;
+    const char *dir = DEFAULT_DIR;
+    int keep = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:u:v:q:D:k")) != -1) {
+        switch (opt) {
+            case 'n': messages = atoi(optarg); break;
+            case 'r': rooms = atoi(optarg); break;
+            case 'u': users = atoi(optarg); break;
+            case 'v': vocab_size = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            case 'D': dir = optarg; break;
+            case 'k': keep = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n messages] [-r rooms] [-u users] [-v vocabulary] "
+                                "[-q queries] [-D dir] [-k]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rooms < 1) rooms = 1;
+    if (users < 1) users = 1;
+    if (vocab_size < 1000) vocab_size = 1000;
+    if (queries < 1) queries = 1;
+    build_vocabulary();
+
+    printf("=== NetChat Search Index ===\n");
+    if (!keep) {
+        mkdir(dir, 0755);
+        clear_dir(dir);
+        SearchIndex *idx = search_index_open(dir);
+        if (!idx) {
+            perror("search_index_open");
+            return 1;
+        }
+
+        double t0 = now_us();
+        char body[256];
+        for (int i = 0; i < messages; i++) {
+            int words = 6 + (int)(next_random() % 11);
+            size_t len = 0;
+            for (int w = 0; w < words; w++) {
+                len += (size_t)snprintf(body + len, sizeof(body) - len, "%s%s", w ? " " : "",
+                                        vocab[zipf_word()]);
+            }
+            char room[16], user[16];
+            snprintf(room, sizeof(room), "room%d", (int)(next_random() % (unsigned)rooms));
+            snprintf(user, sizeof(user), "user%d", (int)(next_random() % (unsigned)users));
+            search_index_add(idx, room, user, (uint64_t)i + 1, body, len);
+            if ((i + 1) % SYNC_EVERY == 0) search_index_sync(idx);
+        }
+        search_index_sync(idx);
+        double secs = (now_us() - t0) / 1e6;
+
+        uint32_t docs;
+        int segments;
+        unsigned long dropped;
+        search_index_info(idx, &docs, &segments, &dropped);
+        search_index_close(idx);
+        printf("Indexed %u messages in %.2f s (%.0f msg/s), %d segments, %.1f MB on disk, %lu dropped\n",
+               docs, secs, docs / secs, segments, dir_bytes(dir) / (1024.0 * 1024.0), dropped);
+    }
+
+    SearchReader *reader = search_reader_open(dir);
+    SearchHit *hits = malloc(HITS * sizeof(SearchHit));
+    SearchQuery probe = { vocab[0], NULL, NULL, 0 };
+    if (!reader || search_run(reader, &probe, hits, 1) < 0) {
+        fprintf(stderr, "No index in %s\n", dir);
+        return 1;
+    }
+    uint32_t docs;
+    int segments;
+    search_reader_info(reader, &docs, &segments);
+    printf("Querying %u messages in %d segments, %d queries per kind, newest %d hits\n\n",
+           docs, segments, queries, HITS);
+
+    QueryKind kinds[] = {
+        { "common word", NULL, 0, 0 },
+        { "rare word", NULL, 0, 0 },
+        { "two words", NULL, 0, 0 },
+        { "word in room", NULL, 0, 0 },
+        { "word by user in room", NULL, 0, 0 },
+        { "room only", NULL, 0, 0 },
+        { "word since 1h", NULL, 0, 0 },
+        { "absent word", NULL, 0, 0 },
+    };
+    int kind_count = (int)(sizeof(kinds) / sizeof(kinds[0]));
+    for (int k = 0; k < kind_count; k++) kinds[k].samples = malloc((size_t)queries * sizeof(double));
+
+    for (int i = 0; i < queries; i++) {
+        char room[16], user[16], two[32];
+        snprintf(room, sizeof(room), "room%d", (int)(next_random() % (unsigned)rooms));
+        snprintf(user, sizeof(user), "user%d", (int)(next_random() % (unsigned)users));
+        const char *common = vocab[next_random() % 10];
+        const char *mid = vocab[100 + next_random() % 900];
+        const char *rare = vocab[vocab_size / 2 + next_random() % (unsigned)(vocab_size / 2)];
+        snprintf(two, sizeof(two), "%s %s", common, mid);
+
+        SearchQuery q[] = {
+            { common, NULL, NULL, 0 },
+            { rare, NULL, NULL, 0 },
+            { two, NULL, NULL, 0 },
+            { mid, room, NULL, 0 },
+            { common, room, user, 0 },
+            { NULL, room, NULL, 0 },
+            { mid, NULL, NULL, time(NULL) - 3600 },
+            { "zzzzzz", NULL, NULL, 0 },
+        };
+        for (int k = 0; k < kind_count; k++) run_query(reader, &kinds[k], &q[k], hits);
+    }
+
+    printf("%-22s %10s %10s %10s\n", "query", "avg hits", "p50 ms", "p99 ms");
+    for (int k = 0; k < kind_count; k++) {
+        qsort(kinds[k].samples, (size_t)kinds[k].count, sizeof(double), compare_double);
+        printf("%-22s %10.1f %10.3f %10.3f\n", kinds[k].name, (double)kinds[k].hits / kinds[k].count,
+               kinds[k].samples[kinds[k].count / 2], kinds[k].samples[(int)(kinds[k].count * 0.99)]);
+        free(kinds[k].samples);
+    }
+
+    search_reader_close(reader);
+    free(hits);
+    return 0;
+}
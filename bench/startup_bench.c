@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Startup benchmark: how long server_enhanced takes to start accepting.
+
+   Writes a history.log of synthetic room chat into a scratch directory,
+   then starts the server there again and again and times each start until
+   a connect() to its port succeeds. A cold start has no snapshot and
+   replays the whole history file; its shutdown writes snapshot.bin, which
+   the warm start that follows loads instead. Shutdown times include
+   writing that snapshot.
+
+   Needs the server's port free: stop any other server first.
+
+   Usage: ./bench/startup_bench [-n messages] [-r rooms] [-i iterations] [-s server] [-D dir]
+*/
+
+#define DEFAULT_MESSAGES 1000000
+#define DEFAULT_ROOMS 50
+#define DEFAULT_ITERATIONS 3
+#define DEFAULT_SERVER "server/server_enhanced"
+#define DEFAULT_DIR "/tmp/netchat_startup_bench"
+#define SERVER_PORT 5555
+#define START_TIMEOUT_MS 120000
+
+typedef struct {
+    double start_ms;
+    double stop_ms;
+} RunTimes;
+
+unsigned long long rng = 88172645463325252ULL;
+
+unsigned long long next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+long long file_size(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+/* The server's own record format: "seq<TAB>len<TAB>room\n" and the rendered line */
+int write_history(const char *dir, int messages, int rooms) {
+    static const char *words[] = { "deploy", "lunch", "review", "merge", "ticket", "coffee",
+                                   "build", "green", "again", "today", "later", "thanks" };
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/history.log", dir);
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    unsigned long long *seqs = calloc((size_t)rooms, sizeof(*seqs));
+    char text[256];
+    for (int i = 0; i < messages; i++) {
+        int room = (int)(next_random() % (unsigned)rooms);
+        int len = snprintf(text, sizeof(text), "[%02d:%02d:%02d] [#room%d] user%d:", (i / 3600) % 24,
+                           (i / 60) % 60, i % 60, room, (int)(next_random() % 500));
+        int count = 4 + (int)(next_random() % 12);
+        for (int w = 0; w < count; w++) {
+            len += snprintf(text + len, sizeof(text) - (size_t)len, " %s", words[next_random() % 12]);
+        }
+        text[len++] = '\n';
+        fprintf(f, "%llu\t%d\troom%d\n", ++seqs[room], len, room);
+        fwrite(text, 1, (size_t)len, f);
+    }
+    free(seqs);
+    return fclose(f);
+}
+
+int port_open() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+    int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+/* Start the server in dir, time it until it accepts, stop it and time that; -1 if it never came up */
+int run_server(const char *server, const char *dir, RunTimes *t) {
+    double t0 = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        char log_path[PATH_MAX];
+        snprintf(log_path, sizeof(log_path), "%s/server.log", dir);
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (chdir(dir) < 0 || log_fd < 0) _exit(127);
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        /* Only what is being measured: no search index, log archive or extra listeners */
+        setenv("NETCHAT_SEARCH_DIR", "", 1);
+        setenv("NETCHAT_LOG_DIR", "", 1);
+        setenv("NETCHAT_WS_PORT", "0", 1);
+        setenv("NETCHAT_HTTP_PORT", "0", 1);
+        setenv("NETCHAT_UNIX_PATH", "", 1);
+        setenv("NETCHAT_SNAPSHOT_SEC", "0", 1);
+        unsetenv("NETCHAT_SNAPSHOT");
+        execl(server, server, (char *)NULL);
+        _exit(127);
+    }
+
+    int up = 0;
+    while (!up && now_ms() - t0 < START_TIMEOUT_MS) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) return -1;
+        up = port_open();
+        if (!up) usleep(500);
+    }
+    t->start_ms = now_ms() - t0;
+
+    double t1 = now_ms();
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    t->stop_ms = now_ms() - t1;
+    return up ? 0 : -1;
+}
+
+void report(const char *name, RunTimes *runs, int n) {
+    double start[n], stop[n];
+    for (int i = 0; i < n; i++) {
+        start[i] = runs[i].start_ms;
+        stop[i] = runs[i].stop_ms;
+    }
+    qsort(start, (size_t)n, sizeof(double), compare_double);
+    qsort(stop, (size_t)n, sizeof(double), compare_double);
+    printf("%-30s %10.1f %10.1f %12.1f\n", name, start[n / 2], start[0], stop[n / 2]);
+}
+
+int main(int argc, char **argv) {
+    int messages = DEFAULT_MESSAGES;
+    int rooms = DEFAULT_ROOMS;
+    int iterations = DEFAULT_ITERATIONS;
+    const char *server_arg = DEFAULT_SERVER;
+    const char *dir = DEFAULT_DIR;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:i:s:D:")) != -1) {
+        switch (opt) {
+            case 'n': messages = atoi(optarg); break;
+            case 'r': rooms = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 's': server_arg = optarg; break;
+            case 'D': dir = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n messages] [-r rooms] [-i iterations] [-s server] [-D dir]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (rooms < 1) rooms = 1;
+    if (iterations < 1) iterations = 1;
+
+    char server[PATH_MAX];
+    if (!realpath(server_arg, server)) {
+        perror(server_arg);
+        return 1;
+    }
+    if (port_open()) {
+        fprintf(stderr, "Port %d is already accepting: stop the running server first\n", SERVER_PORT);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    close(open("/tmp/netchat_key", O_WRONLY | O_CREAT, 0644));  // The server's ftok() key
+
+    printf("=== NetChat Startup ===\n");
+    mkdir(dir, 0755);
+    char path[PATH_MAX];
+    const char *stale[] = { "snapshot.bin", "chat.log", "server.log", "users.txt" };
+    for (size_t i = 0; i < sizeof(stale) / sizeof(stale[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, stale[i]);
+        unlink(path);
+    }
+    double t0 = now_ms();
+    if (write_history(dir, messages, rooms) != 0) {
+        perror("history.log");
+        return 1;
+    }
+    printf("Wrote %d messages in %d rooms to %s/history.log (%.1f MB) in %.2f s\n\n", messages, rooms, dir,
+           file_size(dir, "history.log") / (1024.0 * 1024.0), (now_ms() - t0) / 1000);
+
+    RunTimes cold[iterations], warm[iterations];
+    long long snapshot_bytes = 0;
+    for (int i = 0; i < iterations; i++) {
+        snprintf(path, sizeof(path), "%s/snapshot.bin", dir);
+        unlink(path);
+        if (run_server(server, dir, &cold[i]) < 0) {
+            fprintf(stderr, "Server did not start: see %s/server.log\n", dir);
+            return 1;
+        }
+        snapshot_bytes = file_size(dir, "snapshot.bin");
+        if (snapshot_bytes < 0) {
+            fprintf(stderr, "Shutdown left no snapshot: see %s/server.log\n", dir);
+            return 1;
+        }
+        if (run_server(server, dir, &warm[i]) < 0) {
+            fprintf(stderr, "Server did not start from the snapshot: see %s/server.log\n", dir);
+            return 1;
+        }
+    }
+
+    printf("Snapshot: %.1f KB; %d starts of each kind\n\n", snapshot_bytes / 1024.0, iterations);
+    printf("%-30s %10s %10s %12s\n", "start", "p50 ms", "min ms", "stop p50 ms");
+    report("cold (replay history.log)", cold, iterations);
+    report("warm (snapshot)", warm, iterations);
+    return 0;
+}
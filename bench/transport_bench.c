@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Transport benchmark: the same workload against server_enhanced over loopback TCP
+   and over its Unix socket, reported side by side.
+
+   For each transport:
+     login      - sequential connect + login until the welcome banner arrives
+     latency    - one message in flight: send on a bridge channel, wait for the echo
+     throughput - bridge channels in separate rooms with a window of messages in flight
+
+   Latency and throughput go through a bridge connection ("@bridge", see FEATURES.md)
+   because terminal sessions are capped at 10 messages/sec by the per-user limiter;
+   the bridge is what co-located gateways use anyway. Each channel gets its own room
+   and sends rotate over them, so the per-room fan-out budget is not what is measured.
+
+   Usage: ./bench/transport_bench [-p port] [-u unix-path] [-d seconds] [-c channels]
+                                  [-w window] [-s bytes] [-l logins]
+*/
+
+#define DEFAULT_PORT 5555
+#define DEFAULT_UNIX_PATH "/tmp/netchat.sock"
+#define DEFAULT_SECONDS 4
+#define DEFAULT_CHANNELS 32
+#define DEFAULT_WINDOW 16
+#define DEFAULT_PAYLOAD 64
+#define DEFAULT_LOGINS 50
+#define MAX_SAMPLES 200000
+#define STALL_MS 500             // No echo for this long: count the window as lost
+
+#define BRIDGE_OPEN 0x01
+#define BRIDGE_EVENT 0x03
+#define BRIDGE_DELIVER 0x81
+
+typedef struct {
+    const char *name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} Transport;
+
+typedef struct {
+    int logins;
+    int login_rejected;
+    double login_ms_total;
+    double rtt_p50_us;
+    double rtt_p99_us;
+    double rtt_avg_us;
+    unsigned long rtt_samples;
+    double msgs_per_sec;
+    double mb_per_sec;
+    unsigned long stalls;
+} TransportResult;
+
+int seconds = DEFAULT_SECONDS;
+int channels = DEFAULT_CHANNELS;
+int window = DEFAULT_WINDOW;
+int payload_size = DEFAULT_PAYLOAD;
+int login_count = DEFAULT_LOGINS;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int connect_transport(const Transport *t) {
+    int fd = socket(t->addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (const struct sockaddr *)&t->addr, t->addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (t->addr.ss_family == AF_INET) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    return fd;
+}
+
+int send_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Read until needle shows up in the stream or timeout_ms passes; 1 if found */
+int wait_for(int fd, const char *needle, int timeout_ms) {
+    char buf[8192];
+    size_t have = 0;
+    double deadline = now_us() + timeout_ms * 1000.0;
+
+    while (now_us() < deadline) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int left = (int)((deadline - now_us()) / 1000.0) + 1;
+        if (poll(&pfd, 1, left) <= 0) continue;
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (n <= 0) return 0;
+        have += (size_t)n;
+        buf[have] = '\0';
+        if (strstr(buf, needle)) return 1;
+        if (have > sizeof(buf) / 2) {
+            /* Keep a tail long enough to catch a needle split across reads */
+            memmove(buf, buf + have - 64, 64);
+            have = 64;
+        }
+    }
+    return 0;
+}
+
+void run_logins(const Transport *t, TransportResult *r) {
+    char creds[64];
+    for (int i = 0; i < login_count; i++) {
+        double t0 = now_us();
+        int fd = connect_transport(t);
+        if (fd < 0) {
+            r->login_rejected++;
+            continue;
+        }
+        int len = snprintf(creds, sizeof(creds), "tbench%d\nbench\n", i);
+        if (send_all(fd, creds, (size_t)len) == 0 && wait_for(fd, "WELCOME", 2000)) {
+            r->logins++;
+            r->login_ms_total += (now_us() - t0) / 1000.0;
+        } else {
+            r->login_rejected++;
+        }
+        close(fd);
+        usleep(2000);  // Give the parent a moment to reap the previous session
+    }
+}
+
+/* ========= BRIDGE FRAMES ========= */
+
+typedef struct {
+    int fd;
+    uint8_t buf[1 << 16];
+    size_t have;
+    unsigned long bytes_read;
+} BridgeConn;
+
+void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+int bridge_frame(BridgeConn *b, int type, uint32_t channel, const char *body, size_t body_len) {
+    uint8_t frame[16384];
+    if (body_len + 9 > sizeof(frame)) return -1;
+    put_u32(frame, (uint32_t)(5 + body_len));
+    frame[4] = (uint8_t)type;
+    put_u32(frame + 5, channel);
+    memcpy(frame + 9, body, body_len);
+    return send_all(b->fd, frame, 9 + body_len);
+}
+
+int bridge_event(BridgeConn *b, uint32_t channel, const char *json) {
+    return bridge_frame(b, BRIDGE_EVENT, channel, json, strlen(json));
+}
+
+/* Count DELIVER frames carrying chat ("type":"user") that arrive within timeout_ms;
+   returns -1 when the connection is gone. *bytes accumulates their frame sizes. */
+int bridge_poll_chat(BridgeConn *b, int timeout_ms, unsigned long *bytes) {
+    struct pollfd pfd = { b->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+
+    ssize_t n = recv(b->fd, b->buf + b->have, sizeof(b->buf) - b->have, 0);
+    if (n <= 0) return -1;
+    b->have += (size_t)n;
+    b->bytes_read += (unsigned long)n;
+
+    int chat = 0;
+    size_t pos = 0;
+    while (b->have - pos >= 5) {
+        uint32_t len = get_u32(b->buf + pos);
+        if (b->have - pos < 4 + (size_t)len) break;
+        const uint8_t *frame = b->buf + pos + 4;
+        if (frame[0] == BRIDGE_DELIVER && len > 3) {
+            size_t ids = 2 + (size_t)((frame[1] << 8) | frame[2]) * 4;
+            if (ids < len && memmem(frame + 1 + ids, len - 1 - ids, "\"type\":\"user\"", 13)) {
+                chat++;
+                if (bytes) *bytes += 4 + len;
+            }
+        }
+        pos += 4 + (size_t)len;
+    }
+    memmove(b->buf, b->buf + pos, b->have - pos);
+    b->have -= pos;
+    return chat;
+}
+
+/* Like bridge_poll_chat, but keeps reading through notices and partial frames;
+   0 only when the line was silent for timeout_ms */
+int bridge_wait_chat(BridgeConn *b, int timeout_ms, unsigned long *bytes) {
+    for (;;) {
+        unsigned long before = b->bytes_read;
+        int got = bridge_poll_chat(b, timeout_ms, bytes);
+        if (got != 0 || b->bytes_read == before) return got;
+    }
+}
+
+/* Drain whatever notices are queued until the line goes quiet */
+void bridge_settle(BridgeConn *b) {
+    for (;;) {
+        unsigned long before = b->bytes_read;
+        if (bridge_poll_chat(b, 200, NULL) < 0 || b->bytes_read == before) break;
+    }
+}
+
+int bridge_open(const Transport *t, BridgeConn *b, const char *tag) {
+    b->have = 0;
+    b->bytes_read = 0;
+    b->fd = connect_transport(t);
+    if (b->fd < 0) return -1;
+    if (send_all(b->fd, "@bridge\n-\n", 10) < 0 || !wait_for(b->fd, "NCBRIDGE/1\n", 2000)) {
+        fprintf(stderr, "%s: bridge login refused\n", t->name);
+        close(b->fd);
+        return -1;
+    }
+
+    char name[32];
+    char json[128];
+    for (int c = 1; c <= channels; c++) {
+        int len = snprintf(name, sizeof(name), "tb-%s-%d", tag, c);
+        bridge_frame(b, BRIDGE_OPEN, (uint32_t)c, name, (size_t)len);
+        snprintf(json, sizeof(json), "{\"event\":\"room:join\",\"data\":{\"roomName\":\"tb-%s-%d\"}}", tag, c);
+        bridge_event(b, (uint32_t)c, json);
+    }
+    bridge_settle(b);
+    return 0;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void run_latency(BridgeConn *b, TransportResult *r, const char *json, double duration_us) {
+    double *samples = malloc(sizeof(double) * MAX_SAMPLES);
+    unsigned long count = 0;
+    double total = 0;
+    uint32_t next_channel = 1;
+    double end = now_us() + duration_us;
+
+    while (now_us() < end && count < MAX_SAMPLES && samples) {
+        double t0 = now_us();
+        if (bridge_event(b, next_channel, json) < 0) break;
+        next_channel = next_channel % (uint32_t)channels + 1;
+
+        int got = bridge_wait_chat(b, STALL_MS, NULL);
+        if (got < 0) break;
+        if (got == 0) {
+            r->stalls++;
+            bridge_settle(b);  // A late echo must not be timed against the next send
+            continue;
+        }
+        double rtt = now_us() - t0;
+        samples[count++] = rtt;
+        total += rtt;
+    }
+
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_double);
+        r->rtt_samples = count;
+        r->rtt_avg_us = total / count;
+        r->rtt_p50_us = samples[count / 2];
+        r->rtt_p99_us = samples[(size_t)(count * 0.99)];
+    }
+    free(samples);
+}
+
+void run_throughput(BridgeConn *b, TransportResult *r, const char *json, double duration_us) {
+    unsigned long delivered = 0;
+    unsigned long bytes = 0;
+    int outstanding = 0;
+    uint32_t next_channel = 1;
+    double start = now_us();
+    double end = start + duration_us;
+
+    while (now_us() < end) {
+        while (outstanding < window) {
+            if (bridge_event(b, next_channel, json) < 0) return;
+            next_channel = next_channel % (uint32_t)channels + 1;
+            outstanding++;
+        }
+        int got = bridge_wait_chat(b, STALL_MS, &bytes);
+        if (got < 0) break;
+        if (got == 0) {
+            r->stalls++;       // Dropped under load: stop waiting for them
+            outstanding = 0;
+            continue;
+        }
+        delivered += (unsigned long)got;
+        outstanding -= got;
+        if (outstanding < 0) outstanding = 0;
+    }
+
+    double elapsed = (now_us() - start) / 1e6;
+    bridge_settle(b);
+    r->msgs_per_sec = delivered / elapsed;
+    r->mb_per_sec = bytes / elapsed / (1024.0 * 1024.0);
+}
+
+void run_transport(const Transport *t, TransportResult *r, const char *json) {
+    memset(r, 0, sizeof(*r));
+    printf("[%s] logins...\n", t->name);
+    fflush(stdout);
+    run_logins(t, r);
+
+    static BridgeConn b;
+    if (bridge_open(t, &b, t->name) < 0) return;
+
+    printf("[%s] latency (%d s)...\n", t->name, seconds);
+    fflush(stdout);
+    run_latency(&b, r, json, seconds * 1e6);
+
+    printf("[%s] throughput (%d s, %d channels, window %d)...\n", t->name, seconds, channels, window);
+    fflush(stdout);
+    run_throughput(&b, r, json, seconds * 1e6);
+    close(b.fd);
+    /* The burst of leave notices can raise the overload level, which turns away
+       logins; give the controller (250 ms checks, one level at a time) time to settle */
+    usleep(1500000);
+}
+
+int main(int argc, char **argv) {
+    int port = DEFAULT_PORT;
+    const char *unix_path = DEFAULT_UNIX_PATH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:d:c:w:s:l:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'u': unix_path = optarg; break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'c': channels = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 's': payload_size = atoi(optarg); break;
+            case 'l': login_count = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-u unix-path] [-d seconds] [-c channels] "
+                                "[-w window] [-s bytes] [-l logins]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (seconds < 1) seconds = 1;
+    if (channels < 1) channels = 1;
+    if (channels > 64) channels = 64;   // One room budget each; the server tracks 64 rooms
+    if (window < 1) window = 1;
+    if (payload_size < 1) payload_size = 1;
+    if (payload_size > 900) payload_size = 900;
+
+    Transport transports[2];
+    memset(transports, 0, sizeof(transports));
+
+    transports[0].name = "tcp";
+    struct sockaddr_in *sin = (struct sockaddr_in *)&transports[0].addr;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    transports[0].addr_len = sizeof(*sin);
+
+    transports[1].name = "unix";
+    struct sockaddr_un *sun = (struct sockaddr_un *)&transports[1].addr;
+    if (strlen(unix_path) >= sizeof(sun->sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", unix_path);
+        return 1;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, unix_path);
+    transports[1].addr_len = sizeof(*sun);
+
+    /* Every message is the same size; the body is plain filler */
+    char json[1024];
+    char body[901];
+    memset(body, 'x', (size_t)payload_size);
+    body[payload_size] = '\0';
+    snprintf(json, sizeof(json), "{\"event\":\"message:send\",\"data\":{\"message\":\"%s\"}}", body);
+
+    printf("=== NetChat Transport Benchmark ===\n");
+    printf("TCP 127.0.0.1:%d vs Unix %s, %d-byte messages\n\n", port, unix_path, payload_size);
+
+    TransportResult results[2];
+    for (int i = 0; i < 2; i++) {
+        run_transport(&transports[i], &results[i], json);
+    }
+
+    printf("\n%-22s %14s %14s\n", "", "tcp", "unix");
+    printf("%-22s %14d %14d\n", "Logins", results[0].logins, results[1].logins);
+    printf("%-22s %14d %14d\n", "  rejected/failed", results[0].login_rejected, results[1].login_rejected);
+    printf("%-22s %14.2f %14.2f\n", "  avg login (ms)",
+           results[0].logins ? results[0].login_ms_total / results[0].logins : 0,
+           results[1].logins ? results[1].login_ms_total / results[1].logins : 0);
+    printf("%-22s %14lu %14lu\n", "RTT samples", results[0].rtt_samples, results[1].rtt_samples);
+    printf("%-22s %14.1f %14.1f\n", "  avg RTT (us)", results[0].rtt_avg_us, results[1].rtt_avg_us);
+    printf("%-22s %14.1f %14.1f\n", "  p50 RTT (us)", results[0].rtt_p50_us, results[1].rtt_p50_us);
+    printf("%-22s %14.1f %14.1f\n", "  p99 RTT (us)", results[0].rtt_p99_us, results[1].rtt_p99_us);
+    printf("%-22s %14.0f %14.0f\n", "Throughput (msg/s)", results[0].msgs_per_sec, results[1].msgs_per_sec);
+    printf("%-22s %14.2f %14.2f\n", "  delivered (MB/s)", results[0].mb_per_sec, results[1].mb_per_sec);
+    printf("%-22s %14lu %14lu\n", "Stalls", results[0].stalls, results[1].stalls);
+    return 0;
+}
@@ -2,35 +2,463 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
 /* Default to enhanced server on 5555
    To connect to standard server (8080), compile with: gcc -DUSE_STANDARD_SERVER client.c
    Or set environment variable: export CLIENT_PORT=8080
+   On the server's host, export CLIENT_SOCKET=/tmp/netchat.sock uses its Unix socket instead
+
+   The enhanced server tags room lines with "[seq room:n] ". The client strips the tags,
+   remembers the last number seen per room and, when the connection drops, reconnects
+   with "RESUME room:n ..." so the server replays what was missed.
+   What arrived is acknowledged with "/ack room:n ... pm:n" after each read, and PMs
+   are reported read ("/read pm:n") once the user types again. The server answers
+   the sender with aggregated "[receipt]" lines.
+   Chat lines carry "[id <token>] ". Lines the server has not confirmed with
+   "[sent room:n]" are sent again, same id, after a reconnect; the server drops
+   the ones that already went through and confirms them again.
+   "/upload <path>" streams a file with sendfile() as the server grants
+   "[file] credit"; "/download <hash> [name]" saves the "[file] data" slices.
 */
 #ifdef USE_STANDARD_SERVER
 #define DEFAULT_PORT 8080
 #else
 #define DEFAULT_PORT 5555
 #endif
+#define STANDARD_PORT 8080        // Has no sequence numbers: no RESUME line is sent
 
 int PORT;
 #define BUFFER_SIZE 1024
+#define ROOM_NAME_LEN 50
+#define MAX_MARKS 16              // Rooms one connection can watch
+#define RECONNECT_MIN_S 1
+#define RECONNECT_MAX_S 30
+#define MAX_UNCONFIRMED 8         // Chat lines kept for resending until "[sent ...]" arrives
+#define FILE_CREDIT_WAIT_S 30     // Upload gives up if the server grants nothing for this long
+
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    uint64_t seq;                 // Last sequence number seen in the room
+} RoomMark;
 
-int sockfd;
+volatile int sockfd = -1;
 char username[50];
+char password[50];
+const char *socket_path = NULL;
+int resume_supported = 1;
+
+RoomMark marks[MAX_MARKS];
+int mark_count = 0;
+char current_room[ROOM_NAME_LEN] = "general";
+int ack_pending = 0;              // Marks moved since the last /ack
+volatile uint64_t pm_seen = 0;    // Highest "[pm n]" received
+uint64_t pm_read = 0;             // Highest PM reported read (main thread)
+
+char unconfirmed[MAX_UNCONFIRMED][BUFFER_SIZE];  // Oldest first, from unconfirmed_head
+int unconfirmed_head = 0;
+int unconfirmed_count = 0;
+pthread_mutex_t unconfirmed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Upload: the main thread sends, the receive thread collects the server's answers */
+volatile int uploading = 0;       // Raw bytes on the wire: no /pong or /ack may go out
+uint64_t upload_credit = 0;
+int upload_aborted = 0;
+pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+
+/* Download: receive thread only, apart from the name asked for */
+int download_fd = -1;
+uint64_t download_left = 0;       // Raw bytes still due in the current slice
+char download_name[256];
+char download_as[256];            // "<hash> <name>" from /download
+
+/* ========= CONNECTION ========= */
+
+int connect_server() {
+    int fd = socket(socket_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int connected;
+    if (socket_path) {
+        struct sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, socket_path, sizeof(unix_addr.sun_path) - 1);
+        connected = connect(fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr));
+    } else {
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(PORT);
+        server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        connected = connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    }
+    if (connected < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* "RESUME current:n other:n ..." - the current room first, so the server puts us back there */
+void build_resume(char *out, size_t cap) {
+    size_t len = (size_t)snprintf(out, cap, "RESUME %s", current_room);
+    for (int i = 0; i < mark_count; i++) {
+        if (strcmp(marks[i].room, current_room) == 0) {
+            len += (size_t)snprintf(out + len, cap - len, ":%" PRIu64, marks[i].seq);
+        }
+    }
+    for (int i = 0; i < mark_count && len < cap; i++) {
+        if (strcmp(marks[i].room, current_room) != 0) {
+            len += (size_t)snprintf(out + len, cap - len, " %s:%" PRIu64, marks[i].room, marks[i].seq);
+        }
+    }
+    if (len < cap - 1) {
+        out[len++] = '\n';
+        out[len] = '\0';
+    }
+}
+
+/* Handshake line, then credentials; prints the welcome and exits if they are refused */
+int login(int fd, const char *handshake) {
+    char auth[BUFFER_SIZE * 2];
+    char auth_response[BUFFER_SIZE];
+    snprintf(auth, sizeof(auth), "%s%s\n%s\n", handshake, username, password);
+    if (send(fd, auth, strlen(auth), MSG_NOSIGNAL) < 0) return -1;
+
+    /* Wait for authentication response */
+    int bytes = recv(fd, auth_response, sizeof(auth_response) - 1, 0);
+    if (bytes <= 0) return -1;
+    auth_response[bytes] = '\0';
+    if (strncmp(auth_response, "ERROR:", 6) == 0) {
+        printf("%s", auth_response);
+        close(fd);
+        exit(1);
+    }
+    /* Print welcome banner */
+    printf("%s", auth_response);
+    fflush(stdout);
+    return 0;
+}
+
+/* ========= RETRIES ========= */
+
+/* A chat line is on its way; a full ring forgets the oldest */
+void unconfirmed_push(const char *line) {
+    pthread_mutex_lock(&unconfirmed_lock);
+    if (unconfirmed_count == MAX_UNCONFIRMED) {
+        unconfirmed_head = (unconfirmed_head + 1) % MAX_UNCONFIRMED;
+        unconfirmed_count--;
+    }
+    int slot = (unconfirmed_head + unconfirmed_count) % MAX_UNCONFIRMED;
+    snprintf(unconfirmed[slot], BUFFER_SIZE, "%s", line);
+    unconfirmed_count++;
+    pthread_mutex_unlock(&unconfirmed_lock);
+}
+
+/* The server answered the oldest line, one way or the other */
+void unconfirmed_pop() {
+    pthread_mutex_lock(&unconfirmed_lock);
+    if (unconfirmed_count > 0) {
+        unconfirmed_head = (unconfirmed_head + 1) % MAX_UNCONFIRMED;
+        unconfirmed_count--;
+    }
+    pthread_mutex_unlock(&unconfirmed_lock);
+}
+
+/* After a reconnect: the ids let the server drop what it already had */
+void resend_unconfirmed() {
+    pthread_mutex_lock(&unconfirmed_lock);
+    for (int i = 0; i < unconfirmed_count; i++) {
+        const char *line = unconfirmed[(unconfirmed_head + i) % MAX_UNCONFIRMED];
+        send(sockfd, line, strlen(line), MSG_NOSIGNAL);
+    }
+    pthread_mutex_unlock(&unconfirmed_lock);
+}
+
+/* ========= FILE TRANSFER ========= */
+
+void upload_abort() {
+    pthread_mutex_lock(&upload_lock);
+    upload_aborted = 1;
+    pthread_cond_signal(&upload_cond);
+    pthread_mutex_unlock(&upload_lock);
+}
+
+/* Main thread: send the file no further than the server's credit */
+void upload_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        printf("[Client]: Cannot upload %s\n", path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    pthread_mutex_lock(&upload_lock);
+    upload_credit = 0;
+    upload_aborted = 0;
+    uploading = 1;
+    pthread_mutex_unlock(&upload_lock);
+
+    char cmd[BUFFER_SIZE];
+    int n = snprintf(cmd, sizeof(cmd), "/upload %lld %s\n", (long long)st.st_size, name);
+    send(sockfd, cmd, (size_t)n, MSG_NOSIGNAL);
+    printf("[Client]: Uploading %s (%lld bytes)...\n", name, (long long)st.st_size);
+    fflush(stdout);
+
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        pthread_mutex_lock(&upload_lock);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FILE_CREDIT_WAIT_S;
+        int timed_out = 0;
+        while (!upload_aborted && upload_credit <= (uint64_t)offset && !timed_out) {
+            timed_out = pthread_cond_timedwait(&upload_cond, &upload_lock, &deadline) == ETIMEDOUT;
+        }
+        uint64_t credit = upload_credit;
+        int stop = upload_aborted || timed_out;
+        pthread_mutex_unlock(&upload_lock);
+        if (stop) break;
+
+        if (sendfile(sockfd, fd, &offset, (size_t)(credit - (uint64_t)offset)) <= 0) break;
+    }
+    uploading = 0;
+    close(fd);
+    if (offset < st.st_size) printf("[Client]: Upload of %s stopped\n", name);
+}
+
+/* Receive thread: "[file] ..." lines are the transfer protocol, not chat */
+int handle_file_line(const char *line) {
+    char hash[64];
+    unsigned long long n;
+    if (strncmp(line, "[file] ", 7) != 0) return 0;
+
+    if (sscanf(line, "[file] credit %llu", &n) == 1) {
+        pthread_mutex_lock(&upload_lock);
+        if (n > upload_credit) upload_credit = n;
+        pthread_cond_signal(&upload_cond);
+        pthread_mutex_unlock(&upload_lock);
+    } else if (sscanf(line, "[file] data %llu", &n) == 1) {
+        download_left = n;
+    } else if (sscanf(line, "[file] begin %63s %llu", hash, &n) == 2) {
+        size_t hash_len = strlen(hash);
+        if (strncmp(download_as, hash, hash_len) == 0 && download_as[hash_len] == ' ') {
+            snprintf(download_name, sizeof(download_name), "%s", download_as + hash_len + 1);
+        } else {
+            snprintf(download_name, sizeof(download_name), "%s", hash);
+        }
+        download_fd = open(download_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        printf("[Client]: Downloading %s (%llu bytes)...\n", download_name, n);
+    } else if (sscanf(line, "[file] end %63s", hash) == 1) {
+        if (download_fd >= 0) close(download_fd);
+        download_fd = -1;
+        printf("[Client]: Saved %s\n", download_name);
+    } else if (sscanf(line, "[file] stored %63s %llu", hash, &n) == 2) {
+        printf("[Client]: Stored as %s\n", hash);
+    } else if (strncmp(line, "[file] abort ", 13) == 0) {
+        if (download_fd >= 0) {
+            close(download_fd);
+            unlink(download_name);
+            download_fd = -1;
+        } else {
+            upload_abort();
+        }
+        printf("[Client]: Transfer failed - %s", line + 13);
+    }
+    return 1;
+}
 
-/* Thread to receive messages */
+/* Keep trying with doubling backoff until a resumed session is up */
+void reconnect() {
+    int delay = RECONNECT_MIN_S;
+    printf("\n[Client]: Connection lost - reconnecting...\n");
+    fflush(stdout);
+    close(sockfd);
+    upload_abort();
+    if (download_fd >= 0) {
+        close(download_fd);
+        unlink(download_name);
+        download_fd = -1;
+        download_left = 0;
+    }
+
+    while (1) {
+        sleep(delay);
+        int fd = connect_server();
+        if (fd >= 0) {
+            char handshake[BUFFER_SIZE] = "";
+            if (resume_supported) build_resume(handshake, sizeof(handshake));
+            printf("[Client]: Reconnected - resuming session\n");
+            if (login(fd, handshake) == 0) {
+                sockfd = fd;
+                resend_unconfirmed();
+                return;
+            }
+            close(fd);
+        }
+        if (delay < RECONNECT_MAX_S) delay = delay * 2 > RECONNECT_MAX_S ? RECONNECT_MAX_S : delay * 2;
+    }
+}
+
+/* ========= RECEIVING ========= */
+
+RoomMark *mark_find(const char *room) {
+    for (int i = 0; i < mark_count; i++) {
+        if (strcmp(marks[i].room, room) == 0) return &marks[i];
+    }
+    return NULL;
+}
+
+void mark_remove(const char *room) {
+    RoomMark *m = mark_find(room);
+    if (m) *m = marks[--mark_count];
+}
+
+void mark_update(const char *room, uint64_t seq) {
+    RoomMark *m = mark_find(room);
+    if (!m && mark_count < MAX_MARKS) {
+        m = &marks[mark_count++];
+        snprintf(m->room, sizeof(m->room), "%s", room);
+        m->seq = 0;
+    }
+    if (m && seq > m->seq) m->seq = seq;
+}
+
+/* Room name after a fixed prefix, up to the end of the line */
+int line_room(const char *line, const char *prefix, char *room) {
+    size_t n = strlen(prefix);
+    if (strncmp(line, prefix, n) != 0) return 0;
+    snprintf(room, ROOM_NAME_LEN, "%.*s", (int)strcspn(line + n, " \n"), line + n);
+    return 1;
+}
+
+/* One complete line from the server: strip the tag, follow room changes, print */
+void handle_line(char *line) {
+    if (strcmp(line, "[PING]\n") == 0) {
+        /* Answer server heartbeats silently; an upload keeps the server's clock fresh itself */
+        if (!uploading) send(sockfd, "/pong\n", 6, MSG_NOSIGNAL);
+        return;
+    }
+    if (handle_file_line(line)) return;
+
+    char room[ROOM_NAME_LEN];
+    int room_len;
+    uint64_t seq;
+    if (sscanf(line, "[sent %49[^:]:%" SCNu64 "]%n", room, &seq, &room_len) == 2) {
+        /* The number our own message got: seen, so a resume will not replay it */
+        if (strcmp(room, "pm") != 0) {
+            mark_update(room, seq);
+            unconfirmed_pop();
+        }
+        return;
+    }
+    if (sscanf(line, "[seq %49[^:]:%" SCNu64 "]%n", room, &seq, &room_len) == 2 && line[room_len] == ' ') {
+        mark_update(room, seq);
+        ack_pending = 1;
+        line += room_len + 1;
+    } else if (sscanf(line, "[pm %" SCNu64 "]%n", &seq, &room_len) == 1 && line[room_len] == ' ') {
+        if (seq > pm_seen) pm_seen = seq;
+        ack_pending = 1;
+        line += room_len + 1;
+    }
+
+    if (strncmp(line, "[Server]: Slow down", 19) == 0 || strstr(line, "over its delivery budget")) {
+        unconfirmed_pop();  // Not sent, and not worth repeating
+    }
+
+    if (line_room(line, "[Server]: You are now in room #", room)) {
+        /* /join leaves the old room, so its mark no longer applies */
+        if (strcmp(room, current_room) != 0) mark_remove(current_room);
+        snprintf(current_room, sizeof(current_room), "%s", room);
+    } else if (line_room(line, "[Server]: Unsubscribed from #", room)) {
+        mark_remove(room);
+    }
+
+    printf("%s", line);
+}
+
+/* One cumulative acknowledgement for everything received so far */
+void send_ack() {
+    char ack[BUFFER_SIZE];
+    if (uploading) return;  // Stays pending until the file is through
+    size_t len = (size_t)snprintf(ack, sizeof(ack), "/ack");
+    for (int i = 0; i < mark_count && len < sizeof(ack); i++) {
+        len += (size_t)snprintf(ack + len, sizeof(ack) - len, " %s:%" PRIu64, marks[i].room, marks[i].seq);
+    }
+    if (pm_seen > 0 && len < sizeof(ack)) {
+        len += (size_t)snprintf(ack + len, sizeof(ack) - len, " pm:%" PRIu64, (uint64_t)pm_seen);
+    }
+    if (len < sizeof(ack) - 1) {
+        ack[len++] = '\n';
+        send(sockfd, ack, len, MSG_NOSIGNAL);
+    }
+    ack_pending = 0;
+}
+
+/* Thread to receive messages; reassembles lines so tags never reach the screen */
 void *receive_messages(void *arg) {
     (void)arg;  // Argument not used
-    char buffer[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE * 2];
+    size_t have = 0;
     int bytes;
 
-    while ((bytes = recv(sockfd, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes] = '\0';
-        printf("%s", buffer);
+    while (1) {
+        bytes = recv(sockfd, buffer + have, sizeof(buffer) - 1 - have, 0);
+        if (bytes <= 0) {
+            have = 0;
+            reconnect();
+            continue;
+        }
+        have += (size_t)bytes;
+        buffer[have] = '\0';
+
+        char *start = buffer;
+        char *end = buffer + have;
+        char *nl;
+        for (;;) {
+            /* File slices are raw bytes: straight to disk, whatever they contain */
+            if (download_left > 0) {
+                size_t take = (size_t)(end - start) < download_left ? (size_t)(end - start) : download_left;
+                if (download_fd >= 0 && write(download_fd, start, take) != (ssize_t)take) {
+                    printf("[Client]: Writing %s failed\n", download_name);
+                    close(download_fd);
+                    download_fd = -1;
+                }
+                start += take;
+                download_left -= take;
+                if (download_left > 0) break;
+                continue;
+            }
+            if ((nl = memchr(start, '\n', (size_t)(end - start))) == NULL) break;
+            char saved = nl[1];
+            nl[1] = '\0';
+            handle_line(start);
+            nl[1] = saved;
+            start = nl + 1;
+        }
+
+        /* A partial line is shown now (prompts, banners) unless it may hold a tag or ping */
+        size_t rest = have - (size_t)(start - buffer);
+        if (rest > 0 && (start[0] != '[' || rest >= sizeof(buffer) - 1 - BUFFER_SIZE)) {
+            printf("%s", start);
+            rest = 0;
+        }
+        memmove(buffer, start, rest);
+        have = rest;
         fflush(stdout);
+        if (ack_pending) send_ack();
     }
     return NULL;
 }
@@ -39,15 +467,20 @@ int main() {
     /* Determine which server to connect to */
     const char *env_port = getenv("CLIENT_PORT");
     PORT = env_port ? atoi(env_port) : DEFAULT_PORT;
+    socket_path = getenv("CLIENT_SOCKET");
+    if (socket_path && socket_path[0] == '\0') socket_path = NULL;
     
-    struct sockaddr_in server_addr;
     pthread_t recv_thread;
     char message[BUFFER_SIZE];
     char final_msg[BUFFER_SIZE];
-    char password[50];
+    unsigned int message_number = 0;
 
     printf("=== NetChat Client ===\n");
-    printf("Connecting to server on port %d...\n", PORT);
+    if (socket_path) {
+        printf("Connecting to server at %s...\n", socket_path);
+    } else {
+        printf("Connecting to server on port %d...\n", PORT);
+    }
     printf("Enter your username: ");
     fgets(username, 50, stdin);
     username[strcspn(username, "\n")] = 0;   // remove newline
@@ -56,56 +489,62 @@ int main() {
     fgets(password, 50, stdin);
     password[strcspn(password, "\n")] = 0;   // remove newline
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = connect_server();
     if (sockfd < 0) {
-        perror("Socket failed");
-        exit(1);
-    }
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Connection failed");
         exit(1);
     }
 
     printf("Connected to server...\n");
     
-    /* Send username and password for authentication */
-    char auth_username[BUFFER_SIZE];
-    char auth_password[BUFFER_SIZE];
-    char auth_response[BUFFER_SIZE];
-    snprintf(auth_username, sizeof(auth_username), "%s\n", username);
-    snprintf(auth_password, sizeof(auth_password), "%s\n", password);
-    send(sockfd, auth_username, strlen(auth_username), 0);
-    send(sockfd, auth_password, strlen(auth_password), 0);
-    
-    /* Wait for authentication response */
-    int bytes = recv(sockfd, auth_response, sizeof(auth_response) - 1, 0);
-    if (bytes > 0) {
-        auth_response[bytes] = '\0';
-        if (strncmp(auth_response, "ERROR:", 6) == 0) {
-            printf("%s", auth_response);
-            close(sockfd);
-            exit(1);
-        }
-        /* Print welcome banner */
-        printf("%s", auth_response);
+    /* A bare RESUME asks for sequence tags without a replay */
+    resume_supported = socket_path || PORT != STANDARD_PORT;
+    if (login(sockfd, resume_supported ? "RESUME\n" : "") < 0) {
+        perror("Login failed");
+        exit(1);
     }
 
     pthread_create(&recv_thread, NULL, receive_messages, NULL);
 
-    while (1) {
-        fgets(message, BUFFER_SIZE, stdin);
-        
-        /* Check if it's a command */
-        if (message[0] == '/') {
-            send(sockfd, message, strlen(message), 0);
+    while (fgets(message, BUFFER_SIZE, stdin) != NULL) {
+        /* Typing again means the PMs on screen were seen */
+        uint64_t seen = pm_seen;
+        if (seen > pm_read) {
+            char read_msg[64];
+            int n = snprintf(read_msg, sizeof(read_msg), "/read pm:%" PRIu64 "\n", seen);
+            send(sockfd, read_msg, (size_t)n, MSG_NOSIGNAL);
+            pm_read = seen;
+        }
+
+        /* While reconnecting, sends fail quietly; the receive thread restores sockfd */
+        if (strncmp(message, "/upload ", 8) == 0) {
+            message[strcspn(message, "\n")] = 0;
+            upload_file(message + 8);
+        } else if (strncmp(message, "/download ", 10) == 0) {
+            /* The name is ours to pick; the server only knows the hash */
+            char hash[64], name[192];
+            int fields = sscanf(message + 10, "%63s %191[^\n]", hash, name);
+            if (fields >= 1) {
+                snprintf(download_as, sizeof(download_as), "%s %s", hash, fields == 2 ? name : hash);
+                snprintf(final_msg, BUFFER_SIZE, "/download %s\n", hash);
+                send(sockfd, final_msg, strlen(final_msg), MSG_NOSIGNAL);
+            }
+        } else if (message[0] == '/') {
+            send(sockfd, message, strlen(message), MSG_NOSIGNAL);
         } else {
-            snprintf(final_msg, BUFFER_SIZE, "%s: %s", username, message);
-            send(sockfd, final_msg, strlen(final_msg), 0);
+            int n;
+            if (resume_supported) {
+                /* time.pid.n is unique per login name; it is what a resend is recognised by */
+                n = snprintf(final_msg, BUFFER_SIZE, "[id %lx.%x.%u] %s: ", (unsigned long)time(NULL),
+                             (unsigned)getpid(), ++message_number, username);
+            } else {
+                n = snprintf(final_msg, BUFFER_SIZE, "%s: ", username);
+            }
+            /* The text is cut to fit after the prefix, so the line always ends in its newline */
+            message[strcspn(message, "\n")] = 0;
+            snprintf(final_msg + n, BUFFER_SIZE - n, "%.*s\n", BUFFER_SIZE - n - 2, message);
+            if (resume_supported) unconfirmed_push(final_msg);
+            send(sockfd, final_msg, strlen(final_msg), MSG_NOSIGNAL);
         }
     }
 
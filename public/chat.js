@@ -40,6 +40,7 @@ let connectedUsers = [];
 let typingUsers = [];
 let typingTimeout = null;
 let currentPMUser = null;
+let sentMessageCount = 0; // Numbers message ids for engine-side dedup
 let pmMessagesMap = new Map(); // Store PM history
 // Persisted unread counts: { username: number }
 let unreadCounts = {};
@@ -569,8 +570,10 @@ function sendMessage() {
         return;
     }
 
+    // A buffered emit replayed after a reconnect carries the same id, so the engine sends it once
     socket.emit('message:send', {
         message: message,
+        msgId: `${socket.id}.${Date.now().toString(36)}.${++sentMessageCount}`,
         room: currentRoom,
         encrypted: isEncryptionEnabled,
         encryptionPassword: encryptionPassword
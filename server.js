@@ -9,6 +9,7 @@ const http = require('http');
 const socketIO = require('socket.io');
 const multer = require('multer');
 const crypto = require('crypto');
+const net = require('net');
 
 const app = express();
 const server = http.createServer(app);
@@ -449,6 +450,185 @@ const connectedUsers = new Map();
 const chatRooms = new Map();
 const activeSessions = new Map(); // Track active sessions by userId
 
+// ===== C ENGINE BRIDGE =====
+// When C_SERVER_PORT (or C_SERVER_SOCKET) is set, chat traffic is routed through the C server so that
+// browser and terminal users share rooms. All browser sessions travel over one TCP
+// connection: each socket is a numbered channel, and one DELIVER frame from the
+// engine carries every recipient channel of a message. Frames are
+// [u32 length][u8 type][payload], big-endian, the length counting the type byte.
+// Without a bridge (or while it reconnects) the handlers below work locally as before.
+const C_SERVER_HOST = process.env.C_SERVER_HOST || '127.0.0.1';
+const C_SERVER_PORT = parseInt(process.env.C_SERVER_PORT, 10) || 0;
+const C_SERVER_SOCKET = process.env.C_SERVER_SOCKET || '';  // Unix socket path; wins over host/port
+const BRIDGE_SECRET = process.env.NETCHAT_BRIDGE_SECRET || '-';
+const BRIDGE_RECONNECT_MS = 2000;
+
+const BRIDGE_OPEN = 0x01;
+const BRIDGE_CLOSE = 0x02;
+const BRIDGE_EVENT = 0x03;
+const BRIDGE_DELIVER = 0x81;
+const BRIDGE_CLOSED = 0x82;
+
+const ENCRYPTED_FORMAT = /^[0-9a-f]{32}:[0-9a-f]+$/;
+
+const bridge = {
+  socket: null,
+  ready: false,
+  buffer: Buffer.alloc(0),
+  nextChannel: 1,
+  channels: new Map(),       // channel id -> Socket.IO socket
+  socketChannels: new Map()  // socket.id -> channel id
+};
+
+function bridgeFrame(type, channel, body) {
+  const payload = Buffer.isBuffer(body) ? body : Buffer.from(body || '', 'utf8');
+  const frame = Buffer.alloc(9 + payload.length);
+  frame.writeUInt32BE(5 + payload.length, 0);
+  frame.writeUInt8(type, 4);
+  frame.writeUInt32BE(channel, 5);
+  payload.copy(frame, 9);
+  return frame;
+}
+
+function bridgeOpen(socket) {
+  if (!bridge.ready) return;
+  let channel = bridge.socketChannels.get(socket.id);
+  if (!channel) {
+    channel = bridge.nextChannel++;
+    bridge.socketChannels.set(socket.id, channel);
+    bridge.channels.set(channel, socket);
+  }
+  bridge.socket.write(bridgeFrame(BRIDGE_OPEN, channel, socket.username));
+}
+
+function bridgeClose(socket) {
+  const channel = bridge.socketChannels.get(socket.id);
+  if (!channel) return false;
+  bridge.socketChannels.delete(socket.id);
+  bridge.channels.delete(channel);
+  if (!bridge.ready) return false;
+  bridge.socket.write(bridgeFrame(BRIDGE_CLOSE, channel));
+  return true;
+}
+
+// Forward one event for this socket; false when chat must be handled locally
+function bridgeSend(socket, event, data) {
+  const channel = bridge.socketChannels.get(socket.id);
+  if (!bridge.ready || !channel) return false;
+  bridge.socket.write(bridgeFrame(BRIDGE_EVENT, channel, JSON.stringify({ event, data })));
+  return true;
+}
+
+// Give engine events the fields the browser client expects from local events
+function bridgeEnrich(event, data) {
+  const timestamp = new Date().toISOString();
+  if (event === 'message:new') {
+    const enriched = {
+      id: Date.now().toString(),
+      ...data,
+      username: data.type === 'user' ? data.username : 'System',
+      encrypted: data.type === 'user' && ENCRYPTED_FORMAT.test(data.message),
+      imageUrl: null,
+      timestamp
+    };
+    if (enriched.type === 'user' && chatRooms.has(enriched.room)) {
+      chatRooms.get(enriched.room).messages.push(enriched);
+    }
+    return enriched;
+  }
+  if (event === 'pm:received') {
+    return { ...data, encrypted: ENCRYPTED_FORMAT.test(data.message), imageUrl: null, timestamp };
+  }
+  return data;
+}
+
+function bridgeDispatch(type, payload) {
+  if (type === BRIDGE_CLOSED) {
+    const socket = bridge.channels.get(payload.readUInt32BE(0));
+    if (socket) {
+      console.warn(`⚠️ C engine refused channel for ${socket.username}; handling locally`);
+      bridge.channels.delete(payload.readUInt32BE(0));
+      bridge.socketChannels.delete(socket.id);
+    }
+    return;
+  }
+  if (type !== BRIDGE_DELIVER) return;
+
+  const count = payload.readUInt16BE(0);
+  let parsed;
+  try {
+    parsed = JSON.parse(payload.subarray(2 + count * 4).toString('utf8'));
+  } catch (error) {
+    console.error('Bridge: bad event JSON', error.message);
+    return;
+  }
+
+  const data = bridgeEnrich(parsed.event, parsed.data);
+  for (let i = 0; i < count; i++) {
+    const socket = bridge.channels.get(payload.readUInt32BE(2 + i * 4));
+    if (socket) socket.emit(parsed.event, data);
+  }
+}
+
+function bridgeOnData(chunk) {
+  bridge.buffer = Buffer.concat([bridge.buffer, chunk]);
+
+  // The login reply is a text line; frames start after it
+  if (!bridge.ready) {
+    const newline = bridge.buffer.indexOf(0x0a);
+    if (newline < 0) return;
+    const line = bridge.buffer.subarray(0, newline).toString('utf8');
+    bridge.buffer = bridge.buffer.subarray(newline + 1);
+    if (line !== 'NCBRIDGE/1') {
+      console.error(`❌ C engine refused bridge: ${line}`);
+      bridge.socket.destroy();
+      return;
+    }
+    bridge.ready = true;
+    console.log(`🔗 Bridge to C engine ready (${C_SERVER_SOCKET || `${C_SERVER_HOST}:${C_SERVER_PORT}`})`);
+    // Sessions that connected while the bridge was down join the engine now
+    for (const socket of io.sockets.sockets.values()) {
+      bridgeOpen(socket);
+      const user = connectedUsers.get(socket.userId);
+      if (user && user.room) bridgeSend(socket, 'room:join', { roomName: user.room });
+    }
+  }
+
+  while (bridge.buffer.length >= 5) {
+    const length = bridge.buffer.readUInt32BE(0);
+    if (bridge.buffer.length < 4 + length) break;
+    const type = bridge.buffer.readUInt8(4);
+    const payload = bridge.buffer.subarray(5, 4 + length);
+    bridge.buffer = bridge.buffer.subarray(4 + length);
+    bridgeDispatch(type, payload);
+  }
+}
+
+function bridgeConnect() {
+  const socket = C_SERVER_SOCKET
+    ? net.createConnection({ path: C_SERVER_SOCKET })
+    : net.createConnection({ host: C_SERVER_HOST, port: C_SERVER_PORT });
+  bridge.socket = socket;
+  bridge.buffer = Buffer.alloc(0);
+  if (!C_SERVER_SOCKET) socket.setNoDelay(true);
+  socket.on('connect', () => {
+    socket.write(`@bridge\n${BRIDGE_SECRET}\n`);
+  });
+  socket.on('data', bridgeOnData);
+  socket.on('error', () => {});  // 'close' follows and schedules the retry
+  socket.on('close', () => {
+    if (bridge.ready) console.warn('⚠️ Bridge to C engine lost; handling chat locally until it returns');
+    bridge.ready = false;
+    bridge.channels.clear();
+    bridge.socketChannels.clear();
+    setTimeout(bridgeConnect, BRIDGE_RECONNECT_MS);
+  });
+}
+
+if (C_SERVER_SOCKET || C_SERVER_PORT) {
+  bridgeConnect();
+}
+
 // Middleware to verify JWT token for WebSocket connections
 io.use((socket, next) => {
   const token = socket.handshake.auth.token;
@@ -500,14 +680,17 @@ io.on('connection', (socket) => {
   // Broadcast updated user list to all connected clients
   io.emit('users:update', Array.from(connectedUsers.values()));
 
+  bridgeOpen(socket);
+
   // ===== Join Room =====
   socket.on('room:join', (data) => {
     const { roomName } = data;
+    const bridged = bridgeSend(socket, 'room:join', { roomName });
     
     // Leave previous room if in one
     if (connectedUsers.get(socket.userId)?.room) {
       socket.leave(connectedUsers.get(socket.userId).room);
-      io.to(connectedUsers.get(socket.userId).room).emit('message:new', {
+      if (!bridged) io.to(connectedUsers.get(socket.userId).room).emit('message:new', {
         type: 'system',
         username: 'System',
         message: `${socket.username} left the room`,
@@ -536,8 +719,8 @@ io.on('connection', (socket) => {
       room.users.push(socket.username);
     }
 
-    // Notify room that user joined
-    io.to(roomName).emit('message:new', {
+    // Notify room that user joined (the engine announces bridged joins itself)
+    if (!bridged) io.to(roomName).emit('message:new', {
       type: 'system',
       username: 'System',
       message: `${socket.username} joined the room`,
@@ -557,7 +740,7 @@ io.on('connection', (socket) => {
 
   // ===== Send Message =====
   socket.on('message:send', (data) => {
-    const { message, room, encrypted, encryptionPassword, imageUrl } = data;
+    const { message, room, encrypted, encryptionPassword, imageUrl, msgId } = data;
     const user = connectedUsers.get(socket.userId);
 
     if (!user || !user.room) {
@@ -565,9 +748,17 @@ io.on('connection', (socket) => {
       return;
     }
 
-    // Handle encryption if requested
     let finalMessage = message.trim();
-    if (encrypted && finalMessage && encryptionPassword) {
+    const encrypt = Boolean(encrypted && finalMessage && encryptionPassword);
+
+    // Text goes through the engine, which also encrypts it; images stay local since the engine carries text only
+    const forward = encrypt ? { message: finalMessage, msgId, encrypted: true, encryptionPassword } : { message: finalMessage, msgId };
+    if (!imageUrl && bridgeSend(socket, 'message:send', forward)) {
+      return;
+    }
+
+    // Handle encryption if requested
+    if (encrypt) {
       try {
         finalMessage = encryptMessage(finalMessage, encryptionPassword);
       } catch (error) {
@@ -665,6 +856,7 @@ io.on('connection', (socket) => {
 
   // ===== User Typing =====
   socket.on('user:typing', () => {
+    if (bridgeSend(socket, 'user:typing', {})) return;
     const user = connectedUsers.get(socket.userId);
     if (user && user.room) {
       socket.to(user.room).emit('user:typing', {
@@ -678,9 +870,16 @@ io.on('connection', (socket) => {
   socket.on('pm:send', (data) => {
     const { to, message, encrypted, encryptionPassword, imageUrl } = data;
 
-    // Handle encryption if requested
     let finalMessage = (message || '').trim();
-    if (encrypted && finalMessage && encryptionPassword) {
+    const encrypt = Boolean(encrypted && finalMessage && encryptionPassword);
+
+    const forward = encrypt ? { to, message: finalMessage, encrypted: true, encryptionPassword } : { to, message: finalMessage };
+    if (!imageUrl && finalMessage && bridgeSend(socket, 'pm:send', forward)) {
+      return;
+    }
+
+    // Handle encryption if requested
+    if (encrypt) {
       try {
         finalMessage = encryptMessage(finalMessage, encryptionPassword);
       } catch (error) {
@@ -727,6 +926,7 @@ io.on('connection', (socket) => {
   // ===== Disconnect =====
   socket.on('disconnect', () => {
     const user = connectedUsers.get(socket.userId);
+    const bridged = bridgeClose(socket);
     
     if (user) {
       // Notify room that user left
@@ -734,7 +934,7 @@ io.on('connection', (socket) => {
         const room = chatRooms.get(user.room);
         room.users = room.users.filter(u => u !== socket.username);
 
-        io.to(user.room).emit('message:new', {
+        if (!bridged) io.to(user.room).emit('message:new', {
           type: 'system',
           username: 'System',
           message: `${socket.username} disconnected`,
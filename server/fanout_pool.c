@@ -0,0 +1,224 @@
+#include "fanout_pool.h"
+#include "thread_util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* ========= CHUNK DEQUES ========= */
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *starts;    // First item of each chunk
+    size_t cap;
+    size_t top;        // Thieves take from here
+    size_t bottom;     // The owner pops from here
+} ChunkDeque;
+
+typedef struct {
+    FanoutPool *pool;
+    int id;
+} SenderArg;
+
+struct FanoutPool {
+    int threads;
+    pthread_t tids[FANOUT_MAX_THREADS];
+    SenderArg args[FANOUT_MAX_THREADS];
+    ChunkDeque deques[FANOUT_MAX_THREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // A fan-out is ready
+    pthread_cond_t done;        // Last chunk finished, or last sender left
+    unsigned long generation;
+    int active;                 // Senders may join only while set
+    int busy;                   // Senders inside the current fan-out
+    int stopping;
+    size_t chunks_left;
+
+    /* The current fan-out */
+    const int *items;
+    size_t count;
+    size_t chunk;
+    fanout_fn fn;
+    void *arg;
+
+    unsigned long steals;
+};
+
+static int deque_push(ChunkDeque *d, size_t start) {
+    if (d->bottom == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        size_t *grown = realloc(d->starts, cap * sizeof(size_t));
+        if (!grown) return 0;
+        d->starts = grown;
+        d->cap = cap;
+    }
+    d->starts[d->bottom++] = start;
+    return 1;
+}
+
+/* Owner end: the most recently dealt chunk, still warm in this thread's cache */
+static int deque_pop(ChunkDeque *d, size_t *start) {
+    pthread_mutex_lock(&d->lock);
+    int got = d->bottom > d->top;
+    if (got) *start = d->starts[--d->bottom];
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+/* Thief end: the oldest chunk, furthest from what the owner is working on */
+static int deque_steal(ChunkDeque *d, size_t *start) {
+    pthread_mutex_lock(&d->lock);
+    int got = d->bottom > d->top;
+    if (got) *start = d->starts[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+/* ========= SENDERS ========= */
+
+static void run_chunk(FanoutPool *pool, size_t start) {
+    size_t end = start + pool->chunk < pool->count ? start + pool->chunk : pool->count;
+    for (size_t i = start; i < end; i++) pool->fn(pool->items[i], pool->arg);
+
+    if (__atomic_sub_fetch(&pool->chunks_left, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Own deque first, then steal round the others until everything is gone */
+static void drain_chunks(FanoutPool *pool, int id) {
+    size_t start;
+    while (deque_pop(&pool->deques[id], &start)) run_chunk(pool, start);
+
+    for (int k = 1; k < pool->threads; k++) {
+        ChunkDeque *victim = &pool->deques[(id + k) % pool->threads];
+        while (deque_steal(victim, &start)) {
+            __atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+            run_chunk(pool, start);
+        }
+    }
+}
+
+static void *sender_main(void *p) {
+    SenderArg *sa = p;
+    FanoutPool *pool = sa->pool;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stopping && (!pool->active || pool->generation == seen)) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain_chunks(pool, sa->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* ========= POOL ========= */
+
+FanoutPool *fanout_pool_create(int threads) {
+    if (threads < 1) threads = 1;
+    if (threads > FANOUT_MAX_THREADS) threads = FANOUT_MAX_THREADS;
+
+    FanoutPool *pool = calloc(1, sizeof(FanoutPool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < FANOUT_MAX_THREADS; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    /* Sender 0 is whoever calls fanout_pool_run() */
+    pool->threads = 1;
+    for (int i = 1; i < threads; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].id = i;
+        if (thread_start_quiet(&pool->tids[i], sender_main, &pool->args[i]) != 0) break;
+        pool->threads++;
+    }
+    return pool;
+}
+
+void fanout_pool_destroy(FanoutPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i++) pthread_join(pool->tids[i], NULL);
+
+    for (int i = 0; i < FANOUT_MAX_THREADS; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].starts);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int fanout_pool_threads(const FanoutPool *pool) {
+    return pool ? pool->threads : 1;
+}
+
+unsigned long fanout_pool_steals(const FanoutPool *pool) {
+    return pool ? __atomic_load_n(&pool->steals, __ATOMIC_RELAXED) : 0;
+}
+
+void fanout_pool_run(FanoutPool *pool, const int *items, size_t count, size_t chunk,
+                     fanout_fn fn, void *arg) {
+    if (count == 0) return;
+    if (chunk == 0) chunk = 1;
+
+    /* Deal the chunks before anyone starts; no sender can join until active is set */
+    pthread_mutex_lock(&pool->lock);
+    pool->items = items;
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->fn = fn;
+    pool->arg = arg;
+    size_t dealt = 0;
+    for (size_t start = 0; start < count; start += chunk) {
+        ChunkDeque *d = &pool->deques[dealt % (size_t)pool->threads];
+        pthread_mutex_lock(&d->lock);
+        int ok = deque_push(d, start);
+        pthread_mutex_unlock(&d->lock);
+        if (!ok) {
+            /* Out of memory: this chunk is run here and now instead */
+            for (size_t i = start; i < count && i < start + chunk; i++) fn(items[i], arg);
+            continue;
+        }
+        dealt++;
+    }
+    pool->chunks_left = dealt;
+    pool->active = dealt > 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (dealt > 0) drain_chunks(pool, 0);
+
+    /* Every chunk done and every sender out before the caller may touch the results */
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->chunks_left, __ATOMIC_ACQUIRE) > 0 || pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->active = 0;
+    for (int i = 0; i < pool->threads; i++) {
+        pool->deques[i].top = 0;
+        pool->deques[i].bottom = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
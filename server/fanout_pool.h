@@ -0,0 +1,35 @@
+#ifndef NETCHAT_FANOUT_POOL_H
+#define NETCHAT_FANOUT_POOL_H
+
+#include <stddef.h>
+
+/* ========= FAN-OUT POOL =========
+ * Sender threads that share one large fan-out. The recipient list is cut
+ * into chunks that are dealt round-robin onto one deque per thread. A
+ * thread works its own deque from the back and, once that is empty,
+ * steals from the front of the others, so a thread stuck on slow sockets
+ * does not hold up the rest. The caller is sender 0 and fanout_pool_run()
+ * returns only when every chunk is done: each recipient is written by
+ * exactly one thread, and whatever lock the caller holds covers the whole
+ * fan-out.
+ */
+
+#define FANOUT_MAX_THREADS 32
+
+typedef void (*fanout_fn)(int item, void *arg);
+
+typedef struct FanoutPool FanoutPool;
+
+/* threads counts the caller, so 1 means no extra threads; NULL on failure */
+FanoutPool *fanout_pool_create(int threads);
+void fanout_pool_destroy(FanoutPool *pool);
+int fanout_pool_threads(const FanoutPool *pool);
+
+/* Call fn(items[i], arg) for every item, chunk items at a time, and wait for all of them */
+void fanout_pool_run(FanoutPool *pool, const int *items, size_t count, size_t chunk,
+                     fanout_fn fn, void *arg);
+
+/* Chunks taken from another thread's deque since the pool was created */
+unsigned long fanout_pool_steals(const FanoutPool *pool);
+
+#endif
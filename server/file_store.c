@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include "file_store.h"
+#include "websocket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define FILE_PIPE_SIZE (256 * 1024)  // Asked of F_SETPIPE_SZ; the default 64 KB works too
+
+/* ========= STORE ========= */
+
+int file_store_init(const char *dir) {
+    if (mkdir(dir, 0755) == 0 || errno == EEXIST) return 0;
+    return -1;
+}
+
+static int hash_valid(const char *hash) {
+    size_t n = strspn(hash, "0123456789abcdef");
+    return n == FILE_HASH_HEX - 1 && hash[n] == '\0';
+}
+
+int file_store_open(const char *dir, const char *hash, uint64_t *size) {
+    if (!hash_valid(hash)) return -1;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, hash);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    *size = (uint64_t)st.st_size;
+    return fd;
+}
+
+/* ========= UPLOADS ========= */
+
+int file_upload_begin(FileUpload *up, const char *dir, uint64_t size) {
+    memset(up, 0, sizeof(*up));
+    up->pipe[0] = up->pipe[1] = -1;
+    up->size = size;
+
+    snprintf(up->tmp_path, sizeof(up->tmp_path), "%s/.upload-XXXXXX", dir);
+    up->fd = mkostemp(up->tmp_path, O_CLOEXEC);
+    if (up->fd < 0) return -1;
+
+    if (pipe2(up->pipe, O_CLOEXEC) < 0) {
+        up->pipe[0] = up->pipe[1] = -1;
+        file_upload_abort(up);
+        return -1;
+    }
+    fcntl(up->pipe[1], F_SETPIPE_SZ, FILE_PIPE_SIZE);
+    return 0;
+}
+
+ssize_t file_upload_write(FileUpload *up, const void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(up->fd, (const char *)data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    up->received += done;
+    return (ssize_t)done;
+}
+
+ssize_t file_upload_splice(FileUpload *up, int sock, size_t max) {
+    ssize_t in;
+    do {
+        in = splice(sock, NULL, up->pipe[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (in < 0 && errno == EINTR);
+    if (in <= 0) return in;
+
+    /* Whatever entered the pipe leaves it before we return: the pipe never carries over */
+    size_t left = (size_t)in;
+    while (left > 0) {
+        ssize_t out = splice(up->pipe[0], NULL, up->fd, NULL, left, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR) continue;
+        if (out <= 0) return -1;
+        left -= (size_t)out;
+    }
+    up->received += (uint64_t)in;
+    return in;
+}
+
+int file_upload_commit(FileUpload *up, const char *dir, char hash[FILE_HASH_HEX]) {
+    if (up->fd < 0 || up->received != up->size) return -1;
+
+    /* Read through the page cache the splice just filled */
+    Sha1 s;
+    uint8_t digest[20];
+    sha1_init(&s);
+    if (up->size > 0) {
+        void *map = mmap(NULL, (size_t)up->size, PROT_READ, MAP_PRIVATE, up->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        madvise(map, (size_t)up->size, MADV_SEQUENTIAL);
+        sha1_update(&s, map, (size_t)up->size);
+        munmap(map, (size_t)up->size);
+    }
+    sha1_final(&s, digest);
+    for (int i = 0; i < 20; i++) snprintf(hash + i * 2, 3, "%02x", digest[i]);
+
+    /* The name promises the contents, so they are on disk before it exists */
+    if (fsync(up->fd) < 0) return -1;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, hash);
+    if (access(path, F_OK) == 0) {
+        unlink(up->tmp_path);
+    } else if (rename(up->tmp_path, path) < 0) {
+        return -1;
+    }
+    up->tmp_path[0] = '\0';
+    file_upload_abort(up);  // Closes what is left; nothing to unlink now
+    return 0;
+}
+
+void file_upload_abort(FileUpload *up) {
+    if (up->fd >= 0) close(up->fd);
+    if (up->pipe[0] >= 0) close(up->pipe[0]);
+    if (up->pipe[1] >= 0) close(up->pipe[1]);
+    if (up->tmp_path[0]) unlink(up->tmp_path);
+    up->fd = up->pipe[0] = up->pipe[1] = -1;
+    up->tmp_path[0] = '\0';
+}
+
+/* ========= DOWNLOADS ========= */
+
+ssize_t file_send_range(int sock, int fd, off_t *offset, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = sendfile(sock, fd, offset, len - sent);
+        if (n > 0) {
+            sent += (size_t)n;
+            continue;
+        }
+        if (n == 0) break;  // File shorter than promised
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = { sock, POLLOUT, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        return -1;
+    }
+    return (ssize_t)sent;
+}
+
+/* ========= PACING ========= */
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void file_pacer_start(FilePacer *p, uint64_t rate) {
+    p->rate = rate;
+    p->start_us = now_us();
+    p->bytes = 0;
+}
+
+void file_pacer_wait(FilePacer *p, size_t bytes) {
+    p->bytes += bytes;
+    if (p->rate == 0) return;
+
+    uint64_t due = p->start_us + p->bytes * 1000000 / p->rate;
+    uint64_t now = now_us();
+    if (due <= now) return;
+
+    struct timespec ts = { (time_t)((due - now) / 1000000), (long)((due - now) % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef NETCHAT_FILE_STORE_H
+#define NETCHAT_FILE_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* ========= CONTENT-ADDRESSED FILE STORE =========
+ * Shared files live in one directory under the SHA-1 of their contents, so
+ * a file shared twice is stored once and a hash always names the same
+ * bytes. Uploads are spliced from the socket through a pipe into a
+ * temporary file and downloads leave with sendfile(): file bytes never
+ * pass through user space. The digest is taken from a read-only mapping
+ * once the upload is complete, then the file is renamed into place.
+ * A pacer caps the rate of each transfer.
+ */
+
+#define FILE_HASH_HEX 41             // 40 hex digits and the terminator
+
+typedef struct {
+    int fd;                          // Temporary file, -1 when idle
+    int pipe[2];                     // splice() moves socket -> pipe -> file
+    uint64_t size;                   // Announced length
+    uint64_t received;               // Already in the file
+    char tmp_path[256];
+} FileUpload;
+
+typedef struct {
+    uint64_t rate;                   // Bytes per second; 0 means uncapped
+    uint64_t start_us;
+    uint64_t bytes;                  // Charged since start_us
+} FilePacer;
+
+/* Create the store directory if needed; 0 on success */
+int file_store_init(const char *dir);
+
+/* Temporary file and pipe for an upload of size bytes; 0 on success */
+int file_upload_begin(FileUpload *up, const char *dir, uint64_t size);
+
+/* Bytes the caller had already read off the socket, written the ordinary way */
+ssize_t file_upload_write(FileUpload *up, const void *data, size_t len);
+
+/* Move up to max bytes from a non-blocking socket into the file.
+   Returns bytes moved, 0 at EOF, -1 with errno set (EAGAIN: nothing ready). */
+ssize_t file_upload_splice(FileUpload *up, int sock, size_t max);
+
+/* Hash the finished file and rename it to its digest; 0 on success.
+   A file already in the store is kept and the new copy discarded. */
+int file_upload_commit(FileUpload *up, const char *dir, char hash[FILE_HASH_HEX]);
+
+/* Throw away a partial upload; safe to call on an idle FileUpload */
+void file_upload_abort(FileUpload *up);
+
+/* Open a stored file by its hex digest; returns the fd or -1 */
+int file_store_open(const char *dir, const char *hash, uint64_t *size);
+
+/* sendfile() len bytes from *offset, waiting in poll() while the socket is full.
+   Returns bytes sent (short only at end of file) or -1. */
+ssize_t file_send_range(int sock, int fd, off_t *offset, size_t len);
+
+void file_pacer_start(FilePacer *p, uint64_t rate);
+
+/* Sleep until bytes more are within the rate */
+void file_pacer_wait(FilePacer *p, size_t bytes);
+
+#endif
@@ -0,0 +1,819 @@
+#define _GNU_SOURCE
+#include "http_static.h"
+#include "thread_util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define HTTP_REQUEST_MAX 8192        // Request line and headers
+#define HTTP_HEAD_MAX 1024           // Response headers
+#define HTTP_PATH_MAX 512
+#define HTTP_CACHE_FILE_MAX (1024 * 1024)       // Larger files are sent from disk
+#define HTTP_CACHE_BYTES_MAX (32 * 1024 * 1024)  // Bodies plus their gzip copies
+#define HTTP_CACHE_BUCKETS 256
+#define HTTP_GZIP_MIN 256            // Smaller bodies go out as they are
+#define HTTP_MAX_WATCHES 128         // Directories under the root that inotify follows
+#define HTTP_MAX_DEPTH 8
+#define HTTP_IDLE_MS 15000           // Keep-alive connections idle this long are closed
+#define HTTP_ACCEPT_BATCH 64
+#define HTTP_EPOLL_EVENTS 64
+#define HTTP_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+
+/* ========= TYPES ========= */
+
+typedef struct CacheEntry {
+    struct CacheEntry *next;         // Hash chain
+    char path[HTTP_PATH_MAX];        // URL path, e.g. "/chat.js"
+    const char *type;
+    uint8_t *body;
+    size_t len;
+    uint8_t *gz;                     // NULL when gzip would not be smaller
+    size_t gz_len;
+    char etag[24];                   // Quoted; the gzip copy adds "-gz" inside the quotes
+    char gz_etag[28];
+    int refs;                        // The table's, plus one per response still being written
+} CacheEntry;
+
+typedef struct {
+    int fd;
+    char in[HTTP_REQUEST_MAX];
+    size_t in_len;
+    char head[HTTP_HEAD_MAX];
+    size_t head_len;
+    size_t head_sent;
+    CacheEntry *entry;               // Body from the cache...
+    const uint8_t *body;
+    size_t body_len;
+    size_t body_sent;
+    char err_body[64];               // ...or an error's text, kept until it is written
+    int file_fd;                     // ...or from disk
+    off_t file_off;
+    size_t file_left;
+    int close_after;
+    uint64_t last_ms;
+} HttpConn;
+
+typedef struct {
+    int wd;
+    char prefix[HTTP_PATH_MAX];      // URL path of the directory, "" for the root
+} Watch;
+
+struct HttpStatic {
+    int listen_fd;
+    int epoll_fd;
+    int inotify_fd;
+    int wake_fd;                     // eventfd: http_static_stop() wants the thread back
+    char root[PATH_MAX];
+    pthread_t tid;
+
+    CacheEntry *buckets[HTTP_CACHE_BUCKETS];
+    size_t cache_bytes;
+    Watch watches[HTTP_MAX_WATCHES];
+    int watch_count;
+
+    HttpConn **conns;                // Indexed by fd
+    int conn_cap;
+
+    int preload_files;
+    size_t preload_bytes;
+    size_t preload_gzip;
+
+    time_t date_at;                  // Date header, rebuilt once a second
+    char date[40];
+};
+
+/* ========= HELPERS ========= */
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const char *content_type(const char *path) {
+    static const struct { const char *ext; const char *type; } types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css", "text/css; charset=utf-8" },
+        { ".js", "application/javascript; charset=utf-8" },
+        { ".json", "application/json" },
+        { ".txt", "text/plain; charset=utf-8" },
+        { ".svg", "image/svg+xml" },
+        { ".png", "image/png" },
+        { ".jpg", "image/jpeg" },
+        { ".jpeg", "image/jpeg" },
+        { ".gif", "image/gif" },
+        { ".webp", "image/webp" },
+        { ".ico", "image/x-icon" },
+        { ".woff2", "font/woff2" },
+    };
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if (strcasecmp(dot, types[i].ext) == 0) return types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* Images and fonts are compressed already; only text gains from gzip */
+static int compressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strncmp(type, "application/javascript", 22) == 0 ||
+           strncmp(type, "application/json", 16) == 0 || strncmp(type, "image/svg", 9) == 0;
+}
+
+/* Whole-body gzip (RFC 1952 framing); NULL unless it came out smaller */
+static uint8_t *gzip_body(const uint8_t *in, size_t len, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    size_t cap = deflateBound(&zs, (uLong)len);
+    uint8_t *out = malloc(cap);
+    if (out) {
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = (uInt)len;
+        zs.next_out = out;
+        zs.avail_out = (uInt)cap;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= len) {
+            free(out);
+            out = NULL;
+        } else {
+            *out_len = zs.total_out;
+        }
+    }
+    deflateEnd(&zs);
+    return out;
+}
+
+/* ========= CACHE ========= */
+
+static CacheEntry **cache_slot(HttpStatic *hs, const char *path) {
+    CacheEntry **e = &hs->buckets[fnv1a(path, strlen(path)) % HTTP_CACHE_BUCKETS];
+    while (*e && strcmp((*e)->path, path) != 0) e = &(*e)->next;
+    return e;
+}
+
+static void cache_release(HttpStatic *hs, CacheEntry *e) {
+    if (--e->refs > 0) return;
+    hs->cache_bytes -= e->len + e->gz_len;
+    free(e->body);
+    free(e->gz);
+    free(e);
+}
+
+static void cache_drop(HttpStatic *hs, const char *path) {
+    CacheEntry **slot = cache_slot(hs, path);
+    CacheEntry *e = *slot;
+    if (!e) return;
+    *slot = e->next;
+    cache_release(hs, e);  // Responses still writing it keep it alive
+}
+
+/* Everything under a directory that was removed or renamed */
+static void cache_drop_prefix(HttpStatic *hs, const char *prefix) {
+    size_t n = strlen(prefix);
+    for (int b = 0; b < HTTP_CACHE_BUCKETS; b++) {
+        CacheEntry **slot = &hs->buckets[b];
+        while (*slot) {
+            CacheEntry *e = *slot;
+            if (strncmp(e->path, prefix, n) == 0 && e->path[n] == '/') {
+                *slot = e->next;
+                cache_release(hs, e);
+            } else {
+                slot = &e->next;
+            }
+        }
+    }
+}
+
+/* Read a file into the cache; NULL if it is missing, too big or the cache is full */
+static CacheEntry *cache_load(HttpStatic *hs, const char *path) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", hs->root, path);
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > HTTP_CACHE_FILE_MAX ||
+        hs->cache_bytes + (size_t)st.st_size > HTTP_CACHE_BYTES_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    size_t len = (size_t)st.st_size;
+    if (e) e->body = malloc(len ? len : 1);
+    size_t have = 0;
+    while (e && e->body && have < len) {
+        ssize_t n = pread(fd, e->body + have, len - have, (off_t)have);
+        if (n <= 0) break;
+        have += (size_t)n;
+    }
+    close(fd);
+    if (!e || !e->body || have < len) {
+        if (e) free(e->body);
+        free(e);
+        return NULL;
+    }
+
+    snprintf(e->path, sizeof(e->path), "%s", path);
+    e->type = content_type(path);
+    e->len = len;
+    uint64_t tag = fnv1a(e->body, len);
+    snprintf(e->etag, sizeof(e->etag), "\"%016llx\"", (unsigned long long)tag);
+    snprintf(e->gz_etag, sizeof(e->gz_etag), "\"%016llx-gz\"", (unsigned long long)tag);
+    if (compressible(e->type) && len >= HTTP_GZIP_MIN) e->gz = gzip_body(e->body, len, &e->gz_len);
+    e->refs = 1;
+
+    cache_drop(hs, path);
+    CacheEntry **slot = cache_slot(hs, path);
+    *slot = e;
+    hs->cache_bytes += e->len + e->gz_len;
+    return e;
+}
+
+/* ========= INOTIFY ========= */
+
+static void watch_add(HttpStatic *hs, const char *prefix) {
+    if (hs->watch_count == HTTP_MAX_WATCHES) return;
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", hs->root, prefix);
+    int wd = inotify_add_watch(hs->inotify_fd, full, HTTP_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) return;
+    for (int i = 0; i < hs->watch_count; i++) {
+        if (hs->watches[i].wd == wd) return;  // Already followed
+    }
+    hs->watches[hs->watch_count].wd = wd;
+    snprintf(hs->watches[hs->watch_count].prefix, HTTP_PATH_MAX, "%s", prefix);
+    hs->watch_count++;
+}
+
+/* Stop following a directory that left the tree, and everything below it */
+static void watch_drop_prefix(HttpStatic *hs, const char *prefix) {
+    size_t n = strlen(prefix);
+    for (int i = 0; i < hs->watch_count; ) {
+        const char *p = hs->watches[i].prefix;
+        if (strncmp(p, prefix, n) == 0 && (p[n] == '\0' || p[n] == '/')) {
+            inotify_rm_watch(hs->inotify_fd, hs->watches[i].wd);
+            hs->watches[i] = hs->watches[--hs->watch_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Follow a directory and cache what is in it; dotfiles are never served */
+static void walk_dir(HttpStatic *hs, const char *prefix, int depth) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", hs->root, prefix);
+    DIR *dir = opendir(full);
+    if (!dir) return;
+    watch_add(hs, prefix);
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[HTTP_PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", prefix, de->d_name) >= (int)sizeof(path)) continue;
+        if (de->d_type == DT_DIR) {
+            if (depth < HTTP_MAX_DEPTH) walk_dir(hs, path, depth + 1);
+        } else if (cache_load(hs, path)) {
+            hs->preload_files++;
+        }
+    }
+    closedir(dir);
+}
+
+static void handle_inotify(HttpStatic *hs) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(hs->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            int w = 0;
+            while (w < hs->watch_count && hs->watches[w].wd != ev->wd) w++;
+            if (w == hs->watch_count) continue;
+            if (ev->mask & IN_IGNORED) {
+                hs->watches[w] = hs->watches[--hs->watch_count];
+                continue;
+            }
+            if (ev->len == 0 || ev->name[0] == '.') continue;
+
+            char path[HTTP_PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", hs->watches[w].prefix, ev->name) >= (int)sizeof(path)) continue;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) walk_dir(hs, path, 1);
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    watch_drop_prefix(hs, path);
+                    cache_drop_prefix(hs, path);
+                }
+                continue;
+            }
+            /* A file is reloaded once its writer is done; IN_CREATE alone is a file still being written */
+            cache_drop(hs, path);
+            if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) cache_load(hs, path);
+        }
+    }
+}
+
+/* ========= RESPONSES ========= */
+
+static const char *http_date(HttpStatic *hs) {
+    time_t now = time(NULL);
+    if (now != hs->date_at) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(hs->date, sizeof(hs->date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        hs->date_at = now;
+    }
+    return hs->date;
+}
+
+static void respond_head(HttpStatic *hs, HttpConn *c, const char *status, const char *type, size_t len,
+                         const char *extra) {
+    /* A 304 has no body, and a Content-Length would describe the one it is not sending */
+    char length[48] = "";
+    if (strncmp(status, "304", 3) != 0) snprintf(length, sizeof(length), "Content-Length: %zu\r\n", len);
+    int n = snprintf(c->head, sizeof(c->head),
+        "HTTP/1.1 %s\r\n"
+        "Server: netchat\r\n"
+        "Date: %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "%s"
+        "Connection: %s\r\n\r\n",
+        status, http_date(hs), type, length, extra, c->close_after ? "close" : "keep-alive");
+    c->head_len = n < 0 ? 0 : ((size_t)n < sizeof(c->head) ? (size_t)n : sizeof(c->head) - 1);
+    c->head_sent = 0;
+}
+
+static void respond_error(HttpStatic *hs, HttpConn *c, const char *status, const char *extra, int head_only) {
+    int n = snprintf(c->err_body, sizeof(c->err_body), "%s\n", status);
+    if (n < 0) n = 0;
+    if ((size_t)n >= sizeof(c->err_body)) n = (int)sizeof(c->err_body) - 1;
+    respond_head(hs, c, status, "text/plain; charset=utf-8", (size_t)n, extra);
+    if (!head_only) {
+        c->body = (const uint8_t *)c->err_body;  // Per connection: others may be mid-write
+        c->body_len = (size_t)n;
+        c->body_sent = 0;
+    }
+}
+
+/* Case-insensitive header lookup within one request's header block */
+static const char *header_value(const char *headers, const char *end, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    for (const char *line = headers; line < end; ) {
+        const char *eol = memmem(line, (size_t)(end - line), "\r\n", 2);
+        if (!eol) eol = end;
+        if ((size_t)(eol - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) v++;
+            *len = (size_t)(eol - v);
+            return v;
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+static int value_has(const char *v, size_t len, const char *token) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%.*s", (int)len, v);
+    return strcasestr(copy, token) != NULL;
+}
+
+/* Percent-decode the path and refuse anything that could leave the root */
+static int clean_path(const char *target, size_t len, char *out) {
+    size_t o = 0;
+    for (size_t i = 0; i < len && target[i] != '?' && target[i] != '#'; i++) {
+        char ch = target[i];
+        if (ch == '%' && i + 2 < len) {
+            char hex[3] = { target[i + 1], target[i + 2], '\0' };
+            char *end;
+            ch = (char)strtol(hex, &end, 16);
+            if (*end != '\0') return 0;
+            i += 2;
+        }
+        if (ch == '\0' || ch == '\\' || o >= HTTP_PATH_MAX - 16) return 0;
+        out[o++] = ch;
+    }
+    out[o] = '\0';
+    if (out[0] != '/' || strstr(out, "/.")) return 0;  // Covers ".." and dotfiles
+    if (out[o - 1] == '/') strcat(out, "index.html");
+    return 1;
+}
+
+/* One complete request at the front of c->in; fills in the response */
+static void handle_request(HttpStatic *hs, HttpConn *c, size_t head_len) {
+    char *req = c->in;
+    char *end = c->in + head_len;
+    char *eol = memmem(req, head_len, "\r\n", 2);
+    char *sp1 = eol ? memchr(req, ' ', (size_t)(eol - req)) : NULL;
+    char *sp2 = sp1 ? memchr(sp1 + 1, ' ', (size_t)(eol - sp1 - 1)) : NULL;
+    c->close_after = 0;
+    if (!sp2) {
+        c->close_after = 1;
+        respond_error(hs, c, "400 Bad Request", "", 0);
+        return;
+    }
+
+    int head_only = (size_t)(sp1 - req) == 4 && strncmp(req, "HEAD", 4) == 0;
+    int get = (size_t)(sp1 - req) == 3 && strncmp(req, "GET", 3) == 0;
+    int http10 = (size_t)(eol - sp2 - 1) == 8 && strncmp(sp2 + 1, "HTTP/1.0", 8) == 0;
+    const char *headers = eol + 2;
+    size_t vlen;
+    const char *v = header_value(headers, end, "Connection", &vlen);
+    if (http10) c->close_after = !(v && value_has(v, vlen, "keep-alive"));
+    if (v && value_has(v, vlen, "close")) c->close_after = 1;
+
+    /* No request here carries a body; one we would have to skip is not worth the bytes */
+    if (header_value(headers, end, "Transfer-Encoding", &vlen) ||
+        ((v = header_value(headers, end, "Content-Length", &vlen)) && atol(v) > 0)) {
+        c->close_after = 1;
+        respond_error(hs, c, "413 Content Too Large", "", head_only);
+        return;
+    }
+    if (!get && !head_only) {
+        respond_error(hs, c, "405 Method Not Allowed", "Allow: GET, HEAD\r\n", 0);
+        return;
+    }
+
+    char path[HTTP_PATH_MAX];
+    if (!clean_path(sp1 + 1, (size_t)(sp2 - sp1 - 1), path)) {
+        respond_error(hs, c, "404 Not Found", "", head_only);
+        return;
+    }
+
+    const char *ae = header_value(headers, end, "Accept-Encoding", &vlen);
+    int gzip_ok = ae && value_has(ae, vlen, "gzip");
+    size_t inm_len = 0;
+    const char *inm = header_value(headers, end, "If-None-Match", &inm_len);
+
+    CacheEntry *e = *cache_slot(hs, path);
+    if (!e) e = cache_load(hs, path);  // A miss that fits becomes a hit for the next request
+    if (e) {
+        int gz = gzip_ok && e->gz;
+        const char *etag = gz ? e->gz_etag : e->etag;
+        char extra[160];
+        snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: no-cache\r\n%s%s", etag,
+                 e->gz ? "Vary: Accept-Encoding\r\n" : "", gz ? "Content-Encoding: gzip\r\n" : "");
+        if (inm && (value_has(inm, inm_len, etag) || (inm_len == 1 && inm[0] == '*'))) {
+            respond_head(hs, c, "304 Not Modified", e->type, 0, extra);
+            return;
+        }
+        respond_head(hs, c, "200 OK", e->type, gz ? e->gz_len : e->len, extra);
+        if (!head_only) {
+            e->refs++;
+            c->entry = e;
+            c->body = gz ? e->gz : e->body;
+            c->body_len = gz ? e->gz_len : e->len;
+            c->body_sent = 0;
+        }
+        return;
+    }
+
+    /* Too big for the cache: straight from disk */
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", hs->root, path);
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        respond_error(hs, c, "404 Not Found", "", head_only);
+        return;
+    }
+    char etag[48];
+    char extra[128];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+    snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    if (inm && value_has(inm, inm_len, etag)) {
+        close(fd);
+        respond_head(hs, c, "304 Not Modified", content_type(path), 0, extra);
+        return;
+    }
+    respond_head(hs, c, "200 OK", content_type(path), (size_t)st.st_size, extra);
+    if (head_only) {
+        close(fd);
+        return;
+    }
+    c->file_fd = fd;
+    c->file_off = 0;
+    c->file_left = (size_t)st.st_size;
+}
+
+/* ========= CONNECTIONS ========= */
+
+static void conn_finish_response(HttpStatic *hs, HttpConn *c) {
+    if (c->entry) cache_release(hs, c->entry);
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->entry = NULL;
+    c->body = NULL;
+    c->body_len = c->body_sent = 0;
+    c->head_len = c->head_sent = 0;
+    c->file_fd = -1;
+    c->file_left = 0;
+}
+
+static void conn_close(HttpStatic *hs, HttpConn *c) {
+    epoll_ctl(hs->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    shutdown(c->fd, SHUT_RDWR);  // Forked chat processes may hold copies of the fd
+    close(c->fd);
+    conn_finish_response(hs, c);
+    hs->conns[c->fd] = NULL;
+    free(c);
+}
+
+/* 1 = response fully written, 0 = socket full, -1 = connection lost */
+static int conn_flush(HttpConn *c) {
+    while (c->head_sent < c->head_len || c->body_sent < c->body_len) {
+        struct iovec iov[2];
+        int cnt = 0;
+        if (c->head_sent < c->head_len) {
+            iov[cnt].iov_base = c->head + c->head_sent;
+            iov[cnt++].iov_len = c->head_len - c->head_sent;
+        }
+        if (c->body_sent < c->body_len) {
+            iov[cnt].iov_base = (void *)(c->body + c->body_sent);
+            iov[cnt++].iov_len = c->body_len - c->body_sent;
+        }
+        ssize_t n = writev(c->fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        size_t head_part = c->head_len - c->head_sent < (size_t)n ? c->head_len - c->head_sent : (size_t)n;
+        c->head_sent += head_part;
+        c->body_sent += (size_t)n - head_part;
+    }
+    while (c->file_left > 0) {
+        ssize_t n = sendfile(c->fd, c->file_fd, &c->file_off, c->file_left);
+        if (n > 0) {
+            c->file_left -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;  // Error, or the file shrank under us: the length already went out
+    }
+    return 1;
+}
+
+static void conn_want(HttpStatic *hs, HttpConn *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = c->fd };
+    epoll_ctl(hs->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Answer every complete request buffered, in order, until one has to wait */
+static void conn_serve(HttpStatic *hs, HttpConn *c) {
+    for (;;) {
+        char *blank = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+        if (!blank) {
+            if (c->in_len == sizeof(c->in)) {
+                c->close_after = 1;
+                respond_error(hs, c, "431 Request Header Fields Too Large", "", 0);
+                c->in_len = 0;
+            } else {
+                return;
+            }
+        } else {
+            size_t used = (size_t)(blank - c->in) + 4;
+            handle_request(hs, c, used);
+            memmove(c->in, c->in + used, c->in_len - used);
+            c->in_len -= used;
+        }
+
+        int r = conn_flush(c);
+        if (r < 0) {
+            conn_close(hs, c);
+            return;
+        }
+        if (r == 0) {
+            conn_want(hs, c, EPOLLOUT);  // Reading resumes once this response is out
+            return;
+        }
+        conn_finish_response(hs, c);
+        if (c->close_after) {
+            conn_close(hs, c);
+            return;
+        }
+    }
+}
+
+static void conn_readable(HttpStatic *hs, HttpConn *c) {
+    for (;;) {
+        if (c->in_len == sizeof(c->in)) break;
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        conn_close(hs, c);  // EOF or error
+        return;
+    }
+    c->last_ms = now_ms();
+    conn_serve(hs, c);
+}
+
+static void conn_writable(HttpStatic *hs, HttpConn *c) {
+    int r = conn_flush(c);
+    if (r < 0) {
+        conn_close(hs, c);
+        return;
+    }
+    if (r == 0) return;
+    c->last_ms = now_ms();
+    conn_finish_response(hs, c);
+    if (c->close_after) {
+        conn_close(hs, c);
+        return;
+    }
+    conn_want(hs, c, EPOLLIN);
+    conn_serve(hs, c);  // Pipelined requests that arrived meanwhile
+}
+
+static void accept_conns(HttpStatic *hs) {
+    for (int i = 0; i < HTTP_ACCEPT_BATCH; i++) {
+        int fd = accept4(hs->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        if (fd >= hs->conn_cap) {
+            int cap = hs->conn_cap ? hs->conn_cap : 256;
+            while (cap <= fd) cap *= 2;
+            HttpConn **grown = realloc(hs->conns, (size_t)cap * sizeof(HttpConn *));
+            if (!grown) {
+                close(fd);
+                continue;
+            }
+            memset(grown + hs->conn_cap, 0, (size_t)(cap - hs->conn_cap) * sizeof(HttpConn *));
+            hs->conns = grown;
+            hs->conn_cap = cap;
+        }
+        HttpConn *c = calloc(1, sizeof(HttpConn));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->file_fd = -1;
+        c->last_ms = now_ms();
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+        if (epoll_ctl(hs->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        hs->conns[fd] = c;
+    }
+}
+
+/* ========= THREAD ========= */
+
+static void *http_main(void *arg) {
+    HttpStatic *hs = arg;
+    struct epoll_event events[HTTP_EPOLL_EVENTS];
+    uint64_t last_sweep = now_ms();
+
+    for (;;) {
+        int n = epoll_wait(hs->epoll_fd, events, HTTP_EPOLL_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == hs->wake_fd) return NULL;
+            if (fd == hs->listen_fd) {
+                accept_conns(hs);
+            } else if (fd == hs->inotify_fd) {
+                handle_inotify(hs);
+            } else if (fd < hs->conn_cap && hs->conns[fd]) {
+                HttpConn *c = hs->conns[fd];
+                if (events[i].events & EPOLLOUT) {
+                    conn_writable(hs, c);
+                } else {
+                    conn_readable(hs, c);  // Also how EPOLLHUP/EPOLLERR surface: read fails
+                }
+            }
+        }
+
+        uint64_t now = now_ms();
+        if (now - last_sweep >= 1000) {
+            last_sweep = now;
+            for (int fd = 0; fd < hs->conn_cap; fd++) {
+                if (hs->conns[fd] && now - hs->conns[fd]->last_ms >= HTTP_IDLE_MS) conn_close(hs, hs->conns[fd]);
+            }
+        }
+    }
+}
+
+/* ========= LIFECYCLE ========= */
+
+static void http_free(HttpStatic *hs) {
+    for (int fd = 0; fd < hs->conn_cap; fd++) {
+        if (hs->conns[fd]) conn_close(hs, hs->conns[fd]);
+    }
+    free(hs->conns);
+    for (int b = 0; b < HTTP_CACHE_BUCKETS; b++) {
+        while (hs->buckets[b]) {
+            CacheEntry *e = hs->buckets[b];
+            hs->buckets[b] = e->next;
+            cache_release(hs, e);
+        }
+    }
+    if (hs->epoll_fd >= 0) close(hs->epoll_fd);
+    if (hs->inotify_fd >= 0) close(hs->inotify_fd);
+    if (hs->wake_fd >= 0) close(hs->wake_fd);
+    free(hs);
+}
+
+HttpStatic *http_static_start(int listen_fd, const char *root) {
+    struct stat st;
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+    HttpStatic *hs = calloc(1, sizeof(HttpStatic));
+    if (!hs) return NULL;
+    hs->listen_fd = listen_fd;
+    if (!realpath(root, hs->root)) {
+        free(hs);
+        return NULL;
+    }
+    hs->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    hs->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    hs->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hs->epoll_fd < 0 || hs->wake_fd < 0) {
+        http_free(hs);
+        return NULL;
+    }
+
+    /* Without inotify the cache still works; it just never notices edits */
+    walk_dir(hs, "", 0);
+    hs->preload_bytes = 0;
+    hs->preload_gzip = 0;
+    for (int b = 0; b < HTTP_CACHE_BUCKETS; b++) {
+        for (CacheEntry *e = hs->buckets[b]; e; e = e->next) {
+            hs->preload_bytes += e->len;
+            hs->preload_gzip += e->gz_len;
+        }
+    }
+
+    int fds[3] = { listen_fd, hs->inotify_fd, hs->wake_fd };
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] < 0) continue;
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+        epoll_ctl(hs->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    if (thread_start_quiet(&hs->tid, http_main, hs) != 0) {
+        http_free(hs);
+        return NULL;
+    }
+    return hs;
+}
+
+void http_static_stop(HttpStatic *hs) {
+    if (!hs) return;
+    uint64_t one = 1;
+    if (write(hs->wake_fd, &one, sizeof(one)) < 0) {
+        /* A full counter still wakes the thread */
+    }
+    pthread_join(hs->tid, NULL);
+    epoll_ctl(hs->epoll_fd, EPOLL_CTL_DEL, hs->listen_fd, NULL);
+    http_free(hs);
+}
+
+void http_static_preloaded(const HttpStatic *hs, int *files, size_t *bytes, size_t *gzip_bytes) {
+    *files = hs->preload_files;
+    *bytes = hs->preload_bytes;
+    *gzip_bytes = hs->preload_gzip;
+}
@@ -0,0 +1,29 @@
+#ifndef NETCHAT_HTTP_STATIC_H
+#define NETCHAT_HTTP_STATIC_H
+
+#include <stddef.h>
+
+/* ========= STATIC HTTP =========
+ * Serves a directory (the web UI in public/) as HTTP/1.1 GET and HEAD from
+ * one thread with its own epoll loop, so the chat server's loop never
+ * waits on a browser. Files up to 1 MB are loaded at start into a cache
+ * that keeps each body as-is and, when smaller, gzip-compressed, both with
+ * an ETag taken from the contents; If-None-Match is answered with 304.
+ * inotify on every directory drops and reloads entries as files change.
+ * Larger files are sent from disk with sendfile(). Connections are
+ * keep-alive and pipelined requests are answered in order.
+ */
+
+typedef struct HttpStatic HttpStatic;
+
+/* Serve root on an already listening socket, which stays the caller's.
+   NULL if root is not a readable directory or the thread cannot start. */
+HttpStatic *http_static_start(int listen_fd, const char *root);
+
+/* Stop the thread and close its connections; the listener is left open */
+void http_static_stop(HttpStatic *hs);
+
+/* What the start-up preload put in the cache */
+void http_static_preloaded(const HttpStatic *hs, int *files, size_t *bytes, size_t *gzip_bytes);
+
+#endif
@@ -0,0 +1,899 @@
+#define _GNU_SOURCE
+#include "log_archive.h"
+#include "thread_util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define INDEX_MAGIC "NCLOG 1"
+#define INDEX_FILE "INDEX"
+#define CHUNK_MAGIC 0x4e434c43       // "NCLC"
+#define GZIP_WINDOW (15 + 16)        // zlib window bits asking for a gzip wrapper
+#define HALF_DAY 43200               // A time of day this far below the one before is the next day
+#define COPY_BYTES 65536
+
+/* ========= ON-DISK FORMAT =========
+ * Next to every chat-<name>.log.gz is chat-<name>.idx: a ChunkHeader and a
+ * LogChunk per gzip member, in file order. INDEX is text, one line per
+ * archive: "archive first last first_time last_time raw gz chunks".
+ */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} ChunkHeader;
+
+typedef struct {
+    uint64_t raw_off;            // Of its first line, counting the segments before it
+    uint64_t gz_off;
+    uint32_t raw_len;
+    uint32_t gz_len;
+    int64_t first_time;          // Of its first and last stamped lines
+    int64_t last_time;
+} LogChunk;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+/* The time of day of the latest stamped line and the midnights passed to reach it */
+typedef struct {
+    int tod;                     // -1 before the first stamped line
+    int wraps;
+} DayCount;
+
+/* A chunk being written, its times still relative to the segment's first day */
+typedef struct {
+    LogChunk chunk;
+    DayCount first;
+    DayCount last;
+} ChunkDraft;
+
+/* Turns the times of day of consecutive lines into times */
+typedef struct {
+    time_t midnight;             // Of the day the last stamped line fell on
+    int tod;                     // -1 before the first stamped line
+    time_t last;                 // Given to lines without a stamp
+} DayClock;
+
+struct LogArchive {
+    char dir[256];
+    uint64_t compact_bytes;
+    pthread_t thread;
+    pthread_mutex_t lock;        // Guards everything down to info_gz
+    pthread_cond_t wake;         // A segment rotated in, or stopping
+    uint32_t next_seq;           // Given to the next rotated segment
+    uint32_t cursor;             // Segments from here to next_seq wait for the compressor
+    int stopping;
+    time_t last_rotation;
+    int info_archives;
+    uint64_t info_raw;
+    uint64_t info_gz;
+
+    /* The compressor thread's own */
+    LogArchiveEntry *entries;    // As INDEX lists them
+    int count;
+    int cap;
+};
+
+static int buf_reserve(Buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    uint8_t *grown = realloc(b->data, cap);
+    if (!grown) return -1;
+    b->data = grown;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(Buf *b, const void *data, size_t len) {
+    if (buf_reserve(b, len) < 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* A segment is chat-<seq>.log; an archive of one segment chat-<seq>.log.gz, of a run chat-<first>-<last>.log.gz */
+static void archive_path(char *out, size_t cap, const char *dir, uint32_t first, uint32_t last, const char *ext) {
+    if (first == last) snprintf(out, cap, "%s/chat-%06u%s", dir, first, ext);
+    else snprintf(out, cap, "%s/chat-%06u-%06u%s", dir, first, last, ext);
+}
+
+/* The extension after "chat-<first>[-<last>]", or NULL for any other name */
+static const char *parse_name(const char *name, uint32_t *first, uint32_t *last) {
+    if (strncmp(name, "chat-", 5) != 0 || name[5] < '0' || name[5] > '9') return NULL;
+    char *end;
+    *first = *last = (uint32_t)strtoul(name + 5, &end, 10);
+    if (end[0] == '-' && end[1] >= '0' && end[1] <= '9') *last = (uint32_t)strtoul(end + 1, &end, 10);
+    return end;
+}
+
+/* ========= TIMES ========= */
+
+/* Seconds into the day of a line stamped "[HH:MM:SS]"; -1 for any other line */
+static int line_tod(const char *line, size_t len) {
+    if (len < 10 || line[0] != '[' || line[3] != ':' || line[6] != ':' || line[9] != ']') return -1;
+    int v[3];
+    for (int i = 0; i < 3; i++) {
+        char hi = line[1 + i * 3], lo = line[2 + i * 3];
+        if (hi < '0' || hi > '9' || lo < '0' || lo > '9') return -1;
+        v[i] = (hi - '0') * 10 + (lo - '0');
+    }
+    if (v[0] > 23 || v[1] > 59 || v[2] > 60) return -1;
+    return v[0] * 3600 + v[1] * 60 + v[2];
+}
+
+static int time_of_day(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+}
+
+/* Local midnight of the day days after the one t falls on */
+static time_t day_start(time_t t, int days) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_mday += days;
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/* Follow one line; 1 if it was stamped */
+static int day_count(DayCount *d, const char *line, size_t len) {
+    int tod = line_tod(line, len);
+    if (tod < 0) return 0;
+    if (d->tod >= 0 && tod + HALF_DAY < d->tod) d->wraps++;
+    d->tod = tod;
+    return 1;
+}
+
+/* Midnight of a segment's first day, from its final count and when the file was last written */
+static time_t first_midnight(time_t mtime, const DayCount *end) {
+    int shift = (end->tod > time_of_day(mtime) + HALF_DAY) ? -1 : 0;  // Written just after midnight
+    return day_start(mtime, shift - end->wraps);
+}
+
+static time_t count_time(time_t base, DayCount d, time_t fallback) {
+    return d.tod < 0 ? fallback : day_start(base, d.wraps) + d.tod;
+}
+
+static void clock_start(DayClock *c, time_t midnight, time_t first) {
+    c->midnight = midnight;
+    c->tod = -1;
+    c->last = first;
+}
+
+static time_t clock_line(DayClock *c, const char *line, size_t len) {
+    int tod = line_tod(line, len);
+    if (tod < 0) return c->last;
+    if (c->tod >= 0 && tod + HALF_DAY < c->tod) c->midnight = day_start(c->midnight, 1);
+    c->tod = tod;
+    c->last = c->midnight + tod;
+    return c->last;
+}
+
+/* ========= INDEX ========= */
+
+static int index_read(const char *dir, LogArchiveEntry **entries) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/" INDEX_FILE, dir);
+    *entries = NULL;
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[160];
+    int count = 0, cap = 0, ok = fgets(line, sizeof(line), f) &&
+                                 strncmp(line, INDEX_MAGIC, strlen(INDEX_MAGIC)) == 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        LogArchiveEntry e;
+        long long first_time, last_time;
+        unsigned long long raw, gz;
+        if (sscanf(line, "archive %u %u %lld %lld %llu %llu %u", &e.first_seq, &e.last_seq, &first_time,
+                   &last_time, &raw, &gz, &e.chunks) != 7) {
+            ok = 0;
+            break;
+        }
+        e.first_time = (time_t)first_time;
+        e.last_time = (time_t)last_time;
+        e.raw_bytes = raw;
+        e.gz_bytes = gz;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            LogArchiveEntry *grown = realloc(*entries, (size_t)cap * sizeof(LogArchiveEntry));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            *entries = grown;
+        }
+        (*entries)[count++] = e;
+    }
+    fclose(f);
+    if (!ok) {
+        free(*entries);
+        *entries = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return count;
+}
+
+static int index_write(const char *dir, const LogArchiveEntry *entries, int count) {
+    char path[320], tmp[330];
+    snprintf(path, sizeof(path), "%s/" INDEX_FILE, dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, INDEX_MAGIC "\n");
+    for (int i = 0; i < count; i++) {
+        const LogArchiveEntry *e = &entries[i];
+        fprintf(f, "archive %u %u %lld %lld %llu %llu %u\n", e->first_seq, e->last_seq, (long long)e->first_time,
+                (long long)e->last_time, (unsigned long long)e->raw_bytes, (unsigned long long)e->gz_bytes,
+                e->chunks);
+    }
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* The chunk table of an archive in a malloc()ed array; NULL if it cannot be read */
+static LogChunk *chunks_read(const char *dir, const LogArchiveEntry *e) {
+    char path[320];
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".idx");
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    ChunkHeader hdr;
+    LogChunk *chunks = NULL;
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == CHUNK_MAGIC && hdr.count == e->chunks &&
+        (chunks = malloc((size_t)(hdr.count ? hdr.count : 1) * sizeof(LogChunk))) != NULL &&
+        fread(chunks, sizeof(LogChunk), hdr.count, f) != hdr.count) {
+        free(chunks);
+        chunks = NULL;
+    }
+    fclose(f);
+    return chunks;
+}
+
+/* Write a chunk table under a temporary name, synced; 0 on success */
+static int chunks_write(const char *path, const LogChunk *chunks, uint32_t count) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    ChunkHeader hdr = { CHUNK_MAGIC, count };
+    int ok = write_all(fd, &hdr, sizeof(hdr)) == 0 && write_all(fd, chunks, count * sizeof(LogChunk)) == 0 &&
+             fdatasync(fd) == 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void remove_archive(const char *dir, const LogArchiveEntry *e) {
+    char path[320];
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".log.gz");
+    unlink(path);
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".idx");
+    unlink(path);
+}
+
+/* Rename "<base>.tmp" to base for both files of an archive */
+static int install_archive(const char *dir, const LogArchiveEntry *e) {
+    char tmp[330], path[320];
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".log.gz");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (rename(tmp, path) < 0) return -1;
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    return rename(tmp, path);
+}
+
+/* ========= COMPRESSOR ========= */
+
+static int should_stop(LogArchive *a) {
+    pthread_mutex_lock(&a->lock);
+    int stopping = a->stopping;
+    pthread_mutex_unlock(&a->lock);
+    return stopping;
+}
+
+static void publish_info(LogArchive *a) {
+    uint64_t raw = 0, gz = 0;
+    for (int i = 0; i < a->count; i++) {
+        raw += a->entries[i].raw_bytes;
+        gz += a->entries[i].gz_bytes;
+    }
+    pthread_mutex_lock(&a->lock);
+    a->info_archives = a->count;
+    a->info_raw = raw;
+    a->info_gz = gz;
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* One gzip member holding raw; its compressed length, or -1 */
+static long deflate_member(z_stream *zs, const Buf *raw, Buf *out, int fd) {
+    deflateReset(zs);
+    size_t bound = deflateBound(zs, raw->len);
+    out->len = 0;
+    if (buf_reserve(out, bound) < 0) return -1;
+    zs->next_in = raw->data;
+    zs->avail_in = (uInt)raw->len;
+    zs->next_out = out->data;
+    zs->avail_out = (uInt)bound;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+    size_t len = bound - zs->avail_out;
+    return write_all(fd, out->data, len) == 0 ? (long)len : -1;
+}
+
+/* Copy the whole file at path to fd */
+static int append_file(int fd, const char *path) {
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    char buf[COPY_BYTES];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write_all(fd, buf, (size_t)n) < 0) break;
+    }
+    close(in);
+    return n == 0 ? 0 : -1;
+}
+
+/* Concatenate two archives into a new one covering both; its entry in out */
+static int merge_archives(const char *dir, const LogArchiveEntry *older, const LogArchiveEntry *newer,
+                          LogArchiveEntry *out) {
+    out->first_seq = older->first_seq;
+    out->last_seq = newer->last_seq;
+    out->first_time = older->first_time < newer->first_time ? older->first_time : newer->first_time;
+    out->last_time = older->last_time > newer->last_time ? older->last_time : newer->last_time;
+    out->raw_bytes = older->raw_bytes + newer->raw_bytes;
+    out->gz_bytes = older->gz_bytes + newer->gz_bytes;
+    out->chunks = older->chunks + newer->chunks;
+
+    LogChunk *a = chunks_read(dir, older);
+    LogChunk *b = chunks_read(dir, newer);
+    LogChunk *all = malloc((size_t)(out->chunks ? out->chunks : 1) * sizeof(LogChunk));
+    char path[320], tmp[330];
+    int ok = a && b && all;
+    if (ok) {
+        memcpy(all, a, older->chunks * sizeof(LogChunk));
+        for (uint32_t i = 0; i < newer->chunks; i++) {
+            all[older->chunks + i] = b[i];
+            all[older->chunks + i].raw_off += older->raw_bytes;
+            all[older->chunks + i].gz_off += older->gz_bytes;
+        }
+        archive_path(path, sizeof(path), dir, out->first_seq, out->last_seq, ".idx");
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        ok = chunks_write(tmp, all, out->chunks) == 0;
+    }
+    if (ok) {
+        archive_path(path, sizeof(path), dir, out->first_seq, out->last_seq, ".log.gz");
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        char src[320];
+        archive_path(src, sizeof(src), dir, older->first_seq, older->last_seq, ".log.gz");
+        ok = fd >= 0 && append_file(fd, src) == 0;
+        archive_path(src, sizeof(src), dir, newer->first_seq, newer->last_seq, ".log.gz");
+        ok = ok && append_file(fd, src) == 0 && fdatasync(fd) == 0;
+        if (fd >= 0) close(fd);
+    }
+    free(a);
+    free(b);
+    free(all);
+    return ok ? install_archive(dir, out) : -1;
+}
+
+/* Add a new archive to INDEX, folded into the newest one while both fit in compact_bytes */
+static int commit_archive(LogArchive *a, const LogArchiveEntry *e) {
+    if (a->count > 0) {
+        LogArchiveEntry *prev = &a->entries[a->count - 1];
+        LogArchiveEntry merged;
+        if (prev->raw_bytes + e->raw_bytes <= a->compact_bytes && merge_archives(a->dir, prev, e, &merged) == 0) {
+            LogArchiveEntry old = *prev;
+            *prev = merged;
+            if (index_write(a->dir, a->entries, a->count) == 0) {
+                remove_archive(a->dir, &old);
+                remove_archive(a->dir, e);
+                return 0;
+            }
+            *prev = old;
+            remove_archive(a->dir, &merged);
+            return -1;
+        }
+    }
+
+    if (a->count == a->cap) {
+        int cap = a->cap ? a->cap * 2 : 16;
+        LogArchiveEntry *grown = realloc(a->entries, (size_t)cap * sizeof(LogArchiveEntry));
+        if (!grown) return -1;
+        a->entries = grown;
+        a->cap = cap;
+    }
+    a->entries[a->count++] = *e;
+    if (index_write(a->dir, a->entries, a->count) < 0) {
+        a->count--;
+        return -1;
+    }
+    return 0;
+}
+
+/* Compress segment seq and commit it. 0 when done or there was nothing to do, 1 when
+   stopped part way, -1 on error; unless 0 the segment is left where it was. */
+static int archive_segment(LogArchive *a, uint32_t seq) {
+    char raw_path[320], gz_tmp[330], idx_tmp[330];
+    archive_path(raw_path, sizeof(raw_path), a->dir, seq, seq, ".log");
+    FILE *in = fopen(raw_path, "r");
+    if (!in) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fileno(in), &st) < 0 || st.st_size == 0) {
+        fclose(in);
+        return unlink(raw_path) == 0 ? 0 : -1;
+    }
+
+    archive_path(gz_tmp, sizeof(gz_tmp), a->dir, seq, seq, ".log.gz.tmp");
+    archive_path(idx_tmp, sizeof(idx_tmp), a->dir, seq, seq, ".idx.tmp");
+    int out = open(gz_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (out < 0 || deflateInit2(&zs, LOG_GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        if (out >= 0) close(out);
+        unlink(gz_tmp);
+        fclose(in);
+        return -1;
+    }
+
+    Buf raw = { 0 }, packed = { 0 };
+    ChunkDraft *drafts = NULL, draft;
+    uint32_t count = 0, cap = 0;
+    uint64_t raw_off = 0, gz_off = 0;
+    DayCount day = { -1, 0 };
+    int stamped = 0, result = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    memset(&draft, 0, sizeof(draft));
+
+    for (;;) {
+        ssize_t n = getline(&line, &line_cap, in);
+        if (n > 0) {
+            if (day_count(&day, line, (size_t)n)) {
+                if (!stamped) draft.first = day;
+                draft.last = day;
+                stamped = 1;
+            }
+            if (buf_append(&raw, line, (size_t)n) < 0) {
+                result = -1;
+                break;
+            }
+        } else if (ferror(in)) {
+            result = -1;
+            break;
+        }
+        if (raw.len > 0 && (n <= 0 || raw.len >= LOG_CHUNK_BYTES)) {
+            if (should_stop(a)) {
+                result = 1;
+                break;
+            }
+            if (count == cap) {
+                uint32_t grown_cap = cap ? cap * 2 : 64;
+                ChunkDraft *grown = realloc(drafts, grown_cap * sizeof(ChunkDraft));
+                if (!grown) {
+                    result = -1;
+                    break;
+                }
+                drafts = grown;
+                cap = grown_cap;
+            }
+            long z = deflate_member(&zs, &raw, &packed, out);
+            if (z < 0) {
+                result = -1;
+                break;
+            }
+            if (!stamped) draft.first = draft.last = day;  // Carries on from the line before
+            draft.chunk.raw_off = raw_off;
+            draft.chunk.gz_off = gz_off;
+            draft.chunk.raw_len = (uint32_t)raw.len;
+            draft.chunk.gz_len = (uint32_t)z;
+            drafts[count++] = draft;
+            raw_off += raw.len;
+            gz_off += (uint64_t)z;
+            raw.len = 0;
+            stamped = 0;
+        }
+        if (n <= 0) break;
+    }
+    free(line);
+    free(raw.data);
+    free(packed.data);
+    deflateEnd(&zs);
+    fclose(in);
+    if (result == 0 && fdatasync(out) < 0) result = -1;
+    close(out);
+
+    LogArchiveEntry e = { seq, seq, st.st_mtime, st.st_mtime, raw_off, gz_off, count };
+    LogChunk *chunks = result == 0 ? malloc((size_t)(count ? count : 1) * sizeof(LogChunk)) : NULL;
+    if (chunks) {
+        time_t base = first_midnight(st.st_mtime, &day);
+        for (uint32_t i = 0; i < count; i++) {
+            chunks[i] = drafts[i].chunk;
+            chunks[i].first_time = count_time(base, drafts[i].first, st.st_mtime);
+            chunks[i].last_time = count_time(base, drafts[i].last, st.st_mtime);
+        }
+        if (count > 0) {
+            e.first_time = (time_t)chunks[0].first_time;
+            e.last_time = (time_t)chunks[count - 1].last_time;
+        }
+        result = (chunks_write(idx_tmp, chunks, count) == 0 && install_archive(a->dir, &e) == 0 &&
+                  commit_archive(a, &e) == 0) ? 0 : -1;
+    } else if (result == 0) {
+        result = -1;
+    }
+    free(chunks);
+    free(drafts);
+
+    if (result == 0) {
+        unlink(raw_path);
+        publish_info(a);
+    } else {
+        unlink(gz_tmp);
+        unlink(idx_tmp);
+    }
+    return result;
+}
+
+static void *compressor_main(void *arg) {
+    LogArchive *a = arg;
+
+    pthread_mutex_lock(&a->lock);
+    while (!a->stopping) {
+        if (a->cursor >= a->next_seq) {
+            pthread_cond_wait(&a->wake, &a->lock);
+            continue;
+        }
+        uint32_t seq = a->cursor;
+        pthread_mutex_unlock(&a->lock);
+        int result = archive_segment(a, seq);
+        pthread_mutex_lock(&a->lock);
+        if (result == 1) break;
+        a->cursor = seq + 1;  // A segment that failed stays on disk; the next process retries it
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+/* Drop what an interrupted job left and find the segments still to compress */
+static void scan_directory(LogArchive *a) {
+    uint32_t archived = 0;
+    for (int i = 0; i < a->count; i++) {
+        if (a->entries[i].last_seq > archived) archived = a->entries[i].last_seq;
+    }
+    uint32_t lowest = 0, highest = 0;
+
+    DIR *d = opendir(a->dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char path[512];
+        size_t len = strlen(de->d_name);
+        snprintf(path, sizeof(path), "%s/%s", a->dir, de->d_name);
+        if (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0) {
+            unlink(path);
+            continue;
+        }
+        uint32_t first, last;
+        const char *ext = parse_name(de->d_name, &first, &last);
+        if (!ext) continue;
+        if (strcmp(ext, ".log") == 0 && first == last) {
+            if (first <= archived) {
+                unlink(path);  // Committed just before a crash
+                continue;
+            }
+            if (!lowest || first < lowest) lowest = first;
+            if (first > highest) highest = first;
+        } else if (strcmp(ext, ".log.gz") == 0 || strcmp(ext, ".idx") == 0) {
+            int listed = 0;
+            for (int i = 0; i < a->count && !listed; i++) {
+                listed = a->entries[i].first_seq == first && a->entries[i].last_seq == last;
+            }
+            if (!listed) unlink(path);
+        }
+    }
+    if (d) closedir(d);
+
+    a->next_seq = (highest > archived ? highest : archived) + 1;
+    a->cursor = lowest ? lowest : a->next_seq;
+    if (a->count > 0) a->last_rotation = a->entries[a->count - 1].last_time;
+    if (highest) {
+        char path[320];
+        struct stat st;
+        archive_path(path, sizeof(path), a->dir, highest, highest, ".log");
+        if (stat(path, &st) == 0) a->last_rotation = st.st_mtime;
+    }
+}
+
+LogArchive *log_archive_open(const char *dir, uint64_t compact_bytes) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return NULL;
+
+    LogArchive *a = calloc(1, sizeof(LogArchive));
+    if (!a) return NULL;
+    snprintf(a->dir, sizeof(a->dir), "%s", dir);
+    a->compact_bytes = compact_bytes;
+    a->count = index_read(dir, &a->entries);
+    if (a->count < 0) {
+        if (errno != ENOENT) {
+            free(a);  // Never sweep archives away over an INDEX we cannot read
+            return NULL;
+        }
+        a->count = 0;
+    }
+    a->cap = a->count;
+    scan_directory(a);
+    publish_info(a);
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->wake, NULL);
+
+    if (thread_start_quiet(&a->thread, compressor_main, a) != 0) {
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->wake);
+        free(a->entries);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+FILE *log_archive_rotate(LogArchive *a, const char *path, uint32_t *seq) {
+    char fresh_path[300], segment[320];
+    snprintf(fresh_path, sizeof(fresh_path), "%s.new", path);
+    FILE *fresh = fopen(fresh_path, "a");
+    if (!fresh) return NULL;
+
+    pthread_mutex_lock(&a->lock);
+    archive_path(segment, sizeof(segment), a->dir, a->next_seq, a->next_seq, ".log");
+    if (rename(path, segment) < 0) {
+        pthread_mutex_unlock(&a->lock);
+        fclose(fresh);
+        unlink(fresh_path);
+        return NULL;
+    }
+    if (rename(fresh_path, path) < 0) {
+        rename(segment, path);
+        pthread_mutex_unlock(&a->lock);
+        fclose(fresh);
+        unlink(fresh_path);
+        return NULL;
+    }
+    if (seq) *seq = a->next_seq;
+    a->next_seq++;
+    a->last_rotation = time(NULL);
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    return fresh;
+}
+
+void log_archive_close(LogArchive *a) {
+    if (!a) return;
+    pthread_mutex_lock(&a->lock);
+    a->stopping = 1;
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->wake);
+    free(a->entries);
+    free(a);
+}
+
+void log_archive_info(LogArchive *a, int *archives, int *pending, uint64_t *raw_bytes, uint64_t *gz_bytes) {
+    pthread_mutex_lock(&a->lock);
+    if (archives) *archives = a->info_archives;
+    if (pending) *pending = (int)(a->next_seq - a->cursor);
+    if (raw_bytes) *raw_bytes = a->info_raw;
+    if (gz_bytes) *gz_bytes = a->info_gz;
+    pthread_mutex_unlock(&a->lock);
+}
+
+time_t log_archive_last_rotation(LogArchive *a) {
+    pthread_mutex_lock(&a->lock);
+    time_t t = a->last_rotation;
+    pthread_mutex_unlock(&a->lock);
+    return t;
+}
+
+/* ========= READER ========= */
+
+typedef struct {
+    time_t from;
+    time_t to;
+    LogLineFn fn;
+    void *arg;
+    long lines;
+    LogReadStats *stats;
+} ReadWindow;
+
+/* Hand the lines of text in the window to the callback; 1 once past its end or told to stop */
+static int deliver_lines(ReadWindow *w, DayClock *c, const char *text, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        const char *nl = memchr(text + pos, '\n', len - pos);
+        size_t n = nl ? (size_t)(nl - (text + pos)) + 1 : len - pos;
+        time_t t = clock_line(c, text + pos, n);
+        if (t > w->to) return 1;
+        if (t >= w->from) {
+            w->lines++;
+            if (w->fn(t, text + pos, n, w->arg)) return 1;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+/* Inflate only the chunks of an archive that reach into the window */
+static int read_archive(const char *dir, const LogArchiveEntry *e, ReadWindow *w) {
+    LogChunk *chunks = chunks_read(dir, e);
+    if (!chunks) return -1;
+    w->stats->archives++;
+    uint32_t lo = 0, hi = e->chunks;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (chunks[mid].last_time < (int64_t)w->from) lo = mid + 1;
+        else hi = mid;
+    }
+
+    char path[320];
+    archive_path(path, sizeof(path), dir, e->first_seq, e->last_seq, ".log.gz");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (fd < 0 || inflateInit2(&zs, GZIP_WINDOW) != Z_OK) {
+        if (fd >= 0) close(fd);
+        free(chunks);
+        return -1;
+    }
+
+    Buf packed = { 0 }, plain = { 0 };
+    int result = 0;
+    for (uint32_t i = lo; i < e->chunks && result == 0 && chunks[i].first_time <= (int64_t)w->to; i++) {
+        const LogChunk *ch = &chunks[i];
+        packed.len = plain.len = 0;
+        if (buf_reserve(&packed, ch->gz_len) < 0 || buf_reserve(&plain, ch->raw_len) < 0 ||
+            pread(fd, packed.data, ch->gz_len, (off_t)ch->gz_off) != (ssize_t)ch->gz_len) {
+            result = -1;
+            break;
+        }
+        inflateReset(&zs);
+        zs.next_in = packed.data;
+        zs.avail_in = ch->gz_len;
+        zs.next_out = plain.data;
+        zs.avail_out = ch->raw_len;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0) {
+            result = -1;
+            break;
+        }
+        w->stats->chunks++;
+        w->stats->inflated += ch->raw_len;
+
+        DayClock c;
+        clock_start(&c, day_start((time_t)ch->first_time, 0), (time_t)ch->first_time);
+        result = deliver_lines(w, &c, (const char *)plain.data, ch->raw_len);
+    }
+    inflateEnd(&zs);
+    close(fd);
+    free(packed.data);
+    free(plain.data);
+    free(chunks);
+    return result;
+}
+
+/* A segment with no chunk table: one pass to date it from its mtime, one to deliver */
+static int read_plain(const char *path, ReadWindow *w) {
+    FILE *f = fopen(path, "r");
+    if (!f) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0 || st.st_mtime < w->from) {
+        fclose(f);
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    DayCount day = { -1, 0 };
+    while ((n = getline(&line, &cap, f)) > 0) day_count(&day, line, (size_t)n);
+
+    time_t base = first_midnight(st.st_mtime, &day);
+    DayClock c;
+    clock_start(&c, base, base);
+    rewind(f);
+    int result = 0;
+    while (result == 0 && (n = getline(&line, &cap, f)) > 0) {
+        w->stats->scanned += (uint64_t)n;
+        result = deliver_lines(w, &c, line, (size_t)n);
+    }
+    free(line);
+    fclose(f);
+    return result;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int log_archive_list(const char *dir, LogArchiveEntry **entries) {
+    return index_read(dir, entries);
+}
+
+long log_archive_read(const char *dir, const char *active, time_t from, time_t to,
+                      LogLineFn fn, void *arg, LogReadStats *stats) {
+    LogReadStats local;
+    ReadWindow w = { from, to, fn, arg, 0, stats ? stats : &local };
+    memset(w.stats, 0, sizeof(*w.stats));
+
+    LogArchiveEntry *entries;
+    int count = index_read(dir, &entries);
+    if (count < 0) {
+        if (errno != ENOENT) return -1;
+        count = 0;
+    }
+    int result = 0;
+    uint32_t archived = 0;
+    for (int i = 0; i < count; i++) {
+        if (entries[i].last_seq > archived) archived = entries[i].last_seq;
+        if (result == 0 && entries[i].last_time >= from && entries[i].first_time <= to) {
+            result = read_archive(dir, &entries[i], &w);
+        }
+    }
+    free(entries);
+
+    /* Segments the compressor has not reached, oldest first */
+    uint32_t *pending = NULL;
+    int pending_count = 0, pending_cap = 0;
+    DIR *d = result == 0 ? opendir(dir) : NULL;
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        uint32_t first, last;
+        const char *ext = parse_name(de->d_name, &first, &last);
+        if (!ext || strcmp(ext, ".log") != 0 || first != last || first <= archived) continue;
+        if (pending_count == pending_cap) {
+            pending_cap = pending_cap ? pending_cap * 2 : 16;
+            uint32_t *grown = realloc(pending, (size_t)pending_cap * sizeof(uint32_t));
+            if (!grown) break;
+            pending = grown;
+        }
+        pending[pending_count++] = first;
+    }
+    if (d) closedir(d);
+    qsort(pending, (size_t)pending_count, sizeof(uint32_t), compare_seq);
+    for (int i = 0; i < pending_count && result == 0; i++) {
+        char path[320];
+        archive_path(path, sizeof(path), dir, pending[i], pending[i], ".log");
+        result = read_plain(path, &w);
+    }
+    free(pending);
+
+    if (result == 0 && active) result = read_plain(active, &w);
+    return result < 0 ? -1 : w.lines;
+}
@@ -0,0 +1,85 @@
+#ifndef NETCHAT_LOG_ARCHIVE_H
+#define NETCHAT_LOG_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* ========= CHAT LOG ARCHIVE =========
+ * chat.log is cut into numbered segments. log_archive_rotate() only renames
+ * it into the archive directory as chat-<seq>.log and opens a fresh one; a
+ * compressor thread then gzips the segment in chunks of about
+ * LOG_CHUNK_BYTES, each a complete gzip member, and writes beside it a
+ * chunk table with where every chunk starts in both files and the times of
+ * its first and last line. Members concatenate into an ordinary .gz file,
+ * so zcat still reads an archive whole, while log_archive_read() seeks to
+ * the first chunk that reaches its window and stops after the last one:
+ * old archives are never inflated whole.
+ *
+ * A new archive is compacted into the one before it while the two together
+ * hold no more than the rotation size, so a quiet server rotating daily
+ * does not pile up small files. INDEX, replaced with rename(), lists the
+ * archives and their time ranges. Files it does not list are what an
+ * interrupted job left and are removed; segments still waiting for the
+ * compressor are picked up by the next process to open the archive.
+ *
+ * Log lines carry only the time of day ("[HH:MM:SS]"). Dates are recovered
+ * by anchoring the last line of a segment to the file's mtime and counting
+ * back one day wherever the time of day jumps backwards across midnight.
+ */
+
+#define LOG_CHUNK_BYTES (256 * 1024)      // Raw bytes per gzip member: the unit a reader inflates
+#define LOG_GZIP_LEVEL 6
+
+typedef struct LogArchive LogArchive;    // Compressor, one per directory
+
+typedef struct {
+    uint32_t first_seq;          // Segments it holds; a single one is chat-<seq>.log.gz,
+    uint32_t last_seq;           // a compacted run chat-<first>-<last>.log.gz
+    time_t first_time;
+    time_t last_time;
+    uint64_t raw_bytes;
+    uint64_t gz_bytes;
+    uint32_t chunks;
+} LogArchiveEntry;
+
+typedef struct {
+    int archives;                // Archives whose chunk tables were read
+    int chunks;                  // Chunks inflated
+    uint64_t inflated;           // Bytes those chunks held
+    uint64_t scanned;            // Bytes read from uncompressed segments and the live log
+} LogReadStats;
+
+/* Called for every line in the window, newline included; non-zero stops the read */
+typedef int (*LogLineFn)(time_t when, const char *line, size_t len, void *arg);
+
+/* Open or create the archive in dir and start its compressor. Runs of
+   segments are compacted up to compact_bytes. NULL on failure. */
+LogArchive *log_archive_open(const char *dir, uint64_t compact_bytes);
+
+/* Move the log at path into the archive as the next segment and queue it.
+   Returns the log reopened, empty, at path; NULL if nothing was moved.
+   The caller must keep every writer off path meanwhile. */
+FILE *log_archive_rotate(LogArchive *a, const char *path, uint32_t *seq);
+
+/* Stop the compressor and free the archive; NULL is ignored. A segment it
+   was part way through stays queued for the next process. */
+void log_archive_close(LogArchive *a);
+
+/* Archives, segments waiting for the compressor, and the bytes archived */
+void log_archive_info(LogArchive *a, int *archives, int *pending, uint64_t *raw_bytes, uint64_t *gz_bytes);
+
+/* When the newest segment, compressed or not, was last written; 0 if there is none */
+time_t log_archive_last_rotation(LogArchive *a);
+
+/* The archives INDEX lists, oldest first, in a malloc()ed array; -1 if it cannot be read */
+int log_archive_list(const char *dir, LogArchiveEntry **entries);
+
+/* Every line logged between from and to (inclusive), oldest first: the
+   archives, segments not yet compressed, then the live log at active
+   (NULL to leave it out). Returns the lines delivered, or -1. */
+long log_archive_read(const char *dir, const char *active, time_t from, time_t to,
+                      LogLineFn fn, void *arg, LogReadStats *stats);
+
+#endif
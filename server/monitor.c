@@ -0,0 +1,151 @@
+#include "monitor.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EVENT_MASK (MONITOR_EVENTS - 1)
+
+_Static_assert((MONITOR_EVENTS & EVENT_MASK) == 0, "MONITOR_EVENTS is a power of two");
+
+static const char *event_names[MON_EVENT_TYPES] = {
+    [MON_CONNECT] = "connect",
+    [MON_DISCONNECT] = "disconnect",
+    [MON_SLOW] = "slow",
+    [MON_DROPPED] = "dropped",
+    [MON_SHED] = "shed",
+    [MON_HIGH_WATER] = "high-water",
+    [MON_OVERLOAD] = "overload",
+};
+
+static uint64_t unix_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* ========= WRITER ========= */
+
+MonitorShared *monitor_create(const char *name) {
+    /* A fresh object: one a previous server left may still be mapped by readers */
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+    if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(MonitorShared)) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    MonitorShared *m = mmap(NULL, sizeof(MonitorShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    m->version = MONITOR_VERSION;
+    __atomic_store_n(&m->magic, MONITOR_MAGIC, __ATOMIC_RELEASE);  // Last: readers check it first
+    return m;
+}
+
+void monitor_remove(const char *name) {
+    shm_unlink(name);
+}
+
+void monitor_publish(MonitorShared *m, const MonitorStats *stats) {
+    uint32_t seq = m->stats_seq;
+    __atomic_store_n(&m->stats_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&m->stats, stats, sizeof(*stats));
+    __atomic_store_n(&m->stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void monitor_event(MonitorShared *m, int type, int64_t value, const char *fmt, ...) {
+    if (!m || type < 0 || type >= MON_EVENT_TYPES) return;
+    uint64_t pos = __atomic_fetch_add(&m->event_head, 1, __ATOMIC_ACQ_REL);
+    MonitorEvent *e = &m->events[pos & EVENT_MASK];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->type = (uint16_t)type;
+    e->unix_ms = unix_ms();
+    e->value = value;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e->text, sizeof(e->text), fmt, ap);
+    va_end(ap);
+    __atomic_add_fetch(&m->event_counts[type], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, (uint32_t)(pos + 1), __ATOMIC_RELEASE);
+}
+
+int monitor_bucket(uint64_t ms) {
+    int b = ms == 0 ? 0 : 64 - __builtin_clzll(ms);
+    return b < MONITOR_LAT_BUCKETS ? b : MONITOR_LAT_BUCKETS - 1;
+}
+
+/* ========= READER ========= */
+
+const MonitorShared *monitor_attach(const char *name, uint64_t *ino) {
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MonitorShared)) {
+        close(fd);
+        return NULL;
+    }
+    const MonitorShared *m = mmap(NULL, sizeof(MonitorShared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != MONITOR_MAGIC || m->version != MONITOR_VERSION) {
+        munmap((void *)m, sizeof(MonitorShared));
+        return NULL;
+    }
+    *ino = (uint64_t)st.st_ino;
+    return m;
+}
+
+void monitor_detach(const MonitorShared *m) {
+    if (m) munmap((void *)m, sizeof(MonitorShared));
+}
+
+uint64_t monitor_current(const char *name) {
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    struct stat st;
+    uint64_t ino = fstat(fd, &st) == 0 ? (uint64_t)st.st_ino : 0;
+    close(fd);
+    return ino;
+}
+
+int monitor_read(const MonitorShared *m, MonitorStats *out) {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint32_t before = __atomic_load_n(&m->stats_seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, &m->stats, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&m->stats_seq, __ATOMIC_RELAXED) == before) return 0;
+    }
+    return -1;
+}
+
+int monitor_read_event(const MonitorShared *m, uint64_t pos, MonitorEvent *out) {
+    const MonitorEvent *e = &m->events[pos & EVENT_MASK];
+    uint32_t before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, e, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if (before != (uint32_t)(pos + 1) || after != before || out->type >= MON_EVENT_TYPES) return 0;
+    out->text[sizeof(out->text) - 1] = '\0';
+    return 1;
+}
+
+const char *monitor_event_name(int type) {
+    return type >= 0 && type < MON_EVENT_TYPES ? event_names[type] : "?";
+}
@@ -0,0 +1,149 @@
+#ifndef NETCHAT_MONITOR_H
+#define NETCHAT_MONITOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= LIVE MONITOR =========
+ * A POSIX shared-memory object the server publishes into and anyone on the
+ * host may map read-only (tools/netchat-top). It holds two things:
+ *
+ * - MonitorStats, a snapshot of counters, queue depths and per-room totals
+ *   the parent rebuilds on a timer. It is copied in under a sequence lock:
+ *   the count is odd while the copy is under way, and a reader that sees it
+ *   odd, or changed across its own copy, reads again.
+ * - A ring of the last MONITOR_EVENTS notable events: connects,
+ *   disconnects, slow consumers and the ones dropped for it, shed messages,
+ *   queue high-water marks and overload changes. Writers claim a slot with
+ *   an atomic add and stamp it with its position once it is complete, so a
+ *   reader skips a slot that is being rewritten under it.
+ *
+ * Rates and latency percentiles are not computed by the server: a reader
+ * takes the difference between two snapshots. The server's only extra cost
+ * per message is one histogram increment.
+ */
+
+#define MONITOR_NAME "/netchat_monitor"
+#define MONITOR_MAGIC 0x4e434d4f     // "NCMO"
+#define MONITOR_VERSION 1
+#define MONITOR_LANES 2              // Control, bulk: the server's output lanes
+#define MONITOR_LAT_BUCKETS 16       // Bucket b counts waits under 2^b ms, the last everything longer
+#define MONITOR_ROOMS 64
+#define MONITOR_ROOM_NAME 30
+#define MONITOR_EVENTS 1024          // A power of two
+#define MONITOR_EVENT_TEXT 48
+
+enum {
+    MON_CONNECT,                     // A connection was accepted and handed to a child
+    MON_DISCONNECT,
+    MON_SLOW,                        // A connection's queued output passed the slow-consumer mark
+    MON_DROPPED,                     // ... and it fell so far behind it was disconnected
+    MON_SHED,                        // Messages refused since the last snapshot
+    MON_HIGH_WATER,                  // The broadcast queue reached a new peak
+    MON_OVERLOAD,                    // The overload level changed
+    MON_EVENT_TYPES
+};
+
+typedef struct {
+    char name[MONITOR_ROOM_NAME];
+    uint16_t unused;
+    uint32_t members;                // Connections and gateway channels subscribed
+    uint64_t messages;               // Chat messages ever sent to it
+} MonitorRoom;
+
+typedef struct {
+    uint64_t published_ms;           // Unix time of this snapshot
+    uint64_t started_ms;             // Unix time the server started
+    int32_t pid;
+    int32_t overload_level;
+
+    /* Connections */
+    uint32_t max_clients;
+    uint32_t clients;
+    uint32_t logged_in;
+    uint32_t websocket;
+    uint32_t gateways;
+    uint32_t channels;               // Browser sessions carried by the gateways
+
+    /* Broadcast queue, children to parent */
+    uint32_t queue_slots;
+    uint32_t queue_depth;
+    uint32_t lane_depth[MONITOR_LANES];
+    uint32_t queue_peak;             // Deepest since the last snapshot
+    uint32_t arena_bytes;
+    uint32_t arena_used;
+    uint32_t backlogged;             // Connections the parent holds queued output for
+
+    /* Output the parent is holding for slow sockets */
+    uint64_t backlog_bytes;
+    uint64_t backlog_max;            // The largest single connection's
+
+    /* Cumulative */
+    uint64_t rate_limited;
+    uint64_t queue_full_drops;
+    uint64_t room_budget_drops;
+    uint64_t notices_dropped;
+    uint64_t slow_drops;
+    uint64_t lane_writes[MONITOR_LANES];
+    uint64_t lane_wait[MONITOR_LANES][MONITOR_LAT_BUCKETS];  // Queueing to the socket, per message
+
+    uint32_t rooms;
+    uint32_t unused;
+    MonitorRoom room[MONITOR_ROOMS];
+} MonitorStats;
+
+typedef struct {
+    uint32_t seq;                    // Ring position + 1 once written, 0 while being written
+    uint16_t type;
+    uint16_t unused;
+    uint64_t unix_ms;
+    int64_t value;
+    char text[MONITOR_EVENT_TEXT];
+} MonitorEvent;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stats_seq;              // Odd while stats are being written
+    uint32_t unused;
+    uint64_t event_head;             // Events ever written
+    uint64_t event_counts[MON_EVENT_TYPES];
+    MonitorStats stats;
+    MonitorEvent events[MONITOR_EVENTS];
+} MonitorShared;
+
+/* ---- Server side ---- */
+
+/* Replace any object of that name with a fresh one, readable by everyone; NULL on failure */
+MonitorShared *monitor_create(const char *name);
+void monitor_remove(const char *name);
+
+/* Publish a snapshot; one thread at a time */
+void monitor_publish(MonitorShared *m, const MonitorStats *stats);
+
+/* Append an event; safe from any thread */
+void monitor_event(MonitorShared *m, int type, int64_t value, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/* Histogram bucket for a wait of ms milliseconds */
+int monitor_bucket(uint64_t ms);
+
+/* ---- Reader side ---- */
+
+/* Map the object read-only; NULL if it is missing or from another version.
+   *ino identifies it, to notice a restarted server replacing it. */
+const MonitorShared *monitor_attach(const char *name, uint64_t *ino);
+void monitor_detach(const MonitorShared *m);
+
+/* Inode of the object now behind name, 0 if there is none */
+uint64_t monitor_current(const char *name);
+
+/* A consistent copy of the latest snapshot; -1 if the writer kept it busy */
+int monitor_read(const MonitorShared *m, MonitorStats *out);
+
+/* Event at ring position pos; 0 if it was overwritten or is being written */
+int monitor_read_event(const MonitorShared *m, uint64_t pos, MonitorEvent *out);
+
+const char *monitor_event_name(int type);
+
+#endif
@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include "msg_crypt.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MSG_CRYPT_X86 1
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+#define ENCRYPT_LANES 4              // Messages encrypted side by side
+#define DECRYPT_WIDTH 8              // Blocks in flight through aesdec at once
+#define KEY_CACHE_SLOTS 8
+
+/* ========= SHA-256, HMAC, PBKDF2 ========= */
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t have;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror32(uint32_t v, int n) {
+    return (v >> n) | (v << (32 - n));
+}
+
+static uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void sha256_block(Sha256 *s, const uint8_t *b) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = load_be32(b + i * 4);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = s->h[0], b2 = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b2) ^ (a & c) ^ (b2 & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b2;
+        b2 = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a;
+    s->h[1] += b2;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+    s->h[5] += f;
+    s->h[6] += g;
+    s->h[7] += h;
+}
+
+static void sha256_init(Sha256 *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->have = 0;
+}
+
+static void sha256_update(Sha256 *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+    s->len += len;
+    if (s->have) {
+        size_t take = 64 - s->have < len ? 64 - s->have : len;
+        memcpy(s->buf + s->have, p, take);
+        s->have += take;
+        p += take;
+        len -= take;
+        if (s->have < 64) return;
+        sha256_block(s, s->buf);
+        s->have = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(s, p);
+    memcpy(s->buf, p, len);
+    s->have = len;
+}
+
+static void sha256_final(Sha256 *s, uint8_t out[32]) {
+    uint64_t bits = s->len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (s->have < 56 ? 56 : 120) - s->have;
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) store_be32(out + i * 4, s->h[i]);
+}
+
+typedef struct {
+    Sha256 inner;                // Already fed key ^ ipad
+    Sha256 outer;                // Already fed key ^ opad
+} HmacSha256;
+
+static void hmac_init(HmacSha256 *m, const uint8_t *key, size_t key_len) {
+    uint8_t k[64] = { 0 };
+    if (key_len > 64) {
+        Sha256 s;
+        sha256_init(&s);
+        sha256_update(&s, key, key_len);
+        sha256_final(&s, k);
+    } else {
+        memcpy(k, key, key_len);
+    }
+
+    uint8_t pad[64];
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    sha256_init(&m->inner);
+    sha256_update(&m->inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    sha256_init(&m->outer);
+    sha256_update(&m->outer, pad, 64);
+}
+
+/* One MAC from a prepared key: the key schedule is paid once per PBKDF2 call */
+static void hmac_run(const HmacSha256 *m, const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len,
+                     uint8_t out[32]) {
+    Sha256 s = m->inner;
+    sha256_update(&s, a, a_len);
+    sha256_update(&s, b, b_len);
+    sha256_final(&s, out);
+    s = m->outer;
+    sha256_update(&s, out, 32);
+    sha256_final(&s, out);
+}
+
+/* PBKDF2-HMAC-SHA256 with one iteration, all scrypt asks of it */
+static void pbkdf2_sha256(const uint8_t *pass, size_t pass_len, const uint8_t *salt, size_t salt_len,
+                          uint8_t *out, size_t out_len) {
+    HmacSha256 m;
+    hmac_init(&m, pass, pass_len);
+    for (uint32_t i = 1; out_len > 0; i++) {
+        uint8_t counter[4];
+        uint8_t block[32];
+        store_be32(counter, i);
+        hmac_run(&m, salt, salt_len, counter, 4, block);
+        size_t take = out_len < 32 ? out_len : 32;
+        memcpy(out, block, take);
+        out += take;
+        out_len -= take;
+    }
+}
+
+/* ========= SCRYPT (RFC 7914) ========= */
+
+static uint32_t rol32(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= rol32(x[0] + x[12], 7);   x[8] ^= rol32(x[4] + x[0], 9);
+        x[12] ^= rol32(x[8] + x[4], 13);  x[0] ^= rol32(x[12] + x[8], 18);
+        x[9] ^= rol32(x[5] + x[1], 7);    x[13] ^= rol32(x[9] + x[5], 9);
+        x[1] ^= rol32(x[13] + x[9], 13);  x[5] ^= rol32(x[1] + x[13], 18);
+        x[14] ^= rol32(x[10] + x[6], 7);  x[2] ^= rol32(x[14] + x[10], 9);
+        x[6] ^= rol32(x[2] + x[14], 13);  x[10] ^= rol32(x[6] + x[2], 18);
+        x[3] ^= rol32(x[15] + x[11], 7);  x[7] ^= rol32(x[3] + x[15], 9);
+        x[11] ^= rol32(x[7] + x[3], 13);  x[15] ^= rol32(x[11] + x[7], 18);
+        x[1] ^= rol32(x[0] + x[3], 7);    x[2] ^= rol32(x[1] + x[0], 9);
+        x[3] ^= rol32(x[2] + x[1], 13);   x[0] ^= rol32(x[3] + x[2], 18);
+        x[6] ^= rol32(x[5] + x[4], 7);    x[7] ^= rol32(x[6] + x[5], 9);
+        x[4] ^= rol32(x[7] + x[6], 13);   x[5] ^= rol32(x[4] + x[7], 18);
+        x[11] ^= rol32(x[10] + x[9], 7);  x[8] ^= rol32(x[11] + x[10], 9);
+        x[9] ^= rol32(x[8] + x[11], 13);  x[10] ^= rol32(x[9] + x[8], 18);
+        x[12] ^= rol32(x[15] + x[14], 7); x[13] ^= rol32(x[12] + x[15], 9);
+        x[14] ^= rol32(x[13] + x[12], 13); x[15] ^= rol32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) b[i] += x[i];
+}
+
+/* in and out are 2r 64-byte blocks, as 32-bit words */
+static void block_mix(const uint32_t *in, uint32_t *out, uint32_t r) {
+    uint32_t x[16];
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+    for (uint32_t i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 16; k++) x[k] ^= in[i * 16 + k];
+        salsa20_8(x);
+        /* Even blocks to the first half, odd to the second */
+        memcpy(out + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+}
+
+static void ro_mix(uint8_t *b, uint32_t r, uint64_t n, uint32_t *v, uint32_t *x, uint32_t *y) {
+    size_t words = 32 * (size_t)r;
+    for (size_t k = 0; k < words; k++) {
+        x[k] = (uint32_t)b[k * 4] | (uint32_t)b[k * 4 + 1] << 8 | (uint32_t)b[k * 4 + 2] << 16 |
+               (uint32_t)b[k * 4 + 3] << 24;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        memcpy(v + i * words, x, words * 4);
+        block_mix(x, y, r);
+        memcpy(x, y, words * 4);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+        for (size_t k = 0; k < words; k++) x[k] ^= v[j * words + k];
+        block_mix(x, y, r);
+        memcpy(x, y, words * 4);
+    }
+    for (size_t k = 0; k < words; k++) {
+        b[k * 4] = (uint8_t)x[k];
+        b[k * 4 + 1] = (uint8_t)(x[k] >> 8);
+        b[k * 4 + 2] = (uint8_t)(x[k] >> 16);
+        b[k * 4 + 3] = (uint8_t)(x[k] >> 24);
+    }
+}
+
+int msg_crypt_scrypt(const uint8_t *pass, size_t pass_len, const uint8_t *salt, size_t salt_len,
+                     uint64_t n, uint32_t r, uint32_t p, uint8_t *out, size_t out_len) {
+    if (n < 2 || (n & (n - 1)) != 0 || r == 0 || p == 0 || n > (1ULL << 24) || r > 64 || p > 16) return -1;
+
+    size_t block = 128 * (size_t)r;
+    uint8_t *b = malloc(block * p);
+    uint32_t *v = malloc(block * (size_t)n);
+    uint32_t *xy = malloc(block * 2);
+    if (!b || !v || !xy) {
+        free(b);
+        free(v);
+        free(xy);
+        return -1;
+    }
+
+    pbkdf2_sha256(pass, pass_len, salt, salt_len, b, block * p);
+    for (uint32_t i = 0; i < p; i++) ro_mix(b + i * block, r, n, v, xy, xy + 32 * r);
+    pbkdf2_sha256(pass, pass_len, b, block * p, out, out_len);
+
+    memset(b, 0, block * p);
+    free(b);
+    free(v);
+    free(xy);
+    return 0;
+}
+
+/* ========= HEX =========
+ * Text handling costs as much as the cipher here, so both directions go
+ * through tables: a byte pair per input byte out, a value per character in.
+ */
+
+static uint16_t hex_pairs[256];      // "00".."ff" as two chars in memory order
+static uint8_t hex_values[256];      // Lowercase digit value, 0xff for anything else
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT;
+
+static void build_hex(void) {
+    static const char digits[] = "0123456789abcdef";
+    memset(hex_values, 0xff, sizeof(hex_values));
+    for (int i = 0; i < 16; i++) hex_values[(uint8_t)digits[i]] = (uint8_t)i;
+    for (int i = 0; i < 256; i++) {
+        char pair[2] = { digits[i >> 4], digits[i & 15] };
+        memcpy(&hex_pairs[i], pair, 2);
+    }
+}
+
+static void hex_encode(char *out, const uint8_t *in, size_t len) {
+    for (size_t i = 0; i < len; i++) memcpy(out + i * 2, &hex_pairs[in[i]], 2);
+}
+
+/* server.js writes lowercase, and ENCRYPTED_FORMAT only accepts lowercase */
+static int hex_decode(uint8_t *out, const char *in, size_t bytes) {
+    uint8_t bad = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        uint8_t hi = hex_values[(uint8_t)in[i * 2]];
+        uint8_t lo = hex_values[(uint8_t)in[i * 2 + 1]];
+        bad |= (hi | lo) & 0xf0;
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return bad ? -1 : 0;
+}
+
+size_t msg_crypt_wire_span(const char *s, size_t len) {
+    pthread_once(&hex_once, build_hex);
+    size_t i = 0;
+    while (i < len && i < 2 * MSG_CRYPT_IV_LEN && hex_values[(uint8_t)s[i]] != 0xff) i++;
+    if (i != 2 * MSG_CRYPT_IV_LEN || i >= len || s[i] != ':') return 0;
+    size_t body = ++i;
+    while (i < len && hex_values[(uint8_t)s[i]] != 0xff) i++;
+    return i > body ? i : 0;
+}
+
+/* ========= AES TABLES ========= */
+
+static uint8_t sbox[256];
+static uint8_t inv_sbox[256];
+static uint32_t te[4][256];          // SubBytes + MixColumns, one table per byte position
+static uint32_t td[4][256];          // InvSubBytes + InvMixColumns
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static int use_aesni = -1;           // -1 until probed
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t p = 0;
+    while (b) {
+        if (b & 1) p ^= a;
+        a = (uint8_t)((a << 1) ^ (a & 0x80 ? 0x1b : 0));
+        b >>= 1;
+    }
+    return p;
+}
+
+static uint8_t rol8(uint8_t v, int n) {
+    return (uint8_t)((v << n) | (v >> (8 - n)));
+}
+
+static void build_tables(void) {
+    /* Walk the multiplicative group with generator 3; q tracks the inverse of p */
+    uint8_t p = 1, q = 1;
+    do {
+        p = (uint8_t)(p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0));
+        q ^= (uint8_t)(q << 1);
+        q ^= (uint8_t)(q << 2);
+        q ^= (uint8_t)(q << 4);
+        if (q & 0x80) q ^= 0x09;
+        sbox[p] = (uint8_t)(q ^ rol8(q, 1) ^ rol8(q, 2) ^ rol8(q, 3) ^ rol8(q, 4) ^ 0x63);
+    } while (p != 1);
+    sbox[0] = 0x63;
+    for (int i = 0; i < 256; i++) inv_sbox[sbox[i]] = (uint8_t)i;
+
+    for (int i = 0; i < 256; i++) {
+        uint8_t s = sbox[i];
+        uint32_t e = (uint32_t)gf_mul(s, 2) << 24 | (uint32_t)s << 16 | (uint32_t)s << 8 | gf_mul(s, 3);
+        uint8_t si = inv_sbox[i];
+        uint32_t d = (uint32_t)gf_mul(si, 14) << 24 | (uint32_t)gf_mul(si, 9) << 16 |
+                     (uint32_t)gf_mul(si, 13) << 8 | gf_mul(si, 11);
+        for (int t = 0; t < 4; t++) {
+            te[t][i] = t ? ror32(e, 8 * t) : e;
+            td[t][i] = t ? ror32(d, 8 * t) : d;
+        }
+    }
+}
+
+static void init_tables(void) {
+    pthread_once(&tables_once, build_tables);
+    pthread_once(&hex_once, build_hex);
+    if (use_aesni < 0) {
+#ifdef MSG_CRYPT_X86
+        use_aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+#else
+        use_aesni = 0;
+#endif
+    }
+}
+
+const char *msg_crypt_engine(void) {
+    init_tables();
+    return use_aesni ? "aes-ni" : "portable";
+}
+
+void msg_crypt_force_portable(void) {
+    init_tables();
+    use_aesni = 0;
+}
+
+/* ========= KEY SCHEDULE ========= */
+
+#ifdef MSG_CRYPT_X86
+__attribute__((target("aes,sse2")))
+static void aesni_inverse_keys(MsgKey *key) {
+    _mm_storeu_si128((__m128i *)key->dec[0], _mm_loadu_si128((const __m128i *)key->enc[14]));
+    for (int i = 1; i < 14; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i *)key->enc[14 - i]);
+        _mm_storeu_si128((__m128i *)key->dec[i], _mm_aesimc_si128(k));
+    }
+    _mm_storeu_si128((__m128i *)key->dec[14], _mm_loadu_si128((const __m128i *)key->enc[0]));
+}
+#endif
+
+void msg_crypt_expand(const uint8_t raw[MSG_CRYPT_KEY_LEN], MsgKey *key) {
+    init_tables();
+    uint32_t *w = key->enc_words;
+    uint8_t rcon = 1;
+    for (int i = 0; i < 8; i++) w[i] = load_be32(raw + i * 4);
+    for (int i = 8; i < 60; i++) {
+        uint32_t t = w[i - 1];
+        if (i % 8 == 0) {
+            t = (uint32_t)sbox[(t >> 16) & 0xff] << 24 | (uint32_t)sbox[(t >> 8) & 0xff] << 16 |
+                (uint32_t)sbox[t & 0xff] << 8 | sbox[t >> 24];
+            t ^= (uint32_t)rcon << 24;
+            rcon = gf_mul(rcon, 2);
+        } else if (i % 8 == 4) {
+            t = (uint32_t)sbox[t >> 24] << 24 | (uint32_t)sbox[(t >> 16) & 0xff] << 16 |
+                (uint32_t)sbox[(t >> 8) & 0xff] << 8 | sbox[t & 0xff];
+        }
+        w[i] = w[i - 8] ^ t;
+    }
+    for (int i = 0; i < 60; i++) store_be32(key->enc[i / 4] + (i % 4) * 4, w[i]);
+
+    /* Equivalent inverse cipher: rounds reversed, InvMixColumns on the middle ones.
+       td[][sbox[x]] is InvMixColumns of a lone byte x, so four lookups do a column. */
+    uint32_t *dw = key->dec_words;
+    for (int round = 0; round <= 14; round++) {
+        for (int c = 0; c < 4; c++) {
+            uint32_t v = w[(14 - round) * 4 + c];
+            if (round > 0 && round < 14) {
+                v = td[0][sbox[v >> 24]] ^ td[1][sbox[(v >> 16) & 0xff]] ^
+                    td[2][sbox[(v >> 8) & 0xff]] ^ td[3][sbox[v & 0xff]];
+            }
+            dw[round * 4 + c] = v;
+        }
+    }
+#ifdef MSG_CRYPT_X86
+    if (use_aesni) {
+        aesni_inverse_keys(key);
+        return;
+    }
+#endif
+    for (int i = 0; i < 60; i++) store_be32(key->dec[i / 4] + (i % 4) * 4, dw[i]);
+}
+
+/* ========= BLOCK CIPHER ========= */
+
+static void table_encrypt(const MsgKey *key, uint8_t blk[16]) {
+    const uint32_t *rk = key->enc_words;
+    uint32_t s0 = load_be32(blk) ^ rk[0], s1 = load_be32(blk + 4) ^ rk[1];
+    uint32_t s2 = load_be32(blk + 8) ^ rk[2], s3 = load_be32(blk + 12) ^ rk[3];
+    for (int r = 1; r < 14; r++) {
+        rk += 4;
+        uint32_t t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^ te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ rk[0];
+        uint32_t t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^ te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ rk[1];
+        uint32_t t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^ te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ rk[2];
+        uint32_t t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^ te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 4;
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = (uint32_t)sbox[s[c] >> 24] << 24 | (uint32_t)sbox[(s[(c + 1) & 3] >> 16) & 0xff] << 16 |
+                     (uint32_t)sbox[(s[(c + 2) & 3] >> 8) & 0xff] << 8 | sbox[s[(c + 3) & 3] & 0xff];
+        store_be32(blk + c * 4, v ^ rk[c]);
+    }
+}
+
+static void table_decrypt(const MsgKey *key, uint8_t blk[16]) {
+    const uint32_t *rk = key->dec_words;
+    uint32_t s0 = load_be32(blk) ^ rk[0], s1 = load_be32(blk + 4) ^ rk[1];
+    uint32_t s2 = load_be32(blk + 8) ^ rk[2], s3 = load_be32(blk + 12) ^ rk[3];
+    for (int r = 1; r < 14; r++) {
+        rk += 4;
+        uint32_t t0 = td[0][s0 >> 24] ^ td[1][(s3 >> 16) & 0xff] ^ td[2][(s2 >> 8) & 0xff] ^ td[3][s1 & 0xff] ^ rk[0];
+        uint32_t t1 = td[0][s1 >> 24] ^ td[1][(s0 >> 16) & 0xff] ^ td[2][(s3 >> 8) & 0xff] ^ td[3][s2 & 0xff] ^ rk[1];
+        uint32_t t2 = td[0][s2 >> 24] ^ td[1][(s1 >> 16) & 0xff] ^ td[2][(s0 >> 8) & 0xff] ^ td[3][s3 & 0xff] ^ rk[2];
+        uint32_t t3 = td[0][s3 >> 24] ^ td[1][(s2 >> 16) & 0xff] ^ td[2][(s1 >> 8) & 0xff] ^ td[3][s0 & 0xff] ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 4;
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = (uint32_t)inv_sbox[s[c] >> 24] << 24 | (uint32_t)inv_sbox[(s[(c + 3) & 3] >> 16) & 0xff] << 16 |
+                     (uint32_t)inv_sbox[(s[(c + 2) & 3] >> 8) & 0xff] << 8 | inv_sbox[s[(c + 1) & 3] & 0xff];
+        store_be32(blk + c * 4, v ^ rk[c]);
+    }
+}
+
+#ifdef MSG_CRYPT_X86
+/* n independent blocks at once: each aesenc has several cycles of latency, so
+   interleaving unrelated blocks keeps the unit busy */
+__attribute__((target("aes,sse2")))
+static void aesni_encrypt(const MsgKey *key, uint8_t (*blk)[16], size_t n) {
+    __m128i s[ENCRYPT_LANES];
+    __m128i k = _mm_loadu_si128((const __m128i *)key->enc[0]);
+    for (size_t i = 0; i < n; i++) s[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)blk[i]), k);
+    for (int r = 1; r < 14; r++) {
+        k = _mm_loadu_si128((const __m128i *)key->enc[r]);
+        for (size_t i = 0; i < n; i++) s[i] = _mm_aesenc_si128(s[i], k);
+    }
+    k = _mm_loadu_si128((const __m128i *)key->enc[14]);
+    for (size_t i = 0; i < n; i++) _mm_storeu_si128((__m128i *)blk[i], _mm_aesenclast_si128(s[i], k));
+}
+
+__attribute__((target("aes,sse2")))
+static void aesni_decrypt(const MsgKey *key, uint8_t (*blk)[16], size_t n) {
+    __m128i s[DECRYPT_WIDTH];
+    __m128i k = _mm_loadu_si128((const __m128i *)key->dec[0]);
+    for (size_t i = 0; i < n; i++) s[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)blk[i]), k);
+    for (int r = 1; r < 14; r++) {
+        k = _mm_loadu_si128((const __m128i *)key->dec[r]);
+        for (size_t i = 0; i < n; i++) s[i] = _mm_aesdec_si128(s[i], k);
+    }
+    k = _mm_loadu_si128((const __m128i *)key->dec[14]);
+    for (size_t i = 0; i < n; i++) _mm_storeu_si128((__m128i *)blk[i], _mm_aesdeclast_si128(s[i], k));
+}
+#endif
+
+/* n is at most ENCRYPT_LANES / DECRYPT_WIDTH respectively */
+static void encrypt_blocks(const MsgKey *key, uint8_t (*blk)[16], size_t n) {
+#ifdef MSG_CRYPT_X86
+    if (use_aesni) {
+        aesni_encrypt(key, blk, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) table_encrypt(key, blk[i]);
+}
+
+static void decrypt_blocks(const MsgKey *key, uint8_t (*blk)[16], size_t n) {
+#ifdef MSG_CRYPT_X86
+    if (use_aesni) {
+        aesni_decrypt(key, blk, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) table_decrypt(key, blk[i]);
+}
+
+/* ========= CBC ========= */
+
+void msg_encrypt_batch(const MsgKey *key, MsgCryptJob *jobs, size_t count) {
+    init_tables();
+    for (size_t base = 0; base < count; base += ENCRYPT_LANES) {
+        size_t lanes = count - base < ENCRYPT_LANES ? count - base : ENCRYPT_LANES;
+        uint8_t chain[ENCRYPT_LANES][16];
+        size_t blocks[ENCRYPT_LANES];
+        size_t most = 0;
+
+        for (size_t l = 0; l < lanes; l++) {
+            MsgCryptJob *j = &jobs[base + l];
+            blocks[l] = j->in_len / 16 + 1;
+            j->out_len = -1;
+            if (j->out_cap <= MSG_CRYPT_WIRE_LEN(j->in_len) || getrandom(chain[l], 16, 0) != 16) {
+                blocks[l] = 0;
+                continue;
+            }
+            hex_encode(j->out, chain[l], 16);
+            j->out[32] = ':';
+            if (blocks[l] > most) most = blocks[l];
+        }
+
+        /* Block b of every message still going, in one pass through the cipher */
+        for (size_t b = 0; b < most; b++) {
+            uint8_t work[ENCRYPT_LANES][16];
+            size_t lane_of[ENCRYPT_LANES];
+            size_t n = 0;
+            for (size_t l = 0; l < lanes; l++) {
+                if (b >= blocks[l]) continue;
+                const MsgCryptJob *j = &jobs[base + l];
+                size_t off = b * 16;
+                size_t have = j->in_len - off < 16 ? j->in_len - off : 16;
+                if (b + 1 == blocks[l]) {
+                    have = j->in_len - off;  // PKCS#7: the last block is always partly or wholly padding
+                    memset(work[n], (int)(16 - have), 16);
+                }
+                memcpy(work[n], j->in + off, have);
+                for (int k = 0; k < 16; k++) work[n][k] ^= chain[l][k];
+                lane_of[n++] = l;
+            }
+            encrypt_blocks(key, work, n);
+            for (size_t i = 0; i < n; i++) {
+                size_t l = lane_of[i];
+                memcpy(chain[l], work[i], 16);
+                hex_encode(jobs[base + l].out + 33 + b * 32, work[i], 16);
+            }
+        }
+
+        for (size_t l = 0; l < lanes; l++) {
+            if (blocks[l] == 0) continue;
+            MsgCryptJob *j = &jobs[base + l];
+            j->out_len = (ssize_t)MSG_CRYPT_WIRE_LEN(j->in_len);
+            j->out[j->out_len] = '\0';
+        }
+    }
+}
+
+/* "<32 hex>:<whole blocks of hex>"; the digits themselves are checked while decoding */
+static int wire_shape_ok(const MsgCryptJob *j) {
+    return j->in_len > 33 && j->in[32] == ':' && (j->in_len - 33) % 32 == 0;
+}
+
+void msg_decrypt_batch(const MsgKey *key, MsgCryptJob *jobs, size_t count) {
+    init_tables();
+
+    /* Every job's IV and ciphertext side by side, so blocks of different
+       messages share trips through the cipher */
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        MsgCryptJob *j = &jobs[i];
+        j->out_len = -1;
+        if (wire_shape_ok(j)) total += 1 + (j->in_len - 33) / 32;
+    }
+    if (total == 0) return;
+
+    uint8_t (*ct)[16] = malloc(total * 16);
+    uint8_t (*pt)[16] = malloc(total * 16);
+    size_t *first = malloc(count * sizeof(size_t));   // Index of each job's IV, or SIZE_MAX
+    if (!ct || !pt || !first) {
+        free(ct);
+        free(pt);
+        free(first);
+        return;
+    }
+
+    size_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        const MsgCryptJob *j = &jobs[i];
+        first[i] = SIZE_MAX;
+        if (!wire_shape_ok(j)) continue;
+        size_t n = (j->in_len - 33) / 32;
+        if (hex_decode(ct[at], j->in, 16) < 0 || hex_decode(ct[at + 1], j->in + 33, n * 16) < 0) continue;
+        first[i] = at;
+        at += 1 + n;
+    }
+
+    /* IV slots are decrypted too and ignored: it keeps the walk a straight line */
+    for (size_t k = 0; k < at; k += DECRYPT_WIDTH) {
+        size_t n = at - k < DECRYPT_WIDTH ? at - k : DECRYPT_WIDTH;
+        memcpy(pt[k], ct[k], n * 16);
+        decrypt_blocks(key, pt + k, n);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (first[i] == SIZE_MAX) continue;
+        MsgCryptJob *j = &jobs[i];
+        size_t n = (j->in_len - 33) / 32;
+        size_t f = first[i];
+        for (size_t b = 1; b <= n; b++) {
+            for (int k = 0; k < 16; k++) pt[f + b][k] ^= ct[f + b - 1][k];
+        }
+
+        uint8_t pad = pt[f + n][15];
+        int bad = pad == 0 || pad > 16;
+        for (int k = 16 - (bad ? 1 : pad); k < 16; k++) bad |= pt[f + n][k] != pad;
+        size_t len = n * 16 - pad;
+        if (bad || len >= j->out_cap) continue;
+        memcpy(j->out, pt[f + 1], len);
+        j->out[len] = '\0';
+        j->out_len = (ssize_t)len;
+    }
+
+    memset(pt, 0, total * 16);
+    free(ct);
+    free(pt);
+    free(first);
+}
+
+ssize_t msg_encrypt(const MsgKey *key, const char *text, size_t len, char *out, size_t cap) {
+    MsgCryptJob job = { text, len, out, cap, -1 };
+    msg_encrypt_batch(key, &job, 1);
+    return job.out_len;
+}
+
+ssize_t msg_decrypt(const MsgKey *key, const char *wire, size_t len, char *out, size_t cap) {
+    MsgCryptJob job = { wire, len, out, cap, -1 };
+    msg_decrypt_batch(key, &job, 1);
+    return job.out_len;
+}
+
+/* ========= KEY CACHE ========= */
+
+typedef struct {
+    uint8_t digest[32];          // SHA-256 of the passphrase; the passphrase itself is not kept
+    uint8_t raw[MSG_CRYPT_KEY_LEN];
+    uint64_t used;               // 0 = empty slot
+} CachedKey;
+
+static CachedKey key_cache[KEY_CACHE_SLOTS];
+static uint64_t key_cache_clock;
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int msg_crypt_key(const char *passphrase, MsgKey *key) {
+    size_t len = strlen(passphrase);
+    uint8_t digest[32];
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, passphrase, len);
+    sha256_final(&s, digest);
+
+    uint8_t raw[MSG_CRYPT_KEY_LEN];
+    int found = 0;
+    pthread_mutex_lock(&key_cache_lock);
+    for (int i = 0; i < KEY_CACHE_SLOTS; i++) {
+        if (key_cache[i].used && memcmp(key_cache[i].digest, digest, 32) == 0) {
+            memcpy(raw, key_cache[i].raw, sizeof(raw));
+            key_cache[i].used = ++key_cache_clock;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&key_cache_lock);
+
+    if (!found) {
+        /* Outside the lock: other passphrases need not wait out this one */
+        if (msg_crypt_scrypt((const uint8_t *)passphrase, len, (const uint8_t *)MSG_CRYPT_SALT,
+                             strlen(MSG_CRYPT_SALT), MSG_CRYPT_SCRYPT_N, MSG_CRYPT_SCRYPT_R,
+                             MSG_CRYPT_SCRYPT_P, raw, sizeof(raw)) < 0) {
+            return -1;
+        }
+        pthread_mutex_lock(&key_cache_lock);
+        int victim = 0;
+        for (int i = 1; i < KEY_CACHE_SLOTS; i++) {
+            if (key_cache[i].used < key_cache[victim].used) victim = i;
+        }
+        memcpy(key_cache[victim].digest, digest, 32);
+        memcpy(key_cache[victim].raw, raw, sizeof(raw));
+        key_cache[victim].used = ++key_cache_clock;
+        pthread_mutex_unlock(&key_cache_lock);
+    }
+
+    msg_crypt_expand(raw, key);
+    memset(raw, 0, sizeof(raw));
+    return 0;
+}
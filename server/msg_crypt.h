@@ -0,0 +1,76 @@
+#ifndef NETCHAT_MSG_CRYPT_H
+#define NETCHAT_MSG_CRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* ========= MESSAGE ENCRYPTION =========
+ * The format server.js encryptMessage() produces: AES-256-CBC with PKCS#7
+ * padding under scrypt(passphrase, "netchat-salt-v1", N=16384, r=8, p=1),
+ * written as "<32 hex iv>:<hex ciphertext>". Either side can decrypt what
+ * the other encrypted.
+ *
+ * scrypt is deliberately slow (16 MB, tens of milliseconds), so derived keys
+ * are kept per passphrase in a small per-process cache. Blocks go through
+ * AES-NI when the CPU has it and through 32-bit lookup tables otherwise.
+ * The batch calls are where the speed is: CBC encryption is serial within
+ * a message, so several messages are encrypted side by side, and decryption
+ * runs the blocks of every message in the batch through the cipher together.
+ */
+
+#define MSG_CRYPT_SALT "netchat-salt-v1"
+#define MSG_CRYPT_SCRYPT_N 16384
+#define MSG_CRYPT_SCRYPT_R 8
+#define MSG_CRYPT_SCRYPT_P 1
+#define MSG_CRYPT_KEY_LEN 32
+#define MSG_CRYPT_IV_LEN 16
+
+/* Wire length for a plaintext of n bytes, without the terminator */
+#define MSG_CRYPT_WIRE_LEN(n) (2 * MSG_CRYPT_IV_LEN + 1 + 2 * (((n) / 16 + 1) * 16))
+
+typedef struct {
+    uint8_t enc[15][16];         // Round keys, AES-NI byte order
+    uint8_t dec[15][16];         // Equivalent inverse cipher keys (aesimc applied)
+    uint32_t enc_words[60];      // The same for the table code
+    uint32_t dec_words[60];
+} MsgKey;
+
+typedef struct {
+    const char *in;              // Plaintext to encrypt, or wire text to decrypt
+    size_t in_len;
+    char *out;                   // Always terminated when out_len >= 0
+    size_t out_cap;
+    ssize_t out_len;             // Set by the batch call: bytes written, -1 on failure
+} MsgCryptJob;
+
+/* Key for a passphrase, from the cache or a fresh scrypt; 0 on success */
+int msg_crypt_key(const char *passphrase, MsgKey *key);
+
+/* Round keys from 32 raw key bytes */
+void msg_crypt_expand(const uint8_t raw[MSG_CRYPT_KEY_LEN], MsgKey *key);
+
+/* RFC 7914 scrypt; 0 on success, -1 if the parameters are bad or memory runs out */
+int msg_crypt_scrypt(const uint8_t *pass, size_t pass_len, const uint8_t *salt, size_t salt_len,
+                     uint64_t n, uint32_t r, uint32_t p, uint8_t *out, size_t out_len);
+
+/* Encrypt count messages, each under a fresh random IV */
+void msg_encrypt_batch(const MsgKey *key, MsgCryptJob *jobs, size_t count);
+
+/* Decrypt count wire strings; a job fails on bad hex, bad padding or a short out buffer.
+   A wrong passphrase usually fails on padding but can yield garbage, as in server.js. */
+void msg_decrypt_batch(const MsgKey *key, MsgCryptJob *jobs, size_t count);
+
+ssize_t msg_encrypt(const MsgKey *key, const char *text, size_t len, char *out, size_t cap);
+ssize_t msg_decrypt(const MsgKey *key, const char *wire, size_t len, char *out, size_t cap);
+
+/* Length of the wire string starting at s (as server.js ENCRYPTED_FORMAT matches it), 0 if none */
+size_t msg_crypt_wire_span(const char *s, size_t len);
+
+/* "aes-ni" or "portable" */
+const char *msg_crypt_engine(void);
+
+/* Use the table code even where AES-NI exists, for comparison; call before deriving keys */
+void msg_crypt_force_portable(void);
+
+#endif
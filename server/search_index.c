@@ -0,0 +1,1205 @@
+#define _GNU_SOURCE
+#include "search_index.h"
+#include "thread_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEG_MAGIC 0x4e435347         // "NCSG"
+#define SEG_VERSION 1
+#define MANIFEST_MAGIC "NCSEARCH 1"
+#define MANIFEST_FILE "MANIFEST"
+#define DOCS_FILE "docs.dat"         // DocRecord per document, by number
+#define TEXT_FILE "text.dat"         // "room\0user\0body" per document
+#define MAX_SEGMENTS 128
+#define MEM_INITIAL_TERMS 4096
+
+/* ========= ON-DISK FORMAT =========
+ * A segment file is a SegHeader, the posting lists (each a SkipEntry per
+ * block, then the varint data), the SegTerm dictionary sorted by term, and
+ * the term bytes. Lists start on 4-byte boundaries and the dictionary on an
+ * 8-byte one, so a mapped file is read in place.
+ */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t doc_base;           // First document the segment covers
+    uint32_t doc_count;
+    uint32_t term_count;
+    uint32_t level;              // Merge generation: 0 for a flushed segment
+    uint64_t dict_off;
+    uint64_t strings_off;
+    uint64_t size;
+} SegHeader;
+
+typedef struct {
+    uint32_t str_off;
+    uint32_t str_len;
+    uint32_t df;                 // Documents in the list
+    uint32_t blocks;
+    uint64_t post_off;           // Skip table, then the block data
+    uint64_t post_len;
+} SegTerm;
+
+typedef struct {
+    uint32_t first_doc;
+    uint32_t data_off;           // Of the block's deltas, from the end of the skip table
+} SkipEntry;
+
+typedef struct {
+    uint64_t text_off;
+    uint64_t seq;
+    uint32_t text_len;
+    uint32_t time;
+} DocRecord;
+
+typedef struct {
+    uint32_t gen;                // File name: seg-<gen>.idx
+    uint32_t level;
+    uint32_t doc_base;
+    uint32_t doc_count;
+} SegInfo;
+
+typedef struct {
+    uint32_t docs;               // Documents covered by the segments
+    uint64_t text_bytes;         // Of TEXT_FILE those documents use
+    uint32_t next_gen;
+    int count;
+    SegInfo segs[MAX_SEGMENTS];  // Oldest documents first
+} Manifest;
+
+/* A mapped segment file */
+typedef struct {
+    uint32_t gen;
+    const uint8_t *map;
+    size_t size;
+    const SegHeader *hdr;
+    const SegTerm *terms;
+    const char *strings;
+} Segment;
+
+/* One posting list and the block of it last decoded */
+typedef struct {
+    const SkipEntry *skip;
+    const uint8_t *data;
+    const uint8_t *end;
+    uint32_t df;
+    uint32_t blocks;
+    int cached;                  // Block held in docs[], -1 for none
+    uint32_t n;
+    uint32_t docs[SEARCH_BLOCK];
+} Cursor;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+/* ========= WRITER STATE ========= */
+
+typedef struct Pending {
+    struct Pending *next;
+    uint64_t seq;
+    uint32_t time;
+    char room[SEARCH_NAME_MAX];
+    char user[SEARCH_NAME_MAX];
+    size_t len;
+    char body[];
+} Pending;
+
+/* A term of the in-memory segment and the documents that hold it */
+typedef struct {
+    char term[SEARCH_TERM_MAX + 1];
+    uint32_t *docs;              // Kept across flushes and reused by whichever term lands here
+    uint32_t count;
+    uint32_t cap;
+} MemTerm;
+
+/* Hash table over the terms: compact, so probing stays in cache */
+typedef struct {
+    uint32_t hash;
+    uint32_t term;               // Index into terms + 1, 0 while free
+} MemSlot;
+
+struct SearchIndex {
+    char dir[256];
+    pthread_t thread;
+    pthread_mutex_t lock;        // Guards everything down to info_segments
+    pthread_cond_t wake;         // Work queued, a sync asked for, or stopping
+    pthread_cond_t synced;
+    Pending *head;
+    Pending *tail;
+    size_t queued;
+    unsigned long dropped;
+    uint64_t sync_asked;
+    uint64_t sync_done;
+    int stopping;
+    uint32_t info_docs;
+    int info_segments;
+
+    /* The writer thread's own */
+    Manifest manifest;
+    int docs_fd;
+    int text_fd;
+    uint32_t next_doc;           // Documents numbered so far; the unflushed ones are in memory
+    uint64_t text_end;
+    uint32_t last_time;
+    Buf doc_buf;                 // Store records of the in-memory documents
+    Buf text_buf;
+    MemTerm *terms;
+    size_t term_count;
+    size_t term_cap;
+    MemSlot *slots;
+    size_t slot_cap;
+    uint64_t mem_since_ms;       // When the oldest in-memory document arrived
+};
+
+struct SearchReader {
+    char dir[256];
+    struct stat manifest_st;     // Of the manifest currently loaded
+    Manifest manifest;
+    Segment segs[MAX_SEGMENTS];
+    int docs_fd;
+    int text_fd;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int buf_reserve(Buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    uint8_t *grown = realloc(b->data, cap);
+    if (!grown) return -1;
+    b->data = grown;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(Buf *b, const void *data, size_t len) {
+    if (buf_reserve(b, len) < 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t at) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, at);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        at += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ========= TERMS ========= */
+
+static int is_word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/* Next word of text from *pos, lowercased into word; its length, or 0 at the end.
+   Single letters and runs longer than SEARCH_WORD_MAX are skipped. */
+static size_t next_word(const char *text, size_t len, size_t *pos, char *word) {
+    while (*pos < len) {
+        while (*pos < len && !is_word_byte((unsigned char)text[*pos])) (*pos)++;
+        size_t start = *pos;
+        while (*pos < len && is_word_byte((unsigned char)text[*pos])) (*pos)++;
+        size_t n = *pos - start;
+        if (n < 2 || n > SEARCH_WORD_MAX) continue;
+        for (size_t i = 0; i < n; i++) {
+            char c = text[start + i];
+            word[i] = (c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+        }
+        word[n] = '\0';
+        return n;
+    }
+    return 0;
+}
+
+static size_t name_term(char *out, const char *prefix, const char *name) {
+    int n = snprintf(out, SEARCH_TERM_MAX + 1, "%s%s", prefix, name);
+    return n < 0 ? 0 : ((size_t)n > SEARCH_TERM_MAX ? SEARCH_TERM_MAX : (size_t)n);
+}
+
+/* Dictionary order: bytes, then length */
+static int term_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/* ========= POSTING LISTS ========= */
+
+static size_t put_varint(uint8_t *out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static uint32_t get_varint(const uint8_t **p, const uint8_t *end) {
+    uint32_t v = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+
+/* Skip table and deltas for an ascending list of documents */
+static int encode_list(Buf *out, const uint32_t *docs, uint32_t n) {
+    uint32_t blocks = (n + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+    size_t table = (size_t)blocks * sizeof(SkipEntry);
+    out->len = 0;
+    if (buf_reserve(out, table + (size_t)n * 5) < 0) return -1;
+
+    SkipEntry *skip = (SkipEntry *)out->data;
+    uint8_t *data = out->data + table;
+    size_t pos = 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t first = b * SEARCH_BLOCK;
+        uint32_t end = first + SEARCH_BLOCK < n ? first + SEARCH_BLOCK : n;
+        skip[b].first_doc = docs[first];
+        skip[b].data_off = (uint32_t)pos;
+        for (uint32_t i = first + 1; i < end; i++) pos += put_varint(data + pos, docs[i] - docs[i - 1]);
+    }
+    out->len = table + pos;
+    return 0;
+}
+
+static void cursor_bind(Cursor *c, const Segment *seg, const SegTerm *t) {
+    const uint8_t *post = seg->map + t->post_off;
+    c->skip = (const SkipEntry *)post;
+    c->data = post + (size_t)t->blocks * sizeof(SkipEntry);
+    c->end = post + t->post_len;
+    c->df = t->df;
+    c->blocks = t->blocks;
+    c->cached = -1;
+    c->n = 0;
+}
+
+static void cursor_decode(Cursor *c, uint32_t b) {
+    if (c->cached == (int)b) return;
+    uint32_t n = (b == c->blocks - 1) ? c->df - b * SEARCH_BLOCK : SEARCH_BLOCK;
+    const uint8_t *p = c->data + c->skip[b].data_off;
+    const uint8_t *end = (b + 1 < c->blocks) ? c->data + c->skip[b + 1].data_off : c->end;
+    if (p > c->end) p = end = c->end;
+    uint32_t doc = c->skip[b].first_doc;
+    c->docs[0] = doc;
+    for (uint32_t i = 1; i < n; i++) {
+        doc += get_varint(&p, end);
+        c->docs[i] = doc;
+    }
+    c->n = n;
+    c->cached = (int)b;
+}
+
+/* Is doc in the list? One binary search of the skip table and, at most, one block decode */
+static int cursor_contains(Cursor *c, uint32_t doc) {
+    if (c->blocks == 0 || doc < c->skip[0].first_doc) return 0;
+    uint32_t lo = 0, hi = c->blocks - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (c->skip[mid].first_doc <= doc) lo = mid;
+        else hi = mid - 1;
+    }
+    cursor_decode(c, lo);
+    uint32_t a = 0, b = c->n;
+    while (a < b) {
+        uint32_t mid = (a + b) / 2;
+        if (c->docs[mid] < doc) a = mid + 1;
+        else b = mid;
+    }
+    return a < c->n && c->docs[a] == doc;
+}
+
+/* ========= SEGMENT FILES ========= */
+
+static void seg_path(char *out, size_t cap, const char *dir, uint32_t gen) {
+    snprintf(out, cap, "%s/seg-%08u.idx", dir, gen);
+}
+
+static int seg_map(const char *dir, uint32_t gen, Segment *seg) {
+    char path[320];
+    seg_path(path, sizeof(path), dir, gen);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SegHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const SegHeader *h = map;
+    size_t size = (size_t)st.st_size;
+    if (h->magic != SEG_MAGIC || h->version != SEG_VERSION || h->size != size ||
+        h->dict_off > size || h->term_count > (size - h->dict_off) / sizeof(SegTerm) ||
+        h->strings_off > size) {
+        munmap(map, size);
+        return -1;
+    }
+    seg->gen = gen;
+    seg->map = map;
+    seg->size = size;
+    seg->hdr = h;
+    seg->terms = (const SegTerm *)(seg->map + h->dict_off);
+    seg->strings = (const char *)(seg->map + h->strings_off);
+    return 0;
+}
+
+static void seg_unmap(Segment *seg) {
+    if (seg->map) munmap((void *)seg->map, seg->size);
+    seg->map = NULL;
+}
+
+static const char *seg_term_text(const Segment *seg, const SegTerm *t) {
+    return seg->strings + t->str_off;
+}
+
+/* The term's dictionary entry, or NULL; entries that point outside the file count as missing */
+static const SegTerm *seg_find(const Segment *seg, const char *term, size_t len) {
+    uint32_t lo = 0, hi = seg->hdr->term_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        const SegTerm *t = &seg->terms[mid];
+        int c = term_cmp(seg_term_text(seg, t), t->str_len, term, len);
+        if (c == 0) {
+            if (t->post_off > seg->size || t->post_len > seg->size - t->post_off ||
+                (uint64_t)t->blocks * sizeof(SkipEntry) > t->post_len || t->blocks == 0) {
+                return NULL;
+            }
+            return t;
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+/* Builds a segment file one term at a time, in dictionary order */
+typedef struct {
+    FILE *f;
+    char path[320];
+    uint64_t pos;
+    SegTerm *terms;
+    size_t count;
+    size_t cap;
+    Buf strings;
+    Buf list;
+} SegWriter;
+
+static int seg_writer_pad(SegWriter *w, size_t align) {
+    static const uint8_t zeros[8];
+    size_t pad = (align - w->pos % align) % align;
+    if (pad && fwrite(zeros, 1, pad, w->f) != pad) return -1;
+    w->pos += pad;
+    return 0;
+}
+
+static int seg_writer_begin(SegWriter *w, const char *dir, uint32_t gen) {
+    memset(w, 0, sizeof(*w));
+    seg_path(w->path, sizeof(w->path), dir, gen);
+    w->f = fopen(w->path, "w");
+    if (!w->f) return -1;
+    setvbuf(w->f, NULL, _IOFBF, 1 << 20);
+    SegHeader blank;
+    memset(&blank, 0, sizeof(blank));
+    if (fwrite(&blank, sizeof(blank), 1, w->f) != 1) return -1;
+    w->pos = sizeof(blank);
+    return 0;
+}
+
+static int seg_writer_term(SegWriter *w, const char *term, size_t len, const uint32_t *docs, uint32_t n) {
+    if (n == 0) return 0;
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        SegTerm *grown = realloc(w->terms, cap * sizeof(SegTerm));
+        if (!grown) return -1;
+        w->terms = grown;
+        w->cap = cap;
+    }
+    if (encode_list(&w->list, docs, n) < 0 || seg_writer_pad(w, 4) < 0) return -1;
+
+    SegTerm *t = &w->terms[w->count++];
+    t->str_off = (uint32_t)w->strings.len;
+    t->str_len = (uint32_t)len;
+    t->df = n;
+    t->blocks = (n + SEARCH_BLOCK - 1) / SEARCH_BLOCK;
+    t->post_off = w->pos;
+    t->post_len = w->list.len;
+    if (buf_append(&w->strings, term, len) < 0 ||
+        fwrite(w->list.data, 1, w->list.len, w->f) != w->list.len) {
+        return -1;
+    }
+    w->pos += w->list.len;
+    return 0;
+}
+
+static void seg_writer_free(SegWriter *w) {
+    if (w->f) fclose(w->f);
+    w->f = NULL;
+    free(w->terms);
+    free(w->strings.data);
+    free(w->list.data);
+}
+
+/* Dictionary, term bytes and header, then fsync; 0 once the file is complete */
+static int seg_writer_finish(SegWriter *w, uint32_t doc_base, uint32_t doc_count, uint32_t level) {
+    SegHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SEG_MAGIC;
+    h.version = SEG_VERSION;
+    h.doc_base = doc_base;
+    h.doc_count = doc_count;
+    h.term_count = (uint32_t)w->count;
+    h.level = level;
+
+    int ok = seg_writer_pad(w, 8) == 0;
+    h.dict_off = w->pos;
+    ok = ok && fwrite(w->terms, sizeof(SegTerm), w->count, w->f) == w->count;
+    w->pos += w->count * sizeof(SegTerm);
+    h.strings_off = w->pos;
+    ok = ok && fwrite(w->strings.data, 1, w->strings.len, w->f) == w->strings.len;
+    w->pos += w->strings.len;
+    h.size = w->pos;
+    ok = ok && fseek(w->f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, w->f) == 1;
+    ok = ok && fflush(w->f) == 0 && fsync(fileno(w->f)) == 0;
+    ok = (fclose(w->f) == 0) && ok;
+    w->f = NULL;
+    return ok ? 0 : -1;
+}
+
+/* ========= MANIFEST ========= */
+
+/* 0 when read, -1 when there is none or it is unreadable */
+static int manifest_read(const char *dir, Manifest *m) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/" MANIFEST_FILE, dir);
+    memset(m, 0, sizeof(*m));
+    m->next_gen = 1;
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[128];
+    unsigned long long text = 0;
+    int ok = fgets(line, sizeof(line), f) && strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) == 0 &&
+             fscanf(f, "docs %u text %llu next %u\n", &m->docs, &text, &m->next_gen) == 3;
+    m->text_bytes = text;
+    SegInfo s;
+    while (ok && m->count < MAX_SEGMENTS &&
+           fscanf(f, "seg %u %u %u %u\n", &s.gen, &s.level, &s.doc_base, &s.doc_count) == 4) {
+        m->segs[m->count++] = s;
+    }
+    fclose(f);
+    if (!ok) memset(m, 0, sizeof(*m));
+    return ok ? 0 : -1;
+}
+
+static int manifest_write(const char *dir, const Manifest *m) {
+    char path[320], tmp[330];
+    snprintf(path, sizeof(path), "%s/" MANIFEST_FILE, dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, MANIFEST_MAGIC "\ndocs %u text %llu next %u\n", m->docs, (unsigned long long)m->text_bytes,
+            m->next_gen);
+    for (int i = 0; i < m->count; i++) {
+        fprintf(f, "seg %u %u %u %u\n", m->segs[i].gen, m->segs[i].level, m->segs[i].doc_base,
+                m->segs[i].doc_count);
+    }
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* ========= IN-MEMORY SEGMENT ========= */
+
+static uint64_t term_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static MemSlot *mem_slot(SearchIndex *idx, const char *term, uint32_t hash) {
+    size_t mask = idx->slot_cap - 1;
+    size_t i = hash & mask;
+    while (idx->slots[i].term != 0 &&
+           (idx->slots[i].hash != hash || strcmp(idx->terms[idx->slots[i].term - 1].term, term) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &idx->slots[i];
+}
+
+static int mem_grow(SearchIndex *idx) {
+    size_t cap = idx->slot_cap ? idx->slot_cap * 2 : MEM_INITIAL_TERMS;
+    MemSlot *slots = calloc(cap, sizeof(MemSlot));
+    if (!slots) return -1;
+    for (size_t i = 0; i < idx->slot_cap; i++) {
+        if (idx->slots[i].term == 0) continue;
+        size_t j = idx->slots[i].hash & (cap - 1);
+        while (slots[j].term != 0) j = (j + 1) & (cap - 1);
+        slots[j] = idx->slots[i];
+    }
+    free(idx->slots);
+    idx->slots = slots;
+    idx->slot_cap = cap;
+    return 0;
+}
+
+/* Note that doc holds term; a term repeated within one message is listed once */
+static void mem_add(SearchIndex *idx, const char *term, uint32_t doc) {
+    if ((idx->term_count + 1) * 10 >= idx->slot_cap * 7 && mem_grow(idx) < 0) return;
+    uint32_t hash = (uint32_t)term_hash(term);
+    MemSlot *slot = mem_slot(idx, term, hash);
+    MemTerm *t;
+    if (slot->term == 0) {
+        if (idx->term_count == idx->term_cap) {
+            size_t cap = idx->term_cap ? idx->term_cap * 2 : MEM_INITIAL_TERMS;
+            MemTerm *grown = realloc(idx->terms, cap * sizeof(MemTerm));
+            if (!grown) return;
+            memset(grown + idx->term_cap, 0, (cap - idx->term_cap) * sizeof(MemTerm));
+            idx->terms = grown;
+            idx->term_cap = cap;
+        }
+        t = &idx->terms[idx->term_count++];
+        snprintf(t->term, sizeof(t->term), "%s", term);
+        t->count = 0;
+        slot->hash = hash;
+        slot->term = (uint32_t)idx->term_count;
+    } else {
+        t = &idx->terms[slot->term - 1];
+        if (t->count > 0 && t->docs[t->count - 1] == doc) return;
+    }
+    if (t->count == t->cap) {
+        uint32_t cap = t->cap ? t->cap * 2 : 4;
+        uint32_t *grown = realloc(t->docs, cap * sizeof(uint32_t));
+        if (!grown) return;
+        t->docs = grown;
+        t->cap = cap;
+    }
+    t->docs[t->count++] = doc;
+}
+
+/* Empty the segment; the tables and list buffers are kept for the next one */
+static void mem_clear(SearchIndex *idx) {
+    memset(idx->slots, 0, idx->slot_cap * sizeof(MemSlot));
+    idx->term_count = 0;
+    idx->doc_buf.len = 0;
+    idx->text_buf.len = 0;
+}
+
+static int mem_term_cmp(const void *a, const void *b) {
+    return strcmp((*(MemTerm *const *)a)->term, (*(MemTerm *const *)b)->term);
+}
+
+/* ========= WRITER ========= */
+
+static void index_document(SearchIndex *idx, const Pending *p) {
+    uint32_t doc = idx->next_doc;
+    if (doc == UINT32_MAX) return;
+
+    /* Numbers rise with time, so "since" is a search in the document store */
+    uint32_t t = p->time > idx->last_time ? p->time : idx->last_time;
+    idx->last_time = t;
+
+    size_t room_len = strlen(p->room), user_len = strlen(p->user);
+    DocRecord rec = { idx->text_end, p->seq, (uint32_t)(room_len + user_len + 2 + p->len), t };
+    if (buf_append(&idx->doc_buf, &rec, sizeof(rec)) < 0 ||
+        buf_append(&idx->text_buf, p->room, room_len + 1) < 0 ||
+        buf_append(&idx->text_buf, p->user, user_len + 1) < 0 ||
+        buf_append(&idx->text_buf, p->body, p->len) < 0) {
+        idx->doc_buf.len = (size_t)(doc - idx->manifest.docs) * sizeof(DocRecord);
+        idx->text_buf.len = (size_t)(idx->text_end - idx->manifest.text_bytes);
+        return;
+    }
+    if (doc == idx->manifest.docs) idx->mem_since_ms = now_ms();
+    idx->text_end += rec.text_len;
+    idx->next_doc++;
+
+    char term[SEARCH_TERM_MAX + 1];
+    name_term(term, "room:", p->room);
+    mem_add(idx, term, doc);
+    name_term(term, "user:", p->user);
+    mem_add(idx, term, doc);
+    size_t pos = 0;
+    while (next_word(p->body, p->len, &pos, term) > 0) mem_add(idx, term, doc);
+}
+
+static void publish_info(SearchIndex *idx) {
+    pthread_mutex_lock(&idx->lock);
+    idx->info_docs = idx->manifest.docs;
+    idx->info_segments = idx->manifest.count;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* Merge the count segments from first on, which cover consecutive documents, into one */
+static int merge_segments(SearchIndex *idx, int first, int count) {
+    Manifest *m = &idx->manifest;
+    Segment segs[MAX_SEGMENTS];
+    size_t at[MAX_SEGMENTS];
+    int mapped = 0;
+    for (; mapped < count; mapped++) {
+        if (seg_map(idx->dir, m->segs[first + mapped].gen, &segs[mapped]) < 0) break;
+        at[mapped] = 0;
+    }
+
+    SegWriter w;
+    uint32_t gen = m->next_gen;
+    int ok = mapped == count && seg_writer_begin(&w, idx->dir, gen) == 0;
+    uint32_t *docs = NULL;
+    size_t docs_cap = 0;
+
+    /* k-way walk of the sorted dictionaries; each term's lists are concatenated in segment order */
+    while (ok) {
+        const char *term = NULL;
+        size_t term_len = 0;
+        for (int s = 0; s < count; s++) {
+            if (at[s] >= segs[s].hdr->term_count) continue;
+            const SegTerm *t = &segs[s].terms[at[s]];
+            if (!term || term_cmp(seg_term_text(&segs[s], t), t->str_len, term, term_len) < 0) {
+                term = seg_term_text(&segs[s], t);
+                term_len = t->str_len;
+            }
+        }
+        if (!term) break;
+
+        size_t n = 0;
+        for (int s = 0; s < count && ok; s++) {
+            if (at[s] >= segs[s].hdr->term_count) continue;
+            const SegTerm *t = &segs[s].terms[at[s]];
+            if (term_cmp(seg_term_text(&segs[s], t), t->str_len, term, term_len) != 0) continue;
+            at[s]++;
+            if (n + t->df > docs_cap) {
+                size_t cap = docs_cap ? docs_cap : 1024;
+                while (cap < n + t->df) cap *= 2;
+                uint32_t *grown = realloc(docs, cap * sizeof(uint32_t));
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                docs = grown;
+                docs_cap = cap;
+            }
+            Cursor c;
+            cursor_bind(&c, &segs[s], t);
+            for (uint32_t b = 0; b < c.blocks; b++) {
+                cursor_decode(&c, b);
+                memcpy(docs + n, c.docs, c.n * sizeof(uint32_t));
+                n += c.n;
+            }
+        }
+        ok = ok && seg_writer_term(&w, term, term_len, docs, (uint32_t)n) == 0;
+    }
+    free(docs);
+
+    SegInfo merged = { gen, m->segs[first].level + 1, m->segs[first].doc_base, 0 };
+    for (int s = 0; s < count; s++) merged.doc_count += m->segs[first + s].doc_count;
+    if (mapped == count) {
+        ok = ok && seg_writer_finish(&w, merged.doc_base, merged.doc_count, merged.level) == 0;
+        seg_writer_free(&w);
+    }
+    for (int s = 0; s < mapped; s++) seg_unmap(&segs[s]);
+
+    Manifest next = *m;
+    next.next_gen = gen + 1;
+    next.segs[first] = merged;
+    memmove(&next.segs[first + 1], &m->segs[first + count], (size_t)(m->count - first - count) * sizeof(SegInfo));
+    next.count = m->count - count + 1;
+    if (!ok || manifest_write(idx->dir, &next) < 0) {
+        char path[320];
+        seg_path(path, sizeof(path), idx->dir, gen);
+        unlink(path);
+        m->next_gen = gen + 1;
+        printf("[Search]: Merge of %d segments failed: %s\n", count, strerror(errno));
+        return -1;
+    }
+
+    /* Readers that still have the old files mapped keep them until they reload */
+    for (int s = 0; s < count; s++) {
+        char path[320];
+        seg_path(path, sizeof(path), idx->dir, m->segs[first + s].gen);
+        unlink(path);
+    }
+    *m = next;
+    return 0;
+}
+
+/* Merge while the newest SEARCH_MERGE_FACTOR segments share a generation */
+static void merge_tail(SearchIndex *idx) {
+    Manifest *m = &idx->manifest;
+    while (m->count >= SEARCH_MERGE_FACTOR) {
+        int first = m->count - SEARCH_MERGE_FACTOR;
+        int same = 1;
+        for (int s = first + 1; s < m->count; s++) same = same && m->segs[s].level == m->segs[first].level;
+        if (!same && m->count < MAX_SEGMENTS) break;
+        if (merge_segments(idx, first, SEARCH_MERGE_FACTOR) < 0) break;
+        publish_info(idx);
+    }
+}
+
+/* Write the in-memory documents and their segment, then make them visible */
+static void flush_memory(SearchIndex *idx, int merge) {
+    Manifest *m = &idx->manifest;
+    uint32_t count = idx->next_doc - m->docs;
+    if (count == 0) return;
+
+    MemTerm **sorted = malloc(idx->term_count * sizeof(MemTerm *) + 1);
+    size_t n = 0;
+    for (size_t i = 0; sorted && i < idx->term_count; i++) sorted[n++] = &idx->terms[i];
+
+    SegWriter w;
+    uint32_t gen = m->next_gen++;
+    int ok = sorted != NULL &&
+             pwrite_all(idx->docs_fd, idx->doc_buf.data, idx->doc_buf.len,
+                        (off_t)m->docs * (off_t)sizeof(DocRecord)) == 0 &&
+             pwrite_all(idx->text_fd, idx->text_buf.data, idx->text_buf.len, (off_t)m->text_bytes) == 0 &&
+             fdatasync(idx->docs_fd) == 0 && fdatasync(idx->text_fd) == 0;
+    if (ok) {
+        qsort(sorted, n, sizeof(MemTerm *), mem_term_cmp);
+        ok = seg_writer_begin(&w, idx->dir, gen) == 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            ok = seg_writer_term(&w, sorted[i]->term, strlen(sorted[i]->term), sorted[i]->docs, sorted[i]->count) == 0;
+        }
+        ok = ok && seg_writer_finish(&w, m->docs, count, 0) == 0;
+        seg_writer_free(&w);
+    }
+    free(sorted);
+
+    Manifest next = *m;
+    if (ok && next.count < MAX_SEGMENTS) {
+        next.segs[next.count++] = (SegInfo){ gen, 0, m->docs, count };
+        next.docs = idx->next_doc;
+        next.text_bytes = idx->text_end;
+        ok = manifest_write(idx->dir, &next) == 0;
+    } else {
+        ok = 0;
+    }
+
+    if (ok) {
+        *m = next;
+    } else {
+        /* The numbers are handed out again; the store is overwritten at the same offsets */
+        char path[320];
+        seg_path(path, sizeof(path), idx->dir, gen);
+        unlink(path);
+        printf("[Search]: Could not write a segment (%s), %u messages not indexed\n", strerror(errno), count);
+        idx->next_doc = m->docs;
+        idx->text_end = m->text_bytes;
+    }
+    mem_clear(idx);
+    publish_info(idx);
+    if (ok && merge) merge_tail(idx);
+}
+
+static void *indexer_main(void *arg) {
+    SearchIndex *idx = arg;
+
+    pthread_mutex_lock(&idx->lock);
+    for (;;) {
+        while (!idx->head && !idx->stopping && idx->sync_asked == idx->sync_done) {
+            if (idx->next_doc == idx->manifest.docs) {
+                pthread_cond_wait(&idx->wake, &idx->lock);
+                continue;
+            }
+            uint64_t due = idx->mem_since_ms + SEARCH_FLUSH_MS;
+            if (now_ms() >= due) break;
+            struct timespec ts = { (time_t)(due / 1000), (long)(due % 1000) * 1000000 };
+            pthread_cond_timedwait(&idx->wake, &idx->lock, &ts);
+        }
+        Pending *batch = idx->head;
+        idx->head = idx->tail = NULL;
+        idx->queued = 0;
+        uint64_t asked = idx->sync_asked;
+        int stopping = idx->stopping;
+        pthread_mutex_unlock(&idx->lock);
+
+        while (batch) {
+            Pending *p = batch;
+            batch = p->next;
+            index_document(idx, p);
+            free(p);
+            if (idx->next_doc - idx->manifest.docs >= SEARCH_FLUSH_DOCS) flush_memory(idx, !stopping);
+        }
+        if (idx->next_doc != idx->manifest.docs &&
+            (stopping || asked > idx->sync_done || now_ms() >= idx->mem_since_ms + SEARCH_FLUSH_MS)) {
+            flush_memory(idx, !stopping);  // The next process merges what a shutdown left
+        }
+
+        pthread_mutex_lock(&idx->lock);
+        if (asked > idx->sync_done) {
+            idx->sync_done = asked;
+            pthread_cond_broadcast(&idx->synced);
+        }
+        if (stopping && !idx->head) break;
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return NULL;
+}
+
+/* Segment files a crash left behind, not listed in the manifest */
+static void remove_orphans(const char *dir, const Manifest *m) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned gen;
+        if (sscanf(de->d_name, "seg-%u.idx", &gen) != 1) continue;
+        int listed = 0;
+        for (int i = 0; i < m->count && !listed; i++) listed = m->segs[i].gen == gen;
+        if (!listed) {
+            char path[320];
+            seg_path(path, sizeof(path), dir, gen);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+SearchIndex *search_index_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return NULL;
+
+    SearchIndex *idx = calloc(1, sizeof(SearchIndex));
+    if (!idx) return NULL;
+    snprintf(idx->dir, sizeof(idx->dir), "%s", dir);
+    manifest_read(dir, &idx->manifest);
+    remove_orphans(dir, &idx->manifest);
+
+    /* Whatever follows the indexed documents was never made visible: drop it */
+    char path[320];
+    snprintf(path, sizeof(path), "%s/" DOCS_FILE, dir);
+    idx->docs_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/" TEXT_FILE, dir);
+    idx->text_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (idx->docs_fd < 0 || idx->text_fd < 0 ||
+        ftruncate(idx->docs_fd, (off_t)idx->manifest.docs * (off_t)sizeof(DocRecord)) < 0 ||
+        ftruncate(idx->text_fd, (off_t)idx->manifest.text_bytes) < 0) {
+        if (idx->docs_fd >= 0) close(idx->docs_fd);
+        if (idx->text_fd >= 0) close(idx->text_fd);
+        free(idx);
+        return NULL;
+    }
+    idx->next_doc = idx->manifest.docs;
+    idx->text_end = idx->manifest.text_bytes;
+    DocRecord last;
+    if (idx->next_doc > 0 &&
+        pread(idx->docs_fd, &last, sizeof(last), (off_t)(idx->next_doc - 1) * (off_t)sizeof(DocRecord)) ==
+            (ssize_t)sizeof(last)) {
+        idx->last_time = last.time;
+    }
+    idx->info_docs = idx->manifest.docs;
+    idx->info_segments = idx->manifest.count;
+    mem_grow(idx);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&idx->lock, NULL);
+    pthread_cond_init(&idx->wake, &attr);
+    pthread_cond_init(&idx->synced, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (thread_start_quiet(&idx->thread, indexer_main, idx) != 0) {
+        close(idx->docs_fd);
+        close(idx->text_fd);
+        free(idx->slots);
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+int search_index_add(SearchIndex *idx, const char *room, const char *user, uint64_t seq,
+                     const char *body, size_t len) {
+    while (len > 0 && (body[len - 1] == '\n' || body[len - 1] == '\r')) len--;
+    if (len > SEARCH_BODY_MAX - 1) len = SEARCH_BODY_MAX - 1;
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->queued >= SEARCH_QUEUE_MAX) {
+        idx->dropped++;
+        pthread_mutex_unlock(&idx->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&idx->lock);
+
+    Pending *p = malloc(sizeof(Pending) + len);
+    if (!p) return -1;
+    p->next = NULL;
+    p->seq = seq;
+    p->time = (uint32_t)time(NULL);
+    snprintf(p->room, sizeof(p->room), "%s", room);
+    snprintf(p->user, sizeof(p->user), "%s", user);
+    p->len = len;
+    memcpy(p->body, body, len);
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->tail) idx->tail->next = p;
+    else idx->head = p;
+    idx->tail = p;
+    if (idx->queued++ == 0) pthread_cond_signal(&idx->wake);
+    pthread_mutex_unlock(&idx->lock);
+    return 0;
+}
+
+void search_index_sync(SearchIndex *idx) {
+    pthread_mutex_lock(&idx->lock);
+    uint64_t ticket = ++idx->sync_asked;
+    pthread_cond_signal(&idx->wake);
+    while (idx->sync_done < ticket) pthread_cond_wait(&idx->synced, &idx->lock);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+void search_index_close(SearchIndex *idx) {
+    if (!idx) return;
+    pthread_mutex_lock(&idx->lock);
+    idx->stopping = 1;
+    pthread_cond_signal(&idx->wake);
+    pthread_mutex_unlock(&idx->lock);
+    pthread_join(idx->thread, NULL);
+
+    for (size_t i = 0; i < idx->term_cap; i++) free(idx->terms[i].docs);
+    free(idx->terms);
+    free(idx->slots);
+    free(idx->doc_buf.data);
+    free(idx->text_buf.data);
+    close(idx->docs_fd);
+    close(idx->text_fd);
+    pthread_mutex_destroy(&idx->lock);
+    pthread_cond_destroy(&idx->wake);
+    pthread_cond_destroy(&idx->synced);
+    free(idx);
+}
+
+void search_index_info(SearchIndex *idx, uint32_t *docs, int *segments, unsigned long *dropped) {
+    pthread_mutex_lock(&idx->lock);
+    if (docs) *docs = idx->info_docs;
+    if (segments) *segments = idx->info_segments;
+    if (dropped) *dropped = idx->dropped;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* ========= READER ========= */
+
+SearchReader *search_reader_open(const char *dir) {
+    SearchReader *r = calloc(1, sizeof(SearchReader));
+    if (!r) return NULL;
+    snprintf(r->dir, sizeof(r->dir), "%s", dir);
+    r->docs_fd = -1;
+    r->text_fd = -1;
+    return r;
+}
+
+void search_reader_close(SearchReader *r) {
+    if (!r) return;
+    for (int i = 0; i < r->manifest.count; i++) seg_unmap(&r->segs[i]);
+    if (r->docs_fd >= 0) close(r->docs_fd);
+    if (r->text_fd >= 0) close(r->text_fd);
+    free(r);
+}
+
+void search_reader_info(const SearchReader *r, uint32_t *docs, int *segments) {
+    if (docs) *docs = r->manifest.docs;
+    if (segments) *segments = r->manifest.count;
+}
+
+/* Load the manifest again if it was replaced, keeping segments that are still listed */
+static int reader_refresh(SearchReader *r) {
+    char path[320];
+    snprintf(path, sizeof(path), "%s/" MANIFEST_FILE, r->dir);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        struct stat st;
+        if (stat(path, &st) < 0) return errno == ENOENT ? 0 : -1;  // Nothing indexed yet
+        if (st.st_ino == r->manifest_st.st_ino && st.st_size == r->manifest_st.st_size &&
+            st.st_mtim.tv_sec == r->manifest_st.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == r->manifest_st.st_mtim.tv_nsec) {
+            return 0;
+        }
+
+        Manifest m;
+        if (manifest_read(r->dir, &m) < 0) continue;  // Replaced while we read it
+        Segment segs[MAX_SEGMENTS];
+        int reused[MAX_SEGMENTS] = { 0 };   // By old position
+        int fresh[MAX_SEGMENTS] = { 0 };    // By new position
+        int mapped = 0;
+        for (; mapped < m.count; mapped++) {
+            int have = -1;
+            for (int j = 0; j < r->manifest.count && have < 0; j++) {
+                if (r->segs[j].gen == m.segs[mapped].gen) have = j;
+            }
+            if (have >= 0) {
+                segs[mapped] = r->segs[have];
+                reused[have] = 1;
+            } else if (seg_map(r->dir, m.segs[mapped].gen, &segs[mapped]) == 0) {
+                fresh[mapped] = 1;
+            } else {
+                break;  // Merged away under us: a newer manifest lists its replacement
+            }
+        }
+        if (mapped < m.count) {
+            for (int i = 0; i < mapped; i++) {
+                if (fresh[i]) seg_unmap(&segs[i]);
+            }
+            continue;
+        }
+
+        for (int j = 0; j < r->manifest.count; j++) {
+            if (!reused[j]) seg_unmap(&r->segs[j]);
+        }
+        memcpy(r->segs, segs, (size_t)m.count * sizeof(Segment));
+        r->manifest = m;
+        r->manifest_st = st;
+
+        if (r->docs_fd < 0) {
+            snprintf(path, sizeof(path), "%s/" DOCS_FILE, r->dir);
+            r->docs_fd = open(path, O_RDONLY | O_CLOEXEC);
+            snprintf(path, sizeof(path), "%s/" TEXT_FILE, r->dir);
+            r->text_fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        return (r->docs_fd >= 0 && r->text_fd >= 0) ? 0 : -1;
+    }
+    return -1;
+}
+
+static int read_doc(const SearchReader *r, uint32_t doc, DocRecord *rec) {
+    return pread(r->docs_fd, rec, sizeof(*rec), (off_t)doc * (off_t)sizeof(DocRecord)) == (ssize_t)sizeof(*rec)
+               ? 0 : -1;
+}
+
+/* First document stored at or after t */
+static uint32_t first_doc_since(const SearchReader *r, time_t t) {
+    uint32_t lo = 0, hi = r->manifest.docs;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        DocRecord rec;
+        if (read_doc(r, mid, &rec) < 0) return r->manifest.docs;
+        if ((time_t)rec.time < t) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void load_hit(const SearchReader *r, SearchHit *hit) {
+    DocRecord rec;
+    char text[SEARCH_NAME_MAX * 2 + SEARCH_BODY_MAX];
+    hit->room[0] = hit->user[0] = hit->body[0] = '\0';
+    hit->seq = 0;
+    hit->time = 0;
+    if (read_doc(r, hit->doc, &rec) < 0 || rec.text_len > sizeof(text) ||
+        pread(r->text_fd, text, rec.text_len, (off_t)rec.text_off) != (ssize_t)rec.text_len) {
+        return;
+    }
+    hit->seq = rec.seq;
+    hit->time = (time_t)rec.time;
+    const char *room = text;
+    const char *user = memchr(room, '\0', rec.text_len);
+    const char *body = user ? memchr(user + 1, '\0', rec.text_len - (size_t)(user + 1 - text)) : NULL;
+    if (!body) return;
+    user++;
+    body++;
+    snprintf(hit->room, sizeof(hit->room), "%.*s", SEARCH_NAME_MAX - 1, room);
+    snprintf(hit->user, sizeof(hit->user), "%.*s", SEARCH_NAME_MAX - 1, user);
+    snprintf(hit->body, sizeof(hit->body), "%.*s", (int)(rec.text_len - (size_t)(body - text)), body);
+}
+
+static int query_terms(const SearchQuery *q, char terms[][SEARCH_TERM_MAX + 1]) {
+    int n = 0;
+    if (q->room && q->room[0]) name_term(terms[n++], "room:", q->room);
+    if (q->user && q->user[0]) name_term(terms[n++], "user:", q->user);
+    char word[SEARCH_TERM_MAX + 1];
+    size_t pos = 0, len = q->terms ? strlen(q->terms) : 0;
+    while (n < SEARCH_QUERY_TERMS && next_word(q->terms, len, &pos, word) > 0) {
+        int seen = 0;
+        for (int i = 0; i < n && !seen; i++) seen = strcmp(terms[i], word) == 0;
+        if (!seen) memcpy(terms[n++], word, sizeof(word));
+    }
+    return n;
+}
+
+int search_run(SearchReader *r, const SearchQuery *q, SearchHit *hits, int max) {
+    if (reader_refresh(r) < 0) return -1;
+
+    char terms[SEARCH_QUERY_TERMS][SEARCH_TERM_MAX + 1];
+    int term_count = query_terms(q, terms);
+    if (term_count == 0 || max <= 0 || r->manifest.docs == 0) return 0;
+    uint32_t lo = q->since > 0 ? first_doc_since(r, q->since) : 0;
+
+    Cursor cursors[SEARCH_QUERY_TERMS];
+    int found = 0;
+    for (int s = r->manifest.count - 1; s >= 0 && found < max; s--) {
+        const Segment *seg = &r->segs[s];
+        if (seg->hdr->doc_base + seg->hdr->doc_count <= lo) break;  // Older segments are older still
+
+        /* Every term must be in the segment; the rarest one drives */
+        int missing = 0;
+        int driver = 0;
+        for (int t = 0; t < term_count && !missing; t++) {
+            const SegTerm *st = seg_find(seg, terms[t], strlen(terms[t]));
+            if (!st) {
+                missing = 1;
+                break;
+            }
+            cursor_bind(&cursors[t], seg, st);
+            if (cursors[t].df < cursors[driver].df) driver = t;
+        }
+        if (missing) continue;
+
+        Cursor *d = &cursors[driver];
+        int done = 0;
+        for (int b = (int)d->blocks - 1; b >= 0 && !done; b--) {
+            cursor_decode(d, (uint32_t)b);
+            for (int i = (int)d->n - 1; i >= 0; i--) {
+                uint32_t doc = d->docs[i];
+                if (doc < lo) {
+                    done = 1;
+                    break;
+                }
+                int all = 1;
+                for (int t = 0; t < term_count && all; t++) {
+                    if (t != driver) all = cursor_contains(&cursors[t], doc);
+                }
+                if (!all) continue;
+                hits[found++].doc = doc;
+                if (found == max) {
+                    done = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < found; i++) load_hit(r, &hits[i]);
+    return found;
+}
@@ -0,0 +1,89 @@
+#ifndef NETCHAT_SEARCH_INDEX_H
+#define NETCHAT_SEARCH_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* ========= FULL-TEXT SEARCH =========
+ * An inverted index over room chat, kept in one directory. Every message
+ * gets the next document number. Its words (lowercased) and the exact terms
+ * "room:<name>" and "user:<name>" each have a posting list of the documents
+ * that hold them. A list is cut into blocks of SEARCH_BLOCK documents, each
+ * stored as varint deltas from the block's first document; a skip table in
+ * front of the list has every block's first document and offset, so a
+ * lookup decodes one block instead of the whole list.
+ *
+ * The writer is a thread: search_index_add() only queues the message. The
+ * thread appends it to the document store and to an in-memory segment,
+ * which it writes out as an immutable segment file every SEARCH_FLUSH_DOCS
+ * messages, or SEARCH_FLUSH_MS after the first one it has not written.
+ * Whenever the newest SEARCH_MERGE_FACTOR segments are of one generation
+ * they are merged into one of the next, so a long history is a handful of
+ * large segments and a few small ones. MANIFEST, replaced with rename(),
+ * lists the live segments and how many documents they cover; readers in
+ * other processes map the segment files and reload when it changes.
+ *
+ * A query intersects the lists of all its terms one segment at a time,
+ * newest first, walking the rarest list backwards and probing the others
+ * through their skip tables. It stops as soon as it has enough hits, so the
+ * latest matches come back in milliseconds however long the history is.
+ */
+
+#define SEARCH_BLOCK 128             // Documents per posting block
+#define SEARCH_FLUSH_DOCS 8192       // Messages per in-memory segment
+#define SEARCH_FLUSH_MS 1000         // A message is searchable at most this long after it is queued
+#define SEARCH_MERGE_FACTOR 8        // Segments of one generation merged at a time
+#define SEARCH_QUEUE_MAX 65536       // Messages waiting for the writer; more are dropped
+#define SEARCH_WORD_MAX 24           // Longer runs of letters (hashes, ciphertext) are not words
+#define SEARCH_TERM_MAX 64           // Including the "room:" or "user:" prefix
+#define SEARCH_QUERY_TERMS 16
+#define SEARCH_NAME_MAX 50
+#define SEARCH_BODY_MAX 1024
+
+typedef struct SearchIndex SearchIndex;      // Writer, one per directory
+typedef struct SearchReader SearchReader;    // Query side, one per process
+
+typedef struct {
+    const char *terms;           // Words that must all appear; may be NULL
+    const char *room;            // NULL for any room
+    const char *user;            // NULL for anyone
+    time_t since;                // 0 for all time
+} SearchQuery;
+
+typedef struct {
+    uint32_t doc;
+    uint64_t seq;                // The room's sequence number for the message
+    time_t time;
+    char room[SEARCH_NAME_MAX];
+    char user[SEARCH_NAME_MAX];
+    char body[SEARCH_BODY_MAX];
+} SearchHit;
+
+/* Open or create the index in dir and start its writer thread; NULL on failure */
+SearchIndex *search_index_open(const char *dir);
+
+/* Queue one message for indexing; never blocks. -1 if the queue is full and it was dropped. */
+int search_index_add(SearchIndex *idx, const char *room, const char *user, uint64_t seq,
+                     const char *body, size_t len);
+
+/* Wait until everything queued so far is in a segment on disk */
+void search_index_sync(SearchIndex *idx);
+
+/* Flush, stop the writer and free the index; NULL is ignored */
+void search_index_close(SearchIndex *idx);
+
+/* Documents on disk and live segments, as of the last flush */
+void search_index_info(SearchIndex *idx, uint32_t *docs, int *segments, unsigned long *dropped);
+
+/* A reader for the index in dir; it need not exist yet. NULL only when out of memory. */
+SearchReader *search_reader_open(const char *dir);
+void search_reader_close(SearchReader *r);
+
+/* Up to max matches, newest first. Returns the hit count, or -1 if the index cannot be read. */
+int search_run(SearchReader *r, const SearchQuery *q, SearchHit *hits, int max);
+
+/* Documents and segments the last search_run() looked at */
+void search_reader_info(const SearchReader *r, uint32_t *docs, int *segments);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,14 +7,24 @@
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 
 #define PORT 8080
+#define UNIX_SOCKET_PATH "/tmp/netchat_basic.sock"  // NETCHAT_UNIX_PATH overrides, empty disables
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
 #define LOG_FILE "chat.log"
 #define USERS_FILE "users.txt"
 #define MAX_ROOMS 5
 #define ROOM_NAME_LEN 30
+#define LOGIN_TIMEOUT_SEC 30   // Unauthenticated connections are dropped after this
+#define IDLE_TIMEOUT_SEC 60    // Silence before the server sends a [PING]
+#define ACCEPT_BATCH 64        // Connections accepted per listener readiness event
 
 typedef struct {
     int fd;
@@ -28,6 +39,8 @@ int client_count = 0;
 pthread_mutex_t lock;
 FILE *log_file;
 int server_fd_global;
+int unix_fd_global = -1;     // Unix stream listener for co-located tools, -1 when disabled
+const char *unix_path_global = NULL;
 volatile sig_atomic_t server_running = 1;
 
 /* Get current timestamp */
@@ -203,21 +216,37 @@ void handle_shutdown(int sig) {
     }
     
     close(server_fd_global);
+    if (unix_fd_global >= 0) {
+        close(unix_fd_global);
+        unlink(unix_path_global);
+    }
     pthread_mutex_destroy(&lock);
     
     printf("\nServer shutdown complete.\n");
     exit(0);
 }
 
+/* Bound how long a blocking recv() may wait on this socket */
+void set_recv_timeout(int fd, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
 /* Handle individual client */
 void *handle_client(void *arg) {
-    int client_fd = *(int *)arg;
+    int client_fd = (int)(intptr_t)arg;
     char buffer[BUFFER_SIZE];
     char username[50];
     char password[50];
     char message[BUFFER_SIZE + 100];
     int bytes_read;
     int client_index = -1;
+    int ping_outstanding = 0;
+
+    /* Login deadline: a silent or half-open peer times out of recv() */
+    set_recv_timeout(client_fd, LOGIN_TIMEOUT_SEC);
 
     /* Step 1: Receive username (read until newline) */
     int idx = 0;
@@ -348,9 +377,30 @@ void *handle_client(void *arg) {
     log_message(message);
     broadcast_room(message, -1, "general");  // Send to all in general room
 
+    /* Idle heartbeat: after IDLE_TIMEOUT_SEC of silence send [PING], drop if still silent */
+    set_recv_timeout(client_fd, IDLE_TIMEOUT_SEC);
+
     /* Handle messages and commands */
-    while ((bytes_read = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
+    while (1) {
+        bytes_read = recv(client_fd, buffer, BUFFER_SIZE - 1, 0);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (ping_outstanding) {
+                printf("[Server]: No heartbeat from %s, dropping\n", username);
+                break;
+            }
+            send(client_fd, "[PING]\n", 7, MSG_NOSIGNAL);
+            ping_outstanding = 1;
+            continue;
+        }
+        if (bytes_read <= 0) break;
+        
         buffer[bytes_read] = '\0';
+        ping_outstanding = 0;
+        
+        /* Heartbeat reply */
+        if (strncmp(buffer, "/pong", 5) == 0) {
+            continue;
+        }
         
         /* Check for /help command */
         if (strncmp(buffer, "/help", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
@@ -532,10 +582,80 @@ void *handle_client(void *arg) {
     return NULL;
 }
 
+/* Unix stream listener at path; -1 (with a message) if it cannot be created */
+int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Unix socket failed");
+        return -1;
+    }
+    unlink(path);  // Stale socket file from a previous run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Unix socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Drain one listener's accept queue; every transport shares the same client setup */
+void accept_batch(int listen_fd) {
+    pthread_t tid;
+
+    for (int n = 0; n < ACCEPT_BATCH; n++) {
+        /* Client sockets stay blocking: each one gets its own thread */
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && server_running) {
+                perror("Accept failed");
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&lock);
+        
+        /* Check if server is full */
+        if (client_count >= MAX_CLIENTS) {
+            pthread_mutex_unlock(&lock);
+            char *full_msg = "Server full. Try again later.\n";
+            send(client_fd, full_msg, strlen(full_msg), MSG_NOSIGNAL);
+            close(client_fd);
+            printf("[Server]: Rejected client - server full\n");
+            continue;
+        }
+        
+        /* Let the kernel probe peers that vanish without a FIN (no-op on Unix sockets) */
+        int keepalive = 1;
+        setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+        
+        clients[client_count].fd = client_fd;
+        memset(clients[client_count].username, 0, sizeof(clients[client_count].username));
+        memset(clients[client_count].password, 0, sizeof(clients[client_count].password));
+        clients[client_count].authenticated = 0;
+        strcpy(clients[client_count].room, "general");
+        client_count++;
+        
+        pthread_mutex_unlock(&lock);
+
+        /* Pass the fd by value: the loop reuses client_fd before the thread reads it */
+        pthread_create(&tid, NULL, handle_client, (void *)(intptr_t)client_fd);
+        pthread_detach(tid);  // Auto cleanup thread resources
+    }
+}
+
 int main() {
-    int client_fd;
     struct sockaddr_in server_addr;
-    pthread_t tid;
 
     /* Initialize mutex and open log file */
     pthread_mutex_init(&lock, NULL);
@@ -566,12 +686,25 @@ int main() {
         exit(1);
     }
 
-    if (listen(server_fd_global, 5) < 0) {
+    if (listen(server_fd_global, SOMAXCONN) < 0) {
         perror("Listen failed");
         exit(1);
     }
+    
+    /* Non-blocking listener so each wakeup can drain the backlog */
+    fcntl(server_fd_global, F_SETFL, fcntl(server_fd_global, F_GETFL) | O_NONBLOCK);
+
+    /* Same-host tools and gateways can skip the TCP stack */
+    const char *env_unix_path = getenv("NETCHAT_UNIX_PATH");
+    unix_path_global = env_unix_path ? env_unix_path : UNIX_SOCKET_PATH;
+    if (unix_path_global[0] != '\0') {
+        unix_fd_global = open_unix_listener(unix_path_global);
+    }
 
     printf("Server running on port %d...\n", PORT);
+    if (unix_fd_global >= 0) {
+        printf("Unix socket: %s\n", unix_path_global);
+    }
     printf("Maximum clients: %d\n", MAX_CLIENTS);
     printf("Press Ctrl+C for graceful shutdown\n\n");
     
@@ -580,41 +713,25 @@ int main() {
     log_message(log_msg);
 
     while (server_running) {
-        client_fd = accept(server_fd_global, NULL, NULL);
-        
-        if (client_fd < 0) {
-            if (server_running) {
-                perror("Accept failed");
-            }
+        struct pollfd pfds[2] = {
+            { server_fd_global, POLLIN, 0 },
+            { unix_fd_global, POLLIN, 0 },   // Ignored by poll() while -1
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno != EINTR) perror("poll failed");
             continue;
         }
-
-        pthread_mutex_lock(&lock);
         
-        /* Check if server is full */
-        if (client_count >= MAX_CLIENTS) {
-            pthread_mutex_unlock(&lock);
-            char *full_msg = "Server full. Try again later.\n";
-            send(client_fd, full_msg, strlen(full_msg), 0);
-            close(client_fd);
-            printf("[Server]: Rejected client - server full\n");
-            continue;
-        }
-        
-        clients[client_count].fd = client_fd;
-        memset(clients[client_count].username, 0, sizeof(clients[client_count].username));
-        memset(clients[client_count].password, 0, sizeof(clients[client_count].password));
-        clients[client_count].authenticated = 0;
-        strcpy(clients[client_count].room, "general");
-        client_count++;
-        
-        pthread_mutex_unlock(&lock);
-
-        pthread_create(&tid, NULL, handle_client, &client_fd);
-        pthread_detach(tid);  // Auto cleanup thread resources
+        /* Drain the accept queue in one batch per readiness event */
+        if (pfds[0].revents & POLLIN) accept_batch(server_fd_global);
+        if (pfds[1].revents & POLLIN) accept_batch(unix_fd_global);
     }
 
     close(server_fd_global);
+    if (unix_fd_global >= 0) {
+        close(unix_fd_global);
+        unlink(unix_path_global);
+    }
     if (log_file) {
         fclose(log_file);
     }
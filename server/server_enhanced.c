@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -11,31 +13,271 @@
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <mqueue.h>
 #include <semaphore.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "timer_wheel.h"
+#include "websocket.h"
+#include "fanout_pool.h"
+#include "file_store.h"
+#include "http_static.h"
+#include "msg_crypt.h"
+#include "search_index.h"
+#include "log_archive.h"
+#include "shm_arena.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "monitor.h"
 
 #define PORT 5555
+#define WS_PORT 5556               // Browser clients (RFC 6455); NETCHAT_WS_PORT overrides, 0 disables
+#define UNIX_SOCKET_PATH "/tmp/netchat.sock"  // Same-host clients; NETCHAT_UNIX_PATH overrides, empty disables
+#define HTTP_PORT 5557             // Static web UI; NETCHAT_HTTP_PORT overrides, 0 disables
+#define HTTP_ROOT "../public"      // Served directory, relative to the working directory; NETCHAT_HTTP_ROOT overrides
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
 #define LOG_FILE "chat.log"
+#define LOG_ARCHIVE_DIR "logs"     // Rotated, compressed chat.log segments; NETCHAT_LOG_DIR overrides, empty disables rotation
+#define HISTORY_FILE "history.log"  // Sequenced room chat, read back when a RESUME outruns the ring
+#define SEARCH_DIR "search"        // Full-text index of room chat; NETCHAT_SEARCH_DIR overrides, empty disables
 #define USERS_FILE "users.txt"
-#define MAX_ROOMS 5
 #define ROOM_NAME_LEN 30
+#define CREDENTIAL_LEN 50          // Username and password buffers
 #define SHM_SIZE 131072  // 128KB - increased for broadcast queue
-#define MAX_RECENT_MESSAGES 20
+#define MAX_RECENT_MESSAGES 512   // Ring of references; RECENT_ARENA_BYTES is what really bounds the history
+#define RECENT_ARENA_BYTES 24576
+#define RECENT_SHOWN 20            // /recent without a count, and the messages /decrypt tries
 #define MQ_NAME "/netchat_queue"
 #define MAX_MQ_MESSAGES 10
-#define MAX_BROADCAST_QUEUE 50
+#define MAX_BROADCAST_QUEUE 512
+#define QUEUE_ARENA_BYTES 45056    // Queued broadcasts, stored at their actual length
+#define TIMER_TICK_MS 10
+#define MAX_POLL_WAIT_MS 1000
+#define LOGIN_TIMEOUT_MS 30000     // Unauthenticated connections are dropped after this
+#define IDLE_TIMEOUT_MS 60000      // Silence before the server sends a [PING]
+#define PING_GRACE_MS 15000        // Time allowed to answer a [PING] with /pong
+#define OFFLINE_TTL_SEC 86400      // Offline messages expire after a day
+#define OFFLINE_SWEEP_MS 60000
+#define HISTORY_RING 512           // Recent room chat the parent keeps for RESUME
+#define MAX_REPLAY 256             // Per room and RESUME; anything older is reported, not replayed
+#define ROOM_RING_DEPTH 50         // Messages each room keeps for joiners and /recent; NETCHAT_ROOM_DEPTH overrides
+#define ROOM_RING_MAX 1024
+#define ROOM_RING_BYTES (1024 * 1024)  // Every room's ring together; NETCHAT_ROOM_HISTORY_BYTES overrides
+#define RESUME_SPEC_LEN 512        // "RESUME room:seq ..." handshake line
+#define RECEIPT_FLUSH_MS 500         // Receipts to a sender are batched into one line per interval
+#define PM_TRACK 256                 // Recent PMs whose delivery and read state is tracked
+#define PRESENCE_WINDOW_MS 250       // Presence changes are coalesced this long; NETCHAT_PRESENCE_MS overrides
+#define PRESENCE_JOURNAL 64          // Pending (user, room) presence changes in shared memory
+#define DEDUP_WINDOW 16              // Recent client message ids remembered per user
+#define DEDUP_USERS MAX_CLIENTS      // Users with a window; the least recently used is recycled
+#define MSG_ID_MAX 48                // Longest "[id ...]" token accepted
+
+/* Rate limiting and load shedding */
+#define TOKEN_SCALE 1000             // Buckets hold milli-tokens so 100ms refills stay exact
+#define RATE_REFILL_MS 100
+#define RATE_MSGS_PER_SEC 10         // Per connection
+#define RATE_MSG_BURST 20
+#define RATE_BYTES_PER_SEC 8192      // Per connection
+#define RATE_BYTE_BURST 16384
+#define ROOM_FANOUT_PER_SEC 5000     // Deliveries (recipients x messages) per room
+#define ROOM_FANOUT_BURST 10000
+#define MAX_TRACKED_ROOMS 64
+#define MAX_SUBSCRIPTIONS 16         // Rooms one connection may watch at once (/sub)
+#define MAX_SUBSCRIBERS (MAX_CLIENTS + BRIDGE_MAX_CHANNELS)  // Connection slots, then bridge channels
+#define SUBSCRIBER_WORDS ((MAX_SUBSCRIBERS + 63) / 64)
+#define OVERLOAD_CHECK_MS 250
+#define ACCEPT_BATCH 64              // Connections accepted per listener readiness event
+#define CONTROL_QUEUE_SLOTS 128      // Of MAX_BROADCAST_QUEUE, kept for PMs, replies and server-wide notices
+#define BULK_QUEUE_SLOTS (MAX_BROADCAST_QUEUE - CONTROL_QUEUE_SLOTS)
+#define CONTROL_ARENA_RESERVE 8192   // Queue arena bytes room traffic leaves for the control lane
+#define NOTICE_QUEUE_LIMIT (BULK_QUEUE_SLOTS * 3 / 4)  // Notices never take the last quarter of the bulk lane
+#define NOTICE_ARENA_LIMIT (QUEUE_ARENA_BYTES * 3 / 4) // ... nor of the queue arena
+
+/* Priority lanes: the broadcast queue and every connection's output have one of each */
+#define LANE_CONTROL 0               // PMs, command replies, receipts, server notices
+#define LANE_BULK 1                  // Room traffic and replays
+#define LANES 2
+#define LANE_CONTROL_WEIGHT 4        // Control turns per bulk turn while both lanes have output
+#define LANE_BATCH 64                // Records written per turn, in one sendmsg()
+#define CHILD_REPLY_WAIT_MS 200      // How long a child waits for room in the control lane
+
+/* Large rooms are written by a pool of sender threads in the parent */
+#define FANOUT_THREADS 4             // Senders, the parent's own thread included; NETCHAT_FANOUT_THREADS overrides
+#define FANOUT_INLINE_MAX 256        // Rooms up to this size stay inline; NETCHAT_FANOUT_INLINE overrides
+#define FANOUT_CHUNK 64              // Recipients per unit of work a sender takes or steals
+
+/* chat.log is rotated into LOG_ARCHIVE_DIR; see LOG ROTATION */
+#define LOG_ROTATE_BYTES (64ULL * 1024 * 1024)  // NETCHAT_LOG_MAX_BYTES overrides
+#define LOG_ROTATE_SEC 86400                    // Longest a segment stays open; NETCHAT_LOG_MAX_AGE overrides
+#define LOG_CHECK_MS 1000
+
+/* Encrypted messages use the server.js format; see MESSAGE ENCRYPTION */
+#define ENCRYPT_TEXT_MAX 400         // Plaintext limit: its ciphertext must fit a rendered line
+#define ENCRYPT_PASS_MAX 128
+
+/* /search answers from the index the parent builds; see MESSAGE SEARCH */
+#define SEARCH_RESULTS 15            // Newest matches shown
+#define SEARCH_SNIPPET 160           // Bytes of each message shown
+
+/* Server state is saved for warm restarts; see WARM RESTART SNAPSHOT */
+#define SNAPSHOT_FILE "snapshot.bin"  // NETCHAT_SNAPSHOT overrides, empty disables
+#define SNAPSHOT_SEC 60              // Between periodic snapshots; NETCHAT_SNAPSHOT_SEC overrides, 0 only at shutdown
+
+/* Sampled messages are traced from recv() to send(); see HOT-PATH TRACING */
+#define TRACE_SAMPLE_EVERY 100       // 1 in this many; NETCHAT_TRACE_SAMPLE overrides, 0 traces none
+#define TRACE_DIR "."                // Where SIGUSR2 writes trace-<time>.json; NETCHAT_TRACE_DIR overrides
+
+/* Counters and events for tools/netchat-top; see LIVE MONITOR */
+#define MONITOR_PUBLISH_MS 250       // Between snapshots; NETCHAT_MONITOR names the object, empty disables
+#define MONITOR_PEAK_FLOOR 32        // Broadcast queue depth a new peak must reach to be an event
+#define SLOW_CONSUMER_BYTES (256 * 1024)  // Output queued for one connection that makes it a slow consumer
+
+/* File transfer runs in the child, between the lines of the chat stream */
+#define FILE_STORE_DIR "files"       // Shared files, named by the SHA-1 of their contents
+#define FILE_MAX_BYTES (256ULL * 1024 * 1024)
+#define FILE_NAME_MAX 64
+#define FILE_WINDOW (256 * 1024)     // Upload bytes a client may send ahead of what is on disk
+#define FILE_SLICE (32 * 1024)       // Download bytes per sendfile() turn; queued chat goes out between turns
+#define FILE_RATE_BPS (2 * 1024 * 1024)  // Per transfer and direction; NETCHAT_FILE_RATE overrides, 0 uncaps
+#define FILE_STALL_MS 30000          // An upload that sends nothing for this long is abandoned
+
+#define BCAST_PRIO_NOTICE 0          // Join/leave chatter: first to be shed
+#define BCAST_PRIO_CHAT 1
+
+/* What a broadcast means to a WebSocket client; TCP clients only see the rendered text */
+#define EVENT_NOTICE 0               // message:new (type system)
+#define EVENT_CHAT 1                 // message:new (type user)
+#define EVENT_PM 2                   // pm:received
+#define EVENT_TYPING 3               // user:typing - WebSocket clients only
+#define EVENT_CHANNEL_CLOSED 4       // Bridge only: the engine refused or closed a channel
+#define EVENT_RAW 5                  // Bytes a child handed to the parent, written as they are
+
+/* Presence states; typing travels alongside a state, it never replaces one */
+#define PRESENCE_NONE -1             // Journal entry that only carries typing
+#define PRESENCE_ONLINE 0
+#define PRESENCE_AWAY 1
+#define PRESENCE_LEFT 2              // Left the room; its text notice already went out
+#define PRESENCE_OFFLINE 3           // Disconnected
+
+#define WS_EVENT_MAX (BUFFER_SIZE * 6)  // Room for the escaped welcome box
+#define WS_HANDSHAKE_MAX 4096
+#define WS_TYPING_INTERVAL_MS 1000   // At most one typing event per second per user
+#define WS_REJECT "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/* Node.js gateway: one TCP login carrying many browser sessions ("channels") */
+#define BRIDGE_USERNAME "@bridge"    // Reserved login name; the password line carries the secret
+#define BRIDGE_GREETING "NCBRIDGE/1\n"
+#define BRIDGE_MAX_CHANNELS 256      // Across all bridge connections
+#define BRIDGE_FRAME_MAX (BUFFER_SIZE * 8)
+#define BRIDGE_LIST_MAX (2 + BRIDGE_MAX_CHANNELS * 4)  // DELIVER's u16 count and u32 channel ids
+#define OUT_BACKLOG_MAX (4 * 1024 * 1024)  // Parent-side backlog before a stalled connection is dropped
+#define BRIDGE_OPEN 0x01             // Node -> engine: u32 channel, username
+#define BRIDGE_CLOSE 0x02            // Node -> engine: u32 channel
+#define BRIDGE_EVENT 0x03            // Node -> engine: u32 channel, JSON event
+#define BRIDGE_DELIVER 0x81          // Engine -> Node: u16 count, count x u32 channel, JSON event
+#define BRIDGE_CLOSED 0x82           // Engine -> Node: u32 channel
+
+/* Hot upgrade: a new binary started with --takeover inherits sockets over this path */
+#define UPGRADE_SOCKET_PATH "/tmp/netchat_upgrade.sock"
+#define HANDOFF_MAGIC 0x4e435550     // "NCUP"
+#define HANDOFF_VERSION 5
+#define HANDOFF_MAX_PENDING 16384    // Undelivered bytes carried per session
+#define HANDOFF_CHILD_WAIT_MS 2000
 
 /* ========= BROADCAST MESSAGE STRUCTURE ========= */
+
+/* A broadcast as the parent handles it. The strings point into the queued
+   BroadcastRecord, or at the caller's own text for one sent without queueing. */
 typedef struct {
-    char message[BUFFER_SIZE];
+    const char *message;
+    int length;          // Rendered length, so the parent never re-runs strlen()
     int sender_fd;
-    char room[ROOM_NAME_LEN];
-    int broadcast_type;  // 0=room, 1=all, 2=none
+    int target_fd;       // Recipient for direct delivery
+    const char *room;
+    int broadcast_type;  // 0=room, 1=all, 2=none, 3=direct, 4=resume (message holds the spec),
+                         // 5=room ring request (message holds "join" or "recent <n>")
+    int priority;        // BCAST_PRIO_NOTICE or BCAST_PRIO_CHAT
+    int event;           // EVENT_* for WebSocket recipients
+    const char *sender_name;
+    int body_offset;     // Where the user's text starts inside message[]
+    uint32_t channel;    // Bridge channel: the recipient for direct delivery, else the sender
+    uint64_t seq;        // Room sequence, stamped by the parent; notices carry the room's latest
+    uint64_t queued_ms;  // When it entered the queue, for per-lane latency
+    int more;            // EVENT_RAW: the next chunk from the same child continues this write
+    uint64_t msg_id;     // Hash of the sender's "[id ...]" tag, 0 when it sent none
+    uint32_t trace_id;   // Sampled for tracing, else 0
+    uint64_t trace_ts;   // trace_now() when it was queued
 } BroadcastMessage;
 
+/* A broadcast as it sits in the queue arena: the fixed fields, then the
+   message, room and sender name, each followed by a NUL, and nothing more */
+typedef struct {
+    uint64_t queued_ms;
+    uint64_t msg_id;
+    uint64_t trace_ts;
+    uint32_t trace_id;
+    int32_t sender_fd;
+    int32_t target_fd;
+    uint32_t channel;
+    uint16_t length;
+    uint16_t body_offset;
+    uint8_t broadcast_type;
+    uint8_t priority;
+    uint8_t event;
+    uint8_t more;
+    uint8_t room_len;
+    uint8_t sender_len;
+    char text[];
+} BroadcastRecord;
+
+/* ========= LOAD SHEDDING COUNTERS ========= */
+typedef struct {
+    unsigned long rate_limited_msgs;     // Rejected by a per-connection bucket
+    unsigned long room_budget_drops;     // Rejected by a room's fan-out budget
+    unsigned long logins_rejected;       // Refused at accept() while overloaded
+    unsigned long notices_dropped;       // Low-priority notices shed
+    unsigned long queue_full_drops;      // Chat dropped because the queue was full
+    unsigned long overload_transitions;
+    unsigned long presence_coalesced;    // Presence changes folded into a pending one
+    unsigned long presence_dropped;      // Lost to a full journal
+    unsigned long duplicates_dropped;    // Retries caught by the dedup window
+    unsigned long fanouts_pooled;        // Room broadcasts split across the sender pool
+    unsigned long fanout_steals;         // Chunks a sender took from another's deque
+    int fanout_threads;                  // Pool size, 1 when fan-out is inline
+    unsigned long files_stored;          // Uploads completed
+    unsigned long files_sent;            // Downloads completed
+    unsigned long file_bytes_in;
+    unsigned long file_bytes_out;
+    unsigned long lane_writes[LANES];    // Messages fully written, per outbound lane (parent only)
+    unsigned long lane_wait_ms[LANES];   // Their summed time from queueing to the socket
+    unsigned long lane_wait_max_ms[LANES];
+    unsigned long lane_wait_hist[LANES][MONITOR_LAT_BUCKETS];  // The same waits by monitor_bucket()
+    unsigned long slow_consumer_drops;   // Disconnected for falling OUT_BACKLOG_MAX behind
+    unsigned long ring_requests;         // Joins and /recent for rooms with history
+    unsigned long ring_hits;             // ... answered from the room's ring rather than the history file
+    unsigned long ring_evictions;        // Cold rooms' rings dropped to stay under the budget
+    unsigned long ring_bytes;            // Held by every room's ring (parent)
+    int ring_rooms;
+    int queue_high_water;                // Since the last overload check
+    int loop_latency_ms;                 // Worst loop iteration since the last check; atomic
+} LoadStats;
+
 /* ========= SHARED MEMORY STRUCTURE ========= */
+
+/* Cumulative acknowledgement: everything in room up to seq has arrived */
+typedef struct {
+    char room[ROOM_NAME_LEN];   // "" while unused
+    uint64_t seq;
+} AckMark;
+
 typedef struct {
     int fd;
     char username[50];
@@ -43,22 +285,101 @@ typedef struct {
     int authenticated;
     char room[ROOM_NAME_LEN];
     pid_t process_id;
+    uint64_t last_activity_ms;  // CLOCK_MONOTONIC, updated by the child on every recv
+    long msg_tokens;            // Token buckets (milli-tokens), refilled by the parent
+    long byte_tokens;
+    int websocket;              // Browser connection: output is framed JSON events
+    int bridge;                 // Node.js gateway: output is DELIVER frames for its channels
+    int slot;                   // Subscriber id, stable while the entry moves in clients[]
+    uint64_t subs;              // Subscribed rooms: bit r is rooms[r]; room is the one plain text goes to
+    AckMark acks[MAX_SUBSCRIPTIONS];  // From /ack, written by the child, collected by the parent
+    uint64_t pm_acked;          // Highest PM id acknowledged (cumulative)
+    uint64_t pm_read;           // Highest PM id read (cumulative)
+    uint32_t ack_gen;           // Bumped on every /ack and /read so the parent skips quiet clients
+    int away;                   // /away until /back or the next message
+    int presence_watch;         // /presence on: compact presence lines instead of join/leave text
+    int out_pending;            // Parent holds queued output: child writes must queue behind it
+    int child_writing;          // Child is writing directly: the parent queues instead
+    int handoff_pending;        // Child writes queued for the parent and not yet taken
 } SharedClient;
 
+/* One browser session multiplexed over a bridge connection */
+typedef struct {
+    uint32_t id;                // Chosen by the gateway, unique per bridge connection
+    int bridge_fd;
+    int active;
+    char username[50];
+    char room[ROOM_NAME_LEN];
+    uint64_t subs;              // Always just room; kept so channels share the room index
+} BridgeChannel;
+
+/* A presence change waiting for the parent's next flush */
+typedef struct {
+    char user[CREDENTIAL_LEN];
+    char room[ROOM_NAME_LEN];
+    int state;                  // PRESENCE_*, the latest one in the window
+    int typing;                 // Typed during the window
+    int fd;                     // Typist's connection, never shown its own indicator
+    uint32_t channel;           // Typist's bridge channel, likewise
+} PresenceChange;
+
+/* Message ids one user sent recently, so a retried line is not delivered twice */
+typedef struct {
+    uint64_t user;                   // Hash of the username; 0 while the window is free
+    uint64_t last_used_ms;
+    uint64_t ids[DEDUP_WINDOW];      // Hashes of the client's message ids, a ring
+    uint64_t seqs[DEDUP_WINDOW];     // Sequence number each was given; 0 until the parent stamps it
+    int8_t rooms[DEDUP_WINDOW];      // rooms[] index each went to
+    int next;                        // Ring slot the next id goes in
+} DedupWindow;
+
+/* A live room and the reverse index of who is subscribed to it */
 typedef struct {
-    char messages[MAX_RECENT_MESSAGES][BUFFER_SIZE];
+    char name[ROOM_NAME_LEN];   // "" while the slot is free
+    int member_count;
+    uint64_t members[SUBSCRIBER_WORDS];  // Bit per subscriber id
+} RoomEntry;
+
+typedef struct {
+    ArenaRef recent[MAX_RECENT_MESSAGES];  // Recent messages in recent_arena, a ring
     int message_count;
     int write_index;
     pthread_mutex_t shm_lock;
     SharedClient clients[MAX_CLIENTS];
     int client_count;
-    BroadcastMessage broadcast_queue[MAX_BROADCAST_QUEUE];
-    int broadcast_read_idx;
-    int broadcast_write_idx;
-    int broadcast_count;
+    ArenaRef broadcast_queue[MAX_BROADCAST_QUEUE];  // BroadcastRecords in queue_arena: control lane slots first, then bulk
+    int broadcast_read_idx[LANES];
+    int broadcast_write_idx[LANES];
+    int lane_count[LANES];
+    int broadcast_count;                 // Both lanes
     pid_t parent_pid;
+    int overload_level;  // 0=normal, 1=reject logins, 2=throttle, 3=shed notices
+    LoadStats stats;
+    BridgeChannel channels[BRIDGE_MAX_CHANNELS];
+    RoomEntry rooms[MAX_TRACKED_ROOMS];
+    uint32_t slots_used;                 // Bit per connection slot
+    int slot_fd[MAX_CLIENTS];            // Socket behind each connection slot
+    PresenceChange presence[PRESENCE_JOURNAL];  // Drained by the parent every presence window
+    int presence_count;
+    DedupWindow dedup[DEDUP_USERS];
+    pthread_mutex_t log_lock;            // Held by whichever process is writing chat.log
+    uint32_t log_generation;             // Bumped by every rotation; writers reopen chat.log when it moves
+    ShmArena recent_arena;               // Each arena's bytes follow its header
+    uint8_t recent_bytes[RECENT_ARENA_BYTES];
+    ShmArena queue_arena;
+    uint8_t queue_bytes[QUEUE_ARENA_BYTES];
 } SharedMessageBuffer;
 
+_Static_assert(sizeof(SharedMessageBuffer) <= SHM_SIZE, "SharedMessageBuffer must fit in SHM_SIZE");
+_Static_assert(offsetof(SharedMessageBuffer, recent_bytes) ==
+               offsetof(SharedMessageBuffer, recent_arena) + sizeof(ShmArena) &&
+               offsetof(SharedMessageBuffer, queue_bytes) ==
+               offsetof(SharedMessageBuffer, queue_arena) + sizeof(ShmArena), "arena bytes follow their header");
+_Static_assert(MAX_TRACKED_ROOMS <= 64, "subscription sets are 64-bit masks");
+_Static_assert(MAX_CLIENTS <= 32, "connection slots are a 32-bit mask");
+_Static_assert(LANES == MONITOR_LANES && ROOM_NAME_LEN == MONITOR_ROOM_NAME &&
+               MAX_TRACKED_ROOMS <= MONITOR_ROOMS, "monitor snapshots mirror these");
+
 /* ========= MESSAGE QUEUE STRUCTURE ========= */
 typedef struct {
     char username[50];
@@ -69,13 +390,61 @@ typedef struct {
 
 pthread_mutex_t lock;
 FILE *log_file;
+uint32_t log_generation = 0;  // Of the chat.log log_file has open
 int server_fd_global;
 volatile sig_atomic_t server_running = 1;
 volatile sig_atomic_t broadcast_pending = 0;
 pid_t parent_pid_global = 0;
+MonitorShared *monitor = NULL;  // Parent only; NULL while the live monitor is off
+
+/* ========= MESSAGE RENDERING STRUCTURES ========= */
+
+/* Per-thread wall clock, re-rendered at most once per second */
+typedef struct {
+    time_t second;
+    size_t len;
+    char text[16];
+} ClockCache;
+
+/* Pre-rendered per-session prefix fragments: " [#room] " and "user: " */
+typedef struct {
+    char room_part[ROOM_NAME_LEN + 8];
+    size_t room_len;
+    char user_part[64];
+    size_t user_len;
+} RenderFragments;
+
+/* One rendered line, shared by the log, the history and every recipient */
+typedef struct {
+    char text[BUFFER_SIZE];
+    size_t len;
+    size_t body_offset;  // Start of the user's text, for JSON events
+} RenderedMessage;
+
+/* Event metadata carried with a broadcast; NULL means a server notice */
+typedef struct {
+    int event;
+    const char *sender;
+    size_t body_offset;
+    uint32_t channel;      // Bridge channel, 0 for none
+    int more;              // EVENT_RAW continuation
+    uint64_t msg_id;       // Client message id hash, for the dedup window
+} EventInfo;
+
+static __thread ClockCache clock_cache = { (time_t)-1, 0, "" };
 
 /* Forward declarations */
 void handle_broadcast_signal(int sig);
+uint64_t monotonic_ms();
+ssize_t send_blocking(int fd, const void *buf, size_t len);
+ssize_t client_reply(int fd, const char *text, size_t len);
+int find_client_by_fd(int fd);
+void presence_note(const char *user, const char *room, int state, int fd, uint32_t channel);
+void presence_note_rooms(const char *user, uint64_t subs, int state);
+const char *encrypt_in_place(char *text, size_t cap, const char *passphrase);
+void room_ring_add(const char *room, uint64_t seq, const char *text, size_t len, uint32_t recipients);
+long snapshot_load_history(void);
+void bridge_close_channel(int bridge_fd, uint32_t id);
 
 /* Shared memory variables */
 int shm_id;
@@ -87,8 +456,112 @@ mqd_t message_queue;
 /* Semaphore for connection control */
 sem_t *connection_sem;
 
+/* ========= CONNECTION TIMER STRUCTURES (parent only) ========= */
+
+/* One queued write: header, then len bytes */
+typedef struct {
+    uint64_t len;
+    uint64_t since_ms;     // Queued at, for per-lane latency
+    uint64_t trace_ts;     // Sampled message: trace_now() when it was queued
+    uint32_t trace_id;
+} OutRecord;
+
+/* One outbound priority class: records back to back, oldest at head */
+typedef struct {
+    char *buf;
+    size_t head;
+    size_t len;
+    size_t cap;
+    size_t sent;           // Bytes of the head record already written
+} OutLane;
+
+typedef struct {
+    int fd;
+    int active;
+    pid_t pid;             // Child serving this connection
+    int ping_outstanding;
+    uint64_t ping_sent_ms;
+    TimerNode login_timer;
+    TimerNode idle_timer;
+    char *pending;         // Output captured during a hot-upgrade handoff
+    size_t pending_len;
+    int websocket;
+    int seq_tags;          // Sent RESUME: room lines are prefixed with "[seq room:n] "
+    uint32_t ack_gen_seen; // SharedClient.ack_gen when its acks were last collected
+    int bridge;            // Speaks the bridge protocol
+    OutLane lanes[LANES];  // Output the socket could not take yet, flushed when it is writable
+    size_t out_len;        // Unsent bytes across both lanes
+    int out_lane;          // Lane that must go next (a record is half written or continued), or -1
+    int control_turns;     // Control turns since bulk last had one
+    char *child_out;       // Chunks of a child write handed over, until the last one arrives
+    size_t child_out_len;
+    uint64_t child_out_since_ms;
+    int slow;              // Reported as a slow consumer since its backlog last drained
+} ParentSession;
+
+void session_queue_output(ParentSession *ps, int lane, const char *data, size_t len, uint64_t since_ms);
+void deliver_to_client_lane(int fd, int lane, const char *data, size_t len, uint64_t since_ms);
+
+TimerWheel timer_wheel;
+ParentSession *parent_sessions = NULL;
+int parent_session_cap = 0;
+TimerNode offline_sweep_timer;
+TimerNode rate_refill_timer;
+TimerNode overload_timer;
+
+/* Per-room fan-out budgets (parent only) */
+typedef struct {
+    char name[ROOM_NAME_LEN];
+    long tokens;
+    uint64_t last_used_ms;
+} RoomBudget;
+
+RoomBudget room_budgets[MAX_TRACKED_ROOMS];
+
+/* ========= HOT UPGRADE STRUCTURES ========= */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;           // 0=hello, 1=ack, 2=nak, 3=listener, 4=session, 5=end, 6=history, 7=ws listener,
+                             // 8=unix listener, 9=http listener
+    uint32_t session_count;
+} HandoffHeader;
+
+/* One live session; its socket travels as SCM_RIGHTS on the same datagram */
+typedef struct {
+    HandoffHeader hdr;
+    char username[50];
+    char room[ROOM_NAME_LEN];
+    long msg_tokens;
+    long byte_tokens;
+    int websocket;
+    int seq_tags;
+    char subs[MAX_SUBSCRIPTIONS][ROOM_NAME_LEN];  // Rooms watched besides room; "" ends the list
+    uint32_t pending_len;    // Followed by this many undelivered output bytes
+} HandoffSession;
+
+int upgrade_listen_fd = -1;
+int ws_fd_global = -1;       // WebSocket listener, -1 when disabled
+int unix_fd_global = -1;     // Unix stream listener, -1 when disabled
+int http_fd_global = -1;     // Static web UI listener, -1 when disabled
+HttpStatic *http_server = NULL;
+const char *unix_path_global = UNIX_SOCKET_PATH;
+int handoff_in_progress = 0;
+size_t handoff_dropped = 0;  // Output over HANDOFF_MAX_PENDING a session could not carry
+int takeover_mode = 0;       // Started with --takeover
+int child_input_partial = 0; // Child holds half a WebSocket frame: not a safe point to stop
+volatile sig_atomic_t upgrade_exit_requested = 0;
+
 /* ========= SHARED MEMORY FUNCTIONS ========= */
 
+/* Take shm_lock. A child SIGKILLed while holding it (hot upgrade, OOM killer) leaves
+   a robust mutex behind: every update under it is a few stores, so carry on. */
+void shm_lock_acquire() {
+    if (pthread_mutex_lock(&shm_buffer->shm_lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shm_buffer->shm_lock);
+    }
+}
+
 /* Initialize shared memory */
 void init_shared_memory() {
     /* Use absolute path to ensure ftok works regardless of CWD */
@@ -147,6 +620,9 @@ void init_shared_memory() {
             exit(1);
         }
         
+        /* A child killed holding a lock must not wedge everyone else */
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        
         printf("[DEBUG] Calling pthread_mutex_init\n");
         fflush(stdout);
         
@@ -154,13 +630,17 @@ void init_shared_memory() {
             perror("mutex_init failed");
             exit(1);
         }
+        if (pthread_mutex_init(&shm_buffer->log_lock, &attr) != 0) {
+            perror("log mutex_init failed");
+            exit(1);
+        }
         pthread_mutexattr_destroy(&attr);
         
         shm_buffer->message_count = 0;
         shm_buffer->write_index = 0;
-        shm_buffer->broadcast_read_idx = 0;
-        shm_buffer->broadcast_write_idx = 0;
         shm_buffer->broadcast_count = 0;
+        arena_init(&shm_buffer->recent_arena, RECENT_ARENA_BYTES);
+        arena_init(&shm_buffer->queue_arena, QUEUE_ARENA_BYTES);
         shm_buffer->client_count = 0;
         printf("[IPC]: New shared memory created (ID: %d)\n", shm_id);
     } else {
@@ -168,801 +648,6133 @@ void init_shared_memory() {
     }
 }
 
-/* Queue a message for broadcasting by parent process */
-void queue_broadcast(const char *message, int sender_fd, const char *room, int broadcast_type) {
-    pthread_mutex_lock(&shm_buffer->shm_lock);
-    
-    if (shm_buffer->broadcast_count < MAX_BROADCAST_QUEUE) {
-        BroadcastMessage *msg = &shm_buffer->broadcast_queue[shm_buffer->broadcast_write_idx];
-        strncpy(msg->message, message, BUFFER_SIZE - 1);
-        msg->message[BUFFER_SIZE - 1] = '\0';
-        msg->sender_fd = sender_fd;
-        strncpy(msg->room, room, ROOM_NAME_LEN - 1);
-        msg->room[ROOM_NAME_LEN - 1] = '\0';
-        msg->broadcast_type = broadcast_type;
-        
-        shm_buffer->broadcast_write_idx = (shm_buffer->broadcast_write_idx + 1) % MAX_BROADCAST_QUEUE;
-        shm_buffer->broadcast_count++;
-        
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
-        
-        /* Signal parent to process broadcasts */
-        if (shm_buffer->parent_pid > 0) {
-            kill(shm_buffer->parent_pid, SIGUSR1);
+/* ========= ROOM SUBSCRIPTIONS =========
+ * A connection watches a set of rooms (a bitmask over rooms[]) and each room keeps
+ * the reverse index, a bitmap of subscriber ids: connection slots first, then
+ * bridge channels. Fan-out walks that bitmap, so a room message costs its
+ * subscribers, not every connection. Everything here expects shm_lock to be held.
+ */
+
+int room_find(const char *name) {
+    for (int r = 0; r < MAX_TRACKED_ROOMS; r++) {
+        if (shm_buffer->rooms[r].name[0] != '\0' && strcmp(shm_buffer->rooms[r].name, name) == 0) {
+            return r;
         }
-    } else {
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
-        fprintf(stderr, "[WARNING]: Broadcast queue full, message dropped\n");
     }
+    return -1;
 }
 
-/* Signal handler in parent to process broadcast queue */
-void handle_broadcast_signal(int sig) {
-    (void)sig;  // Unused
-    broadcast_pending = 1;  // Set flag for main loop
-}
-
-/* Process all pending broadcasts (called by parent only) */
-void process_broadcasts() {
-    if (!shm_buffer) return;  // Safety check
+/* Add member to a room, creating it on first use. Returns the room index,
+   -1 when every room slot is taken, -2 when subs is already full. */
+int room_subscribe(int member, uint64_t *subs, const char *name) {
+    int r = room_find(name);
+    if (r >= 0 && (*subs & (1ULL << r))) return r;
+    if (__builtin_popcountll(*subs) >= MAX_SUBSCRIPTIONS) return -2;
     
-    broadcast_pending = 0;  // Clear flag
-    
-    pthread_mutex_lock(&shm_buffer->shm_lock);
-    
-    while (shm_buffer->broadcast_count > 0) {
-        BroadcastMessage *msg = &shm_buffer->broadcast_queue[shm_buffer->broadcast_read_idx];
-        
-        /* Broadcast based on type */
-        for (int i = 0; i < shm_buffer->client_count; i++) {
-            int should_send = 0;
-            
-            if (msg->broadcast_type == 1) {
-                /* Broadcast to all */
-                should_send = 1;
-            } else if (msg->broadcast_type == 0) {
-                /* Broadcast to room (excluding sender) */
-                if (shm_buffer->clients[i].fd != msg->sender_fd &&
-                    strcmp(shm_buffer->clients[i].room, msg->room) == 0) {
-                    should_send = 1;
-                }
-            }
-            
-            if (should_send) {
-                send(shm_buffer->clients[i].fd, msg->message, strlen(msg->message), 0);
-            }
+    if (r < 0) {
+        for (int i = 0; i < MAX_TRACKED_ROOMS && r < 0; i++) {
+            if (shm_buffer->rooms[i].name[0] == '\0') r = i;
         }
-        
-        shm_buffer->broadcast_read_idx = (shm_buffer->broadcast_read_idx + 1) % MAX_BROADCAST_QUEUE;
-        shm_buffer->broadcast_count--;
+        if (r < 0) return -1;
+        memset(&shm_buffer->rooms[r], 0, sizeof(RoomEntry));
+        snprintf(shm_buffer->rooms[r].name, ROOM_NAME_LEN, "%s", name);
     }
     
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    RoomEntry *room = &shm_buffer->rooms[r];
+    room->members[member / 64] |= 1ULL << (member % 64);
+    room->member_count++;
+    *subs |= 1ULL << r;
+    return r;
 }
 
-/* Write message to shared memory */
-void write_to_shared_memory(const char *message) {
-    if (shm_buffer == NULL) return;
-    
-    pthread_mutex_lock(&shm_buffer->shm_lock);
+void room_unsubscribe(int member, uint64_t *subs, int r) {
+    if (r < 0 || !(*subs & (1ULL << r))) return;
+    *subs &= ~(1ULL << r);
     
-    strncpy(shm_buffer->messages[shm_buffer->write_index], message, BUFFER_SIZE - 1);
-    shm_buffer->write_index = (shm_buffer->write_index + 1) % MAX_RECENT_MESSAGES;
-    
-    if (shm_buffer->message_count < MAX_RECENT_MESSAGES) {
-        shm_buffer->message_count++;
+    RoomEntry *room = &shm_buffer->rooms[r];
+    room->members[member / 64] &= ~(1ULL << (member % 64));
+    if (--room->member_count <= 0) {
+        room->name[0] = '\0';  // Last one out frees the slot
     }
-    
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
 }
 
-/* Cleanup shared memory */
-void cleanup_shared_memory() {
-    if (shm_buffer != NULL) {
-        pthread_mutex_destroy(&shm_buffer->shm_lock);
-        shmdt(shm_buffer);
-        shmctl(shm_id, IPC_RMID, NULL);
-        printf("[IPC]: Shared memory cleaned up\n");
+void room_unsubscribe_all(int member, uint64_t *subs) {
+    while (*subs) {
+        room_unsubscribe(member, subs, __builtin_ctzll(*subs));
     }
 }
 
-/* ========= MESSAGE QUEUE FUNCTIONS ========= */
+/* Next subscriber id at or after 'from', or -1 */
+int room_next_member(const RoomEntry *room, int from) {
+    for (int w = from / 64; w < SUBSCRIBER_WORDS; w++) {
+        uint64_t bits = room->members[w];
+        if (w == from / 64) bits &= ~0ULL << (from % 64);
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
 
-/* Initialize message queue */
-void init_message_queue() {
-    struct mq_attr attr;
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = MAX_MQ_MESSAGES;
-    attr.mq_msgsize = sizeof(QueuedMessage);
-    attr.mq_curmsgs = 0;
-    
-    /* Try to unlink first in case it exists from crashed previous run */
-    mq_unlink(MQ_NAME);
-    
-    message_queue = mq_open(MQ_NAME, O_CREAT | O_RDWR, 0666, &attr);
-    if (message_queue == (mqd_t)-1) {
-        perror("mq_open failed");
-        exit(1);
+int room_member_count(const char *name) {
+    int r = room_find(name);
+    return r >= 0 ? shm_buffer->rooms[r].member_count : 0;
+}
+
+/* Subscriber id of a bridge channel */
+int channel_member(const BridgeChannel *ch) {
+    return MAX_CLIENTS + (int)(ch - shm_buffer->channels);
+}
+
+/* Take a connection slot for a new clients[] entry */
+int client_slot_alloc(int fd) {
+    for (int s = 0; s < MAX_CLIENTS; s++) {
+        if (!(shm_buffer->slots_used & (1u << s))) {
+            shm_buffer->slots_used |= 1u << s;
+            shm_buffer->slot_fd[s] = fd;
+            return s;
+        }
     }
-    
-    printf("[IPC]: Message queue initialized\n");
+    return -1;
 }
 
-/* Queue a message for offline delivery */
-void queue_offline_message(const char *username, const char *message, int priority) {
-    QueuedMessage qmsg;
-    strncpy(qmsg.username, username, sizeof(qmsg.username) - 1);
-    strncpy(qmsg.message, message, sizeof(qmsg.message) - 1);
-    qmsg.timestamp = time(NULL);
-    qmsg.priority = priority;
-    
-    if (mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), priority) == -1) {
-        perror("mq_send failed");
-    } else {
-        printf("[MQ]: Queued message for %s (priority: %d)\n", username, priority);
+/* Drop clients[idx]: leave every room, free the slot, close the gap */
+void remove_client_at(int idx) {
+    SharedClient *c = &shm_buffer->clients[idx];
+    if (c->authenticated && !c->bridge) presence_note_rooms(c->username, c->subs, PRESENCE_OFFLINE);
+    room_unsubscribe_all(c->slot, &c->subs);
+    shm_buffer->slots_used &= ~(1u << c->slot);
+    for (int j = idx; j < shm_buffer->client_count - 1; j++) {
+        shm_buffer->clients[j] = shm_buffer->clients[j + 1];
     }
+    shm_buffer->client_count--;
 }
 
-/* Deliver queued messages to user */
-void deliver_queued_messages(int client_fd, const char *username) {
-    QueuedMessage qmsg;
-    unsigned int prio;
-    struct mq_attr attr;
+/* Room traffic is bulk; direct messages, server-wide notices and resumes are control */
+static int broadcast_lane(int broadcast_type) {
+    return broadcast_type == 0 ? LANE_BULK : LANE_CONTROL;
+}
+
+/* Queue a message for broadcasting by parent process; 0 if it was dropped */
+int queue_broadcast(const char *message, size_t len, int sender_fd, int target_fd,
+                     const char *room, int broadcast_type, int priority, const EventInfo *ev) {
+    if (len > BUFFER_SIZE - 1) len = BUFFER_SIZE - 1;
+    int lane = broadcast_lane(broadcast_type);
+    int base = lane == LANE_CONTROL ? 0 : CONTROL_QUEUE_SLOTS;
+    int slots = lane == LANE_CONTROL ? CONTROL_QUEUE_SLOTS : BULK_QUEUE_SLOTS;
+    const char *sender = (ev && ev->sender) ? ev->sender : "";
+    size_t room_len = strnlen(room, ROOM_NAME_LEN - 1);
+    size_t sender_len = strnlen(sender, CREDENTIAL_LEN - 1);
+    uint32_t size = (uint32_t)(sizeof(BroadcastRecord) + len + 1 + room_len + 1 + sender_len + 1);
+    TRACE_STAMP(queue_start);
+    TRACE_NOTE_PARSED(queue_start);
     
-    mq_getattr(message_queue, &attr);
+    shm_lock_acquire();
+    TRACE_SPAN(TP_LOCK_WAIT, queue_start, 0);
     
-    while (attr.mq_curmsgs > 0) {
-        ssize_t bytes_read = mq_receive(message_queue, (char *)&qmsg, sizeof(QueuedMessage), &prio);
+    /* Notices are shed first: at overload level 3, or once the bulk lane or the arena is 3/4 full */
+    if (priority == BCAST_PRIO_NOTICE &&
+        (shm_buffer->overload_level >= 3 || shm_buffer->lane_count[LANE_BULK] >= NOTICE_QUEUE_LIMIT ||
+         arena_used(&shm_buffer->queue_arena) >= NOTICE_ARENA_LIMIT)) {
+        shm_buffer->stats.notices_dropped++;
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        return 0;
+    }
+    
+    /* Each lane has its own slots, and room traffic leaves CONTROL_ARENA_RESERVE
+       bytes of the arena alone, so a saturated room never holds up a PM */
+    ArenaRef ref;
+    BroadcastRecord *rec = NULL;
+    if (shm_buffer->lane_count[lane] < slots) {
+        rec = arena_alloc(&shm_buffer->queue_arena, size, lane == LANE_BULK ? CONTROL_ARENA_RESERVE : 0, &ref);
+    }
+    if (rec) {
+        rec->queued_ms = monotonic_ms();
+        rec->msg_id = ev ? ev->msg_id : 0;
+        rec->trace_id = TRACE_ID();
+        rec->trace_ts = rec->trace_id ? TRACE_NOW() : 0;
+        rec->sender_fd = sender_fd;
+        rec->target_fd = target_fd;
+        rec->channel = ev ? ev->channel : 0;
+        rec->length = (uint16_t)len;
+        rec->body_offset = (ev && ev->body_offset <= len) ? (uint16_t)ev->body_offset : 0;
+        rec->broadcast_type = (uint8_t)broadcast_type;
+        rec->priority = (uint8_t)priority;
+        rec->event = (uint8_t)(ev ? ev->event : EVENT_NOTICE);
+        rec->more = (uint8_t)(ev ? ev->more : 0);
+        rec->room_len = (uint8_t)room_len;
+        rec->sender_len = (uint8_t)sender_len;
+        char *text = rec->text;
+        memcpy(text, message, len);
+        text[len] = '\0';
+        memcpy(text + len + 1, room, room_len);
+        text[len + 1 + room_len] = '\0';
+        memcpy(text + len + 1 + room_len + 1, sender, sender_len);
+        text[len + 1 + room_len + 1 + sender_len] = '\0';
+        shm_buffer->broadcast_queue[base + shm_buffer->broadcast_write_idx[lane]] = ref;
         
-        if (bytes_read >= 0 && strcmp(qmsg.username, username) == 0) {
-            char delivery[BUFFER_SIZE + 100];
-            snprintf(delivery, sizeof(delivery), "[Offline Message]: %s\n", qmsg.message);
-            send(client_fd, delivery, strlen(delivery), 0);
+        shm_buffer->broadcast_write_idx[lane] = (shm_buffer->broadcast_write_idx[lane] + 1) % slots;
+        shm_buffer->lane_count[lane]++;
+        shm_buffer->broadcast_count++;
+        if (shm_buffer->broadcast_count > shm_buffer->stats.queue_high_water) {
+            shm_buffer->stats.queue_high_water = shm_buffer->broadcast_count;
         }
         
-        mq_getattr(message_queue, &attr);
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        
+        /* Signal parent to process broadcasts */
+        TRACE_STAMP(signal_start);
+        if (shm_buffer->parent_pid > 0) {
+            kill(shm_buffer->parent_pid, SIGUSR1);
+        }
+        TRACE_SPAN(TP_SIGNAL, signal_start, 0);
+        TRACE_SPAN(TP_QUEUE, queue_start, broadcast_type);
+        return 1;
     }
+    
+    shm_buffer->stats.queue_full_drops++;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    fprintf(stderr, "[WARNING]: Broadcast queue full, message dropped\n");
+    return 0;
 }
 
-/* Cleanup message queue */
-void cleanup_message_queue() {
-    mq_close(message_queue);
-    mq_unlink(MQ_NAME);
-    printf("[IPC]: Message queue cleaned up\n");
+/* Find (or recycle the coldest slot for) a room's fan-out budget; parent only */
+RoomBudget *room_budget(const char *room) {
+    RoomBudget *coldest = &room_budgets[0];
+    for (int i = 0; i < MAX_TRACKED_ROOMS; i++) {
+        if (room_budgets[i].name[0] != '\0' && strcmp(room_budgets[i].name, room) == 0) {
+            return &room_budgets[i];
+        }
+        if (room_budgets[i].last_used_ms < coldest->last_used_ms) {
+            coldest = &room_budgets[i];
+        }
+    }
+    strncpy(coldest->name, room, ROOM_NAME_LEN - 1);
+    coldest->name[ROOM_NAME_LEN - 1] = '\0';
+    coldest->tokens = (long)ROOM_FANOUT_BURST * TOKEN_SCALE;
+    return coldest;
 }
 
-/* ========= SEMAPHORE FUNCTIONS ========= */
+/* ========= WEBSOCKET EVENT MAPPING ========= */
 
-/* Initialize semaphore */
-void init_semaphore() {
-    /* Unlink first in case it exists from crashed previous run */
-    sem_unlink("/netchat_sem");
+static size_t json_append(char *out, size_t pos, size_t cap, const char *lit) {
+    size_t len = strlen(lit);
+    if (pos + len >= cap) return pos;
+    memcpy(out + pos, lit, len);
+    return pos + len;
+}
+
+static size_t json_append_string(char *out, size_t pos, size_t cap, const char *s, size_t len) {
+    pos = json_append(out, pos, cap, "\"");
+    pos = json_escape(out, pos, cap - 8, s, len);  // Keep room for the closing braces
+    return json_append(out, pos, cap, "\"");
+}
+
+/* {"event":...,"data":{...}} for one broadcast; shared by WebSocket and bridge output */
+size_t render_event_json(char *json, size_t jcap, int event, const char *room,
+                         const char *sender, const char *body, size_t body_len) {
+    size_t j = 0;
     
-    connection_sem = sem_open("/netchat_sem", O_CREAT, 0666, MAX_CLIENTS);
-    if (connection_sem == SEM_FAILED) {
-        perror("sem_open failed");
-        exit(1);
+    /* The chat engine works in lines; events carry the text without the newline */
+    while (body_len > 0 && body[body_len - 1] == '\n') body_len--;
+    
+    switch (event) {
+        case EVENT_CHAT:
+            j = json_append(json, j, jcap, "{\"event\":\"message:new\",\"data\":{\"type\":\"user\",\"room\":");
+            j = json_append_string(json, j, jcap, room, strlen(room));
+            j = json_append(json, j, jcap, ",\"username\":");
+            j = json_append_string(json, j, jcap, sender, strlen(sender));
+            j = json_append(json, j, jcap, ",\"message\":");
+            j = json_append_string(json, j, jcap, body, body_len);
+            break;
+        case EVENT_PM:
+            j = json_append(json, j, jcap, "{\"event\":\"pm:received\",\"data\":{\"from\":");
+            j = json_append_string(json, j, jcap, sender, strlen(sender));
+            j = json_append(json, j, jcap, ",\"message\":");
+            j = json_append_string(json, j, jcap, body, body_len);
+            break;
+        case EVENT_TYPING:
+            j = json_append(json, j, jcap, "{\"event\":\"user:typing\",\"data\":{\"username\":");
+            j = json_append_string(json, j, jcap, sender, strlen(sender));
+            j = json_append(json, j, jcap, ",\"room\":");
+            j = json_append_string(json, j, jcap, room, strlen(room));
+            break;
+        default:
+            j = json_append(json, j, jcap, "{\"event\":\"message:new\",\"data\":{\"type\":\"system\",\"room\":");
+            j = json_append_string(json, j, jcap, room, strlen(room));
+            j = json_append(json, j, jcap, ",\"message\":");
+            j = json_append_string(json, j, jcap, body, body_len);
+            break;
     }
-    printf("[SYNC]: Semaphore initialized (max connections: %d)\n", MAX_CLIENTS);
+    j = json_append(json, j, jcap, "}}");
+    return j;
 }
 
-/* Cleanup semaphore */
-void cleanup_semaphore() {
-    sem_close(connection_sem);
-    sem_unlink("/netchat_sem");
-    printf("[SYNC]: Semaphore cleaned up\n");
+/* One unmasked text frame carrying the event JSON. Returns frame length. */
+size_t ws_render_event(uint8_t *out, size_t cap, int event, const char *room,
+                       const char *sender, const char *body, size_t body_len) {
+    char *json = (char *)out + WS_MAX_HEADER;
+    size_t j = render_event_json(json, cap - WS_MAX_HEADER, event, room, sender, body, body_len);
+    
+    uint8_t header[WS_MAX_HEADER];
+    size_t hlen = ws_frame_header(header, WS_OP_TEXT, j);
+    memmove(out + hlen, json, j);
+    memcpy(out, header, hlen);
+    return hlen + j;
 }
 
-/* ========= EXISTING FUNCTIONS (with enhancements) ========= */
-
-void get_timestamp(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    strftime(buffer, size, "[%H:%M:%S]", t);
+/* A queued broadcast as a WebSocket frame; the parent builds it once per message */
+size_t ws_render_broadcast(const BroadcastMessage *msg, uint8_t *out, size_t cap) {
+    const char *body = msg->message + msg->body_offset;
+    size_t body_len = (size_t)(msg->length - msg->body_offset);
+    return ws_render_event(out, cap, msg->event, msg->room, msg->sender_name, body, body_len);
 }
 
-void log_message(const char *message) {
-    if (!log_file) return;  // Safety check
-    
-    pthread_mutex_lock(&lock);
-    if (log_file) {
-        char timestamp[20];
-        get_timestamp(timestamp, sizeof(timestamp));
-        fprintf(log_file, "%s %s", timestamp, message);
-        fflush(log_file);
+/* Every parent-side write to a client goes through here: lane is its priority class,
+   since_ms when it was first queued */
+void deliver_to_client_lane(int fd, int lane, const char *data, size_t len, uint64_t since_ms) {
+    /* During a hot upgrade nothing is written: output is carried to the new process */
+    if (handoff_in_progress && fd >= 0 && fd < parent_session_cap) {
+        ParentSession *ps = &parent_sessions[fd];
+        char *grown = NULL;
+        if (ps->pending_len + len <= HANDOFF_MAX_PENDING) grown = realloc(ps->pending, ps->pending_len + len);
+        if (!grown) {
+            handoff_dropped += len;
+            return;
+        }
+        memcpy(grown + ps->pending_len, data, len);
+        ps->pending = grown;
+        ps->pending_len += len;
+        return;
     }
-    pthread_mutex_unlock(&lock);
-    
-    /* Also write to shared memory (disabled for stability) */
-    // write_to_shared_memory(message);
+    if (fd >= 0 && fd < parent_session_cap) {
+        session_queue_output(&parent_sessions[fd], lane, data, len, since_ms);
+        return;
+    }
+    send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
 }
 
-void broadcast(char *message, int sender_fd) {
-    /* Child process: queue for parent to broadcast */
-    if (getpid() != shm_buffer->parent_pid) {
-        queue_broadcast(message, sender_fd, "general", 0);
+/* The parent's own replies and notices: control lane, queued now */
+void deliver_to_client(int fd, const char *data, size_t len) {
+    deliver_to_client_lane(fd, LANE_CONTROL, data, len, monotonic_ms());
+}
+
+int session_is_websocket(int fd) {
+    return fd >= 0 && fd < parent_session_cap && parent_sessions[fd].websocket;
+}
+
+/* Server text from the parent: framed as a system event for browser clients */
+void deliver_text(int fd, const char *text, size_t len) {
+    if (session_is_websocket(fd)) {
+        static uint8_t frame[WS_EVENT_MAX];
+        size_t n = ws_render_event(frame, sizeof(frame), EVENT_NOTICE, "", "", text, len);
+        deliver_to_client(fd, (const char *)frame, n);
     } else {
-        /* Parent process: broadcast directly */
-        pthread_mutex_lock(&shm_buffer->shm_lock);
-        for (int i = 0; i < shm_buffer->client_count; i++) {
-            if (shm_buffer->clients[i].fd != sender_fd) {
-                send(shm_buffer->clients[i].fd, message, strlen(message), 0);
-            }
-        }
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        deliver_to_client(fd, text, len);
     }
 }
 
-void broadcast_all(char *message) {
-    /* Child process: queue for parent to broadcast */
-    if (getpid() != shm_buffer->parent_pid) {
-        queue_broadcast(message, -1, "", 1);
-    } else {
-        /* Parent process: broadcast directly */
-        pthread_mutex_lock(&shm_buffer->shm_lock);
-        for (int i = 0; i < shm_buffer->client_count; i++) {
-            send(shm_buffer->clients[i].fd, message, strlen(message), 0);
-        }
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
+/* ========= OUTBOUND LANES (parent) =========
+ * Each connection has a control and a bulk lane. A write goes straight to the
+ * socket while nothing is queued; once the socket pushes back it becomes a record
+ * in its lane. On writability the lanes take weighted turns, LANE_CONTROL_WEIGHT
+ * control turns per bulk turn, and records are only ever interleaved whole, so a
+ * PM or a command reply overtakes a room backlog without splitting a line or a
+ * frame. The child writes its own replies directly only while the parent has
+ * nothing queued; otherwise it hands them to the control lane. Everything here
+ * expects shm_lock to be held.
+ */
+
+/* Atomic because pooled fan-out senders write different connections at once */
+static void lane_account(int lane, uint64_t since_ms) {
+    uint64_t now = monotonic_ms();
+    unsigned long wait = now > since_ms ? (unsigned long)(now - since_ms) : 0;
+    LoadStats *st = &shm_buffer->stats;
+    __atomic_add_fetch(&st->lane_writes[lane], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->lane_wait_ms[lane], wait, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->lane_wait_hist[lane][monitor_bucket(wait)], 1, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&st->lane_wait_max_ms[lane], __ATOMIC_RELAXED);
+    while (wait > max && !__atomic_compare_exchange_n(&st->lane_wait_max_ms[lane], &max, wait, 0,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
 }
 
-void broadcast_room(char *message, int sender_fd, const char *room) {
-    /* Child process: queue for parent to broadcast */
-    if (getpid() != shm_buffer->parent_pid) {
-        queue_broadcast(message, sender_fd, room, 0);
-    } else {
-        /* Parent process: broadcast directly */
-        pthread_mutex_lock(&shm_buffer->shm_lock);
-        for (int i = 0; i < shm_buffer->client_count; i++) {
-            if (shm_buffer->clients[i].fd != sender_fd && 
-                strcmp(shm_buffer->clients[i].room, room) == 0) {
-                send(shm_buffer->clients[i].fd, message, strlen(message), 0);
-            }
+/* Tell the child whether its writes have to queue behind ours */
+static void session_note_backlog(ParentSession *ps) {
+    int idx = find_client_by_fd(ps->fd);
+    if (idx >= 0) shm_buffer->clients[idx].out_pending = ps->out_len > 0;
+}
+
+static int session_child_writing(ParentSession *ps) {
+    int idx = find_client_by_fd(ps->fd);
+    return idx >= 0 && shm_buffer->clients[idx].child_writing;
+}
+
+void session_discard_output(ParentSession *ps) {
+    for (int l = 0; l < LANES; l++) {
+        ps->lanes[l].head = 0;
+        ps->lanes[l].len = 0;
+        ps->lanes[l].sent = 0;
+    }
+    ps->out_len = 0;
+    ps->out_lane = -1;
+    ps->slow = 0;
+}
+
+/* Who is behind a connection, for monitor events */
+static const char *session_user(ParentSession *ps) {
+    int idx = find_client_by_fd(ps->fd);
+    return idx >= 0 && shm_buffer->clients[idx].username[0] ? shm_buffer->clients[idx].username : "-";
+}
+
+static int lane_push(OutLane *l, const char *data, size_t len, uint64_t since_ms) {
+    size_t need = sizeof(OutRecord) + len;
+    if (l->len + need > l->cap && l->head > 0) {
+        memmove(l->buf, l->buf + l->head, l->len - l->head);
+        l->len -= l->head;
+        l->head = 0;
+    }
+    if (l->len + need > l->cap) {
+        size_t cap = l->cap ? l->cap : BRIDGE_FRAME_MAX;
+        while (cap < l->len + need) cap *= 2;
+        char *grown = realloc(l->buf, cap);
+        if (!grown) return 0;
+        l->buf = grown;
+        l->cap = cap;
+    }
+    OutRecord rec = { len, since_ms, 0, TRACE_ID() };
+    if (rec.trace_id) rec.trace_ts = TRACE_NOW();
+    memcpy(l->buf + l->len, &rec, sizeof(rec));
+    memcpy(l->buf + l->len + sizeof(rec), data, len);
+    l->len += need;
+    return 1;
+}
+
+/* n bytes of a lane left the process: pop whole records, remember how far into the next one */
+static void lane_consume(ParentSession *ps, int lane, size_t n, int written) {
+    OutLane *l = &ps->lanes[lane];
+    while (n > 0 && l->head < l->len) {
+        OutRecord rec;
+        memcpy(&rec, l->buf + l->head, sizeof(rec));
+        size_t left = rec.len - l->sent;
+        if (n < left) {
+            l->sent += n;
+            return;
         }
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        n -= left;
+        if (written) lane_account(lane, rec.since_ms);
+        if (written) TRACE_SPAN_ID(rec.trace_id, TP_BACKLOG, rec.trace_ts, ps->fd);
+        l->head += sizeof(rec) + rec.len;
+        l->sent = 0;
+    }
+    if (l->head == l->len) {
+        l->head = 0;
+        l->len = 0;
     }
 }
 
-int send_private_message(const char *target_username, const char *message, const char *sender) {
-    pthread_mutex_lock(&shm_buffer->shm_lock);
-    int found = 0;
+/* Queue (or write) one whole message on a lane; since_ms is when it was first queued */
+void session_queue_output(ParentSession *ps, int lane, const char *data, size_t len, uint64_t since_ms) {
+    if (len == 0) return;
+    size_t sent = 0;
+    if (ps->out_len == 0 && !session_child_writing(ps)) {
+        TRACE_STAMP(send_start);
+        ssize_t n = send(ps->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        TRACE_SPAN(TP_SEND, send_start, ps->fd);
+        if (n == (ssize_t)len) {
+            lane_account(lane, since_ms);
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return;  // Peer gone: the child sees EOF
+            n = 0;
+        }
+        sent = (size_t)n;
+    }
     
-    for (int i = 0; i < shm_buffer->client_count; i++) {
-        if (strcmp(shm_buffer->clients[i].username, target_username) == 0) {
-            char pm[BUFFER_SIZE + 100];
-            snprintf(pm, sizeof(pm), "[PM from %s]: %s", sender, message);
-            send(shm_buffer->clients[i].fd, pm, strlen(pm), 0);
-            found = 1;
+    /* Frames and replays must never be cut short, so a peer this far behind is disconnected */
+    if (ps->out_len + len - sent > OUT_BACKLOG_MAX) {
+        printf("[Server]: fd %d fell %zu bytes behind, dropping\n", ps->fd, ps->out_len + len - sent);
+        __atomic_add_fetch(&shm_buffer->stats.slow_consumer_drops, 1, __ATOMIC_RELAXED);
+        monitor_event(monitor, MON_DROPPED, (int64_t)(ps->out_len + len - sent), "fd %d %s, %zu KB behind",
+                      ps->fd, session_user(ps), (ps->out_len + len - sent) / 1024);
+        shutdown(ps->fd, SHUT_RDWR);
+        session_discard_output(ps);
+        session_note_backlog(ps);
+        return;
+    }
+    if (!lane_push(&ps->lanes[lane], data, len, since_ms)) return;
+    if (sent > 0) {
+        ps->lanes[lane].sent = sent;  // Both lanes were empty: this record is the head
+        ps->out_lane = lane;
+    }
+    ps->out_len += len - sent;
+    if (!ps->slow && ps->out_len >= SLOW_CONSUMER_BYTES) {
+        ps->slow = 1;
+        monitor_event(monitor, MON_SLOW, (int64_t)ps->out_len, "fd %d %s, %zu KB queued", ps->fd,
+                      session_user(ps), ps->out_len / 1024);
+    }
+    session_note_backlog(ps);
+}
+
+/* A message made of lines goes in as one record per line, so control can cut in between */
+void session_queue_lines(ParentSession *ps, int lane, const char *data, size_t len, uint64_t since_ms) {
+    while (len > 0) {
+        const char *nl = memchr(data, '\n', len);
+        size_t line = nl ? (size_t)(nl - data) + 1 : len;
+        session_queue_output(ps, lane, data, line, since_ms);
+        data += line;
+        len -= line;
+    }
+}
+
+/* Lane for the next turn: finish a half-written record first, else control up to its weight */
+static int session_pick_lane(ParentSession *ps) {
+    if (ps->out_lane >= 0) return ps->out_lane;
+    int control = ps->lanes[LANE_CONTROL].len > ps->lanes[LANE_CONTROL].head;
+    int bulk = ps->lanes[LANE_BULK].len > ps->lanes[LANE_BULK].head;
+    if (control && (!bulk || ps->control_turns < LANE_CONTROL_WEIGHT)) {
+        ps->control_turns++;
+        return LANE_CONTROL;
+    }
+    ps->control_turns = 0;
+    return LANE_BULK;
+}
+
+/* Socket is writable again: lanes take turns, up to LANE_BATCH records per sendmsg() */
+void session_flush_output(ParentSession *ps) {
+    if (ps->out_len == 0 || session_child_writing(ps)) return;
+    
+    while (ps->out_len > 0) {
+        int lane = session_pick_lane(ps);
+        OutLane *l = &ps->lanes[lane];
+        struct iovec iov[LANE_BATCH];
+        int count = 0;
+        size_t total = 0;
+        size_t offset = l->sent;
+        for (size_t pos = l->head; pos < l->len && count < LANE_BATCH; count++) {
+            OutRecord rec;
+            memcpy(&rec, l->buf + pos, sizeof(rec));
+            iov[count].iov_base = l->buf + pos + sizeof(rec) + offset;
+            iov[count].iov_len = rec.len - offset;
+            total += iov[count].iov_len;
+            pos += sizeof(rec) + rec.len;
+            offset = 0;
+        }
+        
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = (size_t)count;
+        ssize_t n = sendmsg(ps->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) session_discard_output(ps);
             break;
         }
+        ps->out_len -= (size_t)n;
+        lane_consume(ps, lane, (size_t)n, 1);
+        ps->out_lane = l->sent > 0 ? lane : -1;
+        if ((size_t)n < total) break;
+    }
+    if (ps->out_len == 0) ps->slow = 0;
+    session_note_backlog(ps);
+}
+
+/* Queued output in the order it would have been written, for a hot upgrade */
+size_t session_take_backlog(ParentSession *ps, char *out, size_t cap) {
+    size_t n = 0;
+    while (ps->out_len > 0) {
+        int lane = session_pick_lane(ps);
+        OutLane *l = &ps->lanes[lane];
+        OutRecord rec;
+        memcpy(&rec, l->buf + l->head, sizeof(rec));
+        size_t left = rec.len - l->sent;
+        if (n + left > cap) break;
+        memcpy(out + n, l->buf + l->head + sizeof(rec) + l->sent, left);
+        n += left;
+        ps->out_len -= left;
+        lane_consume(ps, lane, left, 0);
+        ps->out_lane = -1;
     }
+    return n;
+}
+
+/* Output a child handed over because this connection had a backlog. Chunks are put
+   back together first so the write goes into the control lane whole. */
+void session_take_child_output(const BroadcastMessage *msg) {
+    int idx = find_client_by_fd(msg->target_fd);
+    if (idx >= 0) shm_buffer->clients[idx].handoff_pending--;
+    if (msg->target_fd < 0 || msg->target_fd >= parent_session_cap) return;
+    ParentSession *ps = &parent_sessions[msg->target_fd];
     
-    /* If user not found, queue message for offline delivery */
-    if (!found) {
-        char offline_msg[BUFFER_SIZE];
-        snprintf(offline_msg, sizeof(offline_msg), "From %s: %s", sender, message);
-        queue_offline_message(target_username, offline_msg, 1);  // Priority = 1 for PMs
+    if (!msg->more && ps->child_out_len == 0) {
+        deliver_to_client_lane(msg->target_fd, LANE_CONTROL, msg->message, (size_t)msg->length, msg->queued_ms);
+        return;
     }
+    char *grown = realloc(ps->child_out, ps->child_out_len + (size_t)msg->length);
+    if (!grown) return;
+    if (ps->child_out_len == 0) ps->child_out_since_ms = msg->queued_ms;
+    ps->child_out = grown;
+    memcpy(ps->child_out + ps->child_out_len, msg->message, (size_t)msg->length);
+    ps->child_out_len += (size_t)msg->length;
+    if (msg->more) return;
     
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
-    return found;
+    deliver_to_client_lane(msg->target_fd, LANE_CONTROL, ps->child_out, ps->child_out_len,
+                           ps->child_out_since_ms);
+    ps->child_out_len = 0;
 }
 
-int register_user(const char *username, const char *password) {
-    char clean_user[50];
-    char clean_pass[50];
+/* ========= BRIDGE FAN-OUT (parent) =========
+ * A bridge connection carries many browser sessions. Each broadcast is rendered
+ * once and written to every bridge as a single DELIVER frame listing all of its
+ * recipient channels; the gateway expands it to its Socket.IO sockets.
+ */
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+_Static_assert(WS_EVENT_MAX <= BRIDGE_FRAME_MAX, "a rendered event must fit one bridge frame");
+
+/* Frame header and payload for one bridge; all parent writes to a bridge pass here */
+static void bridge_write(int bridge_fd, const BroadcastMessage *msg, int type, const uint8_t *head,
+                         size_t head_len, const char *body, size_t body_len) {
+    if (bridge_fd < 0 || bridge_fd >= parent_session_cap) return;
+    ParentSession *ps = &parent_sessions[bridge_fd];
+    ps->bridge = 1;
     
-    strncpy(clean_user, username, sizeof(clean_user) - 1);
-    clean_user[sizeof(clean_user) - 1] = '\0';
-    clean_user[strcspn(clean_user, "\n\r:")] = '\0';
+    /* One write per frame: split writes hit Nagle + delayed ACK on TCP bridges */
+    static char frame[5 + BRIDGE_LIST_MAX + BRIDGE_FRAME_MAX];
+    if (5 + head_len + body_len > sizeof(frame)) {
+        printf("[Bridge]: Dropped a %zu-byte frame for fd %d: over the %zu-byte limit\n",
+               5 + head_len + body_len, bridge_fd, sizeof(frame));
+        return;
+    }
+    put_u32((uint8_t *)frame, (uint32_t)(1 + head_len + body_len));
+    frame[4] = (char)type;
+    if (head_len > 0) memcpy(frame + 5, head, head_len);
+    if (body_len > 0) memcpy(frame + 5 + head_len, body, body_len);
+    deliver_to_client_lane(bridge_fd, broadcast_lane(msg->broadcast_type), frame, 5 + head_len + body_len,
+                           msg->queued_ms);
+}
+
+/* Deliver one broadcast to bridge channels; caller must hold shm_lock */
+void bridge_fanout(const BroadcastMessage *msg) {
+    static uint8_t ids[BRIDGE_LIST_MAX];
+    static char json[WS_EVENT_MAX];
+    size_t json_len = 0;
     
-    strncpy(clean_pass, password, sizeof(clean_pass) - 1);
-    clean_pass[sizeof(clean_pass) - 1] = '\0';
-    clean_pass[strcspn(clean_pass, "\n\r:")] = '\0';
+    if (msg->broadcast_type == 2 || msg->broadcast_type == 4 || msg->broadcast_type == 5) return;
     
-    if (strlen(clean_user) == 0 || strlen(clean_pass) == 0) {
-        return 0;
+    if (msg->broadcast_type == 3) {
+        if (msg->channel == 0) return;
+        if (msg->event == EVENT_CHANNEL_CLOSED) {
+            put_u32(ids, msg->channel);
+            bridge_write(msg->target_fd, msg, BRIDGE_CLOSED, ids, 4, NULL, 0);
+            return;
+        }
+        json_len = render_event_json(json, sizeof(json), msg->event, msg->room, msg->sender_name,
+                                     msg->message + msg->body_offset,
+                                     (size_t)(msg->length - msg->body_offset));
+        ids[0] = 0;
+        ids[1] = 1;
+        put_u32(ids + 2, msg->channel);
+        bridge_write(msg->target_fd, msg, BRIDGE_DELIVER, ids, 6, json, json_len);
+        return;
     }
     
-    FILE *file = fopen(USERS_FILE, "a");
-    if (!file) {
-        perror("Failed to open users file");
-        return 0;
+    /* Room messages visit only the room's channel subscribers; "all" visits every channel */
+    const RoomEntry *room = NULL;
+    if (msg->broadcast_type == 0) {
+        int r = room_find(msg->room);
+        if (r < 0) return;
+        room = &shm_buffer->rooms[r];
     }
     
-    fprintf(file, "%s:%s\n", clean_user, clean_pass);
-    fclose(file);
+    /* One DELIVER per bridge connection, however many of its channels are in the room */
+    static uint8_t lists[MAX_CLIENTS][BRIDGE_LIST_MAX];
+    int bridge_fds[MAX_CLIENTS];
+    uint16_t counts[MAX_CLIENTS];
+    int bridges = 0;
     
-    char log_msg[BUFFER_SIZE];
-    snprintf(log_msg, sizeof(log_msg), "[Server]: New user registered: %s\n", clean_user);
-    log_message(log_msg);
-    printf("%s", log_msg);
+    int m = room ? room_next_member(room, MAX_CLIENTS) : MAX_CLIENTS;
+    while (m >= 0 && m < MAX_SUBSCRIBERS) {
+        const BridgeChannel *ch = &shm_buffer->channels[m - MAX_CLIENTS];
+        m = room ? room_next_member(room, m + 1) : m + 1;
+        
+        if (!ch->active) continue;
+        if (msg->event == EVENT_TYPING && ch->id == msg->channel) continue;  // Never to the typist
+        
+        int b = 0;
+        while (b < bridges && bridge_fds[b] != ch->bridge_fd) b++;
+        if (b == bridges) {
+            if (bridges == MAX_CLIENTS) continue;
+            bridge_fds[bridges] = ch->bridge_fd;
+            counts[bridges++] = 0;
+        }
+        put_u32(lists[b] + 2 + counts[b] * 4, ch->id);
+        counts[b]++;
+    }
     
-    return 1;
+    for (int b = 0; b < bridges; b++) {
+        if (json_len == 0) {
+            json_len = render_event_json(json, sizeof(json), msg->event, msg->room, msg->sender_name,
+                                         msg->message + msg->body_offset,
+                                         (size_t)(msg->length - msg->body_offset));
+        }
+        lists[b][0] = (uint8_t)(counts[b] >> 8);
+        lists[b][1] = (uint8_t)counts[b];
+        bridge_write(bridge_fds[b], msg, BRIDGE_DELIVER, lists[b], 2 + (size_t)counts[b] * 4, json, json_len);
+    }
 }
 
-int authenticate_user(const char *username, const char *password) {
-    char clean_user[50];
-    char clean_pass[50];
-    
-    strncpy(clean_user, username, sizeof(clean_user) - 1);
-    clean_user[sizeof(clean_user) - 1] = '\0';
-    clean_user[strcspn(clean_user, "\n\r:")] = '\0';
+/* Channels of a bridge connection that has gone away; caller must hold shm_lock */
+void bridge_drop_channels(int bridge_fd) {
+    for (int i = 0; i < BRIDGE_MAX_CHANNELS; i++) {
+        BridgeChannel *ch = &shm_buffer->channels[i];
+        if (ch->bridge_fd == bridge_fd) {
+            if (ch->active) {
+                presence_note_rooms(ch->username, ch->subs, PRESENCE_OFFLINE);
+                room_unsubscribe_all(channel_member(ch), &ch->subs);
+            }
+            ch->active = 0;
+        }
+    }
+}
+
+/* ========= SEQUENCED HISTORY (parent) =========
+ * The parent stamps every delivered room chat message with the room's next
+ * sequence number, keeps the newest HISTORY_RING in memory and appends them to
+ * HISTORY_FILE. A client that logs in with "RESUME room:seq ..." is subscribed
+ * in queue order and sent everything after seq in one write: from the ring, or
+ * from the file once the ring has moved on. Counters are reloaded from the file
+ * at startup, so they keep rising across restarts and hot upgrades.
+ */
+
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    uint64_t seq;            // Last number handed out
+} RoomSeq;
+
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    uint64_t seq;
+    char sender[CREDENTIAL_LEN];  // "" for entries reloaded from disk
+    uint32_t recipients;     // Connection slots it was written to
+    uint32_t acked;          // Recipients that acknowledged it
+    int receipt_dirty;       // Acked changed since the sender was last told
+    size_t len;
+    char text[BUFFER_SIZE];
+} HistoryEntry;
+
+/* Replay output, queued in one go with session_queue_lines() */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} ReplayBuffer;
+
+RoomSeq *room_seqs = NULL;
+int room_seq_count = 0;
+int room_seq_cap = 0;
+HistoryEntry *history_ring = NULL;
+int history_head = 0;        // Next slot to overwrite
+int history_count = 0;
+FILE *history_file = NULL;
+SearchIndex *search_index = NULL;  // Fed every sequenced message; NULL when search is off
+
+RoomSeq *room_seq_find(const char *room) {
+    for (int i = 0; i < room_seq_count; i++) {
+        if (strcmp(room_seqs[i].room, room) == 0) return &room_seqs[i];
+    }
+    return NULL;
+}
+
+RoomSeq *room_seq_get(const char *room) {
+    RoomSeq *rs = room_seq_find(room);
+    if (rs) return rs;
     
-    strncpy(clean_pass, password, sizeof(clean_pass) - 1);
-    clean_pass[sizeof(clean_pass) - 1] = '\0';
-    clean_pass[strcspn(clean_pass, "\n\r:")] = '\0';
+    if (room_seq_count == room_seq_cap) {
+        int cap = room_seq_cap ? room_seq_cap * 2 : 64;
+        RoomSeq *grown = realloc(room_seqs, (size_t)cap * sizeof(RoomSeq));
+        if (!grown) return NULL;
+        room_seqs = grown;
+        room_seq_cap = cap;
+    }
+    rs = &room_seqs[room_seq_count++];
+    snprintf(rs->room, sizeof(rs->room), "%s", room);
+    rs->seq = 0;
+    return rs;
+}
+
+static HistoryEntry *history_remember(const char *room, uint64_t seq, const char *text, size_t len) {
+    HistoryEntry *e = &history_ring[history_head];
+    snprintf(e->room, sizeof(e->room), "%s", room);
+    e->seq = seq;
+    e->sender[0] = '\0';
+    e->recipients = 0;
+    e->acked = 0;
+    e->receipt_dirty = 0;
+    e->len = len < sizeof(e->text) ? len : sizeof(e->text) - 1;
+    memcpy(e->text, text, e->len);
+    history_head = (history_head + 1) % HISTORY_RING;
+    if (history_count < HISTORY_RING) history_count++;
+    return e;
+}
+
+/* Stamp one room chat message and record it; NULL when history is unavailable */
+HistoryEntry *history_record(const char *room, const char *sender, const char *text, size_t len) {
+    if (!history_ring) return NULL;
+    RoomSeq *rs = room_seq_get(room);
+    if (!rs) return NULL;
     
-    FILE *file = fopen(USERS_FILE, "r");
-    if (!file) {
-        return register_user(clean_user, clean_pass);
+    uint64_t seq = ++rs->seq;
+    HistoryEntry *e = history_remember(room, seq, text, len);
+    snprintf(e->sender, sizeof(e->sender), "%s", sender);
+    if (history_file) {
+        /* "seq<TAB>len<TAB>room" then the rendered bytes, which may hold newlines */
+        fprintf(history_file, "%llu\t%zu\t%s\n", (unsigned long long)seq, len, room);
+        fwrite(text, 1, len, history_file);
     }
+    return e;
+}
+
+/* Next record of the history file; 0 at the end or at a torn record */
+static int history_read_record(FILE *f, HistoryEntry *e) {
+    char header[64 + ROOM_NAME_LEN];
+    unsigned long long seq;
+    size_t len;
+    int room_at = 0;
     
-    char line[256];
-    char stored_user[50];
-    char stored_pass[50];
+    if (!fgets(header, sizeof(header), f)) return 0;
+    if (sscanf(header, "%llu\t%zu\t%n", &seq, &len, &room_at) != 2 || room_at == 0 ||
+        len >= sizeof(e->text)) {
+        return 0;
+    }
+    header[strcspn(header, "\n")] = '\0';
+    snprintf(e->room, sizeof(e->room), "%s", header + room_at);
+    if (fread(e->text, 1, len, f) != len) return 0;
+    e->seq = seq;
+    e->len = len;
+    return 1;
+}
+
+/* Reload counters and the ring from disk; cut off a record torn by a crash. A
+   snapshot covers the file up to its offset, so only what follows is replayed. */
+void init_history() {
+    history_ring = calloc(HISTORY_RING, sizeof(HistoryEntry));
+    if (!history_ring) {
+        perror("History ring allocation failed");
+        return;
+    }
     
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n\r")] = 0;
-        
-        if (sscanf(line, "%49[^:]:%49s", stored_user, stored_pass) == 2) {
-            if (strcmp(stored_user, clean_user) == 0) {
-                fclose(file);
-                if (strcmp(stored_pass, clean_pass) == 0) {
-                    return 1;
-                } else {
-                    return -1;
-                }
-            }
+    uint64_t started_ms = monotonic_ms();
+    long start = snapshot_load_history();
+    FILE *f = fopen(HISTORY_FILE, "r");
+    if (f) {
+        static HistoryEntry e;
+        unsigned long records = 0;
+        long good_end = start;
+        fseek(f, start, SEEK_SET);
+        while (history_read_record(f, &e)) {
+            RoomSeq *rs = room_seq_get(e.room);
+            if (rs && e.seq > rs->seq) rs->seq = e.seq;
+            history_remember(e.room, e.seq, e.text, e.len);
+            room_ring_add(e.room, e.seq, e.text, e.len, 0);
+            good_end = ftell(f);
+            records++;
         }
+        fseek(f, 0, SEEK_END);
+        if (ftell(f) > good_end && truncate(HISTORY_FILE, good_end) == 0) {
+            printf("[History]: Dropped a torn record at offset %ld\n", good_end);
+        }
+        fclose(f);
+        printf("[History]: %lu sequenced messages %sreloaded, %d rooms, in %llu ms\n", records,
+               start > 0 ? "newer than the snapshot " : "", room_seq_count,
+               (unsigned long long)(monotonic_ms() - started_ms));
     }
     
-    fclose(file);
-    return register_user(clean_user, clean_pass);
+    history_file = fopen(HISTORY_FILE, "a+");  // Read too: a snapshot checksums its tail
+    if (!history_file) {
+        perror("Failed to open history file");
+    }
 }
 
-void handle_shutdown(int sig) {
-    (void)sig;
-    server_running = 0;
-    
-    printf("\n\n╔════════════════════════════════════════════════════════════════╗\n");
-    printf("║              GRACEFUL SHUTDOWN IN PROGRESS...                ║\n");
-    printf("╚════════════════════════════════════════════════════════════════╝\n\n");
+static void replay_append(ReplayBuffer *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : BUFFER_SIZE * 8;
+        while (cap < out->len + len) cap *= 2;
+        char *grown = realloc(out->data, cap);
+        if (!grown) return;
+        out->data = grown;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+/* "[seq room:n] " in front of a line for sessions that sent RESUME */
+size_t render_seq_tag(char *out, size_t cap, const char *room, uint64_t seq) {
+    int n = snprintf(out, cap, "[seq %s:%llu] ", room, (unsigned long long)seq);
+    return (n < 0) ? 0 : ((size_t)n < cap ? (size_t)n : cap - 1);
+}
+
+static void replay_line(ReplayBuffer *out, const char *room, uint64_t seq, const char *text, size_t len) {
+    char tag[ROOM_NAME_LEN + 32];
+    replay_append(out, tag, render_seq_tag(tag, sizeof(tag), room, seq));
+    replay_append(out, text, len);
+}
+
+/* One "room:seq" token of a RESUME spec; NULL at the end. A bare "room" asks for
+   no replay (seq is then UINT64_MAX). */
+const char *resume_next(const char *spec, char *room, uint64_t *seq) {
+    while (*spec == ' ') spec++;
+    if (*spec == '\0' || *spec == '\n' || *spec == '\r') return NULL;
     
-    char *msg = "\n[Server]: Server is shutting down. Goodbye!\n";
-    broadcast_all(msg);
-    log_message(msg);
+    const char *end = spec + strcspn(spec, " \r\n");
+    const char *colon = NULL;
+    for (const char *p = spec; p < end; p++) {
+        if (*p == ':') colon = p;
+    }
+    size_t name_len = (size_t)((colon ? colon : end) - spec);
+    if (name_len > ROOM_NAME_LEN - 1) name_len = ROOM_NAME_LEN - 1;
+    memcpy(room, spec, name_len);
+    room[name_len] = '\0';
+    *seq = colon ? strtoull(colon + 1, NULL, 10) : UINT64_MAX;
+    return end;
+}
+
+/* Everything in room after 'after', oldest first: the file for what the ring lost.
+   Ring entries count slot as a recipient, so its acks reach their senders. */
+static void replay_room(ReplayBuffer *out, const char *room, uint64_t after, int slot) {
+    RoomSeq *rs = room_seq_find(room);
+    if (!rs || after >= rs->seq) return;
     
-    printf("[Shutdown]: Broadcasting shutdown message to all clients...\n");
+    uint64_t last = rs->seq;
+    uint64_t from = after + 1;
+    uint64_t skipped = 0;
+    if (last - after > MAX_REPLAY) {
+        skipped = last - after - MAX_REPLAY;
+        from = last - MAX_REPLAY + 1;
+    }
     
-    pthread_mutex_lock(&shm_buffer->shm_lock);
-    int child_count = 0;
-    for (int i = 0; i < shm_buffer->client_count; i++) {
-        close(shm_buffer->clients[i].fd);
-        if (shm_buffer->clients[i].process_id > 0) {
-            kill(shm_buffer->clients[i].process_id, SIGTERM);
-            child_count++;
+    /* Oldest copy the ring still holds; the room's entries rise with the ring */
+    uint64_t ring_from = last + 1;
+    int oldest = (history_head - history_count + HISTORY_RING) % HISTORY_RING;
+    for (int i = 0; i < history_count; i++) {
+        const HistoryEntry *e = &history_ring[(oldest + i) % HISTORY_RING];
+        if (e->seq >= from && strcmp(e->room, room) == 0) {
+            ring_from = e->seq;
+            break;
         }
     }
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
     
-    printf("[Shutdown]: Waiting for %d child processes to exit...\n", child_count);
-    
-    /* Wait for all child processes */
-    while (child_count > 0) {
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0) {
-            child_count--;
-        } else {
-            usleep(100000);  // 100ms
+    ReplayBuffer body = { NULL, 0, 0 };
+    uint64_t replayed = 0;
+    if (ring_from > from) {
+        FILE *f = fopen(HISTORY_FILE, "r");
+        static HistoryEntry e;
+        while (f && history_read_record(f, &e)) {
+            if (e.seq >= from && e.seq < ring_from && strcmp(e.room, room) == 0) {
+                replay_line(&body, room, e.seq, e.text, e.len);
+                replayed++;
+            }
+        }
+        if (f) fclose(f);
+    }
+    for (int i = 0; i < history_count; i++) {
+        HistoryEntry *e = &history_ring[(oldest + i) % HISTORY_RING];
+        if (e->seq >= ring_from && e->seq <= last && strcmp(e->room, room) == 0) {
+            replay_line(&body, room, e->seq, e->text, e->len);
+            e->recipients |= 1u << slot;
+            replayed++;
         }
     }
     
-    printf("[Shutdown]: All child processes terminated\n");
-    
-    if (log_file) {
-        fclose(log_file);
+    char header[BUFFER_SIZE];
+    size_t n = render_seq_tag(header, sizeof(header), room, last);
+    n += (size_t)snprintf(header + n, sizeof(header) - n,
+                          "[Server]: Resuming #%s - %llu missed message%s", room,
+                          (unsigned long long)replayed, replayed != 1 ? "s" : "");
+    if (skipped + (last - from + 1 - replayed) > 0 && n < sizeof(header)) {
+        n += (size_t)snprintf(header + n, sizeof(header) - n, " (%llu older no longer available)",
+                              (unsigned long long)(skipped + (last - from + 1 - replayed)));
     }
+    if (n > sizeof(header) - 2) n = sizeof(header) - 2;
+    header[n++] = '\n';
+    replay_append(out, header, n);
+    if (body.len > 0) replay_append(out, body.data, body.len);
+    free(body.data);
+}
+
+/* A RESUME reaches the parent in queue order: subscribe the session, then send what it
+   missed. Messages queued before this were not delivered to it and are in the history;
+   everything after is delivered live, so the two meet without a gap or a duplicate.
+   Caller holds shm_lock. */
+void history_resume(const BroadcastMessage *msg) {
+    int idx = find_client_by_fd(msg->sender_fd);
+    if (idx < 0 || msg->sender_fd >= parent_session_cap) return;  // Gone before we got here
+    SharedClient *c = &shm_buffer->clients[idx];
+    ParentSession *ps = &parent_sessions[msg->sender_fd];
+    ps->seq_tags = 1;
     
-    /* Cleanup IPC resources */
-    printf("[Shutdown]: Cleaning up IPC resources...\n");
-    cleanup_shared_memory();
-    cleanup_message_queue();
-    cleanup_semaphore();
+    room_subscribe(c->slot, &c->subs, c->room);
+    if (history_file) fflush(history_file);
     
-    close(server_fd_global);
-    pthread_mutex_destroy(&lock);
+    ReplayBuffer out = { NULL, 0, 0 };
+    char room[ROOM_NAME_LEN];
+    uint64_t after;
+    const char *spec = msg->message;
+    while ((spec = resume_next(spec, room, &after)) != NULL) {
+        if (room[0] == '\0' || room_subscribe(c->slot, &c->subs, room) < 0) continue;
+        if (after != UINT64_MAX) replay_room(&out, room, after, c->slot);
+    }
+    presence_note_rooms(c->username, c->subs, PRESENCE_ONLINE);
     
-    printf("\n╔════════════════════════════════════════════════════════════════╗\n");
-    printf("║         SHUTDOWN COMPLETE - ALL RESOURCES CLEANED UP         ║\n");
-    printf("╚════════════════════════════════════════════════════════════════╝\n\n");
-    exit(0);
+    if (out.len > 0) {
+        printf("[History]: Replayed %zu bytes to %s\n", out.len, c->username);
+        session_queue_lines(ps, LANE_BULK, out.data, out.len, msg->queued_ms);
+    }
+    free(out.data);
 }
 
-/* Handle child process termination */
-void handle_sigchld(int sig) {
-    (void)sig;
-    int status;
-    pid_t pid;
+/* ========= ROOM HISTORY RINGS (parent) =========
+ * Each room keeps its own ring of the newest sequenced chat, so a busy room
+ * cannot push a quiet one's history out. Depths are set per room
+ * (NETCHAT_ROOM_DEPTH="dev=200,random=20,50", the bare number for every
+ * other room) and all rings together stay under room_ring_budget bytes:
+ * past it the rings of the rooms least recently written or read are
+ * dropped whole, and a dropped ring is read back from HISTORY_FILE the
+ * next time someone asks for it.
+ *
+ * A joiner gets the lines of its new room it was not sent live, in one
+ * write, and "/recent [n]" the room's last n. Both requests are queued
+ * like broadcasts (type 5), so a line is either in the ring when the
+ * request is served or delivered live afterwards.
+ */
+
+typedef struct {
+    uint64_t seq;
+    uint32_t recipients;        // Connection slots it was sent to, live or from the ring
+    uint32_t len;
+    char text[];
+} RingLine;
+
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    int depth;
+    int head;                   // Next slot to fill
+    int count;
+    size_t bytes;               // Its lines and slot array
+    uint64_t last_used_ms;      // Last line added or request served
+    RingLine **lines;
+} RoomRing;
+
+typedef struct {
+    char room[ROOM_NAME_LEN];
+    int depth;
+} RingDepth;
+
+RoomRing *room_rings = NULL;
+int room_ring_count = 0;
+int room_ring_cap = 0;
+size_t room_ring_bytes = 0;
+size_t room_ring_budget = ROOM_RING_BYTES;
+int room_ring_default_depth = ROOM_RING_DEPTH;
+RingDepth ring_depths[MAX_TRACKED_ROOMS];
+int ring_depth_count = 0;
+
+/* "room=n,room=n,n": per-room depths and the default */
+void init_room_rings() {
+    const char *bytes = getenv("NETCHAT_ROOM_HISTORY_BYTES");
+    if (bytes && atol(bytes) > 0) room_ring_budget = (size_t)atol(bytes);
     
-    /* Reap all terminated children */
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        /* Find and remove client from shared memory */
-        pthread_mutex_lock(&shm_buffer->shm_lock);
-        for (int i = 0; i < shm_buffer->client_count; i++) {
-            if (shm_buffer->clients[i].process_id == pid) {
-                /* Close the socket in parent */
-                close(shm_buffer->clients[i].fd);
-                
-                /* Remove this client by shifting others */
-                for (int j = i; j < shm_buffer->client_count - 1; j++) {
-                    shm_buffer->clients[j] = shm_buffer->clients[j + 1];
-                }
-                shm_buffer->client_count--;
-                break;
-            }
+    const char *spec = getenv("NETCHAT_ROOM_DEPTH");
+    while (spec && *spec) {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        int depth = atoi(eq ? eq + 1 : spec);
+        if (depth < 1) depth = 1;
+        if (depth > ROOM_RING_MAX) depth = ROOM_RING_MAX;
+        if (!eq) {
+            room_ring_default_depth = depth;
+        } else if (ring_depth_count < MAX_TRACKED_ROOMS) {
+            RingDepth *d = &ring_depths[ring_depth_count++];
+            size_t name_len = (size_t)(eq - spec) < ROOM_NAME_LEN - 1 ? (size_t)(eq - spec) : ROOM_NAME_LEN - 1;
+            memcpy(d->room, spec, name_len);
+            d->room[name_len] = '\0';
+            d->depth = depth;
         }
-        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        spec += len;
+        if (*spec == ',') spec++;
     }
+    printf("[History]: Room rings keep %d messages per room (%d rooms set apart) in %zu KB\n",
+           room_ring_default_depth, ring_depth_count, room_ring_budget >> 10);
 }
 
-/* ========= PROCESS FORKING - Handle client in separate process ========= */
-void handle_client_process(int client_fd) {
-    char buffer[BUFFER_SIZE];
-    char username[50];
-    char password[50];
-    char message[BUFFER_SIZE + 100];
-    int bytes_read;
-    int client_index = -1;
-
-    /* Receive username */
-    int idx = 0;
-    char c;
-    while (idx < (int)sizeof(username) - 1) {
-        bytes_read = recv(client_fd, &c, 1, 0);
-        if (bytes_read <= 0) {
-            close(client_fd);
-            exit(0);
-        }
-        if (c == '\n') break;
-        username[idx++] = c;
+static int room_ring_depth(const char *room) {
+    for (int i = 0; i < ring_depth_count; i++) {
+        if (strcmp(ring_depths[i].room, room) == 0) return ring_depths[i].depth;
     }
-    username[idx] = '\0';
+    return room_ring_default_depth;
+}
 
-    /* Receive password */
-    idx = 0;
-    while (idx < (int)sizeof(password) - 1) {
-        bytes_read = recv(client_fd, &c, 1, 0);
-        if (bytes_read <= 0) {
-            close(client_fd);
-            exit(0);
-        }
-        if (c == '\n') break;
-        password[idx++] = c;
+static void room_ring_publish(void) {
+    shm_buffer->stats.ring_bytes = room_ring_bytes;
+    shm_buffer->stats.ring_rooms = room_ring_count;
+}
+
+RoomRing *room_ring_find(const char *room) {
+    for (int i = 0; i < room_ring_count; i++) {
+        if (strcmp(room_rings[i].room, room) == 0) return &room_rings[i];
     }
-    password[idx] = '\0';
+    return NULL;
+}
+
+static RoomRing *room_ring_get(const char *room) {
+    RoomRing *r = room_ring_find(room);
+    if (r) return r;
     
-    if (strlen(username) == 0 || strlen(password) == 0) {
+    if (room_ring_count == room_ring_cap) {
+        int cap = room_ring_cap ? room_ring_cap * 2 : 64;
+        RoomRing *grown = realloc(room_rings, (size_t)cap * sizeof(RoomRing));
+        if (!grown) return NULL;
+        room_rings = grown;
+        room_ring_cap = cap;
+    }
+    int depth = room_ring_depth(room);
+    RingLine **lines = calloc((size_t)depth, sizeof(RingLine *));
+    if (!lines) return NULL;
+    r = &room_rings[room_ring_count++];
+    snprintf(r->room, sizeof(r->room), "%s", room);
+    r->depth = depth;
+    r->head = 0;
+    r->count = 0;
+    r->bytes = (size_t)depth * sizeof(RingLine *);
+    r->last_used_ms = monotonic_ms();
+    r->lines = lines;
+    room_ring_bytes += r->bytes;
+    return r;
+}
+
+static void room_ring_drop_oldest(RoomRing *r) {
+    int oldest = (r->head - r->count + r->depth) % r->depth;
+    RingLine *line = r->lines[oldest];
+    size_t size = sizeof(RingLine) + line->len;
+    r->bytes -= size;
+    room_ring_bytes -= size;
+    free(line);
+    r->lines[oldest] = NULL;
+    r->count--;
+}
+
+/* Back under budget: drop the least recently used rings other than *keep, then
+   *keep's own oldest lines. *keep follows its ring if that moves. */
+static void room_ring_trim(RoomRing **keep) {
+    while (room_ring_bytes > room_ring_budget) {
+        int lru = -1;
+        for (int i = 0; i < room_ring_count; i++) {
+            if (&room_rings[i] != *keep &&
+                (lru < 0 || room_rings[i].last_used_ms < room_rings[lru].last_used_ms)) {
+                lru = i;
+            }
+        }
+        if (lru < 0) break;
+        RoomRing *victim = &room_rings[lru];
+        while (victim->count > 0) room_ring_drop_oldest(victim);
+        room_ring_bytes -= victim->bytes;
+        free(victim->lines);
+        shm_buffer->stats.ring_evictions++;
+        
+        RoomRing *last = &room_rings[--room_ring_count];
+        if (victim != last) {
+            *victim = *last;
+            if (*keep == last) *keep = victim;
+        }
+    }
+    while (room_ring_bytes > room_ring_budget && (*keep)->count > 1) room_ring_drop_oldest(*keep);
+}
+
+/* One delivered chat line into its room's ring */
+void room_ring_add(const char *room, uint64_t seq, const char *text, size_t len, uint32_t recipients) {
+    RoomRing *r = room_ring_get(room);
+    if (!r) return;
+    RingLine *line = malloc(sizeof(RingLine) + len);
+    if (!line) return;
+    line->seq = seq;
+    line->recipients = recipients;
+    line->len = (uint32_t)len;
+    memcpy(line->text, text, len);
+    
+    if (r->count == r->depth) room_ring_drop_oldest(r);
+    r->lines[r->head] = line;
+    r->head = (r->head + 1) % r->depth;
+    r->count++;
+    r->bytes += sizeof(RingLine) + len;
+    room_ring_bytes += sizeof(RingLine) + len;
+    r->last_used_ms = monotonic_ms();
+    room_ring_trim(&r);
+    room_ring_publish();
+}
+
+/* A new connection got slot: lines its predecessor was sent are not its own */
+void room_rings_forget_slot(int slot) {
+    if (slot < 0) return;
+    for (int i = 0; i < room_ring_count; i++) {
+        for (int j = 0; j < room_rings[i].depth; j++) {
+            if (room_rings[i].lines[j]) room_rings[i].lines[j]->recipients &= ~(1u << slot);
+        }
+    }
+}
+
+/* Refill a dropped ring from HISTORY_FILE, newest lines last */
+static RoomRing *room_ring_reload(const char *room) {
+    if (history_file) fflush(history_file);
+    FILE *f = fopen(HISTORY_FILE, "r");
+    if (!f) return NULL;
+    static HistoryEntry e;
+    while (history_read_record(f, &e)) {
+        if (strcmp(e.room, room) == 0) room_ring_add(room, e.seq, e.text, e.len, 0);
+    }
+    fclose(f);
+    return room_ring_find(room);
+}
+
+/* Answer a type 5 request: "join" sends the lines of msg->room the joiner has not
+   been sent, "recent <n>" the last n (RECENT_SHOWN if n is 0). Caller holds shm_lock. */
+void room_ring_send(const BroadcastMessage *msg) {
+    int idx = find_client_by_fd(msg->sender_fd);
+    if (idx < 0 || msg->sender_fd >= parent_session_cap) return;
+    int slot = shm_buffer->clients[idx].slot;
+    int join = strncmp(msg->message, "join", 4) == 0;
+    int want = join ? ROOM_RING_MAX : atoi(msg->message + 6);
+    if (want <= 0) want = RECENT_SHOWN;
+    
+    RoomRing *r = room_ring_find(msg->room);
+    RoomSeq *rs = room_seq_find(msg->room);
+    if (rs && rs->seq > 0) {
+        shm_buffer->stats.ring_requests++;
+        if (r && r->count > 0) shm_buffer->stats.ring_hits++;
+        else r = room_ring_reload(msg->room);
+    }
+    
+    /* Newest first to find where to start, then oldest first into the reply */
+    int first = 0;
+    int count = 0;
+    for (int i = 0; r && i < r->count && count < want; i++) {
+        const RingLine *line = r->lines[(r->head - 1 - i + r->depth) % r->depth];
+        if (join && (line->recipients & (1u << slot))) continue;
+        first = i;
+        count++;
+    }
+    if (join && count == 0) return;
+    
+    char header[ROOM_NAME_LEN + 64];
+    int n = join ? snprintf(header, sizeof(header), "[Server]: Last %d message%s in #%s:\n", count,
+                            count != 1 ? "s" : "", msg->room)
+                 : snprintf(header, sizeof(header), "\n[Recent Messages in #%s]:\n", msg->room);
+    ReplayBuffer out = { NULL, 0, 0 };
+    replay_append(&out, header, (size_t)n);
+    int tagged = parent_sessions[msg->sender_fd].seq_tags;
+    for (int i = first; r && i >= 0; i--) {
+        RingLine *line = r->lines[(r->head - 1 - i + r->depth) % r->depth];
+        if (join && (line->recipients & (1u << slot))) continue;
+        line->recipients |= 1u << slot;
+        if (tagged) replay_line(&out, msg->room, line->seq, line->text, line->len);
+        else replay_append(&out, line->text, line->len);
+    }
+    if (count == 0) replay_append(&out, "(none)\n", 7);
+    if (r) r->last_used_ms = monotonic_ms();
+    room_ring_publish();
+    
+    if (out.len > 0) deliver_text(msg->sender_fd, out.data, out.len);
+    free(out.data);
+}
+
+/* ========= DELIVERY RECEIPTS (parent) =========
+ * Sequenced clients acknowledge cumulatively: "/ack general:41 pm:17" says every
+ * room message up to 41 and every PM up to 17 has arrived, and "/read pm:17" that
+ * the PMs were seen. The child only records the marks in shared memory. Every
+ * RECEIPT_FLUSH_MS the parent folds them into per-message recipient bitmaps and
+ * tells each sender what changed in a single "[receipt]" line, so a message read
+ * by a whole room costs its sender one line per interval, not one per reader.
+ */
+
+#define PM_DELIVERED 1
+#define PM_READ 2
+
+typedef struct {
+    uint64_t id;
+    char sender[CREDENTIAL_LEN];
+    int target_slot;         // -1 once the slot has been handed to another connection
+    int state;               // PM_DELIVERED | PM_READ
+    int receipt_dirty;       // State bits the sender has not been told about
+} PmRecord;
+
+PmRecord pm_track[PM_TRACK];
+uint64_t pm_next_id = 0;
+TimerNode receipt_timer;
+
+/* Stamp a PM to a connection slot; ids start from the clock so they keep rising
+   across restarts and hot upgrades without being stored */
+uint64_t pm_record(const char *sender, int target_slot) {
+    if (pm_next_id == 0) pm_next_id = (uint64_t)time(NULL) * 1000;
+    PmRecord *r = &pm_track[pm_next_id % PM_TRACK];
+    r->id = pm_next_id++;
+    snprintf(r->sender, sizeof(r->sender), "%s", sender);
+    r->target_slot = target_slot;
+    r->state = 0;
+    r->receipt_dirty = 0;
+    return r->id;
+}
+
+/* A new connection got slot: acks from it must not count for its predecessor's messages */
+void receipts_forget_slot(int slot) {
+    if (slot < 0) return;
+    for (int i = 0; history_ring && i < history_count; i++) {
+        history_ring[i].recipients &= ~(1u << slot);
+        history_ring[i].acked &= ~(1u << slot);
+    }
+    for (int i = 0; i < PM_TRACK; i++) {
+        if (pm_track[i].target_slot == slot) pm_track[i].target_slot = -1;
+    }
+}
+
+static void receipts_ack_room(int slot, const AckMark *mark) {
+    for (int i = 0; i < history_count; i++) {
+        HistoryEntry *e = &history_ring[i];
+        if (e->seq <= mark->seq && (e->recipients & ~e->acked & (1u << slot)) &&
+            strcmp(e->room, mark->room) == 0) {
+            e->acked |= 1u << slot;
+            e->receipt_dirty = 1;
+        }
+    }
+}
+
+static void receipts_ack_pm(int slot, uint64_t upto, int state) {
+    for (int i = 0; i < PM_TRACK; i++) {
+        PmRecord *r = &pm_track[i];
+        if (r->id != 0 && r->id <= upto && r->target_slot == slot && !(r->state & state)) {
+            r->state |= state | PM_DELIVERED;  // Read implies delivered
+            r->receipt_dirty = 1;
+        }
+    }
+}
+
+/* Everything the sender has not been told yet, as one line; entries that do not fit wait */
+static size_t receipts_render(const char *sender, char *out, size_t cap) {
+    size_t len = 0;
+    int items = 0;
+    for (int i = 0; i < history_count; i++) {
+        HistoryEntry *e = &history_ring[(history_head - history_count + i + HISTORY_RING) % HISTORY_RING];
+        if (!e->receipt_dirty || strcmp(e->sender, sender) != 0) continue;
+        int n = snprintf(out + len, cap - len, "%s #%s:%llu %d/%d", items ? "," : "[receipt]", e->room,
+                         (unsigned long long)e->seq, __builtin_popcount(e->acked),
+                         __builtin_popcount(e->recipients));
+        if (n < 0 || (size_t)n >= cap - len - 1) break;
+        len += (size_t)n;
+        e->receipt_dirty = 0;
+        items++;
+    }
+    for (int i = 0; i < PM_TRACK; i++) {
+        PmRecord *r = &pm_track[i];
+        if (!r->receipt_dirty || strcmp(r->sender, sender) != 0) continue;
+        int n = snprintf(out + len, cap - len, "%s pm:%llu %s", items ? "," : "[receipt]",
+                         (unsigned long long)r->id, (r->state & PM_READ) ? "read" : "delivered");
+        if (n < 0 || (size_t)n >= cap - len - 1) break;
+        len += (size_t)n;
+        r->receipt_dirty = 0;
+        items++;
+    }
+    if (items == 0) return 0;
+    out[len++] = '\n';
+    return len;
+}
+
+/* Collect new acks, then send each sequenced sender one aggregated line */
+void on_receipt_flush(TimerNode *node, void *arg) {
+    (void)arg;
+    shm_lock_acquire();
+    
+    int changed = 0;
+    for (int i = 0; history_ring && i < shm_buffer->client_count; i++) {
+        SharedClient *c = &shm_buffer->clients[i];
+        if (c->fd < 0 || c->fd >= parent_session_cap) continue;
+        ParentSession *ps = &parent_sessions[c->fd];
+        if (c->ack_gen == ps->ack_gen_seen) continue;
+        ps->ack_gen_seen = c->ack_gen;
+        
+        for (int a = 0; a < MAX_SUBSCRIPTIONS; a++) {
+            if (c->acks[a].room[0]) receipts_ack_room(c->slot, &c->acks[a]);
+        }
+        receipts_ack_pm(c->slot, c->pm_acked, PM_DELIVERED);
+        receipts_ack_pm(c->slot, c->pm_read, PM_READ);
+        changed = 1;
+    }
+    
+    for (int i = 0; changed && i < shm_buffer->client_count; i++) {
+        SharedClient *c = &shm_buffer->clients[i];
+        if (c->bridge || c->fd < 0 || c->fd >= parent_session_cap || !parent_sessions[c->fd].seq_tags) {
+            continue;
+        }
+        char line[BUFFER_SIZE];
+        size_t len = receipts_render(c->username, line, sizeof(line));
+        if (len > 0) deliver_to_client(c->fd, line, len);
+    }
+    
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    tw_arm(&timer_wheel, node, RECEIPT_FLUSH_MS, on_receipt_flush, NULL);
+}
+
+/* "[sent room:n]" tells a sequenced sender, or one that tagged the line with an id,
+   the number its own message got */
+void send_seq_confirmation(int fd, const char *room, uint64_t seq, int asked) {
+    if (fd < 0 || fd >= parent_session_cap || (!parent_sessions[fd].seq_tags && !asked)) return;
+    if (parent_sessions[fd].websocket) return;  // Browsers get no tags
+    char line[ROOM_NAME_LEN + 32];
+    int n = snprintf(line, sizeof(line), "[sent %s:%llu]\n", room, (unsigned long long)seq);
+    deliver_to_client(fd, line, (size_t)n);
+}
+
+/* Wire forms of one broadcast, each rendered on first use */
+typedef struct {
+    uint8_t ws_frame[WS_EVENT_MAX];
+    size_t ws_len;
+    char tagged[BUFFER_SIZE + ROOM_NAME_LEN + 32];
+    size_t tagged_len;
+} BroadcastForms;
+
+static void forms_render_ws(const BroadcastMessage *msg, BroadcastForms *forms) {
+    if (forms->ws_len == 0) forms->ws_len = ws_render_broadcast(msg, forms->ws_frame, WS_EVENT_MAX);
+}
+
+static void forms_render_tagged(const BroadcastMessage *msg, BroadcastForms *forms) {
+    if (forms->tagged_len > 0) return;
+    size_t n = msg->broadcast_type == 0
+        ? render_seq_tag(forms->tagged, sizeof(forms->tagged), msg->room, msg->seq)
+        : (size_t)snprintf(forms->tagged, sizeof(forms->tagged), "[pm %llu] ",
+                           (unsigned long long)msg->seq);
+    memcpy(forms->tagged + n, msg->message, (size_t)msg->length);
+    forms->tagged_len = n + (size_t)msg->length;
+}
+
+/* Pick the wire form of a broadcast for one recipient */
+static void deliver_broadcast(int fd, const BroadcastMessage *msg, BroadcastForms *forms) {
+    int lane = broadcast_lane(msg->broadcast_type);
+    if (session_is_websocket(fd)) {
+        forms_render_ws(msg, forms);
+        deliver_to_client_lane(fd, lane, (const char *)forms->ws_frame, forms->ws_len, msg->queued_ms);
+    } else if (msg->event == EVENT_TYPING) {
+        /* Terminals have no typing indicator */
+    } else if ((msg->broadcast_type == 0 || msg->seq != 0) && fd >= 0 && fd < parent_session_cap &&
+               parent_sessions[fd].seq_tags) {
+        forms_render_tagged(msg, forms);
+        deliver_to_client_lane(fd, lane, forms->tagged, forms->tagged_len, msg->queued_ms);
+    } else {
+        deliver_to_client_lane(fd, lane, msg->message, (size_t)msg->length, msg->queued_ms);
+    }
+}
+
+/* ========= MESSAGE DEDUP =========
+ * A client that may retry tags a chat line with "[id <token>] " (browsers and
+ * the gateway send a "msgId" with message:send). Before the line is logged,
+ * stored or queued, the child looks the id up in the sender's window in shared
+ * memory: a retry is dropped and answered with the "[sent room:n]" the original
+ * got. Windows belong to users rather than connections, so they outlive the
+ * reconnect a retry usually follows, and hold the last DEDUP_WINDOW ids. The
+ * parent stamps each id with the sequence number it hands out and forgets it
+ * when the original was never delivered.
+ */
+
+static uint64_t dedup_hash(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;  // 0 means "no id"
+}
+
+/* "[id <token>] " in front of a line: strip it and return the token's hash, 0 when absent */
+uint64_t take_message_id(char *buffer, int *len) {
+    if (strncmp(buffer, "[id ", 4) != 0) return 0;
+    size_t n = strspn(buffer + 4, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._:-");
+    if (n == 0 || n > MSG_ID_MAX || buffer[4 + n] != ']') return 0;
+    
+    uint64_t id = dedup_hash(buffer + 4, n);
+    size_t skip = 4 + n + 1;
+    if (buffer[skip] == ' ') skip++;
+    memmove(buffer, buffer + skip, (size_t)*len - skip + 1);
+    *len -= (int)skip;
+    return id;
+}
+
+/* The user's window, or with create the least recently used one recycled; caller holds shm_lock */
+static DedupWindow *dedup_window(const char *user, int create) {
+    uint64_t key = dedup_hash(user, strlen(user));
+    DedupWindow *lru = &shm_buffer->dedup[0];
+    for (int i = 0; i < DEDUP_USERS; i++) {
+        DedupWindow *w = &shm_buffer->dedup[i];
+        if (w->user == key) return w;
+        if (w->last_used_ms < lru->last_used_ms) lru = w;
+    }
+    if (!create) return NULL;
+    memset(lru, 0, sizeof(*lru));
+    lru->user = key;
+    return lru;
+}
+
+static int dedup_find(const DedupWindow *w, uint64_t id) {
+    for (int k = 0; k < DEDUP_WINDOW; k++) {
+        if (w->ids[k] == id) return k;
+    }
+    return -1;
+}
+
+/* Child: 1 if the line repeats a recent id. reply then holds the original's "[sent room:n]",
+   or is empty while the parent has not numbered it yet (its own confirmation is on the way). */
+int dedup_check(const char *user, uint64_t id, const char *room, char *reply, size_t cap) {
+    reply[0] = '\0';
+    shm_lock_acquire();
+    DedupWindow *w = dedup_window(user, 1);
+    w->last_used_ms = monotonic_ms();
+    
+    int k = dedup_find(w, id);
+    if (k >= 0) {
+        int r = w->rooms[k];
+        if (w->seqs[k] != 0 && r >= 0 && shm_buffer->rooms[r].name[0] != '\0') {
+            snprintf(reply, cap, "[sent %s:%llu]\n", shm_buffer->rooms[r].name,
+                     (unsigned long long)w->seqs[k]);
+        }
+        shm_buffer->stats.duplicates_dropped++;
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        return 1;
+    }
+    
+    w->ids[w->next] = id;
+    w->seqs[w->next] = 0;
+    w->rooms[w->next] = (int8_t)room_find(room);
+    w->next = (w->next + 1) % DEDUP_WINDOW;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    return 0;
+}
+
+/* The original was never delivered: let a retry through. Caller holds shm_lock. */
+void dedup_forget(const char *user, uint64_t id) {
+    DedupWindow *w = dedup_window(user, 0);
+    int k = w ? dedup_find(w, id) : -1;
+    if (k >= 0) w->ids[k] = 0;
+}
+
+/* Parent: remember the number the original got, for answering its retries. Caller holds shm_lock. */
+void dedup_stamp(const char *user, uint64_t id, const char *room, uint64_t seq) {
+    DedupWindow *w = dedup_window(user, 0);
+    int k = w ? dedup_find(w, id) : -1;
+    if (k < 0) return;
+    w->seqs[k] = seq;
+    w->rooms[k] = (int8_t)room_find(room);
+}
+
+/* ========= ROOM FAN-OUT (parent) =========
+ * Rooms above fanout_inline_max recipients are not written one socket at a
+ * time: the recipient list is split into chunks for the sender pool, each
+ * sender writing the connections in the chunks it takes. The parent waits
+ * for the pool with shm_lock held, so it covers the senders too; every form
+ * of the message is rendered before they start, and per-connection state
+ * is only ever touched by the one sender that owns it for this message.
+ */
+
+FanoutPool *fanout_pool = NULL;
+int fanout_inline_max = FANOUT_INLINE_MAX;
+
+typedef struct {
+    const BroadcastMessage *msg;
+    BroadcastForms *forms;
+} RoomFanout;
+
+void init_fanout_pool() {
+    int threads = FANOUT_THREADS;
+    const char *env_threads = getenv("NETCHAT_FANOUT_THREADS");
+    if (env_threads) threads = atoi(env_threads);
+    const char *env_inline = getenv("NETCHAT_FANOUT_INLINE");
+    if (env_inline && atoi(env_inline) > 0) fanout_inline_max = atoi(env_inline);
+    
+    if (threads > 1) fanout_pool = fanout_pool_create(threads);
+    shm_buffer->stats.fanout_threads = fanout_pool_threads(fanout_pool);
+    if (fanout_pool && fanout_pool_threads(fanout_pool) > 1) {
+        printf("[FANOUT]: %d sender threads for rooms over %d recipients\n",
+               fanout_pool_threads(fanout_pool), fanout_inline_max);
+    } else {
+        printf("[FANOUT]: Room fan-out runs inline\n");
+    }
+}
+
+static void fanout_deliver(int fd, void *arg) {
+    RoomFanout *rf = arg;
+    TRACE_SET(rf->msg->trace_id);
+    deliver_broadcast(fd, rf->msg, rf->forms);
+}
+
+/* Write one broadcast to every fd in the list: inline for small rooms, else on the pool */
+void room_fanout(const BroadcastMessage *msg, BroadcastForms *forms, const int *fds, int count) {
+    if (count <= fanout_inline_max || !fanout_pool || fanout_pool_threads(fanout_pool) < 2) {
+        for (int i = 0; i < count; i++) deliver_broadcast(fds[i], msg, forms);
+        return;
+    }
+    forms_render_ws(msg, forms);
+    forms_render_tagged(msg, forms);
+    RoomFanout rf = { msg, forms };
+    fanout_pool_run(fanout_pool, fds, (size_t)count, FANOUT_CHUNK, fanout_deliver, &rf);
+    shm_buffer->stats.fanouts_pooled++;
+    shm_buffer->stats.fanout_steals = fanout_pool_steals(fanout_pool);
+}
+
+/* ========= PRESENCE =========
+ * Online/away/typing state is journalled in shared memory instead of being
+ * broadcast as it happens. Writers fold a change into the pending entry for the
+ * same user and room, so a burst of typing or a disconnect-reconnect becomes one
+ * entry. Every presence window the parent drains the journal, drops changes that
+ * cancel out against what it last published, and sends each affected room one
+ * line: "[presence #room] +alice ~bob *carol -dave" to connections that asked for
+ * it with /presence on, typing events to browsers, and the usual text notices to
+ * everyone else. Presence traffic then grows with changes per room per window,
+ * not with users squared.
+ */
+
+typedef struct {
+    char user[CREDENTIAL_LEN];
+    char room[ROOM_NAME_LEN];
+    int state;                  // PRESENCE_ONLINE or PRESENCE_AWAY; absent users have no entry
+} PresenceState;
+
+PresenceState *presence_table = NULL;   // What watchers were last told (parent only)
+int presence_table_len = 0;
+int presence_table_cap = 0;
+int presence_window_ms = PRESENCE_WINDOW_MS;
+TimerNode presence_timer;
+
+/* Journal a presence change for the parent's next flush; caller holds shm_lock.
+   PRESENCE_NONE with fd/channel records typing without touching the state. */
+void presence_note(const char *user, const char *room, int state, int fd, uint32_t channel) {
+    if (user[0] == '\0' || room[0] == '\0') return;
+    
+    PresenceChange *p = NULL;
+    for (int i = 0; i < shm_buffer->presence_count && !p; i++) {
+        PresenceChange *e = &shm_buffer->presence[i];
+        if (strcmp(e->room, room) == 0 && strcmp(e->user, user) == 0) p = e;
+    }
+    
+    if (p) {
+        shm_buffer->stats.presence_coalesced++;
+    } else {
+        if (shm_buffer->presence_count == PRESENCE_JOURNAL) {
+            /* Full: a typing-only entry is the cheapest thing to lose */
+            int victim = -1;
+            for (int i = 0; i < PRESENCE_JOURNAL && victim < 0; i++) {
+                if (shm_buffer->presence[i].state == PRESENCE_NONE) victim = i;
+            }
+            shm_buffer->stats.presence_dropped++;
+            if (victim < 0 || state == PRESENCE_NONE) return;
+            shm_buffer->presence[victim] = shm_buffer->presence[--shm_buffer->presence_count];
+        }
+        p = &shm_buffer->presence[shm_buffer->presence_count++];
+        memset(p, 0, sizeof(*p));
+        snprintf(p->user, sizeof(p->user), "%s", user);
+        snprintf(p->room, sizeof(p->room), "%s", room);
+        p->state = PRESENCE_NONE;
+        p->fd = -1;
+    }
+    
+    if (state == PRESENCE_NONE) {
+        p->typing = 1;
+        p->fd = fd;
+        p->channel = channel;
+    } else {
+        p->state = state;
+        if (state >= PRESENCE_LEFT) p->typing = 0;  // Nobody is typing in a room they left
+    }
+    
+    /* Half full: have the parent flush now rather than at the end of the window */
+    if (shm_buffer->presence_count == PRESENCE_JOURNAL / 2 && shm_buffer->parent_pid > 0 &&
+        getpid() != shm_buffer->parent_pid) {
+        kill(shm_buffer->parent_pid, SIGUSR1);
+    }
+}
+
+/* The same change in every room of a subscription set; caller holds shm_lock */
+void presence_note_rooms(const char *user, uint64_t subs, int state) {
+    for (int r = 0; subs; r++, subs >>= 1) {
+        if (subs & 1) presence_note(user, shm_buffer->rooms[r].name, state, -1, 0);
+    }
+}
+
+/* Known in the parent after a hot upgrade: already announced, so not announced again */
+void presence_seed(const char *user, const char *room) {
+    if (presence_table_len == presence_table_cap) {
+        int cap = presence_table_cap ? presence_table_cap * 2 : 64;
+        PresenceState *grown = realloc(presence_table, (size_t)cap * sizeof(PresenceState));
+        if (!grown) return;
+        presence_table = grown;
+        presence_table_cap = cap;
+    }
+    PresenceState *ps = &presence_table[presence_table_len++];
+    snprintf(ps->user, sizeof(ps->user), "%s", user);
+    snprintf(ps->room, sizeof(ps->room), "%s", room);
+    ps->state = PRESENCE_ONLINE;
+}
+
+/* Record what watchers are about to be told; returns the previous state */
+static int presence_publish(const char *user, const char *room, int state) {
+    int i = 0;
+    while (i < presence_table_len &&
+           (strcmp(presence_table[i].room, room) != 0 || strcmp(presence_table[i].user, user) != 0)) {
+        i++;
+    }
+    int prev = i < presence_table_len ? presence_table[i].state : PRESENCE_OFFLINE;
+    
+    if (state >= PRESENCE_LEFT) {
+        if (i < presence_table_len) presence_table[i] = presence_table[--presence_table_len];
+    } else if (i < presence_table_len) {
+        presence_table[i].state = state;
+    } else {
+        presence_seed(user, room);
+        presence_table[presence_table_len - 1].state = state;
+    }
+    return prev;
+}
+
+static int presence_watching(int fd) {
+    int idx = find_client_by_fd(fd);
+    return idx >= 0 && shm_buffer->clients[idx].presence_watch;
+}
+
+/* A presence notice or typing event for one room, sent like a room broadcast
+   except that watchers get their compact line instead of the text */
+static void presence_notify_room(const char *room, const char *text, int event, const PresenceChange *p) {
+    static BroadcastMessage msg;
+    static BroadcastForms forms;
+    forms.ws_len = 0;
+    forms.tagged_len = 0;
+    
+    msg.message = text;
+    msg.length = (int)strlen(text);
+    msg.sender_fd = event == EVENT_TYPING ? p->fd : -1;
+    msg.target_fd = -1;
+    msg.room = room;
+    msg.broadcast_type = 0;
+    msg.priority = BCAST_PRIO_NOTICE;
+    msg.event = event;
+    msg.sender_name = p->user;
+    msg.body_offset = 0;
+    msg.channel = event == EVENT_TYPING ? p->channel : 0;
+    RoomSeq *rs = room_seq_find(room);
+    msg.seq = rs ? rs->seq : 0;
+    msg.queued_ms = monotonic_ms();
+    
+    int r = room_find(room);
+    int recipients[MAX_CLIENTS];
+    int recipient_count = 0;
+    for (int m = r >= 0 ? room_next_member(&shm_buffer->rooms[r], 0) : -1;
+         m >= 0 && m < MAX_CLIENTS; m = room_next_member(&shm_buffer->rooms[r], m + 1)) {
+        int fd = shm_buffer->slot_fd[m];
+        if (fd == msg.sender_fd || (event == EVENT_NOTICE && presence_watching(fd))) continue;
+        recipients[recipient_count++] = fd;
+    }
+    room_fanout(&msg, &forms, recipients, recipient_count);
+    bridge_fanout(&msg);
+}
+
+static void presence_send_watchers(const char *room, const char *line, size_t len) {
+    int r = room_find(room);
+    for (int m = r >= 0 ? room_next_member(&shm_buffer->rooms[r], 0) : -1;
+         m >= 0 && m < MAX_CLIENTS; m = room_next_member(&shm_buffer->rooms[r], m + 1)) {
+        if (presence_watching(shm_buffer->slot_fd[m])) {
+            deliver_to_client(shm_buffer->slot_fd[m], line, len);
+        }
+    }
+}
+
+/* Append " +user" to a room's line, sending it first if it is full */
+static void presence_token(const char *room, char *line, size_t cap, size_t *len, int *tokens,
+                           char mark, const char *user) {
+    size_t need = strlen(user) + 3;
+    if (*tokens > 0 && *len + need >= cap) {
+        line[*len] = '\n';
+        presence_send_watchers(room, line, *len + 1);
+        *len = (size_t)snprintf(line, cap, "[presence #%s]", room);
+        *tokens = 0;
+    }
+    *len += (size_t)snprintf(line + *len, cap - *len - 1, " %c%s", mark, user);
+    (*tokens)++;
+}
+
+/* Drain the journal, one line per room; caller holds shm_lock */
+void presence_flush() {
+    static PresenceChange batch[PRESENCE_JOURNAL];
+    int n = shm_buffer->presence_count;
+    if (n == 0) return;
+    memcpy(batch, shm_buffer->presence, (size_t)n * sizeof(PresenceChange));
+    shm_buffer->presence_count = 0;
+    
+    for (int i = 0; i < n; i++) {
+        if (batch[i].room[0] == '\0') continue;  // Done with its room already
+        char room[ROOM_NAME_LEN];
+        strcpy(room, batch[i].room);
+        
+        char line[BUFFER_SIZE];
+        size_t len = (size_t)snprintf(line, sizeof(line), "[presence #%s]", room);
+        int tokens = 0;
+        
+        for (int j = i; j < n; j++) {
+            PresenceChange *p = &batch[j];
+            if (strcmp(p->room, room) != 0) continue;
+            p->room[0] = '\0';
+            
+            int here = p->state == PRESENCE_NONE || p->state < PRESENCE_LEFT;
+            if (p->state != PRESENCE_NONE) {
+                int prev = presence_publish(p->user, room, p->state);
+                int was_here = prev < PRESENCE_LEFT;
+                if (prev != p->state && (was_here || here)) {
+                    presence_token(room, line, sizeof(line), &len, &tokens,
+                                   !here ? '-' : p->state == PRESENCE_AWAY ? '*' : '+', p->user);
+                    
+                    /* Joins and leaves already went out as text; the rest is news to everyone */
+                    char text[BUFFER_SIZE];
+                    text[0] = '\0';
+                    if (p->state == PRESENCE_OFFLINE && was_here) {
+                        snprintf(text, sizeof(text), "[Server]: %s has disconnected\n", p->user);
+                    } else if (p->state == PRESENCE_AWAY && was_here) {
+                        snprintf(text, sizeof(text), "[Server]: %s is away\n", p->user);
+                    } else if (p->state == PRESENCE_ONLINE && prev == PRESENCE_AWAY) {
+                        snprintf(text, sizeof(text), "[Server]: %s is back\n", p->user);
+                    }
+                    if (text[0]) presence_notify_room(room, text, EVENT_NOTICE, p);
+                }
+            }
+            if (p->typing && here) {
+                presence_token(room, line, sizeof(line), &len, &tokens, '~', p->user);
+                presence_notify_room(room, "", EVENT_TYPING, p);
+            }
+        }
+        
+        if (tokens > 0) {
+            line[len++] = '\n';
+            presence_send_watchers(room, line, len);
+        }
+    }
+}
+
+void on_presence_flush(TimerNode *node, void *arg) {
+    (void)arg;
+    shm_lock_acquire();
+    presence_flush();
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    tw_arm(&timer_wheel, node, presence_window_ms, on_presence_flush, NULL);
+}
+
+/* Signal handler in parent to process broadcast queue */
+void handle_broadcast_signal(int sig) {
+    (void)sig;  // Unused
+    broadcast_pending = 1;  // Set flag for main loop
+}
+
+/* The queued record behind ref as a BroadcastMessage; 0 if ref is stale. shm_lock held. */
+static int broadcast_decode(ArenaRef ref, BroadcastMessage *msg) {
+    const BroadcastRecord *rec = arena_get(&shm_buffer->queue_arena, ref, NULL);
+    if (!rec) return 0;
+    msg->message = rec->text;
+    msg->length = rec->length;
+    msg->sender_fd = rec->sender_fd;
+    msg->target_fd = rec->target_fd;
+    msg->room = rec->text + rec->length + 1;
+    msg->broadcast_type = rec->broadcast_type;
+    msg->priority = rec->priority;
+    msg->event = rec->event;
+    msg->sender_name = msg->room + rec->room_len + 1;
+    msg->body_offset = rec->body_offset;
+    msg->channel = rec->channel;
+    msg->seq = 0;       // Stamped below
+    msg->queued_ms = rec->queued_ms;
+    msg->more = rec->more;
+    msg->msg_id = rec->msg_id;
+    msg->trace_id = rec->trace_id;
+    msg->trace_ts = rec->trace_ts;
+    return 1;
+}
+
+/* Process all pending broadcasts (called by parent only) */
+void process_broadcasts() {
+    if (!shm_buffer) return;  // Safety check
+    
+    broadcast_pending = 0;  // Clear flag
+    
+    shm_lock_acquire();
+    
+    while (shm_buffer->broadcast_count > 0) {
+        /* The control lane is always drained first */
+        int lane = shm_buffer->lane_count[LANE_CONTROL] > 0 ? LANE_CONTROL : LANE_BULK;
+        int base = lane == LANE_CONTROL ? 0 : CONTROL_QUEUE_SLOTS;
+        int slots = lane == LANE_CONTROL ? CONTROL_QUEUE_SLOTS : BULK_QUEUE_SLOTS;
+        ArenaRef ref = shm_buffer->broadcast_queue[base + shm_buffer->broadcast_read_idx[lane]];
+        shm_buffer->broadcast_read_idx[lane] = (shm_buffer->broadcast_read_idx[lane] + 1) % slots;
+        shm_buffer->lane_count[lane]--;
+        shm_buffer->broadcast_count--;
+        
+        BroadcastMessage view;
+        BroadcastMessage *msg = &view;
+        if (!broadcast_decode(ref, msg)) continue;
+        TRACE_SET(msg->trace_id);
+        TRACE_SPAN(TP_QUEUED, msg->trace_ts, lane);
+        TRACE_STAMP(deliver_start);
+        static BroadcastForms forms;
+        forms.ws_len = 0;
+        forms.tagged_len = 0;
+        
+        /* A reconnecting client: subscribe it and replay what it missed */
+        if (msg->broadcast_type == 4) {
+            history_resume(msg);
+        }
+        
+        /* A joiner's backlog or /recent, from the room's ring */
+        if (msg->broadcast_type == 5) {
+            room_ring_send(msg);
+        }
+        
+        /* Direct delivery (PMs) goes to exactly one socket, or one bridge channel.
+           PMs to a connection get an id for delivery and read receipts. */
+        if (msg->broadcast_type == 3 && msg->event == EVENT_RAW) {
+            session_take_child_output(msg);
+        } else if (msg->broadcast_type == 3 && msg->channel == 0) {
+            int target = find_client_by_fd(msg->target_fd);
+            if (msg->event == EVENT_PM && target >= 0) {
+                msg->seq = pm_record(msg->sender_name, shm_buffer->clients[target].slot);
+                send_seq_confirmation(msg->sender_fd, "pm", msg->seq, 0);
+            }
+            deliver_broadcast(msg->target_fd, msg, &forms);
+        }
+        
+        /* Room chat is charged against the room's fan-out budget. A connection's own
+           message is not echoed back; a bridge channel's is. */
+        int over_budget = 0;
+        if (msg->broadcast_type == 0 && msg->priority == BCAST_PRIO_CHAT) {
+            long recipients = room_member_count(msg->room);
+            if (recipients > 0 && msg->sender_fd >= 0) recipients--;
+            
+            RoomBudget *budget = room_budget(msg->room);
+            budget->last_used_ms = monotonic_ms();
+            if (budget->tokens >= recipients * TOKEN_SCALE) {
+                budget->tokens -= recipients * TOKEN_SCALE;
+            } else {
+                over_budget = 1;
+                shm_buffer->stats.room_budget_drops++;
+                if (msg->msg_id) dedup_forget(msg->sender_name, msg->msg_id);  // A retry may go through
+                const char *busy = "[Server]: Room is over its delivery budget - message not delivered.\n";
+                deliver_text(msg->sender_fd, busy, strlen(busy));
+            }
+        }
+        
+        /* Broadcast to all: every connection except gateways, which get their
+           channels' share from bridge_fanout() */
+        for (int i = 0; msg->broadcast_type == 1 && i < shm_buffer->client_count; i++) {
+            if (!shm_buffer->clients[i].bridge) {
+                deliver_broadcast(shm_buffer->clients[i].fd, msg, &forms);
+            }
+        }
+        
+        /* Room chat gets the room's next sequence number; notices carry the latest */
+        HistoryEntry *entry = NULL;
+        if (msg->broadcast_type == 0 && !over_budget) {
+            if (msg->event == EVENT_CHAT) {
+                entry = history_record(msg->room, msg->sender_name, msg->message, (size_t)msg->length);
+                msg->seq = entry ? entry->seq : 0;
+                if (entry) send_seq_confirmation(msg->sender_fd, msg->room, msg->seq, msg->msg_id != 0);
+                if (entry && msg->msg_id) dedup_stamp(msg->sender_name, msg->msg_id, msg->room, msg->seq);
+                if (entry && search_index && msg->body_offset <= msg->length) {
+                    search_index_add(search_index, msg->room, msg->sender_name, msg->seq,
+                                     msg->message + msg->body_offset, (size_t)(msg->length - msg->body_offset));
+                }
+            } else {
+                RoomSeq *rs = room_seq_find(msg->room);
+                msg->seq = rs ? rs->seq : 0;
+            }
+        }
+        
+        /* Broadcast to room (excluding sender): walk the room's connection subscribers */
+        int r = (msg->broadcast_type == 0 && !over_budget) ? room_find(msg->room) : -1;
+        int recipients[MAX_CLIENTS];
+        int recipient_count = 0;
+        for (int m = r >= 0 ? room_next_member(&shm_buffer->rooms[r], 0) : -1;
+             m >= 0 && m < MAX_CLIENTS; m = room_next_member(&shm_buffer->rooms[r], m + 1)) {
+            int fd = shm_buffer->slot_fd[m];
+            if (msg->priority == BCAST_PRIO_NOTICE && msg->event == EVENT_NOTICE && presence_watching(fd)) {
+                continue;  // Joins and leaves reach watchers as presence lines
+            }
+            if (fd != msg->sender_fd) {
+                recipients[recipient_count++] = fd;
+                if (entry) entry->recipients |= 1u << m;
+            }
+        }
+        room_fanout(msg, &forms, recipients, recipient_count);
+        if (!over_budget) {
+            bridge_fanout(msg);
+        }
+        if (entry) room_ring_add(msg->room, entry->seq, msg->message, (size_t)msg->length, entry->recipients);
+        TRACE_SPAN(TP_DELIVER, deliver_start, msg->broadcast_type == 1 ? shm_buffer->client_count :
+                                              msg->broadcast_type == 3 ? 1 : recipient_count);
+        TRACE_SET(0);
+        
+        arena_free(&shm_buffer->queue_arena, ref);
+    }
+    
+    /* A writer found the journal half full: flush before the window ends */
+    if (shm_buffer->presence_count >= PRESENCE_JOURNAL / 2) presence_flush();
+    
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    /* One flush per batch keeps the file current for replays without a write per message */
+    if (history_file) fflush(history_file);
+}
+
+/* Write message to shared memory: the ring keeps as many recent messages as
+   fit in recent_arena, the oldest making room for the newest */
+void write_to_shared_memory(const char *message, size_t len) {
+    if (shm_buffer == NULL) return;
+    if (len > BUFFER_SIZE - 1) len = BUFFER_SIZE - 1;
+    
+    shm_lock_acquire();
+    
+    ShmArena *arena = &shm_buffer->recent_arena;
+    if (shm_buffer->message_count == MAX_RECENT_MESSAGES) {
+        arena_free(arena, shm_buffer->recent[shm_buffer->write_index]);
+        shm_buffer->message_count--;
+    }
+    
+    ArenaRef ref;
+    char *text = arena_alloc_evict(arena, (uint32_t)len + 1, &ref);
+    if (text) {
+        memcpy(text, message, len);
+        text[len] = '\0';
+        shm_buffer->recent[shm_buffer->write_index] = ref;
+        shm_buffer->write_index = (shm_buffer->write_index + 1) % MAX_RECENT_MESSAGES;
+        shm_buffer->message_count++;
+    }
+    
+    /* Whatever the arena pushed out to fit it is at the old end of the ring */
+    while (shm_buffer->message_count > 0) {
+        int oldest = (shm_buffer->write_index - shm_buffer->message_count + MAX_RECENT_MESSAGES) % MAX_RECENT_MESSAGES;
+        if (arena_get(arena, shm_buffer->recent[oldest], NULL)) break;
+        shm_buffer->message_count--;
+    }
+    
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+}
+
+/* The newest max recent messages, oldest first; returns how many. shm_lock held. */
+int recent_newest(const char **texts, int max) {
+    int count = shm_buffer->message_count < max ? shm_buffer->message_count : max;
+    int start = (shm_buffer->write_index - count + MAX_RECENT_MESSAGES) % MAX_RECENT_MESSAGES;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const char *text = arena_get(&shm_buffer->recent_arena, shm_buffer->recent[(start + i) % MAX_RECENT_MESSAGES], NULL);
+        if (text) texts[n++] = text;
+    }
+    return n;
+}
+
+/* Cleanup shared memory */
+void cleanup_shared_memory() {
+    if (shm_buffer != NULL) {
+        pthread_mutex_destroy(&shm_buffer->shm_lock);
+        shmdt(shm_buffer);
+        shmctl(shm_id, IPC_RMID, NULL);
+        printf("[IPC]: Shared memory cleaned up\n");
+    }
+}
+
+/* ========= MESSAGE QUEUE FUNCTIONS ========= */
+
+/* Initialize message queue */
+void init_message_queue() {
+    struct mq_attr attr;
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = MAX_MQ_MESSAGES;
+    attr.mq_msgsize = sizeof(QueuedMessage);
+    attr.mq_curmsgs = 0;
+    
+    /* Try to unlink first in case it exists from crashed previous run;
+       a hot upgrade keeps it so offline messages survive */
+    if (!takeover_mode) {
+        mq_unlink(MQ_NAME);
+    }
+    
+    /* Non-blocking: a full queue must never stall a client process */
+    message_queue = mq_open(MQ_NAME, O_CREAT | O_RDWR | O_NONBLOCK, 0666, &attr);
+    if (message_queue == (mqd_t)-1) {
+        perror("mq_open failed");
+        exit(1);
+    }
+    
+    printf("[IPC]: Message queue initialized\n");
+}
+
+/* Queue a message for offline delivery */
+void queue_offline_message(const char *username, const char *message, int priority) {
+    QueuedMessage qmsg;
+    strncpy(qmsg.username, username, sizeof(qmsg.username) - 1);
+    strncpy(qmsg.message, message, sizeof(qmsg.message) - 1);
+    qmsg.timestamp = time(NULL);
+    qmsg.priority = priority;
+    
+    if (mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), priority) == -1) {
+        perror("mq_send failed");
+    } else {
+        printf("[MQ]: Queued message for %s (priority: %d)\n", username, priority);
+    }
+}
+
+/* Deliver queued messages to user; messages for anyone else go back in the queue */
+void deliver_queued_messages(int client_fd, const char *username) {
+    QueuedMessage qmsg;
+    unsigned int prio;
+    struct mq_attr attr;
+    time_t now = time(NULL);
+    
+    mq_getattr(message_queue, &attr);
+    long pending = attr.mq_curmsgs;
+    
+    for (long i = 0; i < pending; i++) {
+        ssize_t bytes_read = mq_receive(message_queue, (char *)&qmsg, sizeof(QueuedMessage), &prio);
+        if (bytes_read < 0) break;
+        
+        if (now - qmsg.timestamp > OFFLINE_TTL_SEC) {
+            continue;  // Expired
+        }
+        
+        if (strcmp(qmsg.username, username) == 0) {
+            char delivery[BUFFER_SIZE + 100];
+            snprintf(delivery, sizeof(delivery), "[Offline Message]: %s\n", qmsg.message);
+            client_reply(client_fd, delivery, strlen(delivery));
+        } else {
+            mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), prio);
+        }
+    }
+}
+
+/* Drop offline messages older than OFFLINE_TTL_SEC (parent, from the timer wheel) */
+void expire_offline_messages() {
+    QueuedMessage qmsg;
+    unsigned int prio;
+    struct mq_attr attr;
+    time_t now = time(NULL);
+    int expired = 0;
+    
+    mq_getattr(message_queue, &attr);
+    long pending = attr.mq_curmsgs;
+    
+    /* Cycling the whole queue once keeps the order within each priority */
+    for (long i = 0; i < pending; i++) {
+        if (mq_receive(message_queue, (char *)&qmsg, sizeof(QueuedMessage), &prio) < 0) break;
+        
+        if (now - qmsg.timestamp > OFFLINE_TTL_SEC) {
+            expired++;
+            continue;
+        }
+        mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), prio);
+    }
+    
+    if (expired > 0) {
+        printf("[MQ]: Expired %d offline message%s\n", expired, expired != 1 ? "s" : "");
+    }
+}
+
+/* Cleanup message queue */
+void cleanup_message_queue() {
+    mq_close(message_queue);
+    mq_unlink(MQ_NAME);
+    printf("[IPC]: Message queue cleaned up\n");
+}
+
+/* ========= WARM RESTART SNAPSHOT (parent) =========
+ * Every SNAPSHOT_SEC the parent forks a writer that saves the room sequence
+ * counters, the history ring, every room's ring, the recent messages and the
+ * offline mailbox to SNAPSHOT_FILE (see snapshot.h for the format). The
+ * writer works on the copy-on-write image of the parent's heap that fork()
+ * gave it, so the parent only pays for the fork and for copying what lives
+ * outside its heap: the recent messages, in shared memory, and the mailbox,
+ * which can only be read by cycling the message queue. Nothing is written
+ * while none of it changed, and shutdown writes a last snapshot in-process
+ * once the children are gone.
+ *
+ * At startup init_history() takes the counters and rings from the snapshot
+ * and replays only what HISTORY_FILE gained after the offset it records;
+ * init_snapshot() then puts the recent messages and mailbox back, unless a
+ * hot upgrade handed those over. A snapshot that is missing, damaged or was
+ * taken of another history file is ignored and the whole file is replayed.
+ * A crash loses only mailbox changes made since the last snapshot.
+ */
+
+#define SNAP_META 1                  // u64 history offset, u32 CRC of the history just before it
+#define SNAP_TAIL_BYTES 4096         // History bytes that CRC covers
+#define SNAP_ROOMS 2                 // room, u64 last seq
+#define SNAP_HISTORY 3               // room, u64 seq, text; oldest first
+#define SNAP_ROOM_RINGS 4            // room, u32 count, count x (u64 seq, text); least recently used room first
+#define SNAP_RECENT 5                // text; oldest first
+#define SNAP_MAILBOX 6               // u32 queue priority, u64 timestamp, u32 priority, user, message
+
+typedef struct {
+    uint64_t history_offset;
+    uint32_t history_crc;            // Of the SNAP_TAIL_BYTES before history_offset
+    uint64_t recent_allocs;          // Of recent_arena: moves with every recent message
+    long mail;                       // Offline messages queued
+} SnapshotMarks;
+
+const char *snapshot_path = SNAPSHOT_FILE;
+int snapshot_sec = SNAPSHOT_SEC;
+TimerNode snapshot_timer;
+volatile pid_t snapshot_pid = 0;     // Writer still running; handle_sigchld reaps it
+uint64_t snapshot_started_ms = 0;
+SnapshotMarks snapshot_marks;        // State the newest snapshot was taken of
+SnapshotMarks snapshot_last;
+Snapshot startup_snapshot;           // Open from init_history() until init_snapshot()
+
+/* Taken before the writer starts: it must not touch the queue or shared memory itself */
+static SnapshotWriter snapshot_writer;
+static char snapshot_recent[RECENT_ARENA_BYTES];
+static uint32_t snapshot_recent_len[MAX_RECENT_MESSAGES];
+static int snapshot_recent_count = 0;
+static QueuedMessage snapshot_mail[MAX_MQ_MESSAGES];
+static unsigned int snapshot_mail_prio[MAX_MQ_MESSAGES];
+static int snapshot_mail_count = 0;
+static int *snapshot_ring_order = NULL;  // Indexes into room_rings, least recently used first
+
+static void snapshot_config(void) {
+    const char *env_path = getenv("NETCHAT_SNAPSHOT");
+    if (env_path) snapshot_path = env_path;
+    const char *env_sec = getenv("NETCHAT_SNAPSHOT_SEC");
+    if (env_sec) snapshot_sec = atoi(env_sec);
+}
+
+static void snapshot_mark(SnapshotMarks *m) {
+    memset(m, 0, sizeof(*m));
+    if (history_file) {
+        struct stat st;
+        fflush(history_file);
+        uint64_t end = fstat(fileno(history_file), &st) == 0 ? (uint64_t)st.st_size : 0;
+        uint64_t from = end > SNAP_TAIL_BYTES ? end - SNAP_TAIL_BYTES : 0;
+        m->history_offset = end;
+        m->history_crc = snapshot_file_crc(fileno(history_file), from, end);
+    }
+    shm_lock_acquire();
+    m->recent_allocs = shm_buffer->recent_arena.allocs;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    struct mq_attr attr;
+    if (mq_getattr(message_queue, &attr) == 0) m->mail = attr.mq_curmsgs;
+}
+
+static int compare_ring_use(const void *a, const void *b) {
+    uint64_t x = room_rings[*(const int *)a].last_used_ms;
+    uint64_t y = room_rings[*(const int *)b].last_used_ms;
+    return (x > y) - (x < y);
+}
+
+/* Copy what the writer cannot read on its own */
+static void snapshot_capture(void) {
+    const char *texts[MAX_RECENT_MESSAGES];
+    size_t used = 0;
+    snapshot_recent_count = 0;
+    shm_lock_acquire();
+    int n = recent_newest(texts, MAX_RECENT_MESSAGES);
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(texts[i]);
+        if (used + len > sizeof(snapshot_recent)) break;
+        memcpy(snapshot_recent + used, texts[i], len);
+        snapshot_recent_len[snapshot_recent_count++] = (uint32_t)len;
+        used += len;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    /* Cycling the whole queue once keeps the order within each priority */
+    QueuedMessage qmsg;
+    unsigned int prio;
+    struct mq_attr attr;
+    snapshot_mail_count = 0;
+    long pending = mq_getattr(message_queue, &attr) == 0 ? attr.mq_curmsgs : 0;
+    for (long i = 0; i < pending; i++) {
+        if (mq_receive(message_queue, (char *)&qmsg, sizeof(QueuedMessage), &prio) < 0) break;
+        if (snapshot_mail_count < MAX_MQ_MESSAGES) {
+            snapshot_mail[snapshot_mail_count] = qmsg;
+            snapshot_mail_prio[snapshot_mail_count++] = prio;
+        }
+        mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), prio);
+    }
+    
+    int *order = realloc(snapshot_ring_order, (size_t)(room_ring_count + 1) * sizeof(int));
+    if (order) snapshot_ring_order = order;
+    for (int i = 0; order && i < room_ring_count; i++) order[i] = i;
+    if (order) qsort(order, (size_t)room_ring_count, sizeof(int), compare_ring_use);
+}
+
+/* Everything from the parent's state and the capture; no locks, no allocation */
+static int snapshot_write(const SnapshotMarks *marks) {
+    SnapshotWriter *w = &snapshot_writer;
+    if (snapshot_begin(w, snapshot_path) < 0) return -1;
+    
+    snapshot_section(w, SNAP_META);
+    snapshot_put_u64(w, marks->history_offset);
+    snapshot_put_u32(w, marks->history_crc);
+    snapshot_record(w);
+    
+    snapshot_section(w, SNAP_ROOMS);
+    for (int i = 0; i < room_seq_count; i++) {
+        snapshot_put_str(w, room_seqs[i].room, strlen(room_seqs[i].room));
+        snapshot_put_u64(w, room_seqs[i].seq);
+        snapshot_record(w);
+    }
+    
+    snapshot_section(w, SNAP_HISTORY);
+    int oldest = (history_head - history_count + HISTORY_RING) % HISTORY_RING;
+    for (int i = 0; history_ring && i < history_count; i++) {
+        const HistoryEntry *e = &history_ring[(oldest + i) % HISTORY_RING];
+        snapshot_put_str(w, e->room, strlen(e->room));
+        snapshot_put_u64(w, e->seq);
+        snapshot_put_str(w, e->text, e->len);
+        snapshot_record(w);
+    }
+    
+    snapshot_section(w, SNAP_ROOM_RINGS);
+    for (int i = 0; snapshot_ring_order && i < room_ring_count; i++) {
+        const RoomRing *r = &room_rings[snapshot_ring_order[i]];
+        snapshot_put_str(w, r->room, strlen(r->room));
+        snapshot_put_u32(w, (uint32_t)r->count);
+        for (int j = 0; j < r->count; j++) {
+            const RingLine *line = r->lines[(r->head - r->count + j + r->depth) % r->depth];
+            snapshot_put_u64(w, line->seq);
+            snapshot_put_str(w, line->text, line->len);
+        }
+        snapshot_record(w);
+    }
+    
+    snapshot_section(w, SNAP_RECENT);
+    size_t at = 0;
+    for (int i = 0; i < snapshot_recent_count; i++) {
+        snapshot_put_str(w, snapshot_recent + at, snapshot_recent_len[i]);
+        at += snapshot_recent_len[i];
+        snapshot_record(w);
+    }
+    
+    snapshot_section(w, SNAP_MAILBOX);
+    for (int i = 0; i < snapshot_mail_count; i++) {
+        const QueuedMessage *q = &snapshot_mail[i];
+        snapshot_put_u32(w, snapshot_mail_prio[i]);
+        snapshot_put_u64(w, (uint64_t)q->timestamp);
+        snapshot_put_u32(w, (uint32_t)q->priority);
+        snapshot_put_str(w, q->username, strnlen(q->username, sizeof(q->username)));
+        snapshot_put_str(w, q->message, strnlen(q->message, sizeof(q->message)));
+        snapshot_record(w);
+    }
+    
+    return snapshot_commit(w);
+}
+
+/* Periodic snapshot: fork a writer, unless one is still running or nothing changed */
+void on_snapshot(TimerNode *node, void *arg) {
+    (void)arg;
+    tw_arm(&timer_wheel, node, (uint64_t)snapshot_sec * 1000, on_snapshot, NULL);
+    if (snapshot_pid > 0) return;
+    
+    SnapshotMarks marks;
+    snapshot_mark(&marks);
+    if (marks.history_offset == snapshot_marks.history_offset &&
+        marks.recent_allocs == snapshot_marks.recent_allocs &&
+        marks.mail == 0 && snapshot_marks.mail == 0) {
+        return;
+    }
+    
+    snapshot_capture();
+    snapshot_started_ms = monotonic_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Client sockets stay the parent's alone: a close there must still reach the peer */
+        signal(SIGINT, SIG_IGN);
+        close_range(3, ~0U, 0);
+        _exit(snapshot_write(&marks) == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        perror("Snapshot writer fork failed");
+        return;
+    }
+    snapshot_pid = pid;
+    snapshot_last = snapshot_marks;
+    snapshot_marks = marks;
+}
+
+/* From handle_sigchld, with the writer's exit status */
+void snapshot_finished(int status) {
+    snapshot_pid = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("[Snapshot]: Saved to %s in %llu ms\n", snapshot_path,
+               (unsigned long long)(monotonic_ms() - snapshot_started_ms));
+    } else {
+        printf("[Snapshot]: Writing %s failed\n", snapshot_path);
+        snapshot_marks = snapshot_last;  // Try again at the next interval
+    }
+}
+
+/* Shutdown, once the children are gone: the final state, written in-process */
+void snapshot_final() {
+    if (snapshot_path[0] == '\0') return;
+    
+    SnapshotMarks marks;
+    uint64_t started_ms = monotonic_ms();
+    snapshot_mark(&marks);
+    snapshot_capture();
+    if (snapshot_write(&marks) == 0) {
+        printf("[Snapshot]: Final state saved to %s in %llu ms\n", snapshot_path,
+               (unsigned long long)(monotonic_ms() - started_ms));
+    } else {
+        perror("Final snapshot failed");
+    }
+}
+
+/* A room name record into room; 0 if it does not fit */
+static int snap_room(SnapCursor *c, char *room) {
+    const char *name;
+    size_t len;
+    if (!snap_str(c, &name, &len) || len >= ROOM_NAME_LEN) return 0;
+    memcpy(room, name, len);
+    room[len] = '\0';
+    return 1;
+}
+
+/* Counters, history ring and room rings from the snapshot; the HISTORY_FILE
+   offset to replay from, 0 without a snapshot that matches the file */
+long snapshot_load_history(void) {
+    snapshot_config();
+    if (snapshot_path[0] == '\0') return 0;
+    uint64_t started_ms = monotonic_ms();
+    if (snapshot_open(snapshot_path, &startup_snapshot) < 0) {
+        if (access(snapshot_path, F_OK) == 0) {
+            printf("[Snapshot]: %s is damaged, replaying %s\n", snapshot_path, HISTORY_FILE);
+        }
+        return 0;
+    }
+    
+    SnapCursor c;
+    uint32_t count;
+    uint64_t offset;
+    uint32_t crc;
+    if (!snapshot_find(&startup_snapshot, SNAP_META, &c, &count) ||
+        !snap_u64(&c, &offset) || !snap_u32(&c, &crc) || offset == 0) {
+        return 0;
+    }
+    
+    /* The history file must still hold what the snapshot was taken of, byte for byte at its end */
+    int fd = open(HISTORY_FILE, O_RDONLY);
+    uint32_t found = fd >= 0 ? snapshot_file_crc(fd, offset > SNAP_TAIL_BYTES ? offset - SNAP_TAIL_BYTES : 0, offset) : 0;
+    if (fd >= 0) close(fd);
+    if (found != crc) {
+        printf("[Snapshot]: %s was taken of another %s, replaying it\n", snapshot_path, HISTORY_FILE);
+        return 0;
+    }
+    
+    char room[ROOM_NAME_LEN];
+    const char *text;
+    size_t len;
+    uint64_t seq;
+    int rooms = 0, messages = 0, lines = 0;
+    
+    if (snapshot_find(&startup_snapshot, SNAP_ROOMS, &c, &count)) {
+        for (uint32_t i = 0; i < count && snap_room(&c, room) && snap_u64(&c, &seq); i++) {
+            RoomSeq *rs = room_seq_get(room);
+            if (rs && seq > rs->seq) rs->seq = seq;
+            rooms++;
+        }
+    }
+    if (snapshot_find(&startup_snapshot, SNAP_HISTORY, &c, &count)) {
+        for (uint32_t i = 0; i < count && snap_room(&c, room) && snap_u64(&c, &seq) &&
+                             snap_str(&c, &text, &len); i++) {
+            history_remember(room, seq, text, len);
+            messages++;
+        }
+    }
+    if (snapshot_find(&startup_snapshot, SNAP_ROOM_RINGS, &c, &count)) {
+        for (uint32_t i = 0; i < count && snap_room(&c, room); i++) {
+            uint32_t ring_lines;
+            if (!snap_u32(&c, &ring_lines)) break;
+            for (uint32_t j = 0; j < ring_lines && snap_u64(&c, &seq) && snap_str(&c, &text, &len); j++) {
+                room_ring_add(room, seq, text, len, 0);
+                lines++;
+            }
+        }
+    }
+    printf("[Snapshot]: %d rooms, %d history and %d room ring messages from %s (%lds old) in %llu ms\n",
+           rooms, messages, lines, snapshot_path, (long)(time(NULL) - (time_t)startup_snapshot.created),
+           (unsigned long long)(monotonic_ms() - started_ms));
+    return (long)offset;
+}
+
+/* Put back the recent messages and mailbox, then start the periodic snapshots */
+void init_snapshot() {
+    SnapCursor c;
+    uint32_t count;
+    const char *text;
+    size_t len;
+    int recent = 0, mail = 0;
+    
+    /* A hot upgrade handed both over already */
+    if (startup_snapshot.base && !takeover_mode) {
+        if (snapshot_find(&startup_snapshot, SNAP_RECENT, &c, &count)) {
+            for (uint32_t i = 0; i < count && snap_str(&c, &text, &len); i++) {
+                write_to_shared_memory(text, len);
+                recent++;
+            }
+        }
+        if (snapshot_find(&startup_snapshot, SNAP_MAILBOX, &c, &count)) {
+            time_t now = time(NULL);
+            for (uint32_t i = 0; i < count; i++) {
+                QueuedMessage qmsg;
+                uint32_t prio, priority;
+                uint64_t timestamp;
+                const char *user, *message;
+                size_t user_len, message_len;
+                if (!snap_u32(&c, &prio) || !snap_u64(&c, &timestamp) || !snap_u32(&c, &priority) ||
+                    !snap_str(&c, &user, &user_len) || !snap_str(&c, &message, &message_len)) {
+                    break;
+                }
+                if (now - (time_t)timestamp > OFFLINE_TTL_SEC) continue;
+                memset(&qmsg, 0, sizeof(qmsg));
+                memcpy(qmsg.username, user, user_len < sizeof(qmsg.username) ? user_len : sizeof(qmsg.username) - 1);
+                memcpy(qmsg.message, message, message_len < sizeof(qmsg.message) ? message_len : sizeof(qmsg.message) - 1);
+                qmsg.timestamp = (time_t)timestamp;
+                qmsg.priority = (int)priority;
+                if (mq_send(message_queue, (char *)&qmsg, sizeof(QueuedMessage), prio) == 0) mail++;
+            }
+        }
+        printf("[Snapshot]: %d recent messages and %d offline messages restored\n", recent, mail);
+    }
+    snapshot_close(&startup_snapshot);
+    
+    if (snapshot_path[0] == '\0') {
+        printf("[Snapshot]: Disabled\n");
+        return;
+    }
+    snapshot_mark(&snapshot_marks);  // What was just loaded needs no snapshot of its own
+    if (snapshot_sec > 0) {
+        tw_node_init(&snapshot_timer);
+        tw_arm(&timer_wheel, &snapshot_timer, (uint64_t)snapshot_sec * 1000, on_snapshot, NULL);
+        printf("[Snapshot]: Saving state to %s every %d s and at shutdown\n", snapshot_path, snapshot_sec);
+    } else {
+        printf("[Snapshot]: Saving state to %s at shutdown\n", snapshot_path);
+    }
+}
+
+/* ========= HOT-PATH TRACING (parent) =========
+ * The rings are mapped here, before any fork, so every client process
+ * inherits them. SIGUSR2 asks for a dump: the main loop forks a child that
+ * writes the rings out as Chrome trace JSON while the server carries on.
+ */
+
+#if NETCHAT_TRACE
+volatile sig_atomic_t trace_dump_requested = 0;
+char trace_dir[256] = TRACE_DIR;
+
+void handle_trace_signal(int sig) {
+    (void)sig;
+    trace_dump_requested = 1;
+}
+
+/* From the main loop, after SIGUSR2 */
+void trace_dump_start() {
+    trace_dump_requested = 0;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/trace-%ld.json", trace_dir, (long)time(NULL));
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN);
+        close_range(3, ~0U, 0);
+        long events = trace_dump(path);
+        if (events < 0) {
+            perror(path);
+            _exit(1);
+        }
+        printf("[Trace]: %ld events written to %s\n", events, path);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid < 0) perror("Trace dump fork failed");
+}
+
+void init_trace() {
+    int sample = TRACE_SAMPLE_EVERY;
+    const char *env_sample = getenv("NETCHAT_TRACE_SAMPLE");
+    if (env_sample) sample = atoi(env_sample);
+    const char *env_dir = getenv("NETCHAT_TRACE_DIR");
+    if (env_dir && env_dir[0]) snprintf(trace_dir, sizeof(trace_dir), "%s", env_dir);
+    
+    if (sample <= 0) {
+        printf("[Trace]: Disabled\n");
+        return;
+    }
+    if (trace_init((uint32_t)sample) < 0) {
+        perror("Trace rings");
+        return;
+    }
+    TRACE_NAME("loop");
+    signal(SIGUSR2, handle_trace_signal);
+    printf("[Trace]: Sampling 1 in %d messages; kill -USR2 %d writes %s/trace-<time>.json\n",
+           sample, getpid(), trace_dir);
+}
+#endif
+
+/* ========= LIVE MONITOR (parent) =========
+ * Every MONITOR_PUBLISH_MS the parent copies its counters, queue depths and
+ * rooms into the monitor object for tools/netchat-top. Events are appended
+ * where they happen. The object is replaced at every start, hot upgrades
+ * included, and unlinked at shutdown.
+ */
+
+char monitor_name[64] = MONITOR_NAME;
+TimerNode monitor_timer;
+uint64_t monitor_started_ms = 0;
+int monitor_queue_peak = 0;        // Deepest the queue got since the last snapshot
+int monitor_queue_record = 0;      // Deepest of the current burst, reported as it grows
+unsigned long monitor_shed_seen[4];  // Shed counters at the last snapshot
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* From the overload check, with shm_lock held, before the high-water mark is reset */
+void monitor_note_load(int high_water, int old_level, int level, int depth_pct, int latency) {
+    if (!monitor) return;
+    if (high_water > monitor_queue_peak) monitor_queue_peak = high_water;
+    if (high_water < MONITOR_PEAK_FLOOR) {
+        monitor_queue_record = 0;
+    } else if (high_water > monitor_queue_record) {
+        monitor_queue_record = high_water;
+        monitor_event(monitor, MON_HIGH_WATER, high_water, "queue %d/%d slots, arena %u KB",
+                      high_water, MAX_BROADCAST_QUEUE, shm_buffer->queue_arena.high_water / 1024);
+    }
+    if (level != old_level) {
+        monitor_event(monitor, MON_OVERLOAD, level, "level %d -> %d (queue %d%%, loop %d ms)",
+                      old_level, level, depth_pct, latency);
+    }
+}
+
+void on_monitor_publish(TimerNode *node, void *arg) {
+    (void)arg;
+    static MonitorStats ms;  // Too big for the stack with its rooms
+    memset(&ms, 0, sizeof(ms));
+    ms.published_ms = wall_ms();
+    ms.started_ms = monitor_started_ms;
+    ms.pid = getpid();
+    ms.max_clients = MAX_CLIENTS;
+    ms.queue_slots = MAX_BROADCAST_QUEUE;
+    ms.arena_bytes = QUEUE_ARENA_BYTES;
+    
+    shm_lock_acquire();
+    ms.overload_level = shm_buffer->overload_level;
+    ms.clients = shm_buffer->client_count;
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        SharedClient *c = &shm_buffer->clients[i];
+        if (c->authenticated) ms.logged_in++;
+        if (c->websocket) ms.websocket++;
+        if (c->bridge) ms.gateways++;
+        
+        /* Every connection, gateways included, has a slot in clients[] */
+        if (c->fd >= 0 && c->fd < parent_session_cap && parent_sessions[c->fd].active) {
+            size_t out = parent_sessions[c->fd].out_len;
+            if (out > 0) ms.backlogged++;
+            ms.backlog_bytes += out;
+            if (out > ms.backlog_max) ms.backlog_max = out;
+        }
+    }
+    for (int i = 0; i < BRIDGE_MAX_CHANNELS; i++) {
+        if (shm_buffer->channels[i].active) ms.channels++;
+    }
+    
+    ms.queue_depth = shm_buffer->broadcast_count;
+    for (int l = 0; l < LANES; l++) ms.lane_depth[l] = shm_buffer->lane_count[l];
+    int peak = shm_buffer->stats.queue_high_water;
+    ms.queue_peak = peak > monitor_queue_peak ? peak : monitor_queue_peak;
+    monitor_queue_peak = 0;
+    ms.arena_used = arena_used(&shm_buffer->queue_arena);
+    
+    LoadStats *st = &shm_buffer->stats;
+    ms.rate_limited = st->rate_limited_msgs;
+    ms.queue_full_drops = st->queue_full_drops;
+    ms.room_budget_drops = st->room_budget_drops;
+    ms.notices_dropped = st->notices_dropped;
+    ms.slow_drops = __atomic_load_n(&st->slow_consumer_drops, __ATOMIC_RELAXED);
+    for (int l = 0; l < LANES; l++) {
+        ms.lane_writes[l] = __atomic_load_n(&st->lane_writes[l], __ATOMIC_RELAXED);
+        for (int b = 0; b < MONITOR_LAT_BUCKETS; b++) {
+            ms.lane_wait[l][b] = __atomic_load_n(&st->lane_wait_hist[l][b], __ATOMIC_RELAXED);
+        }
+    }
+    
+    for (int r = 0; r < MAX_TRACKED_ROOMS; r++) {
+        RoomEntry *room = &shm_buffer->rooms[r];
+        if (room->name[0] == '\0') continue;
+        MonitorRoom *mr = &ms.room[ms.rooms++];
+        memcpy(mr->name, room->name, ROOM_NAME_LEN);
+        mr->members = room->member_count;
+        RoomSeq *rs = room_seq_find(room->name);
+        mr->messages = rs ? rs->seq : 0;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    /* Children shed at admission, where no event can be told apart from the next: one per snapshot */
+    unsigned long shed[4] = { ms.rate_limited, ms.queue_full_drops, ms.room_budget_drops, ms.notices_dropped };
+    unsigned long delta[4], total = 0;
+    for (int i = 0; i < 4; i++) {
+        delta[i] = shed[i] - monitor_shed_seen[i];
+        total += delta[i];
+        monitor_shed_seen[i] = shed[i];
+    }
+    if (total > 0) {
+        monitor_event(monitor, MON_SHED, (int64_t)total, "rate %lu full %lu budget %lu notice %lu",
+                      delta[0], delta[1], delta[2], delta[3]);
+    }
+    
+    monitor_publish(monitor, &ms);
+    tw_arm(&timer_wheel, node, MONITOR_PUBLISH_MS, on_monitor_publish, NULL);
+}
+
+/* After init_timers(): publishing runs off the timer wheel */
+void init_monitor() {
+    const char *env_name = getenv("NETCHAT_MONITOR");
+    if (env_name) snprintf(monitor_name, sizeof(monitor_name), "%s", env_name);
+    if (monitor_name[0] == '\0') {
+        printf("[Monitor]: Disabled\n");
+        return;
+    }
+    
+    monitor = monitor_create(monitor_name);
+    if (!monitor) {
+        perror("Monitor shared memory");
+        return;
+    }
+    monitor_started_ms = wall_ms();
+    
+    /* Shedding before this start is not news */
+    shm_lock_acquire();
+    monitor_shed_seen[0] = shm_buffer->stats.rate_limited_msgs;
+    monitor_shed_seen[1] = shm_buffer->stats.queue_full_drops;
+    monitor_shed_seen[2] = shm_buffer->stats.room_budget_drops;
+    monitor_shed_seen[3] = shm_buffer->stats.notices_dropped;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    tw_node_init(&monitor_timer);
+    on_monitor_publish(&monitor_timer, NULL);
+    printf("[Monitor]: Publishing to /dev/shm%s every %d ms; watch with tools/netchat-top\n",
+           monitor_name, MONITOR_PUBLISH_MS);
+}
+
+/* ========= SEMAPHORE FUNCTIONS ========= */
+
+/* Initialize semaphore */
+void init_semaphore() {
+    /* Unlink first in case it exists from crashed previous run */
+    sem_unlink("/netchat_sem");
+    
+    connection_sem = sem_open("/netchat_sem", O_CREAT, 0666, MAX_CLIENTS);
+    if (connection_sem == SEM_FAILED) {
+        perror("sem_open failed");
+        exit(1);
+    }
+    printf("[SYNC]: Semaphore initialized (max connections: %d)\n", MAX_CLIENTS);
+}
+
+/* Cleanup semaphore */
+void cleanup_semaphore() {
+    sem_close(connection_sem);
+    sem_unlink("/netchat_sem");
+    printf("[SYNC]: Semaphore cleaned up\n");
+}
+
+/* ========= CONNECTION TIMERS (parent only) ========= */
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Caller must hold shm_lock */
+int find_client_by_fd(int fd) {
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+/* Record that the peer is alive (child, after every recv) */
+void touch_activity(int client_fd) {
+    shm_lock_acquire();
+    int idx = find_client_by_fd(client_fd);
+    if (idx >= 0) {
+        shm_buffer->clients[idx].last_activity_ms = monotonic_ms();
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+}
+
+/* Charge one inbound message against the sender's buckets (child); 0 = over the limit */
+int admit_message(int client_fd, size_t bytes) {
+    int allowed = 1;
+    long byte_cost = (long)bytes * TOKEN_SCALE;
+    
+    shm_lock_acquire();
+    int idx = find_client_by_fd(client_fd);
+    if (idx >= 0) {
+        SharedClient *c = &shm_buffer->clients[idx];
+        c->last_activity_ms = monotonic_ms();
+        if (c->msg_tokens >= TOKEN_SCALE && c->byte_tokens >= byte_cost) {
+            c->msg_tokens -= TOKEN_SCALE;
+            c->byte_tokens -= byte_cost;
+        } else {
+            allowed = 0;
+            shm_buffer->stats.rate_limited_msgs++;
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    return allowed;
+}
+
+void session_close(ParentSession *ps) {
+    tw_cancel(&timer_wheel, &ps->login_timer);
+    tw_cancel(&timer_wheel, &ps->idle_timer);
+    ps->active = 0;
+    ps->bridge = 0;
+    for (int l = 0; l < LANES; l++) {
+        free(ps->lanes[l].buf);
+        ps->lanes[l].buf = NULL;
+        ps->lanes[l].cap = 0;
+    }
+    session_discard_output(ps);
+    ps->control_turns = 0;
+    free(ps->child_out);
+    ps->child_out = NULL;
+    ps->child_out_len = 0;
+}
+
+/* Tell the peer why and shut the socket down; the child sees EOF and exits */
+void drop_connection(ParentSession *ps, const char *reason) {
+    shm_lock_acquire();
+    deliver_text(ps->fd, reason, strlen(reason));
+    if (ps->websocket) {
+        static const uint8_t close_frame[] = { 0x88, 0x02, 0x03, 0xE8 };  // 1000 normal closure
+        deliver_to_client(ps->fd, (const char *)close_frame, sizeof(close_frame));
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    shutdown(ps->fd, SHUT_RDWR);
+    session_close(ps);
+}
+
+void on_login_deadline(TimerNode *node, void *arg) {
+    (void)node;
+    ParentSession *ps = arg;
+    
+    shm_lock_acquire();
+    int idx = find_client_by_fd(ps->fd);
+    int authenticated = (idx >= 0) ? shm_buffer->clients[idx].authenticated : 0;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    if (idx < 0) {
+        session_close(ps);
+    } else if (!authenticated) {
+        printf("[Timer]: Login deadline expired for fd %d\n", ps->fd);
+        drop_connection(ps, "ERROR: Login timed out. Disconnecting...\n");
+    }
+}
+
+void on_idle_check(TimerNode *node, void *arg) {
+    (void)node;
+    ParentSession *ps = arg;
+    
+    shm_lock_acquire();
+    int idx = find_client_by_fd(ps->fd);
+    uint64_t last = (idx >= 0) ? shm_buffer->clients[idx].last_activity_ms : 0;
+    int bridge = (idx >= 0) ? shm_buffer->clients[idx].bridge : 0;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    if (idx < 0) {
+        session_close(ps);
+        return;
+    }
+    
+    /* The gateway's stream is framed: a [PING] line would corrupt it. EOF is enough. */
+    if (bridge) {
+        tw_arm(&timer_wheel, &ps->idle_timer, IDLE_TIMEOUT_MS, on_idle_check, ps);
+        return;
+    }
+    
+    uint64_t now = monotonic_ms();
+    
+    if (ps->ping_outstanding) {
+        if (last < ps->ping_sent_ms) {
+            printf("[Timer]: No heartbeat from fd %d, dropping\n", ps->fd);
+            drop_connection(ps, "[Server]: Connection timed out.\n");
+            return;
+        }
+        ps->ping_outstanding = 0;
+    }
+    
+    uint64_t idle = now > last ? now - last : 0;
+    if (idle >= IDLE_TIMEOUT_MS) {
+        /* Application-level heartbeat: the client answers with /pong (or a pong frame) */
+        static const uint8_t ping_frame[] = { 0x89, 0x00 };
+        shm_lock_acquire();
+        if (ps->websocket) {
+            deliver_to_client(ps->fd, (const char *)ping_frame, sizeof(ping_frame));
+        } else {
+            deliver_to_client(ps->fd, "[PING]\n", 7);
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        ps->ping_outstanding = 1;
+        ps->ping_sent_ms = now;
+        tw_arm(&timer_wheel, &ps->idle_timer, PING_GRACE_MS, on_idle_check, ps);
+    } else {
+        tw_arm(&timer_wheel, &ps->idle_timer, IDLE_TIMEOUT_MS - idle, on_idle_check, ps);
+    }
+}
+
+void on_offline_sweep(TimerNode *node, void *arg) {
+    (void)arg;
+    expire_offline_messages();
+    tw_arm(&timer_wheel, node, OFFLINE_SWEEP_MS, on_offline_sweep, NULL);
+}
+
+/* Token bucket refill for every connection and room budget; half rate while throttling */
+void on_rate_refill(TimerNode *node, void *arg) {
+    (void)arg;
+    shm_lock_acquire();
+    
+    int divisor = (shm_buffer->overload_level >= 2) ? 2 : 1;
+    long msg_add = (long)RATE_MSGS_PER_SEC * TOKEN_SCALE * RATE_REFILL_MS / 1000 / divisor;
+    long byte_add = (long)RATE_BYTES_PER_SEC * TOKEN_SCALE * RATE_REFILL_MS / 1000 / divisor;
+    
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        SharedClient *c = &shm_buffer->clients[i];
+        c->msg_tokens += msg_add;
+        if (c->msg_tokens > (long)RATE_MSG_BURST * TOKEN_SCALE) c->msg_tokens = (long)RATE_MSG_BURST * TOKEN_SCALE;
+        c->byte_tokens += byte_add;
+        if (c->byte_tokens > (long)RATE_BYTE_BURST * TOKEN_SCALE) c->byte_tokens = (long)RATE_BYTE_BURST * TOKEN_SCALE;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    long room_add = (long)ROOM_FANOUT_PER_SEC * TOKEN_SCALE * RATE_REFILL_MS / 1000 / divisor;
+    for (int i = 0; i < MAX_TRACKED_ROOMS; i++) {
+        room_budgets[i].tokens += room_add;
+        if (room_budgets[i].tokens > (long)ROOM_FANOUT_BURST * TOKEN_SCALE) {
+            room_budgets[i].tokens = (long)ROOM_FANOUT_BURST * TOKEN_SCALE;
+        }
+    }
+    
+    tw_arm(&timer_wheel, node, RATE_REFILL_MS, on_rate_refill, NULL);
+}
+
+/* Map queue depth and loop latency to an overload level; step down one level at a time */
+void on_overload_check(TimerNode *node, void *arg) {
+    (void)arg;
+    shm_lock_acquire();
+    
+    /* Depth is whichever the queue ran shorter of: slots or arena bytes */
+    int depth_pct = shm_buffer->stats.queue_high_water * 100 / MAX_BROADCAST_QUEUE;
+    int bytes_pct = (int)((uint64_t)shm_buffer->queue_arena.high_water * 100 / QUEUE_ARENA_BYTES);
+    if (bytes_pct > depth_pct) depth_pct = bytes_pct;
+    int latency = __atomic_exchange_n(&shm_buffer->stats.loop_latency_ms, 0, __ATOMIC_RELAXED);  // Read and restart
+    int target = 0;
+    
+    if (depth_pct >= 90 || latency >= 100) target = 3;
+    else if (depth_pct >= 75 || latency >= 50) target = 2;
+    else if (depth_pct >= 50 || latency >= 20) target = 1;
+    
+    int level = shm_buffer->overload_level;
+    if (target > level) level = target;
+    else if (target < level) level--;
+    
+    monitor_note_load(shm_buffer->stats.queue_high_water, shm_buffer->overload_level, level,
+                      depth_pct, latency);
+    if (level != shm_buffer->overload_level) {
+        printf("[Load]: Overload level %d -> %d (queue high-water %d%%, loop %d ms)\n",
+               shm_buffer->overload_level, level, depth_pct, latency);
+        shm_buffer->overload_level = level;
+        shm_buffer->stats.overload_transitions++;
+    }
+    
+    shm_buffer->stats.queue_high_water = shm_buffer->broadcast_count;
+    arena_reset_high_water(&shm_buffer->queue_arena);
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    tw_arm(&timer_wheel, node, OVERLOAD_CHECK_MS, on_overload_check, NULL);
+}
+
+/* Start the login deadline and idle heartbeat for a freshly accepted socket */
+void session_open(int fd, int websocket) {
+    if (fd < 0 || fd >= parent_session_cap) return;
+    
+    ParentSession *ps = &parent_sessions[fd];
+    session_close(ps);
+    ps->fd = fd;
+    ps->active = 1;
+    ps->pid = 0;
+    ps->websocket = websocket;
+    ps->seq_tags = 0;
+    ps->ping_outstanding = 0;
+    ps->out_lane = -1;
+    tw_arm(&timer_wheel, &ps->login_timer, LOGIN_TIMEOUT_MS, on_login_deadline, ps);
+    tw_arm(&timer_wheel, &ps->idle_timer, IDLE_TIMEOUT_MS, on_idle_check, ps);
+}
+
+void init_timers() {
+    struct rlimit rl;
+    parent_session_cap = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        parent_session_cap = (int)rl.rlim_cur;
+    }
+    
+    parent_sessions = calloc(parent_session_cap, sizeof(ParentSession));
+    if (!parent_sessions) {
+        perror("calloc sessions failed");
+        exit(1);
+    }
+    for (int i = 0; i < parent_session_cap; i++) {
+        tw_node_init(&parent_sessions[i].login_timer);
+        tw_node_init(&parent_sessions[i].idle_timer);
+    }
+    
+    tw_init(&timer_wheel, monotonic_ms(), TIMER_TICK_MS);
+    tw_node_init(&offline_sweep_timer);
+    tw_arm(&timer_wheel, &offline_sweep_timer, OFFLINE_SWEEP_MS, on_offline_sweep, NULL);
+    tw_node_init(&rate_refill_timer);
+    tw_arm(&timer_wheel, &rate_refill_timer, RATE_REFILL_MS, on_rate_refill, NULL);
+    tw_node_init(&overload_timer);
+    tw_arm(&timer_wheel, &overload_timer, OVERLOAD_CHECK_MS, on_overload_check, NULL);
+    tw_node_init(&receipt_timer);
+    tw_arm(&timer_wheel, &receipt_timer, RECEIPT_FLUSH_MS, on_receipt_flush, NULL);
+    const char *env_presence_ms = getenv("NETCHAT_PRESENCE_MS");
+    if (env_presence_ms && atoi(env_presence_ms) > 0) presence_window_ms = atoi(env_presence_ms);
+    tw_node_init(&presence_timer);
+    tw_arm(&timer_wheel, &presence_timer, presence_window_ms, on_presence_flush, NULL);
+    printf("[TIMER]: Timer wheel initialized (tick %d ms, %d session slots)\n",
+           TIMER_TICK_MS, parent_session_cap);
+}
+
+/* ========= MESSAGE RENDERING ========= */
+
+/* Cached "[HH:MM:SS]" for the calling thread; localtime/strftime run once per second */
+const char *cached_clock(size_t *len) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    
+    if (now.tv_sec != clock_cache.second) {
+        struct tm t;
+        localtime_r(&now.tv_sec, &t);
+        clock_cache.len = strftime(clock_cache.text, sizeof(clock_cache.text), "[%H:%M:%S]", &t);
+        clock_cache.second = now.tv_sec;
+    }
+    
+    if (len) *len = clock_cache.len;
+    return clock_cache.text;
+}
+
+void render_set_user(RenderFragments *frag, const char *username) {
+    int n = snprintf(frag->user_part, sizeof(frag->user_part), "%s: ", username);
+    frag->user_len = (n < 0) ? 0 : ((size_t)n < sizeof(frag->user_part) ? (size_t)n : sizeof(frag->user_part) - 1);
+}
+
+void render_set_room(RenderFragments *frag, const char *room) {
+    int n = snprintf(frag->room_part, sizeof(frag->room_part), " [#%.*s] ", ROOM_NAME_LEN - 1, room);
+    frag->room_len = (n < 0) ? 0 : ((size_t)n < sizeof(frag->room_part) ? (size_t)n : sizeof(frag->room_part) - 1);
+}
+
+/* Append raw bytes to a rendered message, truncating at capacity */
+static void render_append(RenderedMessage *out, const char *data, size_t len) {
+    size_t room_left = sizeof(out->text) - 1 - out->len;
+    if (len > room_left) len = room_left;
+    memcpy(out->text + out->len, data, len);
+    out->len += len;
+    out->text[out->len] = '\0';
+}
+
+/* "[HH:MM:SS] [#room] user: body" assembled with memcpy from cached pieces */
+void render_chat_line(RenderedMessage *out, const RenderFragments *frag,
+                      const char *body, size_t body_len) {
+    size_t clock_len;
+    const char *clock = cached_clock(&clock_len);
+    
+    out->len = 0;
+    render_append(out, clock, clock_len);
+    render_append(out, frag->room_part, frag->room_len);
+    render_append(out, frag->user_part, frag->user_len);
+    out->body_offset = out->len;
+    render_append(out, body, body_len);
+}
+
+/* "<tag><from>]: body\n" for private messages and their confirmations */
+void render_pm_line(RenderedMessage *out, const char *tag, const char *peer, const char *body) {
+    out->len = 0;
+    render_append(out, tag, strlen(tag));
+    render_append(out, peer, strlen(peer));
+    render_append(out, "]: ", 3);
+    out->body_offset = out->len;
+    render_append(out, body, strlen(body));
+    if (out->len == sizeof(out->text) - 1) out->len--;  // Keep room for the newline
+    render_append(out, "\n", 1);
+}
+
+/* ========= LOG ROTATION =========
+ * Every process appends to chat.log, the parent and each child through its
+ * own FILE. All of them write under log_lock in shared memory, so once the
+ * parent has moved chat.log into the archive under that lock, nothing can
+ * still be adding to the segment the compressor is about to read. A writer
+ * that finds log_generation moved on reopens chat.log before its line.
+ */
+
+LogArchive *log_archive = NULL;  // Parent only; NULL when rotation is off
+const char *log_archive_dir = LOG_ARCHIVE_DIR;
+uint64_t log_rotate_bytes = LOG_ROTATE_BYTES;
+int log_rotate_sec = LOG_ROTATE_SEC;
+time_t log_opened = 0;           // When chat.log last started empty, as near as we know
+TimerNode log_rotate_timer;
+
+void log_acquire() {
+    if (!shm_buffer) {
+        pthread_mutex_lock(&lock);
+        return;
+    }
+    if (pthread_mutex_lock(&shm_buffer->log_lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shm_buffer->log_lock);  // Its owner died mid-line; the file is still good
+    }
+    if (log_generation != shm_buffer->log_generation) {
+        FILE *fresh = fopen(LOG_FILE, "a");
+        if (fresh) {
+            if (log_file) fclose(log_file);
+            log_file = fresh;
+        }
+        log_generation = shm_buffer->log_generation;
+    }
+}
+
+void log_release() {
+    pthread_mutex_unlock(shm_buffer ? &shm_buffer->log_lock : &lock);
+}
+
+void rotate_log(off_t size) {
+    uint32_t seq = 0;
+    log_acquire();
+    FILE *fresh = log_archive_rotate(log_archive, LOG_FILE, &seq);
+    if (fresh) {
+        fclose(log_file);
+        log_file = fresh;
+        log_generation = ++shm_buffer->log_generation;
+    }
+    log_release();
+    
+    if (!fresh) {
+        perror("chat.log rotation failed");
+        return;
+    }
+    log_opened = time(NULL);
+    printf("[Log]: chat.log (%.1f MB) rotated into %s/chat-%06u.log for compression\n",
+           size / (1024.0 * 1024.0), log_archive_dir, seq);
+}
+
+void on_log_rotate_check(TimerNode *node, void *arg) {
+    (void)arg;
+    struct stat st;
+    time_t now = time(NULL);
+    if (log_file && fstat(fileno(log_file), &st) == 0) {
+        if (st.st_size == 0) {
+            log_opened = now;  // Age counts from the first line, not from the last rotation
+        } else if ((uint64_t)st.st_size >= log_rotate_bytes || now - log_opened >= log_rotate_sec) {
+            rotate_log(st.st_size);
+        }
+    }
+    tw_arm(&timer_wheel, node, LOG_CHECK_MS, on_log_rotate_check, NULL);
+}
+
+void init_log_rotation() {
+    const char *env_dir = getenv("NETCHAT_LOG_DIR");
+    const char *env_bytes = getenv("NETCHAT_LOG_MAX_BYTES");
+    const char *env_age = getenv("NETCHAT_LOG_MAX_AGE");
+    if (env_dir) log_archive_dir = env_dir;
+    if (env_bytes && strtoull(env_bytes, NULL, 10) > 0) log_rotate_bytes = strtoull(env_bytes, NULL, 10);
+    if (env_age && atoi(env_age) > 0) log_rotate_sec = atoi(env_age);
+    if (log_archive_dir[0] == '\0' || !log_file) return;
+    
+    log_archive = log_archive_open(log_archive_dir, log_rotate_bytes);
+    if (!log_archive) {
+        perror("Log archive unavailable");
+        return;
+    }
+    log_opened = log_archive_last_rotation(log_archive);
+    if (log_opened == 0) log_opened = time(NULL);
+    tw_node_init(&log_rotate_timer);
+    tw_arm(&timer_wheel, &log_rotate_timer, LOG_CHECK_MS, on_log_rotate_check, NULL);
+    
+    int archives, pending;
+    uint64_t raw, gz;
+    log_archive_info(log_archive, &archives, &pending, &raw, &gz);
+    printf("[Log]: chat.log rotates at %.1f MB or after %d s into %s/ "
+           "(%d archives, %.1f MB gzipped to %.1f MB, %d segments to compress)\n",
+           log_rotate_bytes / (1024.0 * 1024.0), log_rotate_sec, log_archive_dir, archives,
+           raw / (1024.0 * 1024.0), gz / (1024.0 * 1024.0), pending);
+}
+
+/* ========= EXISTING FUNCTIONS (with enhancements) ========= */
+
+void get_timestamp(char *buffer, size_t size) {
+    size_t len;
+    const char *clock = cached_clock(&len);
+    if (len >= size) len = size - 1;
+    memcpy(buffer, clock, len);
+    buffer[len] = '\0';
+}
+
+void log_message(const char *message) {
+    if (!log_file) return;  // Safety check
+    
+    log_acquire();
+    if (log_file) {
+        fputs(cached_clock(NULL), log_file);
+        fputc(' ', log_file);
+        fputs(message, log_file);
+        fflush(log_file);
+    }
+    log_release();
+    
+    /* Also write to shared memory (disabled for stability) */
+    // write_to_shared_memory(message);
+}
+
+/* Log an already time-stamped line without stamping it again */
+void log_rendered(const RenderedMessage *rendered) {
+    if (!log_file) return;
+    
+    log_acquire();
+    if (log_file) {
+        fwrite(rendered->text, 1, rendered->len, log_file);
+        fflush(log_file);
+    }
+    log_release();
+}
+
+void broadcast(char *message, int sender_fd) {
+    /* Child process: queue for parent to broadcast */
+    if (getpid() != shm_buffer->parent_pid) {
+        queue_broadcast(message, strlen(message), sender_fd, -1, "general", 0, BCAST_PRIO_CHAT, NULL);
+    } else {
+        /* Parent process: broadcast directly */
+        shm_lock_acquire();
+        for (int i = 0; i < shm_buffer->client_count; i++) {
+            if (shm_buffer->clients[i].fd != sender_fd) {
+                deliver_text(shm_buffer->clients[i].fd, message, strlen(message));
+            }
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+    }
+}
+
+void broadcast_all(char *message) {
+    /* Child process: queue for parent to broadcast */
+    if (getpid() != shm_buffer->parent_pid) {
+        queue_broadcast(message, strlen(message), -1, -1, "", 1, BCAST_PRIO_CHAT, NULL);
+    } else {
+        /* Parent process: broadcast directly */
+        shm_lock_acquire();
+        for (int i = 0; i < shm_buffer->client_count; i++) {
+            if (shm_buffer->clients[i].bridge) continue;
+            deliver_text(shm_buffer->clients[i].fd, message, strlen(message));
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+    }
+}
+
+/* ev describes the message for WebSocket recipients; NULL for server text */
+int broadcast_room_len(const char *message, size_t len, int sender_fd, const char *room,
+                       const EventInfo *ev) {
+    /* Child process: queue for parent to broadcast */
+    if (getpid() != shm_buffer->parent_pid) {
+        return queue_broadcast(message, len, sender_fd, -1, room, 0, BCAST_PRIO_CHAT, ev);
+    } else {
+        /* Parent process: broadcast directly */
+        shm_lock_acquire();
+        int r = room_find(room);
+        for (int m = r >= 0 ? room_next_member(&shm_buffer->rooms[r], 0) : -1;
+             m >= 0 && m < MAX_CLIENTS; m = room_next_member(&shm_buffer->rooms[r], m + 1)) {
+            if (shm_buffer->slot_fd[m] != sender_fd) {
+                deliver_text(shm_buffer->slot_fd[m], message, len);
+            }
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        return 1;
+    }
+}
+
+void broadcast_room(char *message, int sender_fd, const char *room) {
+    broadcast_room_len(message, strlen(message), sender_fd, room, NULL);
+}
+
+/* Join/leave/disconnect notices: sheddable under load. room == NULL means everyone */
+void broadcast_notice(char *message, const char *room) {
+    if (getpid() != shm_buffer->parent_pid) {
+        queue_broadcast(message, strlen(message), -1, -1, room ? room : "",
+                        room ? 0 : 1, BCAST_PRIO_NOTICE, NULL);
+    } else if (room) {
+        broadcast_room(message, -1, room);
+    } else {
+        broadcast_all(message);
+    }
+}
+
+int send_private_message(const char *target_username, const char *message, const char *sender, int sender_fd) {
+    int target_fd = -1;
+    uint32_t target_channel = 0;
+    
+    shm_lock_acquire();
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (strcmp(shm_buffer->clients[i].username, target_username) == 0) {
+            target_fd = shm_buffer->clients[i].fd;
+            break;
+        }
+    }
+    for (int i = 0; target_fd < 0 && i < BRIDGE_MAX_CHANNELS; i++) {
+        BridgeChannel *ch = &shm_buffer->channels[i];
+        if (ch->active && strcmp(ch->username, target_username) == 0) {
+            target_fd = ch->bridge_fd;
+            target_channel = ch->id;
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    /* Deliver through the parent: only it holds every client's socket */
+    if (target_fd >= 0) {
+        RenderedMessage pm;
+        render_pm_line(&pm, "[PM from ", sender, message);
+        EventInfo ev = { EVENT_PM, sender, pm.body_offset, target_channel, 0, 0 };
+        queue_broadcast(pm.text, pm.len, sender_fd, target_fd, "", 3, BCAST_PRIO_CHAT, &ev);
+        return 1;
+    }
+    
+    /* If user not found, queue message for offline delivery */
+    char offline_msg[BUFFER_SIZE];
+    snprintf(offline_msg, sizeof(offline_msg), "From %s: %s", sender, message);
+    queue_offline_message(target_username, offline_msg, 1);  // Priority = 1 for PMs
+    return 0;
+}
+
+int register_user(const char *username, const char *password) {
+    char clean_user[50];
+    char clean_pass[50];
+    
+    strncpy(clean_user, username, sizeof(clean_user) - 1);
+    clean_user[sizeof(clean_user) - 1] = '\0';
+    clean_user[strcspn(clean_user, "\n\r:")] = '\0';
+    
+    strncpy(clean_pass, password, sizeof(clean_pass) - 1);
+    clean_pass[sizeof(clean_pass) - 1] = '\0';
+    clean_pass[strcspn(clean_pass, "\n\r:")] = '\0';
+    
+    if (strlen(clean_user) == 0 || strlen(clean_pass) == 0) {
+        return 0;
+    }
+    
+    FILE *file = fopen(USERS_FILE, "a");
+    if (!file) {
+        perror("Failed to open users file");
+        return 0;
+    }
+    
+    fprintf(file, "%s:%s\n", clean_user, clean_pass);
+    fclose(file);
+    
+    char log_msg[BUFFER_SIZE];
+    snprintf(log_msg, sizeof(log_msg), "[Server]: New user registered: %s\n", clean_user);
+    log_message(log_msg);
+    printf("%s", log_msg);
+    
+    return 1;
+}
+
+int authenticate_user(const char *username, const char *password) {
+    char clean_user[50];
+    char clean_pass[50];
+    
+    strncpy(clean_user, username, sizeof(clean_user) - 1);
+    clean_user[sizeof(clean_user) - 1] = '\0';
+    clean_user[strcspn(clean_user, "\n\r:")] = '\0';
+    
+    strncpy(clean_pass, password, sizeof(clean_pass) - 1);
+    clean_pass[sizeof(clean_pass) - 1] = '\0';
+    clean_pass[strcspn(clean_pass, "\n\r:")] = '\0';
+    
+    FILE *file = fopen(USERS_FILE, "r");
+    if (!file) {
+        return register_user(clean_user, clean_pass);
+    }
+    
+    char line[256];
+    char stored_user[50];
+    char stored_pass[50];
+    
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n\r")] = 0;
+        
+        if (sscanf(line, "%49[^:]:%49s", stored_user, stored_pass) == 2) {
+            if (strcmp(stored_user, clean_user) == 0) {
+                fclose(file);
+                if (strcmp(stored_pass, clean_pass) == 0) {
+                    return 1;
+                } else {
+                    return -1;
+                }
+            }
+        }
+    }
+    
+    fclose(file);
+    return register_user(clean_user, clean_pass);
+}
+
+void handle_shutdown(int sig) {
+    (void)sig;
+    server_running = 0;
+    
+    /* We reap children ourselves below; keep handle_sigchld from racing us for shm_lock */
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+    
+    printf("\n\n╔════════════════════════════════════════════════════════════════╗\n");
+    printf("║              GRACEFUL SHUTDOWN IN PROGRESS...                ║\n");
+    printf("╚════════════════════════════════════════════════════════════════╝\n\n");
+    
+    char *msg = "\n[Server]: Server is shutting down. Goodbye!\n";
+    broadcast_all(msg);
+    log_message(msg);
+    
+    printf("[Shutdown]: Broadcasting shutdown message to all clients...\n");
+    
+    /* A snapshot writer is no client: it must not be counted below */
+    if (snapshot_pid > 0) {
+        int status;
+        if (waitpid(snapshot_pid, &status, 0) == snapshot_pid) snapshot_finished(status);
+    }
+    
+    shm_lock_acquire();
+    int child_count = 0;
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        close(shm_buffer->clients[i].fd);
+        if (shm_buffer->clients[i].process_id > 0) {
+            kill(shm_buffer->clients[i].process_id, SIGTERM);
+            child_count++;
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    printf("[Shutdown]: Waiting for %d child processes to exit...\n", child_count);
+    
+    /* Wait for all child processes */
+    while (child_count > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            child_count--;
+        } else {
+            usleep(100000);  // 100ms
+        }
+    }
+    
+    printf("[Shutdown]: All child processes terminated\n");
+    
+    /* Nothing changes any more: save it before the queue and shared memory go */
+    snapshot_final();
+    
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    log_archive_close(log_archive);  // A segment it was compressing is picked up at the next start
+    
+    /* Cleanup IPC resources */
+    printf("[Shutdown]: Cleaning up IPC resources...\n");
+    cleanup_shared_memory();
+    cleanup_message_queue();
+    cleanup_semaphore();
+    if (monitor) monitor_remove(monitor_name);
+    
+    close(server_fd_global);
+    if (ws_fd_global >= 0) close(ws_fd_global);
+    if (unix_fd_global >= 0) {
+        close(unix_fd_global);
+        unlink(unix_path_global);
+    }
+    http_static_stop(http_server);
+    if (http_fd_global >= 0) close(http_fd_global);
+    if (upgrade_listen_fd >= 0) {
+        close(upgrade_listen_fd);
+        unlink(UPGRADE_SOCKET_PATH);
+    }
+    pthread_mutex_destroy(&lock);
+    
+    printf("\n╔════════════════════════════════════════════════════════════════╗\n");
+    printf("║         SHUTDOWN COMPLETE - ALL RESOURCES CLEANED UP         ║\n");
+    printf("╚════════════════════════════════════════════════════════════════╝\n\n");
+    exit(0);
+}
+
+/* Handle child process termination */
+void handle_sigchld(int sig) {
+    (void)sig;
+    int status;
+    pid_t pid;
+    
+    /* Reap all terminated children */
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int found = 0;
+        
+        if (pid == snapshot_pid) {
+            snapshot_finished(status);
+            continue;
+        }
+        
+        /* Find and remove client from shared memory */
+        shm_lock_acquire();
+        for (int i = 0; i < shm_buffer->client_count; i++) {
+            if (shm_buffer->clients[i].process_id == pid) {
+                found = 1;
+                /* Close the socket in parent and free its connection slot */
+                int fd = shm_buffer->clients[i].fd;
+                monitor_event(monitor, MON_DISCONNECT, pid, "fd %d pid %d %s", fd, (int)pid,
+                              shm_buffer->clients[i].username[0] ? shm_buffer->clients[i].username : "-");
+                if (shm_buffer->clients[i].bridge) {
+                    bridge_drop_channels(fd);
+                }
+                close(fd);
+                sem_post(connection_sem);
+                if (fd >= 0 && fd < parent_session_cap) {
+                    session_close(&parent_sessions[fd]);
+                    parent_sessions[fd].pid = 0;
+                }
+                
+                remove_client_at(i);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        
+        /* A clean logout removes its own entry first: find the socket by pid instead */
+        for (int fd = 0; !found && fd < parent_session_cap; fd++) {
+            ParentSession *ps = &parent_sessions[fd];
+            if (ps->pid == pid) {
+                monitor_event(monitor, MON_DISCONNECT, pid, "fd %d pid %d, left cleanly", fd, (int)pid);
+                close(fd);
+                sem_post(connection_sem);
+                session_close(ps);
+                ps->pid = 0;
+                found = 1;
+            }
+        }
+    }
+}
+
+/* ========= CHILD SOCKET I/O =========
+ * Client sockets are accepted non-blocking so the parent can never stall on them.
+ * The open file description is shared with the child, which waits in poll() instead.
+ */
+
+/* SIGUSR2 from the parent: a new binary is taking over this connection */
+void handle_upgrade_signal(int sig) {
+    (void)sig;
+    upgrade_exit_requested = 1;
+}
+
+/* SIGUSR2 stays blocked outside recv, so it may be waiting rather than delivered */
+static int upgrade_pending(void) {
+    sigset_t pending;
+    return upgrade_exit_requested || (sigpending(&pending) == 0 && sigismember(&pending, SIGUSR2));
+}
+
+/* Between messages is the only safe point to hand a socket over: nothing is half-read */
+static void exit_if_upgrading(void) {
+    if (child_input_partial || !upgrade_pending()) return;
+    _exit(0);  // No cleanup: the session lives on in the new process
+}
+
+ssize_t recv_blocking(int fd, void *buf, size_t len) {
+    sigset_t wait_mask;
+    sigprocmask(SIG_SETMASK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR2);
+    
+    for (;;) {
+        exit_if_upgrading();
+        TRACE_STAMP(recv_start);
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n > 0) TRACE_NOTE_RECV(recv_start, n);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        
+        /* SIGUSR2 is unblocked only while we sleep here */
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (ppoll(&pfd, 1, NULL, &wait_mask) < 0 && errno != EINTR) return -1;
+    }
+}
+
+/* Terminal input one line at a time: a client may put several commands in one segment.
+   Input without a newline is returned as it came, so nothing is held across a recv. */
+char tcp_inbuf[BUFFER_SIZE];
+size_t tcp_in_len = 0;
+
+ssize_t tcp_next_line(int fd, char *buf, size_t cap) {
+    if (tcp_in_len == 0) {
+        ssize_t n = recv_blocking(fd, tcp_inbuf, sizeof(tcp_inbuf));
+        if (n <= 0) return n;
+        tcp_in_len = (size_t)n;
+    }
+    
+    char *nl = memchr(tcp_inbuf, '\n', tcp_in_len);
+    size_t take = nl ? (size_t)(nl - tcp_inbuf) + 1 : tcp_in_len;
+    if (take > cap) take = cap;
+    memcpy(buf, tcp_inbuf, take);
+    memmove(tcp_inbuf, tcp_inbuf + take, tcp_in_len - take);
+    tcp_in_len -= take;
+    return (ssize_t)take;
+}
+
+ssize_t send_blocking(int fd, const void *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        return -1;
+    }
+    return (ssize_t)sent;
+}
+
+/* The socket is the child's to write while the parent has nothing queued for it.
+   1 = claimed (the parent skips it until released), 0 = parent output pending,
+   -1 = the connection is not in the table (nothing to coordinate with). */
+int child_claim_socket(int fd) {
+    shm_lock_acquire();
+    int idx = find_client_by_fd(fd);
+    int claimed = idx < 0 ? -1 : (!shm_buffer->clients[idx].out_pending && !shm_buffer->clients[idx].handoff_pending);
+    if (claimed == 1) shm_buffer->clients[idx].child_writing = 1;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    return claimed;
+}
+
+void child_release_socket(int fd) {
+    shm_lock_acquire();
+    int behind = 0;
+    int idx = find_client_by_fd(fd);
+    if (idx >= 0) {
+        shm_buffer->clients[idx].child_writing = 0;
+        behind = shm_buffer->clients[idx].out_pending;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    if (behind && shm_buffer->parent_pid > 0) kill(shm_buffer->parent_pid, SIGUSR1);  // Parent held off for us
+}
+
+/* Child write to its own client. While the parent has output queued for this
+   connection, writing directly would jump the lanes (or land inside a half-sent
+   frame), so the bytes are handed to the parent's control lane instead. */
+ssize_t child_send(int fd, const void *buf, size_t len) {
+    int claimed = child_claim_socket(fd);
+    if (claimed != 0) {
+        ssize_t n = send_blocking(fd, buf, len);
+        if (claimed == 1) child_release_socket(fd);
+        return n;
+    }
+    
+    /* Once the first chunk is queued the rest must follow, or the parent would hold a torn write */
+    const char *p = buf;
+    size_t left = len;
+    int started = 0;
+    uint64_t deadline = monotonic_ms() + CHILD_REPLY_WAIT_MS;
+    EventInfo ev = { EVENT_RAW, NULL, 0, 0, 0, 0 };
+    while (left > 0) {
+        size_t chunk = left < BUFFER_SIZE - 1 ? left : BUFFER_SIZE - 1;
+        ev.more = chunk < left;
+        
+        shm_lock_acquire();
+        int space = shm_buffer->lane_count[LANE_CONTROL] < CONTROL_QUEUE_SLOTS;
+        int idx = find_client_by_fd(fd);
+        if (space && idx >= 0) shm_buffer->clients[idx].handoff_pending++;
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        if (idx < 0) return -1;
+        
+        if (space && queue_broadcast(p, chunk, fd, fd, "", 3, BCAST_PRIO_CHAT, &ev)) {
+            started = 1;
+            p += chunk;
+            left -= chunk;
+            continue;
+        }
+        if (space) {
+            shm_lock_acquire();
+            idx = find_client_by_fd(fd);
+            if (idx >= 0) shm_buffer->clients[idx].handoff_pending--;
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+        }
+        if (!started && monotonic_ms() >= deadline) return -1;
+        usleep(1000);
+    }
+    return (ssize_t)len;
+}
+
+/* ========= WEBSOCKET CLIENT I/O (child) =========
+ * Browser connections speak JSON events over RFC 6455 frames. Incoming events are
+ * turned into the command lines a terminal client would type and every reply is
+ * framed, so the command loop below serves both kinds of client unchanged.
+ */
+
+int child_websocket = 0;
+WsParser ws_parser;
+uint8_t ws_inbuf[BUFFER_SIZE * 4];
+size_t ws_in_len = 0;
+size_t ws_in_pos = 0;
+char child_username[CREDENTIAL_LEN];
+uint64_t last_typing_ms = 0;
+
+ssize_t ws_send_frame(int fd, int opcode, const void *payload, size_t len) {
+    static uint8_t frame[WS_EVENT_MAX];
+    if (len > sizeof(frame) - WS_MAX_HEADER) len = sizeof(frame) - WS_MAX_HEADER;
+    size_t hlen = ws_frame_header(frame, opcode, len);
+    memcpy(frame + hlen, payload, len);
+    return child_send(fd, frame, hlen + len);
+}
+
+/* {"event":<event>,"data":{<key>:<value>}} */
+void ws_send_event(int fd, const char *event, const char *key, const char *value) {
+    char json[BUFFER_SIZE * 2];
+    size_t j = 0;
+    j = json_append(json, j, sizeof(json), "{\"event\":");
+    j = json_append_string(json, j, sizeof(json), event, strlen(event));
+    j = json_append(json, j, sizeof(json), ",\"data\":{\"");
+    j = json_append(json, j, sizeof(json), key);
+    j = json_append(json, j, sizeof(json), "\":");
+    j = json_append_string(json, j, sizeof(json), value, strlen(value));
+    j = json_append(json, j, sizeof(json), "}}");
+    ws_send_frame(fd, WS_OP_TEXT, json, j);
+}
+
+/* Child-side writes: raw text for terminals, a system message event for browsers */
+ssize_t client_reply(int fd, const char *text, size_t len) {
+    if (!child_websocket) return child_send(fd, text, len);
+    
+    static uint8_t frame[WS_EVENT_MAX];
+    size_t n = ws_render_event(frame, sizeof(frame), EVENT_NOTICE, "", "", text, len);
+    return child_send(fd, frame, n);
+}
+
+void client_auth_failed(int fd, const char *reason) {
+    if (child_websocket) {
+        ws_send_event(fd, "auth:error", "message", reason);
+    } else {
+        send_blocking(fd, reason, strlen(reason));
+    }
+    close(fd);
+    exit(0);
+}
+
+/* Read the HTTP upgrade request and answer 101; anything else gets a 400 */
+int ws_accept_upgrade(int fd) {
+    char request[WS_HANDSHAKE_MAX + 1];
+    size_t have = 0;
+    char *end = NULL;
+    
+    while (!end) {
+        if (have == WS_HANDSHAKE_MAX) return 0;
+        ssize_t n = recv_blocking(fd, request + have, WS_HANDSHAKE_MAX - have);
+        if (n <= 0) return 0;
+        have += (size_t)n;
+        request[have] = '\0';
+        end = strstr(request, "\r\n\r\n");
+    }
+    
+    char reply[256];
+    size_t reply_len = ws_handshake_response(request, reply, sizeof(reply));
+    if (reply_len == 0) {
+        const char *bad = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_blocking(fd, bad, strlen(bad));
+        return 0;
+    }
+    send_blocking(fd, reply, reply_len);
+    
+    /* Frames sent right behind the request are already in our buffer */
+    size_t extra = have - (size_t)(end + 4 - request);
+    memcpy(ws_inbuf, end + 4, extra);
+    ws_in_len = extra;
+    ws_in_pos = 0;
+    return 1;
+}
+
+/* Next complete text message (1), a pong (2), or 0 once the peer is gone.
+   Pings are answered here; protocol errors close with 1002, oversize with 1009. */
+int ws_next_message(int fd) {
+    for (;;) {
+        if (ws_in_pos == ws_in_len) {
+            ws_in_pos = ws_in_len = 0;
+            child_input_partial = ws_parser_partial(&ws_parser);
+            ssize_t n = recv_blocking(fd, ws_inbuf, sizeof(ws_inbuf));
+            child_input_partial = 0;
+            if (n <= 0) return 0;
+            ws_in_len = (size_t)n;
+        }
+        
+        size_t used;
+        int r = ws_parse(&ws_parser, ws_inbuf + ws_in_pos, ws_in_len - ws_in_pos, &used);
+        ws_in_pos += used;
+        
+        if (r == WS_ERROR || r == WS_TOO_BIG) {
+            uint8_t code[2] = { 0x03, (uint8_t)(r == WS_ERROR ? 0xEA : 0xF1) };
+            ws_send_frame(fd, WS_OP_CLOSE, code, sizeof(code));
+            return 0;
+        }
+        if (r == WS_CONTROL) {
+            if (ws_parser.control_opcode == WS_OP_PONG) return 2;
+            if (ws_parser.control_opcode == WS_OP_PING) {
+                ws_send_frame(fd, WS_OP_PONG, ws_parser.control, ws_parser.control_len);
+                continue;
+            }
+            /* Close: echo the status code and stop */
+            ws_send_frame(fd, WS_OP_CLOSE, ws_parser.control, ws_parser.control_len >= 2 ? 2 : 0);
+            return 0;
+        }
+        if (r == WS_MESSAGE && ws_parser.message_opcode == WS_OP_TEXT) return 1;
+    }
+}
+
+/* The first event on a browser connection must be {"event":"auth","data":{username,password}} */
+int ws_read_credentials(int fd, char *username, char *password) {
+    char event[32];
+    for (;;) {
+        int r = ws_next_message(fd);
+        if (r == 0) return 0;
+        if (r != 1) continue;
+        
+        const char *json = (const char *)ws_parser.message;
+        size_t len = ws_parser.message_len;
+        if (json_get_string(json, len, "event", event, sizeof(event)) && strcmp(event, "auth") == 0) {
+            if (!json_get_string(json, len, "username", username, CREDENTIAL_LEN)) username[0] = '\0';
+            if (!json_get_string(json, len, "password", password, CREDENTIAL_LEN)) password[0] = '\0';
+            return 1;
+        }
+        ws_send_event(fd, "error", "message", "Authenticate first");
+    }
+}
+
+static ssize_t command_length(int n, size_t cap) {
+    if (n < 0) return 0;
+    return (size_t)n < cap ? n : (ssize_t)cap - 1;
+}
+
+/* Encrypt a message field when the event asks for it; 0 (after telling the user) if that fails */
+static int ws_encrypt_field(int fd, const char *json, size_t len, char *text, size_t cap) {
+    char passphrase[ENCRYPT_PASS_MAX];
+    if (!json_get_bool(json, len, "encrypted") ||
+        !json_get_string(json, len, "encryptionPassword", passphrase, sizeof(passphrase))) return 1;
+    
+    const char *err = encrypt_in_place(text, cap, passphrase);
+    if (err) {
+        char reason[BUFFER_SIZE];
+        snprintf(reason, sizeof(reason), "%.*s", (int)strcspn(err + 10, "\n"), err + 10);  // Without "[Server]: "
+        ws_send_event(fd, "error", "message", reason);
+        return 0;
+    }
+    return 1;
+}
+
+/* Map one JSON event to a command line; 0 when the event needs no command */
+ssize_t ws_event_to_command(int fd, const char *json, size_t len, char *out, size_t cap) {
+    char event[32];
+    char first[BUFFER_SIZE];
+    char second[BUFFER_SIZE];
+    
+    if (!json_get_string(json, len, "event", event, sizeof(event))) {
+        ws_send_event(fd, "error", "message", "Missing event name");
+        return 0;
+    }
+    
+    if (strcmp(event, "message:send") == 0) {
+        if (!json_get_string(json, len, "message", first, sizeof(first)) || first[0] == '\0') return 0;
+        if (!ws_encrypt_field(fd, json, len, first, sizeof(first))) return 0;
+        if (json_get_string(json, len, "msgId", second, MSG_ID_MAX + 1) && second[0] != '\0') {
+            return command_length(snprintf(out, cap, "[id %s] %s\n", second, first), cap);
+        }
+        return command_length(snprintf(out, cap, "%s\n", first), cap);
+    }
+    if (strcmp(event, "room:join") == 0) {
+        if (!json_get_string(json, len, "roomName", first, sizeof(first)) || first[0] == '\0') return 0;
+        return command_length(snprintf(out, cap, "/join %s\n", first), cap);
+    }
+    if (strcmp(event, "pm:send") == 0) {
+        if (!json_get_string(json, len, "to", first, sizeof(first)) ||
+            !json_get_string(json, len, "message", second, sizeof(second))) return 0;
+        if (!ws_encrypt_field(fd, json, len, second, sizeof(second))) return 0;
+        return command_length(snprintf(out, cap, "/pm %s %s\n", first, second), cap);
+    }
+    if (strcmp(event, "user:typing") == 0) {
+        /* Cheap and frequent: throttled here, never charged to the message buckets */
+        uint64_t now = monotonic_ms();
+        if (now - last_typing_ms < WS_TYPING_INTERVAL_MS) return 0;
+        last_typing_ms = now;
+        
+        shm_lock_acquire();
+        int idx = find_client_by_fd(fd);
+        if (idx >= 0) presence_note(child_username, shm_buffer->clients[idx].room, PRESENCE_NONE, fd, 0);
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        return 0;
+    }
+    
+    ws_send_event(fd, "error", "message", "Unknown event");
+    return 0;
+}
+
+/* Child-side reads: one recv for terminals, one mapped event for browsers */
+ssize_t client_read(int fd, char *buf, size_t cap) {
+    if (!child_websocket) return tcp_next_line(fd, buf, cap);
+    
+    for (;;) {
+        int r = ws_next_message(fd);
+        if (r == 0) return 0;
+        if (r == 2) return command_length(snprintf(buf, cap, "/pong\n"), cap);
+        
+        ssize_t n = ws_event_to_command(fd, (const char *)ws_parser.message, ws_parser.message_len, buf, cap);
+        if (n > 0) return n;
+    }
+}
+
+/* ========= BRIDGE SESSIONS (child) =========
+ * The Node.js gateway logs in as BRIDGE_USERNAME and then speaks length-prefixed
+ * binary frames: [u32 length][u8 type][payload], big-endian, length counting the
+ * type byte. Each browser session is a channel; its events use the same JSON as
+ * the WebSocket endpoint. The child only reads - every byte to the gateway is
+ * written by the parent, so frames from different senders never interleave.
+ */
+
+/* Shared secret when NETCHAT_BRIDGE_SECRET is set, otherwise loopback peers only */
+int bridge_allowed(int fd, const char *secret) {
+    const char *expected = getenv("NETCHAT_BRIDGE_SECRET");
+    if (expected && expected[0]) {
+        size_t expected_len = strlen(expected);
+        size_t secret_len = strlen(secret);
+        unsigned char diff = (expected_len != secret_len);
+        for (size_t i = 0; i < secret_len; i++) {
+            diff |= (unsigned char)(secret[i] ^ expected[i % expected_len]);
+        }
+        return diff == 0;
+    }
+    
+    printf("[Bridge]: Warning: NETCHAT_BRIDGE_SECRET is not set, trusting any local gateway\n");
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) < 0) return 0;
+    if (peer.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&peer)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (peer.ss_family == AF_INET6) {
+        const struct in6_addr *a = &((struct sockaddr_in6 *)&peer)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return peer.ss_family == AF_UNIX;
+}
+
+/* Caller must hold shm_lock */
+BridgeChannel *bridge_find_channel(int bridge_fd, uint32_t id) {
+    for (int i = 0; i < BRIDGE_MAX_CHANNELS; i++) {
+        BridgeChannel *ch = &shm_buffer->channels[i];
+        if (ch->active && ch->bridge_fd == bridge_fd && ch->id == id) return ch;
+    }
+    return NULL;
+}
+
+/* Server text for one channel, routed through the parent like every bridge write */
+void bridge_reply(int bridge_fd, uint32_t channel, const char *text) {
+    EventInfo ev = { EVENT_NOTICE, "", 0, channel, 0, 0 };
+    queue_broadcast(text, strlen(text), -1, bridge_fd, "", 3, BCAST_PRIO_CHAT, &ev);
+}
+
+/* The gateway leaves encryption to us: same fields as a direct browser event */
+int bridge_encrypt_field(int bridge_fd, uint32_t id, const char *json, size_t len, char *text, size_t cap) {
+    char passphrase[ENCRYPT_PASS_MAX];
+    if (!json_get_bool(json, len, "encrypted") ||
+        !json_get_string(json, len, "encryptionPassword", passphrase, sizeof(passphrase))) return 1;
+    
+    const char *err = encrypt_in_place(text, cap, passphrase);
+    if (err) bridge_reply(bridge_fd, id, err);
+    return err == NULL;
+}
+
+void bridge_open_channel(int bridge_fd, uint32_t id, const uint8_t *name, size_t name_len) {
+    char username[CREDENTIAL_LEN];
+    size_t n = 0;
+    for (size_t i = 0; i < name_len && n < sizeof(username) - 1; i++) {
+        if (name[i] >= 0x20 && name[i] != 0x7f) username[n++] = (char)name[i];
+    }
+    username[n] = '\0';
+    
+    if (id == 0 || n == 0) {
+        EventInfo ev = { EVENT_CHANNEL_CLOSED, "", 0, id, 0, 0 };
+        queue_broadcast("", 0, -1, bridge_fd, "", 3, BCAST_PRIO_CHAT, &ev);
+        return;
+    }
+    
+    shm_lock_acquire();
+    /* Channels share the user namespace: a name someone is logged in under is theirs */
+    int taken = strcmp(username, BRIDGE_USERNAME) == 0;
+    for (int i = 0; !taken && i < shm_buffer->client_count; i++) {
+        const SharedClient *c = &shm_buffer->clients[i];
+        taken = c->authenticated && !c->bridge && strcmp(c->username, username) == 0;
+    }
+    BridgeChannel *ch = taken ? NULL : bridge_find_channel(bridge_fd, id);
+    for (int i = 0; !taken && !ch && i < BRIDGE_MAX_CHANNELS; i++) {
+        if (!shm_buffer->channels[i].active) ch = &shm_buffer->channels[i];
+    }
+    if (ch) {
+        if (ch->active) room_unsubscribe_all(channel_member(ch), &ch->subs);  // Reopened
+        ch->id = id;
+        ch->bridge_fd = bridge_fd;
+        ch->active = 1;
+        ch->subs = 0;
+        snprintf(ch->username, sizeof(ch->username), "%s", username);
+        strcpy(ch->room, "general");
+        room_subscribe(channel_member(ch), &ch->subs, "general");
+        presence_note(username, "general", PRESENCE_ONLINE, -1, 0);
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    if (taken) {
+        printf("[Bridge]: %s is logged in directly, refusing the channel\n", username);
+        bridge_reply(bridge_fd, id, "[Server]: That username is in use. Choose another.\n");
+        bridge_close_channel(bridge_fd, id);  // A reopen under the new name ends the old one
+    } else if (!ch) {
+        printf("[Bridge]: Channel table full, refusing %s\n", username);
+    }
+    if (!ch) {
+        EventInfo ev = { EVENT_CHANNEL_CLOSED, "", 0, id, 0, 0 };
+        queue_broadcast("", 0, -1, bridge_fd, "", 3, BCAST_PRIO_CHAT, &ev);
+        return;
+    }
+    
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "[Server]: %s has joined #general (via bridge)\n", username);
+    printf("%s", message);
+    log_message(message);
+    broadcast_notice(message, "general");
+}
+
+void bridge_close_channel(int bridge_fd, uint32_t id) {
+    char username[CREDENTIAL_LEN] = "";
+    
+    shm_lock_acquire();
+    BridgeChannel *ch = bridge_find_channel(bridge_fd, id);
+    if (ch) {
+        strcpy(username, ch->username);
+        presence_note_rooms(ch->username, ch->subs, PRESENCE_OFFLINE);  // Rooms hear it next flush
+        room_unsubscribe_all(channel_member(ch), &ch->subs);
+        ch->active = 0;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    if (username[0]) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "[Server]: %s has disconnected (bridge channel %u)\n",
+                 username, id);
+        printf("%s", message);
+        log_message(message);
+    }
+}
+
+/* One JSON event from a browser session: the same events the WebSocket endpoint takes */
+void bridge_channel_event(int bridge_fd, uint32_t id, const char *json, size_t len) {
+    char event[32];
+    char first[BUFFER_SIZE];
+    char second[BUFFER_SIZE];
+    char username[CREDENTIAL_LEN];
+    char room[ROOM_NAME_LEN];
+    
+    shm_lock_acquire();
+    BridgeChannel *ch = bridge_find_channel(bridge_fd, id);
+    if (ch) {
+        strcpy(username, ch->username);
+        strcpy(room, ch->room);
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    if (!ch) return;  // Closed while the event was in flight
+    if (!json_get_string(json, len, "event", event, sizeof(event))) {
+        bridge_reply(bridge_fd, id, "[Server]: Missing event name.\n");
+        return;
+    }
+    
+    if (strcmp(event, "message:send") == 0) {
+        if (!json_get_string(json, len, "message", first, sizeof(first) - 1) || first[0] == '\0') return;
+        if (!bridge_encrypt_field(bridge_fd, id, json, len, first, sizeof(first) - 1)) return;
+        size_t body_len = strlen(first);
+        first[body_len++] = '\n';
+        
+        /* A gateway retry carries the same msgId: dropped quietly, the browser already has it */
+        char token[MSG_ID_MAX + 1];
+        uint64_t msg_id = 0;
+        if (json_get_string(json, len, "msgId", token, sizeof(token)) && token[0] != '\0') {
+            char dup[ROOM_NAME_LEN + 32];
+            msg_id = dedup_hash(token, strlen(token));
+            if (dedup_check(username, msg_id, room, dup, sizeof(dup))) return;
+        }
+        
+        RenderFragments frag;
+        RenderedMessage rendered;
+        render_set_user(&frag, username);
+        render_set_room(&frag, room);
+        render_chat_line(&rendered, &frag, first, body_len);
+        
+        fwrite(rendered.text, 1, rendered.len, stdout);
+        log_rendered(&rendered);
+        write_to_shared_memory(rendered.text, rendered.len);
+        EventInfo ev = { EVENT_CHAT, username, rendered.body_offset, id, 0, msg_id };
+        if (!broadcast_room_len(rendered.text, rendered.len, -1, room, &ev) && msg_id) {
+            shm_lock_acquire();
+            dedup_forget(username, msg_id);
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+        }
+    }
+    else if (strcmp(event, "room:join") == 0) {
+        char new_room[ROOM_NAME_LEN];
+        if (!json_get_string(json, len, "roomName", new_room, sizeof(new_room)) || new_room[0] == '\0') return;
+        
+        shm_lock_acquire();
+        ch = bridge_find_channel(bridge_fd, id);
+        int joined = 0;
+        if (ch && strcmp(room, new_room) != 0) {
+            int member = channel_member(ch);
+            room_unsubscribe_all(member, &ch->subs);
+            joined = room_subscribe(member, &ch->subs, new_room) >= 0;
+            if (!joined) {
+                room_subscribe(member, &ch->subs, room);
+            } else {
+                strcpy(ch->room, new_room);
+                presence_note(username, room, PRESENCE_LEFT, -1, 0);
+                presence_note(username, new_room, PRESENCE_ONLINE, -1, 0);
+            }
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        if (!ch || strcmp(room, new_room) == 0) return;
+        if (!joined) {
+            bridge_reply(bridge_fd, id, "[Server]: Too many active rooms - try an existing one.\n");
+            return;
+        }
+        
+        char notice[BUFFER_SIZE];
+        snprintf(notice, sizeof(notice), "[Server]: %s has left #%s\n", username, room);
+        broadcast_notice(notice, room);
+        snprintf(notice, sizeof(notice), "[Server]: %s has joined #%s\n", username, new_room);
+        broadcast_notice(notice, new_room);
+    }
+    else if (strcmp(event, "pm:send") == 0) {
+        if (!json_get_string(json, len, "to", first, sizeof(first)) ||
+            !json_get_string(json, len, "message", second, sizeof(second))) return;
+        if (!bridge_encrypt_field(bridge_fd, id, json, len, second, sizeof(second))) return;
+        if (!send_private_message(first, second, username, -1)) {
+            bridge_reply(bridge_fd, id, "[Server]: User offline. Message queued for delivery.\n");
+        }
+    }
+    else if (strcmp(event, "user:typing") == 0) {
+        shm_lock_acquire();
+        presence_note(username, room, PRESENCE_NONE, -1, id);
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+    }
+    else {
+        bridge_reply(bridge_fd, id, "[Server]: Unknown event.\n");
+    }
+}
+
+/* Serve a gateway connection until it closes; never returns */
+void handle_bridge_process(int bridge_fd) {
+    static uint8_t in[BRIDGE_FRAME_MAX * 2];
+    size_t have = 0;
+    
+    shm_lock_acquire();
+    int idx = find_client_by_fd(bridge_fd);
+    if (idx >= 0) {
+        SharedClient *c = &shm_buffer->clients[idx];
+        snprintf(c->username, sizeof(c->username), "%s", BRIDGE_USERNAME);
+        c->room[0] = '\0';  // Never matches a room broadcast
+        c->authenticated = 1;
+        c->bridge = 1;
+        c->process_id = getpid();
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    /* Frames are latency-sensitive and already batched; fails harmlessly on AF_UNIX */
+    int nodelay = 1;
+    setsockopt(bridge_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    
+    printf("[Bridge]: Gateway connected (Process: %d)\n", getpid());
+    log_message("[Server]: Bridge gateway connected\n");
+    send_blocking(bridge_fd, BRIDGE_GREETING, strlen(BRIDGE_GREETING));
+    
+    for (;;) {
+        ssize_t n = recv_blocking(bridge_fd, in + have, sizeof(in) - have);
+        if (n <= 0) break;
+        have += (size_t)n;
+        touch_activity(bridge_fd);
+        
+        size_t pos = 0;
+        int protocol_error = 0;
+        while (have - pos >= 4) {
+            uint32_t frame_len = get_u32(in + pos);
+            if (frame_len == 0 || frame_len > BRIDGE_FRAME_MAX) {
+                protocol_error = 1;
+                break;
+            }
+            if (have - pos < 4 + (size_t)frame_len) break;
+            
+            int type = in[pos + 4];
+            const uint8_t *payload = in + pos + 5;
+            size_t payload_len = frame_len - 1;
+            uint32_t channel = payload_len >= 4 ? get_u32(payload) : 0;
+            
+            if (payload_len < 4) {
+                protocol_error = 1;
+                break;
+            } else if (type == BRIDGE_OPEN) {
+                bridge_open_channel(bridge_fd, channel, payload + 4, payload_len - 4);
+            } else if (type == BRIDGE_CLOSE) {
+                bridge_close_channel(bridge_fd, channel);
+            } else if (type == BRIDGE_EVENT) {
+                bridge_channel_event(bridge_fd, channel, (const char *)payload + 4, payload_len - 4);
+            }
+            pos += 4 + (size_t)frame_len;
+        }
+        if (protocol_error) {
+            printf("[Bridge]: Malformed frame from gateway, disconnecting\n");
+            break;
+        }
+        memmove(in, in + pos, have - pos);
+        have -= pos;
+    }
+    
+    /* Every session the gateway carried goes offline with it */
+    for (int i = 0; i < BRIDGE_MAX_CHANNELS; i++) {
+        shm_lock_acquire();
+        BridgeChannel *ch = &shm_buffer->channels[i];
+        int mine = ch->active && ch->bridge_fd == bridge_fd;
+        uint32_t id = ch->id;
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        if (mine) bridge_close_channel(bridge_fd, id);
+    }
+    
+    shm_lock_acquire();
+    idx = find_client_by_fd(bridge_fd);
+    if (idx >= 0) {
+        remove_client_at(idx);
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    printf("[Bridge]: Gateway disconnected (Process: %d exiting)\n", getpid());
+    log_message("[Server]: Bridge gateway disconnected\n");
+    close(bridge_fd);
+    exit(0);
+}
+
+/* Child: one rendered chat line to stdout, the log, the recent ring and the room,
+   unless its message id marks it as a retry of a line already sent */
+void send_chat(int client_fd, const char *username, const char *room, const RenderedMessage *rendered,
+               uint64_t msg_id) {
+    char reply[ROOM_NAME_LEN + 32];
+    if (msg_id && dedup_check(username, msg_id, room, reply, sizeof(reply))) {
+        if (reply[0] && !child_websocket) client_reply(client_fd, reply, strlen(reply));
+        return;
+    }
+    
+    fwrite(rendered->text, 1, rendered->len, stdout);
+    log_rendered(rendered);
+    write_to_shared_memory(rendered->text, rendered->len);
+    EventInfo ev = { EVENT_CHAT, username, rendered->body_offset, 0, 0, msg_id };
+    if (!broadcast_room_len(rendered->text, rendered->len, client_fd, room, &ev) && msg_id) {
+        shm_lock_acquire();
+        dedup_forget(username, msg_id);
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+    }
+}
+
+/* ========= FILE TRANSFER (child) =========
+ * "/upload <size> <name>" turns the connection into a byte stream for exactly
+ * size bytes. The client may send only as far as the last "[file] credit <n>",
+ * which runs one window ahead of what is on disk, so a paced upload holds the
+ * sender back instead of filling socket buffers. The stored file is announced
+ * in the room with the hash that fetches it.
+ *
+ * "/download <hash>" answers "[file] begin <hash> <size>", then "[file] data <n>"
+ * lines each followed by n raw bytes, then "[file] end <hash>". A slice is written
+ * only while the parent has nothing queued for the connection, so chat and
+ * replies go first and never land inside one.
+ */
+
+uint64_t file_rate = FILE_RATE_BPS;
+
+void init_file_store() {
+    const char *env_rate = getenv("NETCHAT_FILE_RATE");
+    if (env_rate) file_rate = strtoull(env_rate, NULL, 10);
+    if (file_store_init(FILE_STORE_DIR) < 0) {
+        perror("File store directory creation failed");
+        exit(1);
+    }
+    printf("[FILES]: Shared files in %s/, %llu bytes/s per transfer%s\n", FILE_STORE_DIR,
+           (unsigned long long)file_rate, file_rate ? "" : " (uncapped)");
+}
+
+static void file_reply(int client_fd, const char *fmt, ...) {
+    char line[BUFFER_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    client_reply(client_fd, line, command_length(len, sizeof(line)));
+}
+
+static void file_account(int upload, uint64_t bytes) {
+    shm_lock_acquire();
+    if (upload) {
+        shm_buffer->stats.files_stored++;
+        shm_buffer->stats.file_bytes_in += bytes;
+    } else {
+        shm_buffer->stats.files_sent++;
+        shm_buffer->stats.file_bytes_out += bytes;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+}
+
+/* Last path component, without anything that would break the announcement line */
+static void file_clean_name(const char *in, char *out) {
+    const char *slash = strrchr(in, '/');
+    if (slash) in = slash + 1;
+    size_t n = 0;
+    for (; *in && n < FILE_NAME_MAX; in++) {
+        out[n++] = ((unsigned char)*in < 0x20 || *in == 0x7f) ? '_' : *in;
+    }
+    out[n] = '\0';
+}
+
+/* Returns 0 once the connection carries lines again, -1 if it is lost mid-upload */
+int file_receive(int client_fd, const char *username, const char *room, const RenderFragments *frag,
+                 char *args, uint64_t msg_id) {
+    unsigned long long size = 0;
+    int name_at = 0;
+    char name[FILE_NAME_MAX + 1];
+    args[strcspn(args, "\r\n")] = '\0';
+    
+    if (child_websocket) {
+        char *err = "[Server]: File transfer needs a terminal connection.\n";
+        client_reply(client_fd, err, strlen(err));
+        return 0;
+    }
+    if (sscanf(args, "%llu %n", &size, &name_at) != 1 || name_at == 0 || args[name_at] == '\0') {
+        file_reply(client_fd, "[file] abort Usage: /upload <size> <name>\n");
+        return 0;
+    }
+    file_clean_name(args + name_at, name);
+    if (size > FILE_MAX_BYTES) {
+        file_reply(client_fd, "[file] abort Files are limited to %llu MB\n", FILE_MAX_BYTES >> 20);
+        return 0;
+    }
+    
+    FileUpload up;
+    if (file_upload_begin(&up, FILE_STORE_DIR, size) < 0) {
+        file_reply(client_fd, "[file] abort Server could not store the file\n");
+        return 0;
+    }
+    
+    /* Whatever arrived behind the command line is the start of the file */
+    size_t early = tcp_in_len < size ? tcp_in_len : (size_t)size;
+    if (early > 0) {
+        file_upload_write(&up, tcp_inbuf, early);
+        memmove(tcp_inbuf, tcp_inbuf + early, tcp_in_len - early);
+        tcp_in_len -= early;
+    }
+    
+    FilePacer pacer;
+    file_pacer_start(&pacer, file_rate);
+    uint64_t credit = up.received + FILE_WINDOW < size ? up.received + FILE_WINDOW : size;
+    file_reply(client_fd, "[file] credit %llu\n", (unsigned long long)credit);
+    
+    int stopping = 0;  // A new binary is taking over: take what was credited, grant no more
+    uint64_t last_data = monotonic_ms();
+    uint64_t last_touch = last_data;
+    while (up.received < credit) {
+        if (!stopping && upgrade_pending()) stopping = 1;
+        
+        size_t want = credit - up.received < FILE_SLICE ? (size_t)(credit - up.received) : FILE_SLICE;
+        ssize_t n = file_upload_splice(&up, client_fd, want);
+        if (n > 0) {
+            uint64_t now = monotonic_ms();
+            last_data = now;
+            if (now - last_touch >= 1000) {
+                touch_activity(client_fd);  // The heartbeat would be read as file data
+                last_touch = now;
+            }
+            if (stopping) continue;
+            file_pacer_wait(&pacer, (size_t)n);
+            if (credit < size && credit - up.received <= FILE_WINDOW / 2) {
+                credit = up.received + FILE_WINDOW < size ? up.received + FILE_WINDOW : size;
+                file_reply(client_fd, "[file] credit %llu\n", (unsigned long long)credit);
+            }
+            continue;
+        }
+        
+        /* Lost or stalled half-way, the stream cannot be told apart from commands again */
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+            monotonic_ms() - last_data >= FILE_STALL_MS) {
+            file_upload_abort(&up);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                file_reply(client_fd, "[file] abort No data for %d seconds\n", FILE_STALL_MS / 1000);
+            }
+            return -1;
+        }
+        struct pollfd pfd = { client_fd, POLLIN, 0 };
+        poll(&pfd, 1, 100);  // Short, so a pending upgrade is noticed
+    }
+    
+    if (up.received < size) {
+        file_upload_abort(&up);
+        file_reply(client_fd, "[file] abort Server restarting - send the file again\n");
+        return 0;  // The next read hands the connection over
+    }
+    
+    char hash[FILE_HASH_HEX];
+    if (file_upload_commit(&up, FILE_STORE_DIR, hash) < 0) {
+        file_upload_abort(&up);
+        file_reply(client_fd, "[file] abort Server could not store the file\n");
+        return 0;
+    }
+    file_account(1, size);
+    file_reply(client_fd, "[file] stored %s %llu\n", hash, size);
+    printf("[FILES]: %s shared %s (%llu bytes) as %s\n", username, name, size, hash);
+    
+    char body[BUFFER_SIZE];
+    int len = snprintf(body, sizeof(body), "shared %s (%llu bytes) - /download %s\n", name, size, hash);
+    RenderedMessage rendered;
+    render_chat_line(&rendered, frag, body, command_length(len, sizeof(body)));
+    send_chat(client_fd, username, room, &rendered, msg_id);
+    return 0;
+}
+
+/* Returns 0 when done (or refused), -1 if the connection broke mid-file */
+int file_send(int client_fd, char *args) {
+    char hash[FILE_HASH_HEX];
+    args[strcspn(args, " \r\n")] = '\0';
+    snprintf(hash, sizeof(hash), "%s", args);
+    
+    if (child_websocket) {
+        char *err = "[Server]: File transfer needs a terminal connection.\n";
+        client_reply(client_fd, err, strlen(err));
+        return 0;
+    }
+    uint64_t size;
+    int fd = file_store_open(FILE_STORE_DIR, hash, &size);
+    if (fd < 0) {
+        file_reply(client_fd, "[Server]: No shared file %s - check the hash.\n", hash);
+        return 0;
+    }
+    file_reply(client_fd, "[file] begin %s %llu\n", hash, (unsigned long long)size);
+    
+    FilePacer pacer;
+    file_pacer_start(&pacer, file_rate);
+    off_t offset = 0;
+    uint64_t last_touch = monotonic_ms();
+    while ((uint64_t)offset < size) {
+        if (upgrade_pending()) {
+            close(fd);
+            file_reply(client_fd, "[file] abort Server restarting - download %s again\n", hash);
+            return 0;
+        }
+        int claimed = child_claim_socket(client_fd);
+        if (claimed == 0) {
+            usleep(1000);  // Chat first; the parent signals nobody, so poll for it
+            continue;
+        }
+        
+        size_t slice = size - (uint64_t)offset < FILE_SLICE ? (size_t)(size - (uint64_t)offset) : FILE_SLICE;
+        char head[32];
+        int head_len = snprintf(head, sizeof(head), "[file] data %zu\n", slice);
+        ssize_t sent = send_blocking(client_fd, head, (size_t)head_len) == head_len
+                     ? file_send_range(client_fd, fd, &offset, slice) : -1;
+        if (claimed == 1) child_release_socket(client_fd);
+        if (sent != (ssize_t)slice) {
+            close(fd);
+            return -1;
+        }
+        
+        uint64_t now = monotonic_ms();
+        if (now - last_touch >= 1000) {
+            touch_activity(client_fd);  // Heartbeat replies wait unread behind the file
+            last_touch = now;
+        }
+        file_pacer_wait(&pacer, slice);
+    }
+    close(fd);
+    file_account(0, size);
+    file_reply(client_fd, "[file] end %s\n", hash);
+    return 0;
+}
+
+/* ========= MESSAGE ENCRYPTION (child) =========
+ * Ciphertext in the format server.js encryptMessage() writes, so the web
+ * UI and /api/decrypt read what is encrypted here and the other way round.
+ * "/encrypt <passphrase> <message>" posts the ciphertext to the room and
+ * "/decrypt <passphrase> <iv:hex>" answers with the plaintext. Without a
+ * ciphertext, /decrypt tries every encrypted line in the recent history
+ * in one batch. Browser and gateway events that carry "encrypted": true
+ * and an "encryptionPassword" are encrypted here before they are posted.
+ */
+
+/* Replace text with its ciphertext; NULL on success, else the reason for the user */
+const char *encrypt_in_place(char *text, size_t cap, const char *passphrase) {
+    size_t len = strcspn(text, "\n");
+    if (len > ENCRYPT_TEXT_MAX) return "[Server]: Encrypted messages are limited to 400 characters.\n";
+    if (passphrase[0] == '\0') return "[Server]: Usage: /encrypt <passphrase> <message>\n";
+    
+    MsgKey key;
+    char wire[MSG_CRYPT_WIRE_LEN(ENCRYPT_TEXT_MAX) + 1];
+    if (msg_crypt_key(passphrase, &key) < 0 || msg_encrypt(&key, text, len, wire, sizeof(wire)) < 0) {
+        return "[Server]: Encryption failed.\n";
+    }
+    snprintf(text, cap, "%s%s", wire, text[len] == '\n' ? "\n" : "");
+    return NULL;
+}
+
+/* Split "<passphrase> <rest>"; rest is NULL when there is none */
+char *split_passphrase(char *args, char *passphrase) {
+    args[strcspn(args, "\r\n")] = '\0';
+    size_t len = strcspn(args, " ");
+    snprintf(passphrase, ENCRYPT_PASS_MAX, "%.*s", (int)len, args);
+    if (args[len] == '\0') return NULL;
+    char *rest = args + len;
+    while (*rest == ' ') rest++;
+    return *rest ? rest : NULL;
+}
+
+/* "/decrypt <passphrase> [iv:hex]" */
+void decrypt_command(int client_fd, char *args) {
+    char passphrase[ENCRYPT_PASS_MAX];
+    char *wire = split_passphrase(args, passphrase);
+    char reply[BUFFER_SIZE * 4];
+    MsgKey key;
+    
+    if (passphrase[0] == '\0' || msg_crypt_key(passphrase, &key) < 0) {
+        char *err = "[Server]: Usage: /decrypt <passphrase> [ciphertext]\n";
+        client_reply(client_fd, err, strlen(err));
+        return;
+    }
+    
+    if (wire) {
+        char plain[BUFFER_SIZE];
+        if (msg_decrypt(&key, wire, strlen(wire), plain, sizeof(plain)) < 0) {
+            snprintf(reply, sizeof(reply), "[Server]: Decryption failed - wrong password or corrupted message.\n");
+        } else {
+            snprintf(reply, sizeof(reply), "[Decrypted]: %s\n", plain);
+        }
+        client_reply(client_fd, reply, strlen(reply));
+        return;
+    }
+    
+    /* Every ciphertext in the newest RECENT_SHOWN messages, through the cipher together */
+    static char lines[RECENT_SHOWN][BUFFER_SIZE];
+    static char plain[RECENT_SHOWN][BUFFER_SIZE];
+    MsgCryptJob jobs[RECENT_SHOWN];
+    int body_at[RECENT_SHOWN];
+    const char *texts[RECENT_SHOWN];
+    int count = 0;
+    
+    shm_lock_acquire();
+    int recent = recent_newest(texts, RECENT_SHOWN);
+    for (int i = 0; i < recent; i++) {
+        const char *text = texts[i];
+        const char *body = strstr(text, ": ");
+        if (!body) continue;
+        body += 2;
+        size_t body_len = strcspn(body, "\n");
+        if (body_len == 0 || msg_crypt_wire_span(body, body_len) != body_len) continue;
+        
+        snprintf(lines[count], BUFFER_SIZE, "%s", text);
+        body_at[count] = (int)(body - text);
+        jobs[count] = (MsgCryptJob){ lines[count] + body_at[count], body_len, plain[count], BUFFER_SIZE, -1 };
+        count++;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    msg_decrypt_batch(&key, jobs, (size_t)count);
+    
+    int opened = 0;
+    size_t pos = (size_t)snprintf(reply, sizeof(reply), "\n[Decrypted from recent messages]:\n");
+    for (int i = 0; i < count && pos < sizeof(reply); i++) {
+        if (jobs[i].out_len < 0) continue;
+        pos += (size_t)snprintf(reply + pos, sizeof(reply) - pos, "%.*s%s\n", body_at[i], lines[i], plain[i]);
+        opened++;
+    }
+    if (pos >= sizeof(reply)) pos = sizeof(reply) - 1;
+    if (opened == 0) {
+        pos = (size_t)snprintf(reply, sizeof(reply),
+                               "[Server]: None of the %d recent encrypted messages opens with that passphrase.\n",
+                               count);
+    }
+    client_reply(client_fd, reply, pos);
+}
+
+/* ========= MESSAGE SEARCH =========
+ * The parent queues every sequenced room message for the index writer in
+ * search_index.c, which makes it searchable within SEARCH_FLUSH_MS. A child
+ * answers "/search" itself from the segment files, so a query never waits
+ * on the parent's loop and the parent never waits on a query.
+ *
+ * "/search <words> [#room] [@user] [since:<when>]" lists the newest messages
+ * holding every word, oldest of them first, each with the room:seq a RESUME
+ * takes. since is "30m", "2h", "7d", "2w" ago or a date, "2026-10-01".
+ */
+
+const char *search_dir = SEARCH_DIR;
+SearchReader *search_reader = NULL;  // Child: opened by its first /search
+
+void init_search() {
+    const char *env_dir = getenv("NETCHAT_SEARCH_DIR");
+    if (env_dir) search_dir = env_dir;
+    if (search_dir[0] == '\0') return;
+    
+    search_index = search_index_open(search_dir);
+    if (!search_index) {
+        perror("Search index unavailable");
+        search_dir = "";
+        return;
+    }
+    uint32_t docs;
+    int segments;
+    search_index_info(search_index, &docs, &segments, NULL);
+    printf("[Search]: %u messages indexed in %d segments under %s/\n", docs, segments, search_dir);
+}
+
+/* Start of a "since:" spec as a time; -1 if it is not one */
+time_t parse_since(const char *spec) {
+    int year, month, day;
+    if (sscanf(spec, "%4d-%2d-%2d", &year, &month, &day) == 3) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+    
+    char *unit;
+    long n = strtol(spec, &unit, 10);
+    if (unit == spec || n < 0 || unit[0] == '\0' || unit[1] != '\0') return -1;
+    long scale = unit[0] == 'm' ? 60 : unit[0] == 'h' ? 3600 : unit[0] == 'd' ? 86400 : unit[0] == 'w' ? 604800 : 0;
+    if (scale == 0) return -1;
+    return time(NULL) - (time_t)(n * scale);
+}
+
+void search_command(int client_fd, char *args) {
+    char words[BUFFER_SIZE] = "";
+    char room[ROOM_NAME_LEN] = "";
+    char user[CREDENTIAL_LEN] = "";
+    size_t words_len = 0;
+    time_t since = 0;
+    
+    args[strcspn(args, "\r\n")] = '\0';
+    for (char *tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+        if (tok[0] == '#' && tok[1]) {
+            snprintf(room, sizeof(room), "%s", tok + 1);
+        } else if (tok[0] == '@' && tok[1]) {
+            snprintf(user, sizeof(user), "%s", tok + 1);
+        } else if (strncmp(tok, "since:", 6) == 0) {
+            since = parse_since(tok + 6);
+            if (since < 0) break;
+        } else {
+            words_len += (size_t)snprintf(words + words_len, sizeof(words) - words_len, "%s ", tok);
+            if (words_len >= sizeof(words)) words_len = sizeof(words) - 1;
+        }
+    }
+    
+    if (search_dir[0] == '\0') {
+        char *off = "[Server]: Search is not enabled on this server.\n";
+        client_reply(client_fd, off, strlen(off));
+        return;
+    }
+    if (since < 0 || (words[0] == '\0' && room[0] == '\0' && user[0] == '\0')) {
+        char *usage = "[Server]: Usage: /search <words> [#room] [@user] [since:2h|7d|2026-10-01]\n";
+        client_reply(client_fd, usage, strlen(usage));
+        return;
+    }
+    
+    static SearchHit hits[SEARCH_RESULTS];
+    if (!search_reader) search_reader = search_reader_open(search_dir);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    SearchQuery query = { words, room[0] ? room : NULL, user[0] ? user : NULL, since };
+    int found = search_reader ? search_run(search_reader, &query, hits, SEARCH_RESULTS) : -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (found < 0) {
+        char *err = "[Server]: Search index unavailable.\n";
+        client_reply(client_fd, err, strlen(err));
+        return;
+    }
+    
+    uint32_t docs;
+    search_reader_info(search_reader, &docs, NULL);
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    char reply[BUFFER_SIZE * 5];
+    size_t pos;
+    if (found == 0) {
+        pos = (size_t)snprintf(reply, sizeof(reply), "[Search]: No matches in %u messages (%.2f ms)\n", docs, ms);
+        client_reply(client_fd, reply, pos);
+        return;
+    }
+    
+    pos = (size_t)snprintf(reply, sizeof(reply), "\n[Search]: %d newest match%s in %u messages (%.2f ms):\n",
+                           found, found != 1 ? "es" : "", docs, ms);
+    for (int i = found - 1; i >= 0 && pos < sizeof(reply); i--) {
+        const SearchHit *h = &hits[i];
+        char when[32];
+        struct tm tm;
+        localtime_r(&h->time, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+        
+        /* Cut long messages on a character boundary */
+        size_t len = strlen(h->body);
+        int cut = len > SEARCH_SNIPPET;
+        if (cut) {
+            len = SEARCH_SNIPPET;
+            while (len > 0 && ((unsigned char)h->body[len] & 0xC0) == 0x80) len--;
+        }
+        pos += (size_t)snprintf(reply + pos, sizeof(reply) - pos, "  [%s] [#%s:%llu] %s: %.*s%s\n", when, h->room,
+                                (unsigned long long)h->seq, h->user, (int)len, h->body, cut ? "..." : "");
+    }
+    if (pos >= sizeof(reply)) pos = sizeof(reply) - 1;
+    client_reply(client_fd, reply, pos);
+}
+
+/* ========= PROCESS FORKING - Handle client in separate process ========= */
+
+/* "RESUME [room:seq ...]" before the credentials: sequence tags and a replay */
+int child_resume = 0;
+char child_resume_spec[RESUME_SPEC_LEN];
+
+/* One '\n'-terminated line, byte by byte so nothing after it is consumed; exits on EOF */
+static void login_read_line(int client_fd, char *out, size_t cap) {
+    size_t idx = 0;
+    char c;
+    while (idx < cap - 1) {
+        if (recv_blocking(client_fd, &c, 1) <= 0) {
+            close(client_fd);
+            exit(0);
+        }
+        if (c == '\n') break;
+        out[idx++] = c;
+    }
+    out[idx] = '\0';
+}
+
+/* Read credentials, authenticate and send the welcome box; exits the child on failure */
+void client_login(int client_fd, char *username, char *password) {
+
+    if (child_websocket) {
+        /* Browser: HTTP upgrade, then an "auth" event */
+        if (!ws_accept_upgrade(client_fd) || !ws_read_credentials(client_fd, username, password)) {
+            close(client_fd);
+            exit(0);
+        }
+    } else {
+        /* Receive username, after an optional RESUME line */
+        char first[RESUME_SPEC_LEN];
+        login_read_line(client_fd, first, sizeof(first));
+        if (strncmp(first, "RESUME", 6) == 0 && (first[6] == ' ' || first[6] == '\0' || first[6] == '\r')) {
+            child_resume = 1;
+            snprintf(child_resume_spec, sizeof(child_resume_spec), "%s", first + 6);
+            login_read_line(client_fd, username, CREDENTIAL_LEN);
+        } else {
+            snprintf(username, CREDENTIAL_LEN, "%.*s", CREDENTIAL_LEN - 1, first);
+        }
+
+        /* Receive password */
+        login_read_line(client_fd, password, CREDENTIAL_LEN);
+        
+        /* The Node.js gateway: no account, a secret (or loopback) instead */
+        if (strcmp(username, BRIDGE_USERNAME) == 0) {
+            if (!bridge_allowed(client_fd, password)) {
+                client_auth_failed(client_fd, "ERROR: Bridge not authorized. Disconnecting...\n");
+            }
+            handle_bridge_process(client_fd);
+        }
+    }
+    
+    if (strlen(username) == 0 || strlen(password) == 0) {
         char *err = "Error: Username and password cannot be empty.\n";
-        send(client_fd, err, strlen(err), 0);
-        close(client_fd);
-        exit(0);
+        client_auth_failed(client_fd, err);
+    }
+
+    /* Authenticate */
+    int auth_result = authenticate_user(username, password);
+    if (auth_result != 1) {
+        char *auth_fail = (auth_result == -1) ? 
+            "ERROR: Wrong password. Disconnecting...\n" :
+            "ERROR: Authentication failed. Disconnecting...\n";
+        client_auth_failed(client_fd, auth_fail);
+    }
+    if (child_websocket) {
+        ws_send_event(client_fd, "auth:ok", "username", username);
+    }
+
+    /* Send welcome message */
+    char welcome[BUFFER_SIZE * 4];
+    snprintf(welcome, sizeof(welcome),
+        "\n╔════════════════════════════════════════════════════════════════╗\n"
+        "║           🎉 WELCOME TO NETCHAT (ENHANCED)! 🎉               ║\n"
+        "╠════════════════════════════════════════════════════════════════╣\n"
+        "║  ✅ Authentication successful!                                ║\n"
+        "║  🔄 Running in separate process (PID: %d)                     ║\n"
+        "║  💾 Shared memory enabled for message history                ║\n"
+        "║  📨 Message queue active for offline delivery                ║\n"
+        "║  🔐 Semaphore controlling concurrent connections             ║\n"
+        "╚════════════════════════════════════════════════════════════════╝\n\n"
+        "╔════════════════════════════════════════════════════════════════╗\n"
+        "║                     AVAILABLE COMMANDS                         ║\n"
+        "╠════════════════════════════════════════════════════════════════╣\n"
+        "║                                                                ║\n"
+        "║  💬 MESSAGING:                                                 ║\n"
+        "║     • Type normally to send message to current room           ║\n"
+        "║     • /pm <user> <message>  - Send private message            ║\n"
+        "║     • /upload <file>        - Share a file with the room      ║\n"
+        "║     • /download <hash>      - Fetch a shared file             ║\n"
+        "║     • /encrypt <pass> <msg> - Post an encrypted message       ║\n"
+        "║     • /decrypt <pass> [msg] - Decrypt one or recent messages  ║\n"
+        "║                                                                ║\n"
+        "║  🏢 ROOMS:                                                     ║\n"
+        "║     • /room                 - Show current room               ║\n"
+        "║     • /join <roomname>      - Join/create a room              ║\n"
+        "║     • /sub [room]           - Also watch a room (or list)     ║\n"
+        "║     • /unsub <room>         - Stop watching a room            ║\n"
+        "║     • /say <room> <message> - Post to a watched room          ║\n"
+        "║     • /rooms                - List all active rooms           ║\n"
+        "║     • /recent [n]           - Recent messages in this room     ║\n"
+        "║     • /search <words>       - Search history (#room @user)    ║\n"
+        "║                                                                ║\n"
+        "║  👥 USERS:                                                     ║\n"
+        "║     • /users                - List users in current room      ║\n"
+        "║     • /stats                - Show server load counters       ║\n"
+        "║     • /away, /back          - Set or clear away status        ║\n"
+        "║     • /presence on|off      - Compact presence updates        ║\n"
+        "║                                                                ║\n"
+        "║  ℹ️  HELP:                                                      ║\n"
+        "║     • /help                 - Show this menu again            ║\n"
+        "║                                                                ║\n"
+        "╚════════════════════════════════════════════════════════════════╝\n\n",
+        getpid());
+    client_reply(client_fd, welcome, strlen(welcome));
+}
+
+/* "/ack room:seq ... pm:n" or "/read pm:n": raise the connection's cumulative marks */
+void record_acks(int client_fd, int read, const char *spec) {
+    char room[ROOM_NAME_LEN];
+    uint64_t seq;
+    
+    shm_lock_acquire();
+    int idx = find_client_by_fd(client_fd);
+    SharedClient *c = idx >= 0 ? &shm_buffer->clients[idx] : NULL;
+    while (c && (spec = resume_next(spec, room, &seq)) != NULL) {
+        if (seq == UINT64_MAX) continue;
+        if (strcmp(room, "pm") == 0) {
+            uint64_t *mark = read ? &c->pm_read : &c->pm_acked;
+            if (seq > *mark) *mark = seq;
+            continue;
+        }
+        if (read) continue;  // Read receipts are for PMs only
+        
+        /* Reuse the room's mark, a free one, or one for a room no longer watched */
+        AckMark *slot = NULL;
+        for (int a = 0; a < MAX_SUBSCRIPTIONS && !slot; a++) {
+            if (strcmp(c->acks[a].room, room) == 0) slot = &c->acks[a];
+        }
+        for (int a = 0; a < MAX_SUBSCRIPTIONS && !slot; a++) {
+            int r = c->acks[a].room[0] ? room_find(c->acks[a].room) : -1;
+            if (r < 0 || !(c->subs & (1ULL << r))) {
+                slot = &c->acks[a];
+                snprintf(slot->room, sizeof(slot->room), "%s", room);
+                slot->seq = 0;
+            }
+        }
+        if (slot && seq > slot->seq) slot->seq = seq;
+    }
+    if (c) c->ack_gen++;
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+}
+
+/* /away and /back: every subscribed room hears it at the next presence flush.
+   Returns 0 when the connection was already in that state. */
+int child_away = 0;
+
+int set_away(int client_fd, int away) {
+    int changed = 0;
+    shm_lock_acquire();
+    int idx = find_client_by_fd(client_fd);
+    if (idx >= 0 && shm_buffer->clients[idx].away != away) {
+        SharedClient *c = &shm_buffer->clients[idx];
+        c->away = away;
+        presence_note_rooms(c->username, c->subs, away ? PRESENCE_AWAY : PRESENCE_ONLINE);
+        changed = 1;
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    child_away = away;
+    return changed;
+}
+
+/* Room argument of /sub, /unsub and /say: an optional '#', up to the first blank.
+   Returns where the rest of the line starts. */
+const char *parse_room_arg(const char *arg, char *room) {
+    size_t n = 0;
+    if (*arg == '#') arg++;
+    while (*arg && *arg != ' ' && *arg != '\n' && *arg != '\r') {
+        if (n < ROOM_NAME_LEN - 1) room[n++] = *arg;
+        arg++;
+    }
+    room[n] = '\0';
+    while (*arg == ' ') arg++;
+    return arg;
+}
+
+/* resume is non-NULL for a session inherited from a previous server binary */
+void handle_client_process(int client_fd, const HandoffSession *resume, int websocket) {
+    char buffer[BUFFER_SIZE];
+    char username[CREDENTIAL_LEN];
+    char password[CREDENTIAL_LEN];
+    char room[ROOM_NAME_LEN];
+    char message[BUFFER_SIZE + 100];
+    int bytes_read;
+    RenderFragments frag;
+    RenderedMessage rendered;
+    TRACE_NAME("client");
+
+    /* A hot upgrade asks us to exit at the next recv; SIGUSR2 is only taken there */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_upgrade_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+    sigset_t usr2_mask;
+    sigemptyset(&usr2_mask);
+    sigaddset(&usr2_mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &usr2_mask, NULL);
+    signal(SIGPIPE, SIG_IGN);  // sendfile() has no MSG_NOSIGNAL; a closed peer is an error return
+    
+    child_websocket = websocket;
+    ws_parser_init(&ws_parser);
+
+    if (resume) {
+        /* Already authenticated by the previous binary: no login, no welcome */
+        snprintf(username, sizeof(username), "%s", resume->username);
+        snprintf(room, sizeof(room), "%s", resume->room);
+        password[0] = '\0';
+    } else {
+        client_login(client_fd, username, password);
+        strcpy(room, "general");
+        
+        /* A resuming client comes back to the first room it lists */
+        uint64_t ignored;
+        char first_room[ROOM_NAME_LEN];
+        if (child_resume && resume_next(child_resume_spec, first_room, &ignored) && first_room[0]) {
+            snprintf(room, sizeof(room), "%s", first_room);
+        }
+    }
+
+    /* Store user info */
+    shm_lock_acquire();
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].fd == client_fd) {
+            strncpy(shm_buffer->clients[i].username, username, sizeof(shm_buffer->clients[i].username) - 1);
+            strncpy(shm_buffer->clients[i].password, password, sizeof(shm_buffer->clients[i].password) - 1);
+            shm_buffer->clients[i].authenticated = 1;
+            strcpy(shm_buffer->clients[i].room, room);
+            shm_buffer->clients[i].process_id = getpid();
+            
+            /* Subscriptions start at login, so half-logged-in sockets receive no room traffic.
+               A resuming client is subscribed by the parent, in queue order with its replay. */
+            SharedClient *c = &shm_buffer->clients[i];
+            if (!child_resume) {
+                room_subscribe(c->slot, &c->subs, room);
+                if (!resume) presence_note(username, room, PRESENCE_ONLINE, -1, 0);
+            }
+            for (int s = 0; resume && s < MAX_SUBSCRIPTIONS && resume->subs[s][0]; s++) {
+                room_subscribe(c->slot, &c->subs, resume->subs[s]);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    render_set_user(&frag, username);
+    render_set_room(&frag, room);
+    snprintf(child_username, sizeof(child_username), "%s", username);
+
+    if (!resume) {
+        /* Deliver queued messages */
+        deliver_queued_messages(client_fd, username);
+        
+        /* Replay request; if the queue cannot take it, fall back to a plain login */
+        if (child_resume &&
+            !queue_broadcast(child_resume_spec, strlen(child_resume_spec), client_fd, -1, room, 4,
+                             BCAST_PRIO_CHAT, NULL)) {
+            shm_lock_acquire();
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) {
+                SharedClient *c = &shm_buffer->clients[idx];
+                room_subscribe(c->slot, &c->subs, room);
+                presence_note(username, room, PRESENCE_ONLINE, -1, 0);
+            }
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            char *busy = "[Server]: Server busy - missed messages were not replayed.\n";
+            client_reply(client_fd, busy, strlen(busy));
+        }
+
+        /* Join notification */
+        snprintf(message, sizeof(message), "[Server]: %s has joined #%s (Process: %d)\n", username, room, getpid());
+        printf("%s", message);
+        log_message(message);
+        broadcast_notice(message, room);
+    }
+
+    /* Message handling loop */
+    while ((bytes_read = client_read(client_fd, buffer, BUFFER_SIZE - 1)) > 0) {
+        buffer[bytes_read] = '\0';
+        TRACE_SAMPLE();
+        uint64_t msg_id = take_message_id(buffer, &bytes_read);
+        if (bytes_read == 0) continue;
+        
+        /* Command handling */
+        if (strncmp(buffer, "/pong", 5) == 0) {
+            /* Heartbeat reply: free of charge */
+            touch_activity(client_fd);
+        }
+        else if (strncmp(buffer, "/ack ", 5) == 0 || strncmp(buffer, "/read ", 6) == 0) {
+            /* Receipts: free too, they only move marks the parent collects on its timer */
+            record_acks(client_fd, buffer[1] == 'r', buffer + (buffer[1] == 'r' ? 6 : 5));
+        }
+        else if (!admit_message(client_fd, (size_t)bytes_read)) {
+            char *slow = "[Server]: Slow down - message not sent.\n";
+            client_reply(client_fd, slow, strlen(slow));
+        }
+        else if (strncmp(buffer, "/stats", 6) == 0 && (buffer[6] == '\n' || buffer[6] == '\0')) {
+            /* Load-shedding counters */
+            shm_lock_acquire();
+            LoadStats st = shm_buffer->stats;
+            int level = shm_buffer->overload_level;
+            int depth = shm_buffer->broadcast_count;
+            int control_depth = shm_buffer->lane_count[LANE_CONTROL];
+            uint32_t queue_bytes = arena_used(&shm_buffer->queue_arena);
+            uint64_t arena_full = shm_buffer->queue_arena.failures;
+            int recent_count = shm_buffer->message_count;
+            uint32_t recent_bytes = arena_used(&shm_buffer->recent_arena);
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            unsigned long avg_wait[LANES];
+            for (int l = 0; l < LANES; l++) {
+                avg_wait[l] = st.lane_writes[l] ? st.lane_wait_ms[l] / st.lane_writes[l] : 0;
+            }
+            
+            static const char *level_names[] = { "normal", "rejecting logins", "throttling", "shedding notices" };
+            char stats_msg[BUFFER_SIZE * 2];
+            snprintf(stats_msg, sizeof(stats_msg),
+                "\n[Server Load]:\n"
+                "  • Overload level: %d (%s)\n"
+                "  • Broadcast queue: %d/%d (control %d/%d), %u/%u bytes, %llu refused for space\n"
+                "  • Recent history: %d messages in %u/%u bytes\n"
+                "  • Room rings: %d rooms in %lu/%lu KB, %lu of %lu requests from memory (%lu%%), %lu rooms evicted\n"
+                "  • Control lane: %lu writes, avg %lu ms, max %lu ms queued\n"
+                "  • Bulk lane: %lu writes, avg %lu ms, max %lu ms queued\n"
+                "  • Rate-limited messages: %lu\n"
+                "  • Room budget drops: %lu\n"
+                "  • Logins rejected: %lu\n"
+                "  • Notices shed: %lu\n"
+                "  • Queue-full drops: %lu\n"
+                "  • Overload transitions: %lu\n"
+                "  • Presence changes coalesced: %lu\n"
+                "  • Presence changes dropped: %lu\n"
+                "  • Duplicate messages dropped: %lu\n"
+                "  • Pooled room fan-outs: %lu (%d senders, %lu chunks stolen)\n"
+                "  • Files: %lu stored (%lu KB in), %lu sent (%lu KB out)\n\n",
+                level, level_names[level], depth, MAX_BROADCAST_QUEUE, control_depth, CONTROL_QUEUE_SLOTS,
+                queue_bytes, QUEUE_ARENA_BYTES, (unsigned long long)arena_full,
+                recent_count, recent_bytes, RECENT_ARENA_BYTES,
+                st.ring_rooms, st.ring_bytes >> 10, (unsigned long)(room_ring_budget >> 10), st.ring_hits,
+                st.ring_requests, st.ring_requests ? st.ring_hits * 100 / st.ring_requests : 100, st.ring_evictions,
+                st.lane_writes[LANE_CONTROL], avg_wait[LANE_CONTROL], st.lane_wait_max_ms[LANE_CONTROL],
+                st.lane_writes[LANE_BULK], avg_wait[LANE_BULK], st.lane_wait_max_ms[LANE_BULK],
+                st.rate_limited_msgs, st.room_budget_drops, st.logins_rejected,
+                st.notices_dropped, st.queue_full_drops, st.overload_transitions,
+                st.presence_coalesced, st.presence_dropped, st.duplicates_dropped,
+                st.fanouts_pooled, st.fanout_threads, st.fanout_steals,
+                st.files_stored, st.file_bytes_in >> 10, st.files_sent, st.file_bytes_out >> 10);
+            client_reply(client_fd, stats_msg, strlen(stats_msg));
+        }
+        else if (strncmp(buffer, "/pm ", 4) == 0) {
+            char *cmd = buffer + 4;
+            char *space = strchr(cmd, ' ');
+            if (space) {
+                *space = '\0';
+                char *target_user = cmd;
+                char *pm_msg = space + 1;
+                pm_msg[strcspn(pm_msg, "\n")] = 0;
+                
+                if (send_private_message(target_user, pm_msg, username, client_fd)) {
+                    render_pm_line(&rendered, "[PM to ", target_user, pm_msg);
+                    client_reply(client_fd, rendered.text, rendered.len);
+                } else {
+                    char *queued = "[Server]: User offline. Message queued for delivery.\n";
+                    client_reply(client_fd, queued, strlen(queued));
+                }
+            }
+        }
+        else if (strncmp(buffer, "/help", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
+            /* Show help menu */
+            char help_menu[BUFFER_SIZE * 3];
+            snprintf(help_menu, sizeof(help_menu),
+                "\n╔════════════════════════════════════════════════════════════════╗\n"
+                "║                     AVAILABLE COMMANDS                         ║\n"
+                "╠════════════════════════════════════════════════════════════════╣\n"
+                "║                                                                ║\n"
+                "║  💬 MESSAGING:                                                 ║\n"
+                "║     • Type normally to send message to current room           ║\n"
+                "║     • /pm <user> <message>  - Send private message            ║\n"
+                "║     • /upload <file>        - Share a file with the room      ║\n"
+                "║     • /download <hash>      - Fetch a shared file             ║\n"
+                "║     • /encrypt <pass> <msg> - Post an encrypted message       ║\n"
+                "║     • /decrypt <pass> [msg] - Decrypt one or recent messages  ║\n"
+                "║                                                                ║\n"
+                "║  🏢 ROOMS:                                                     ║\n"
+                "║     • /room                 - Show current room               ║\n"
+                "║     • /join <roomname>      - Join/create a room              ║\n"
+                "║     • /sub [room]           - Also watch a room (or list)     ║\n"
+                "║     • /unsub <room>         - Stop watching a room            ║\n"
+                "║     • /say <room> <message> - Post to a watched room          ║\n"
+                "║     • /rooms                - List all active rooms           ║\n"
+                "║     • /recent [n]           - Recent messages in this room     ║\n"
+                "║     • /search <words>       - Search history (#room @user)    ║\n"
+                "║                                                                ║\n"
+                "║  👥 USERS:                                                     ║\n"
+                "║     • /users                - List users in current room      ║\n"
+                "║     • /stats                - Show server load counters       ║\n"
+                "║     • /away, /back          - Set or clear away status        ║\n"
+                "║     • /presence on|off      - Compact presence updates        ║\n"
+                "║                                                                ║\n"
+                "║  ℹ️  HELP:                                                      ║\n"
+                "║     • /help                 - Show this menu again            ║\n"
+                "║                                                                ║\n"
+                "╚════════════════════════════════════════════════════════════════╝\n\n");
+            client_reply(client_fd, help_menu, strlen(help_menu));
+        }
+        else if (strncmp(buffer, "/recent", 7) == 0) {
+            /* "/recent [n]": the parent answers from the current room's ring */
+            char request[32];
+            int n = snprintf(request, sizeof(request), "recent %d", atoi(buffer + 7));
+            shm_lock_acquire();
+            char current_room[ROOM_NAME_LEN] = "general";
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) strcpy(current_room, shm_buffer->clients[idx].room);
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            if (!queue_broadcast(request, (size_t)n, client_fd, -1, current_room, 5, BCAST_PRIO_CHAT, NULL)) {
+                char *busy = "[Server]: Server busy - try /recent again.\n";
+                client_reply(client_fd, busy, strlen(busy));
+            }
+        }
+        else if (strncmp(buffer, "/search", 7) == 0 &&
+                 (buffer[7] == ' ' || buffer[7] == '\n' || buffer[7] == '\r' || buffer[7] == '\0')) {
+            search_command(client_fd, buffer + 7);
+        }
+        else if (strncmp(buffer, "/join ", 6) == 0) {
+            /* Join/create a room: it replaces the current room; other subscriptions stay */
+            char *room_str = buffer + 6;
+            room_str[strcspn(room_str, "\n")] = 0;
+            room_str[strnlen(room_str, ROOM_NAME_LEN - 1)] = '\0';
+            
+            if (strlen(room_str) > 0) {
+                char old_room[ROOM_NAME_LEN] = "";
+                int result = -1;
+                int already = 0;
+                
+                shm_lock_acquire();
+                int idx = find_client_by_fd(client_fd);
+                if (idx >= 0) {
+                    SharedClient *c = &shm_buffer->clients[idx];
+                    strcpy(old_room, c->room);
+                    int r = room_find(room_str);
+                    already = r >= 0 && (c->subs & (1ULL << r));
+                    if (strcmp(old_room, room_str) == 0) {
+                        result = r;
+                    } else {
+                        room_unsubscribe(c->slot, &c->subs, room_find(old_room));
+                        result = room_subscribe(c->slot, &c->subs, room_str);
+                        if (result < 0) {
+                            room_subscribe(c->slot, &c->subs, old_room);
+                        } else {
+                            strcpy(c->room, room_str);
+                            presence_note(username, old_room, PRESENCE_LEFT, -1, 0);
+                            if (!already) {
+                                presence_note(username, room_str, c->away ? PRESENCE_AWAY : PRESENCE_ONLINE, -1, 0);
+                            }
+                        }
+                    }
+                }
+                pthread_mutex_unlock(&shm_buffer->shm_lock);
+                
+                if (result < 0) {
+                    char *err = "[Server]: Too many active rooms - try an existing one.\n";
+                    client_reply(client_fd, err, strlen(err));
+                } else {
+                    if (strcmp(old_room, room_str) != 0) {
+                        render_set_room(&frag, room_str);
+                        
+                        /* Notify room left */
+                        char leaving_msg[BUFFER_SIZE];
+                        snprintf(leaving_msg, sizeof(leaving_msg), 
+                            "[Server]: %s has left #%s\n", username, old_room);
+                        broadcast_notice(leaving_msg, old_room);
+                        
+                        /* Notify room joined, unless already watching it */
+                        if (!already) {
+                            char joining_msg[BUFFER_SIZE];
+                            snprintf(joining_msg, sizeof(joining_msg), 
+                                "[Server]: %s has joined #%s\n", username, room_str);
+                            broadcast_notice(joining_msg, room_str);
+                        }
+                    }
+                    
+                    /* Confirm to user */
+                    char confirm[BUFFER_SIZE];
+                    snprintf(confirm, sizeof(confirm), 
+                        "[Server]: You are now in room #%s\n", room_str);
+                    client_reply(client_fd, confirm, strlen(confirm));
+                    
+                    /* Then what the room said that it has not seen, from the parent */
+                    if (strcmp(old_room, room_str) != 0) {
+                        queue_broadcast("join", 4, client_fd, -1, room_str, 5, BCAST_PRIO_CHAT, NULL);
+                    }
+                }
+            } else {
+                char *err = "[Server]: Room name cannot be empty.\n";
+                client_reply(client_fd, err, strlen(err));
+            }
+        }
+        else if (strncmp(buffer, "/sub", 4) == 0 && (buffer[4] == '\n' || buffer[4] == '\0')) {
+            /* List subscriptions */
+            char list[BUFFER_SIZE];
+            size_t len = (size_t)snprintf(list, sizeof(list), "[Server]: Subscribed rooms:");
+            
+            shm_lock_acquire();
+            int idx = find_client_by_fd(client_fd);
+            uint64_t subs = idx >= 0 ? shm_buffer->clients[idx].subs : 0;
+            for (int r = 0; subs; r++, subs >>= 1) {
+                if (!(subs & 1) || len >= sizeof(list)) continue;
+                const char *name = shm_buffer->rooms[r].name;
+                len += (size_t)snprintf(list + len, sizeof(list) - len, " #%s%s", name,
+                                        strcmp(name, shm_buffer->clients[idx].room) == 0 ? " (current)" : "");
+            }
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            if (len > sizeof(list) - 2) len = sizeof(list) - 2;
+            list[len++] = '\n';
+            client_reply(client_fd, list, len);
+        }
+        else if (strncmp(buffer, "/sub ", 5) == 0) {
+            /* Watch another room without leaving the current one */
+            char target[ROOM_NAME_LEN];
+            parse_room_arg(buffer + 5, target);
+            
+            int result = -3;
+            int already = 0;
+            if (target[0]) {
+                shm_lock_acquire();
+                int idx = find_client_by_fd(client_fd);
+                if (idx >= 0) {
+                    SharedClient *c = &shm_buffer->clients[idx];
+                    int r = room_find(target);
+                    already = r >= 0 && (c->subs & (1ULL << r));
+                    result = room_subscribe(c->slot, &c->subs, target);
+                    if (result >= 0 && !already) {
+                        presence_note(username, target, c->away ? PRESENCE_AWAY : PRESENCE_ONLINE, -1, 0);
+                    }
+                }
+                pthread_mutex_unlock(&shm_buffer->shm_lock);
+            }
+            
+            char reply[BUFFER_SIZE];
+            if (result >= 0) {
+                if (!already) {
+                    char joining_msg[BUFFER_SIZE];
+                    snprintf(joining_msg, sizeof(joining_msg), "[Server]: %s has joined #%s\n", username, target);
+                    broadcast_notice(joining_msg, target);
+                }
+                snprintf(reply, sizeof(reply),
+                    "[Server]: Subscribed to #%s - post there with /say %s <message>\n", target, target);
+            } else if (result == -2) {
+                snprintf(reply, sizeof(reply),
+                    "[Server]: You can watch at most %d rooms - /unsub one first.\n", MAX_SUBSCRIPTIONS);
+            } else if (result == -1) {
+                snprintf(reply, sizeof(reply), "[Server]: Too many active rooms - try an existing one.\n");
+            } else {
+                snprintf(reply, sizeof(reply), "[Server]: Usage: /sub <room>\n");
+            }
+            client_reply(client_fd, reply, strlen(reply));
+        }
+        else if (strncmp(buffer, "/unsub ", 7) == 0) {
+            /* Stop watching a room; the current room is left with /join */
+            char target[ROOM_NAME_LEN];
+            parse_room_arg(buffer + 7, target);
+            
+            int result = 0;  // 1 left, -1 current room, 0 not subscribed
+            shm_lock_acquire();
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0 && target[0]) {
+                SharedClient *c = &shm_buffer->clients[idx];
+                int r = room_find(target);
+                if (strcmp(c->room, target) == 0) {
+                    result = -1;
+                } else if (r >= 0 && (c->subs & (1ULL << r))) {
+                    room_unsubscribe(c->slot, &c->subs, r);
+                    presence_note(username, target, PRESENCE_LEFT, -1, 0);
+                    result = 1;
+                }
+            }
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            char reply[BUFFER_SIZE];
+            if (result == 1) {
+                char leaving_msg[BUFFER_SIZE];
+                snprintf(leaving_msg, sizeof(leaving_msg), "[Server]: %s has left #%s\n", username, target);
+                broadcast_notice(leaving_msg, target);
+                snprintf(reply, sizeof(reply), "[Server]: Unsubscribed from #%s\n", target);
+            } else if (result == -1) {
+                snprintf(reply, sizeof(reply),
+                    "[Server]: #%s is your current room - /join another room first.\n", target);
+            } else {
+                snprintf(reply, sizeof(reply), "[Server]: You are not subscribed to #%s\n", target);
+            }
+            client_reply(client_fd, reply, strlen(reply));
+        }
+        else if (strncmp(buffer, "/away", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
+            char *reply = set_away(client_fd, 1)
+                ? "[Server]: You are marked away - /back or any message clears it.\n"
+                : "[Server]: You are already away.\n";
+            client_reply(client_fd, reply, strlen(reply));
+        }
+        else if (strncmp(buffer, "/back", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
+            char *reply = set_away(client_fd, 0)
+                ? "[Server]: Welcome back.\n"
+                : "[Server]: You are not away.\n";
+            client_reply(client_fd, reply, strlen(reply));
+        }
+        else if (strncmp(buffer, "/presence ", 10) == 0) {
+            /* Compact presence lines instead of join/leave/away text */
+            char *arg = buffer + 10;
+            arg[strcspn(arg, "\n")] = 0;
+            int on = strcmp(arg, "on") == 0;
+            
+            char *reply = "[Server]: Usage: /presence on|off\n";
+            if (on || strcmp(arg, "off") == 0) {
+                shm_lock_acquire();
+                int idx = find_client_by_fd(client_fd);
+                if (idx >= 0) shm_buffer->clients[idx].presence_watch = on;
+                pthread_mutex_unlock(&shm_buffer->shm_lock);
+                reply = on ? "[Server]: Presence updates on - [presence #room] +online *away ~typing -gone\n"
+                           : "[Server]: Presence updates off.\n";
+            }
+            client_reply(client_fd, reply, strlen(reply));
+        }
+        else if (strncmp(buffer, "/encrypt ", 9) == 0) {
+            char passphrase[ENCRYPT_PASS_MAX];
+            char *text = split_passphrase(buffer + 9, passphrase);
+            const char *err = text ? encrypt_in_place(text, sizeof(buffer) - (size_t)(text - buffer), passphrase)
+                                   : "[Server]: Usage: /encrypt <passphrase> <message>\n";
+            if (err) {
+                client_reply(client_fd, err, strlen(err));
+            } else {
+                shm_lock_acquire();
+                char current_room[ROOM_NAME_LEN] = "general";
+                int idx = find_client_by_fd(client_fd);
+                if (idx >= 0) strcpy(current_room, shm_buffer->clients[idx].room);
+                pthread_mutex_unlock(&shm_buffer->shm_lock);
+                
+                RenderFragments crypt_frag = frag;
+                render_set_room(&crypt_frag, current_room);
+                render_chat_line(&rendered, &crypt_frag, text, strlen(text));
+                send_chat(client_fd, username, current_room, &rendered, msg_id);
+            }
+        }
+        else if (strncmp(buffer, "/decrypt ", 9) == 0) {
+            decrypt_command(client_fd, buffer + 9);
+        }
+        else if (strncmp(buffer, "/upload ", 8) == 0) {
+            /* Raw file bytes follow; the room hears about it once they are stored */
+            shm_lock_acquire();
+            char current_room[ROOM_NAME_LEN] = "general";
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) strcpy(current_room, shm_buffer->clients[idx].room);
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            RenderFragments file_frag = frag;
+            render_set_room(&file_frag, current_room);
+            if (file_receive(client_fd, username, current_room, &file_frag, buffer + 8, msg_id) < 0) break;
+        }
+        else if (strncmp(buffer, "/download ", 10) == 0) {
+            if (file_send(client_fd, buffer + 10) < 0) break;
+        }
+        else if (strncmp(buffer, "/say ", 5) == 0) {
+            /* Post to a subscribed room other than the current one */
+            char target[ROOM_NAME_LEN];
+            const char *body = parse_room_arg(buffer + 5, target);
+            size_t body_len = (size_t)bytes_read - (size_t)(body - buffer);
+            
+            shm_lock_acquire();
+            int idx = find_client_by_fd(client_fd);
+            int r = target[0] ? room_find(target) : -1;
+            int subscribed = idx >= 0 && r >= 0 && (shm_buffer->clients[idx].subs & (1ULL << r));
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            if (body_len == 0 || body[0] == '\n') {
+                char *err = "[Server]: Usage: /say <room> <message>\n";
+                client_reply(client_fd, err, strlen(err));
+            } else if (!subscribed) {
+                char reply[BUFFER_SIZE];
+                snprintf(reply, sizeof(reply), "[Server]: Subscribe with /sub %s before posting there.\n", target);
+                client_reply(client_fd, reply, strlen(reply));
+            } else {
+                RenderFragments say_frag = frag;
+                render_set_room(&say_frag, target);
+                render_chat_line(&rendered, &say_frag, body, body_len);
+                send_chat(client_fd, username, target, &rendered, msg_id);
+            }
+        }
+        else if (strncmp(buffer, "/room", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
+            /* Show current room */
+            shm_lock_acquire();
+            char current_room[ROOM_NAME_LEN];
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) {
+                strcpy(current_room, shm_buffer->clients[idx].room);
+            } else {
+                strcpy(current_room, "unknown");
+            }
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            char response[BUFFER_SIZE];
+            snprintf(response, sizeof(response), 
+                "[Server]: You are currently in room #%s\n", current_room);
+            client_reply(client_fd, response, strlen(response));
+        }
+        else if (strncmp(buffer, "/rooms", 6) == 0 && (buffer[6] == '\n' || buffer[6] == '\0')) {
+            /* List all active rooms */
+            shm_lock_acquire();
+            char rooms_list[BUFFER_SIZE * 2];
+            strcpy(rooms_list, "\n[Active Rooms]:\n");
+            
+            /* The room table already counts subscribers, browser channels included */
+            for (int r = 0; r < MAX_TRACKED_ROOMS; r++) {
+                const RoomEntry *entry = &shm_buffer->rooms[r];
+                if (entry->name[0] == '\0' || strlen(rooms_list) + ROOM_NAME_LEN + 24 >= sizeof(rooms_list)) {
+                    continue;
+                }
+                char room_info[BUFFER_SIZE];
+                snprintf(room_info, sizeof(room_info), 
+                    "  • #%s (%d user%s)\n", 
+                    entry->name, 
+                    entry->member_count,
+                    entry->member_count != 1 ? "s" : "");
+                strcat(rooms_list, room_info);
+            }
+            
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            strcat(rooms_list, "\n");
+            client_reply(client_fd, rooms_list, strlen(rooms_list));
+        }
+        else if (strncmp(buffer, "/users", 6) == 0 && (buffer[6] == '\n' || buffer[6] == '\0')) {
+            /* List users in current room */
+            shm_lock_acquire();
+            char current_room[ROOM_NAME_LEN];
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) {
+                strcpy(current_room, shm_buffer->clients[idx].room);
+            } else {
+                strcpy(current_room, "general");
+            }
+            
+            char users_list[BUFFER_SIZE * 2];
+            snprintf(users_list, sizeof(users_list), 
+                "\n[Users in #%s]:\n", current_room);
+            
+            /* Everyone subscribed, whether it is their current room or a watched one */
+            int r = room_find(current_room);
+            for (int m = r >= 0 ? room_next_member(&shm_buffer->rooms[r], 0) : -1; m >= 0;
+                 m = room_next_member(&shm_buffer->rooms[r], m + 1)) {
+                char user_info[BUFFER_SIZE];
+                if (m < MAX_CLIENTS) {
+                    int i = find_client_by_fd(shm_buffer->slot_fd[m]);
+                    if (i < 0) continue;
+                    snprintf(user_info, sizeof(user_info), "  • %s%s\n", shm_buffer->clients[i].username,
+                             shm_buffer->clients[i].away ? " (away)" : "");
+                } else {
+                    snprintf(user_info, sizeof(user_info), "  • %s (web)\n",
+                             shm_buffer->channels[m - MAX_CLIENTS].username);
+                }
+                if (strlen(users_list) + strlen(user_info) + 2 < sizeof(users_list)) {
+                    strcat(users_list, user_info);
+                }
+            }
+            
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            strcat(users_list, "\n");
+            client_reply(client_fd, users_list, strlen(users_list));
+        }
+        else {
+            /* Regular message: render once, reuse for stdout, log, history and fan-out */
+            if (child_away) set_away(client_fd, 0);
+            shm_lock_acquire();
+            char current_room[ROOM_NAME_LEN] = "general";
+            int idx = find_client_by_fd(client_fd);
+            if (idx >= 0) strcpy(current_room, shm_buffer->clients[idx].room);
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+            
+            render_chat_line(&rendered, &frag, buffer, (size_t)bytes_read);
+            send_chat(client_fd, username, current_room, &rendered, msg_id);
+        }
     }
+    TRACE_SET(0);
 
-    /* Authenticate */
-    int auth_result = authenticate_user(username, password);
-    if (auth_result != 1) {
-        char *auth_fail = (auth_result == -1) ? 
-            "ERROR: Wrong password. Disconnecting...\n" :
-            "ERROR: Authentication failed. Disconnecting...\n";
-        send(client_fd, auth_fail, strlen(auth_fail), 0);
-        close(client_fd);
-        exit(0);
+    /* Cleanup */
+    shm_lock_acquire();
+    char leaving_user[50];
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].fd == client_fd) {
+            strncpy(leaving_user, shm_buffer->clients[i].username, sizeof(leaving_user) - 1);
+            remove_client_at(i);
+            break;
+        }
     }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
 
-    /* Send welcome message */
-    char welcome[BUFFER_SIZE * 3];
-    snprintf(welcome, sizeof(welcome),
-        "\n╔════════════════════════════════════════════════════════════════╗\n"
-        "║           🎉 WELCOME TO NETCHAT (ENHANCED)! 🎉               ║\n"
-        "╠════════════════════════════════════════════════════════════════╣\n"
-        "║  ✅ Authentication successful!                                ║\n"
-        "║  🔄 Running in separate process (PID: %d)                     ║\n"
-        "║  💾 Shared memory enabled for message history                ║\n"
-        "║  📨 Message queue active for offline delivery                ║\n"
-        "║  🔐 Semaphore controlling concurrent connections             ║\n"
-        "╚════════════════════════════════════════════════════════════════╝\n\n"
-        "╔════════════════════════════════════════════════════════════════╗\n"
-        "║                     AVAILABLE COMMANDS                         ║\n"
-        "╠════════════════════════════════════════════════════════════════╣\n"
-        "║                                                                ║\n"
-        "║  💬 MESSAGING:                                                 ║\n"
-        "║     • Type normally to send message to current room           ║\n"
-        "║     • /pm <user> <message>  - Send private message            ║\n"
-        "║                                                                ║\n"
-        "║  🏢 ROOMS:                                                     ║\n"
-        "║     • /room                 - Show current room               ║\n"
-        "║     • /join <roomname>      - Join/create a room              ║\n"
-        "║     • /rooms                - List all active rooms           ║\n"
-        "║     • /recent               - Show recent messages from memory ║\n"
-        "║                                                                ║\n"
-        "║  👥 USERS:                                                     ║\n"
-        "║     • /users                - List users in current room      ║\n"
-        "║                                                                ║\n"
-        "║  ℹ️  HELP:                                                      ║\n"
-        "║     • /help                 - Show this menu again            ║\n"
-        "║                                                                ║\n"
-        "╚════════════════════════════════════════════════════════════════╝\n\n",
-        getpid());
-    send(client_fd, welcome, strlen(welcome), 0);
+    /* Its rooms hear about it from the next presence flush */
+    snprintf(message, sizeof(message), "[Server]: %s has disconnected (Process: %d exiting)\n", leaving_user, getpid());
+    printf("%s", message);
+    log_message(message);
 
-    /* Store user info */
-    pthread_mutex_lock(&shm_buffer->shm_lock);
+    close(client_fd);
+    exit(0);  // Exit child process
+}
+
+/* ========= ACCEPT PATH ========= */
+
+/* Refuse a connection immediately - never blocks the parent loop */
+void reject_connection(int client_fd, const char *reason) {
+    send(client_fd, reason, strlen(reason), MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+/* Admission control and fork for one accepted socket; resume carries an inherited session */
+void admit_connection(int client_fd, const sigset_t *child_mask, const HandoffSession *resume,
+                      int websocket) {
+    /* Browsers have not upgraded yet: they get an HTTP status instead of chat text */
+    const char *full = websocket ? WS_REJECT : "Server full. Try again later.\n";
+    const char *busy = websocket ? WS_REJECT : "Server busy. Try again later.\n";
+    
+    /* Connection slot: try, never wait */
+    if (sem_trywait(connection_sem) == -1) {
+        reject_connection(client_fd, full);
+        return;
+    }
+    
+    shm_lock_acquire();
+    
+    if (shm_buffer->client_count >= MAX_CLIENTS) {
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        reject_connection(client_fd, full);
+        sem_post(connection_sem);
+        return;
+    }
+    
+    /* First stage of load shedding: turn away new logins */
+    if (!resume && shm_buffer->overload_level >= 1) {
+        shm_buffer->stats.logins_rejected++;
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        reject_connection(client_fd, busy);
+        sem_post(connection_sem);
+        return;
+    }
+    
+    SharedClient *c = &shm_buffer->clients[shm_buffer->client_count];
+    memset(c, 0, sizeof(*c));
+    c->fd = client_fd;
+    c->last_activity_ms = monotonic_ms();
+    c->msg_tokens = (long)RATE_MSG_BURST * TOKEN_SCALE;
+    c->byte_tokens = (long)RATE_BYTE_BURST * TOKEN_SCALE;
+    c->websocket = websocket;
+    c->slot = client_slot_alloc(client_fd);  // client_count < MAX_CLIENTS, so one is free
+    receipts_forget_slot(c->slot);
+    room_rings_forget_slot(c->slot);
+    strcpy(c->room, "general");
+    if (resume) {
+        snprintf(c->username, sizeof(c->username), "%s", resume->username);
+        snprintf(c->room, sizeof(c->room), "%s", resume->room);
+        c->authenticated = 1;
+        c->msg_tokens = resume->msg_tokens;
+        c->byte_tokens = resume->byte_tokens;
+        presence_seed(resume->username, resume->room);
+        for (int s = 0; s < MAX_SUBSCRIPTIONS && resume->subs[s][0]; s++) {
+            presence_seed(resume->username, resume->subs[s]);
+        }
+    }
+    shm_buffer->client_count++;
+    
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    session_open(client_fd, websocket);
+    if (resume) {
+        /* Already logged in; flush what the old process could not deliver before anything new */
+        tw_cancel(&timer_wheel, &parent_sessions[client_fd].login_timer);
+        parent_sessions[client_fd].seq_tags = resume->seq_tags;
+        if (resume->pending_len > 0) {
+            shm_lock_acquire();
+            session_queue_lines(&parent_sessions[client_fd], LANE_BULK, (const char *)(resume + 1),
+                                resume->pending_len, monotonic_ms());
+            pthread_mutex_unlock(&shm_buffer->shm_lock);
+        }
+    }
+    
+    /* Fork a child process to handle client */
+    pid_t pid = fork();
+    
+    if (pid < 0) {
+        perror("Fork failed");
+        shm_lock_acquire();
+        int idx = find_client_by_fd(client_fd);
+        if (idx >= 0) {
+            remove_client_at(idx);
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        session_close(&parent_sessions[client_fd]);
+        reject_connection(client_fd, busy);
+        sem_post(connection_sem);
+    }
+    else if (pid == 0) {
+        /* Child process */
+        sigprocmask(SIG_SETMASK, child_mask, NULL);  // Parent-only signal gating
+        close(server_fd_global);  // Child doesn't need server socket
+        if (ws_fd_global >= 0) close(ws_fd_global);
+        if (unix_fd_global >= 0) close(unix_fd_global);
+        if (http_fd_global >= 0) close(http_fd_global);
+        if (upgrade_listen_fd >= 0) close(upgrade_listen_fd);
+        handle_client_process(client_fd, resume, websocket);
+        /* Never reaches here - handle_client_process calls exit() */
+    }
+    else {
+        /* Parent process */
+        printf("[Server]: Forked child process %d for new client\n", pid);
+        monitor_event(monitor, MON_CONNECT, pid, "fd %d pid %d%s%s", client_fd, (int)pid,
+                      websocket ? " websocket" : "", resume ? " resumed" : "");
+        
+        /* Update client's process ID */
+        parent_sessions[client_fd].pid = pid;
+        shm_lock_acquire();
+        int idx = find_client_by_fd(client_fd);
+        if (idx >= 0) {
+            shm_buffer->clients[idx].process_id = pid;
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
+        
+        /* Parent keeps the socket open for broadcasting - child will close it when done.
+           The connection slot is released when handle_sigchld() reaps the child. */
+    }
+}
+
+/* Accept everything queued on a listener, up to ACCEPT_BATCH per readiness event */
+void accept_batch(int listen_fd, const sigset_t *child_mask, int websocket) {
+    for (int n = 0; n < ACCEPT_BATCH; n++) {
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && server_running) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        
+        if (client_fd >= parent_session_cap) {
+            reject_connection(client_fd, websocket ? WS_REJECT : "Server full. Try again later.\n");
+            continue;
+        }
+        
+        admit_connection(client_fd, child_mask, NULL, websocket);
+    }
+}
+
+/* Bound, listening, non-blocking TCP socket; exits on failure like the rest of startup */
+int open_tcp_listener(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket failed");
+        exit(1);
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Bind failed");
+        exit(1);
+    }
+
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        exit(1);
+    }
+    
+    /* Non-blocking listener: accept_batch() drains it until EAGAIN */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Unix stream listener for same-host clients and gateways. Optional, so a failure
+   is reported and the server carries on over TCP. Access follows the file mode. */
+int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Unix socket failed");
+        return -1;
+    }
+    unlink(path);  // Stale socket file from a previous run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Unix socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* ========= HOT UPGRADE =========
+ * A new binary started with --takeover connects to UPGRADE_SOCKET_PATH. The running
+ * parent stops its children at a message boundary, flushes the broadcast queue into
+ * per-session buffers, then passes the listener and every logged-in socket across
+ * with SCM_RIGHTS. Clients keep their TCP connection and never see a reconnect.
+ */
+
+/* One record per datagram, optionally carrying a single descriptor */
+int handoff_send(int sock, const void *data, size_t len, int fd) {
+    struct iovec iov = { (void *)data, len };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+ssize_t handoff_recv(int sock, void *data, size_t len, int *fd_out) {
+    struct iovec iov = { data, len };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    *fd_out = -1;
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return -1;
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd_out, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return n;
+}
+
+void handoff_header(HandoffHeader *hdr, uint32_t kind, uint32_t session_count) {
+    hdr->magic = HANDOFF_MAGIC;
+    hdr->version = HANDOFF_VERSION;
+    hdr->kind = kind;
+    hdr->session_count = session_count;
+}
+
+/* Listening control socket for the next binary */
+void init_upgrade_socket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, UPGRADE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    
+    unlink(UPGRADE_SOCKET_PATH);
+    upgrade_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (upgrade_listen_fd < 0 ||
+        bind(upgrade_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(upgrade_listen_fd, 1) < 0) {
+        perror("Upgrade socket failed");
+        if (upgrade_listen_fd >= 0) close(upgrade_listen_fd);
+        upgrade_listen_fd = -1;
+        return;
+    }
+    printf("[Upgrade]: Hot upgrade socket at %s\n", UPGRADE_SOCKET_PATH);
+}
+
+/* Stop every child at a message boundary; SIGKILL stragglers after HANDOFF_CHILD_WAIT_MS */
+void stop_children_for_handoff() {
+    shm_lock_acquire();
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].process_id > 0) {
+            kill(shm_buffer->clients[i].process_id, SIGUSR2);
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    
+    uint64_t deadline = monotonic_ms() + HANDOFF_CHILD_WAIT_MS;
+    for (;;) {
+        pid_t pid = waitpid(-1, NULL, WNOHANG);
+        if (pid < 0) return;  // ECHILD: all gone
+        if (pid > 0) continue;
+        if (monotonic_ms() >= deadline) break;
+        usleep(10000);
+    }
+    
+    printf("[Upgrade]: Children slow to stop, killing\n");
+    shm_lock_acquire();
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].process_id > 0) {
+            kill(shm_buffer->clients[i].process_id, SIGKILL);
+        }
+    }
+    pthread_mutex_unlock(&shm_buffer->shm_lock);
+    while (waitpid(-1, NULL, 0) > 0);
+}
+
+/* Old binary: serve one takeover request. Returns only if the handshake is refused. */
+void perform_handoff() {
+    int sock = accept4(upgrade_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) return;
+    
+    HandoffHeader hello, reply;
+    int unused_fd;
+    struct timeval tv = { 2, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    if (handoff_recv(sock, &hello, sizeof(hello), &unused_fd) != sizeof(hello) ||
+        hello.magic != HANDOFF_MAGIC || hello.kind != 0) {
+        close(sock);
+        return;
+    }
+    if (hello.version != HANDOFF_VERSION) {
+        printf("[Upgrade]: Refusing takeover from protocol version %u\n", hello.version);
+        handoff_header(&reply, 2, 0);
+        handoff_send(sock, &reply, sizeof(reply), -1);
+        close(sock);
+        return;
+    }
+    handoff_header(&reply, 1, 0);
+    if (handoff_send(sock, &reply, sizeof(reply), -1) < 0) {
+        close(sock);
+        return;
+    }
+    
+    printf("[Upgrade]: New binary connected, handing off\n");
+    log_message("[Server]: Hot upgrade in progress\n");
+    
+    /* From here on parent output is captured per session instead of written */
+    handoff_in_progress = 1;
+    stop_children_for_handoff();
+    process_broadcasts();
+    
+    /* Children are gone: the shared segment is ours alone */
+    int session_count = 0;
+    for (int i = 0; i < shm_buffer->client_count; i++) {
+        if (shm_buffer->clients[i].authenticated && !shm_buffer->clients[i].bridge) session_count++;
+    }
+    
+    HandoffHeader listener;
+    handoff_header(&listener, 3, (uint32_t)session_count);
+    handoff_send(sock, &listener, sizeof(listener), server_fd_global);
+    if (ws_fd_global >= 0) {
+        handoff_header(&listener, 7, 0);
+        handoff_send(sock, &listener, sizeof(listener), ws_fd_global);
+    }
+    if (unix_fd_global >= 0) {
+        handoff_header(&listener, 8, 0);
+        handoff_send(sock, &listener, sizeof(listener), unix_fd_global);
+    }
+    if (http_fd_global >= 0) {
+        /* Browsers retry a dropped keep-alive connection; the new binary rebuilds its own cache */
+        http_static_stop(http_server);
+        http_server = NULL;
+        handoff_header(&listener, 9, 0);
+        handoff_send(sock, &listener, sizeof(listener), http_fd_global);
+    }
+    
+    /* History ring, oldest first, so /recent survives the restart */
+    static const char *texts[MAX_RECENT_MESSAGES];
+    int recent = recent_newest(texts, MAX_RECENT_MESSAGES);
+    for (int i = 0; i < recent; i++) {
+        char record[sizeof(HandoffHeader) + BUFFER_SIZE];
+        const char *text = texts[i];
+        size_t len = strnlen(text, BUFFER_SIZE - 1);
+        handoff_header((HandoffHeader *)record, 6, 0);
+        memcpy(record + sizeof(HandoffHeader), text, len);
+        handoff_send(sock, record, sizeof(HandoffHeader) + len, -1);
+    }
+    
+    HandoffSession *rec = malloc(sizeof(HandoffSession) + HANDOFF_MAX_PENDING);
+    int handed = 0;
     for (int i = 0; i < shm_buffer->client_count; i++) {
-        if (shm_buffer->clients[i].fd == client_fd) {
-            strncpy(shm_buffer->clients[i].username, username, sizeof(shm_buffer->clients[i].username) - 1);
-            strncpy(shm_buffer->clients[i].password, password, sizeof(shm_buffer->clients[i].password) - 1);
-            shm_buffer->clients[i].authenticated = 1;
-            strcpy(shm_buffer->clients[i].room, "general");
-            shm_buffer->clients[i].process_id = getpid();
-            client_index = i;
-            break;
+        SharedClient *c = &shm_buffer->clients[i];
+        ParentSession *ps = (c->fd >= 0 && c->fd < parent_session_cap) ? &parent_sessions[c->fd] : NULL;
+        
+        /* Channel state lives in the old segment: the gateway reconnects and reopens them */
+        if (c->bridge) {
+            close(c->fd);
+            continue;
+        }
+        if (!c->authenticated || !rec) {
+            const char *bye = "[Server]: Server restarting - please reconnect.\n";
+            handoff_in_progress = 0;  // Goes out now, not into a pending buffer
+            deliver_text(c->fd, bye, strlen(bye));
+            handoff_in_progress = 1;
+            close(c->fd);
+            continue;
+        }
+        
+        memset(rec, 0, sizeof(*rec));
+        handoff_header(&rec->hdr, 4, 0);
+        snprintf(rec->username, sizeof(rec->username), "%s", c->username);
+        snprintf(rec->room, sizeof(rec->room), "%s", c->room);
+        int n = 0;
+        for (int r = 0; r < MAX_TRACKED_ROOMS && n < MAX_SUBSCRIPTIONS; r++) {
+            if ((c->subs & (1ULL << r)) && strcmp(shm_buffer->rooms[r].name, c->room) != 0) {
+                snprintf(rec->subs[n++], ROOM_NAME_LEN, "%s", shm_buffer->rooms[r].name);
+            }
+        }
+        rec->msg_tokens = c->msg_tokens;
+        rec->byte_tokens = c->byte_tokens;
+        rec->websocket = c->websocket;
+        if (ps) {
+            /* Queued output goes first, in lane order, then what arrived during the handoff */
+            size_t backlog = session_take_backlog(ps, (char *)(rec + 1), HANDOFF_MAX_PENDING);
+            size_t pending = ps->pending_len < HANDOFF_MAX_PENDING - backlog ? ps->pending_len
+                                                                             : HANDOFF_MAX_PENDING - backlog;
+            if (pending > 0) memcpy((char *)(rec + 1) + backlog, ps->pending, pending);
+            handoff_dropped += ps->out_len + (ps->pending_len - pending);
+            rec->pending_len = (uint32_t)(backlog + pending);
+            rec->seq_tags = ps->seq_tags;
         }
+        
+        if (handoff_send(sock, rec, sizeof(*rec) + rec->pending_len, c->fd) == 0) {
+            handed++;
+        }
+        close(c->fd);
     }
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
-
-    /* Deliver queued messages */
-    deliver_queued_messages(client_fd, username);
+    free(rec);
+    
+    /* Release every name the new binary is about to create, then let it proceed */
+    if (log_file) fclose(log_file);
+    log_file = NULL;
+    log_archive_close(log_archive);  // The new binary compresses whatever is still queued
+    log_archive = NULL;
+    search_index_close(search_index);  // Flushed: the new binary indexes on from here
+    search_index = NULL;
+    cleanup_shared_memory();
+    mq_close(message_queue);  // Not unlinked: offline messages carry over
+    sem_close(connection_sem);
+    close(upgrade_listen_fd);
+    unlink(UPGRADE_SOCKET_PATH);
+    
+    HandoffHeader end;
+    handoff_header(&end, 5, (uint32_t)handed);
+    handoff_send(sock, &end, sizeof(end), -1);
+    close(sock);
+    close(server_fd_global);
+    if (ws_fd_global >= 0) close(ws_fd_global);
+    if (unix_fd_global >= 0) close(unix_fd_global);  // The socket file now belongs to the new binary
+    if (http_fd_global >= 0) close(http_fd_global);
+    
+    if (handoff_dropped > 0) {
+        printf("[Upgrade]: Dropped %zu bytes of output over the %d-byte per-session limit\n",
+               handoff_dropped, HANDOFF_MAX_PENDING);
+    }
+    printf("[Upgrade]: Handed off %d sessions, exiting\n", handed);
+    exit(0);
+}
 
-    /* Join notification */
-    snprintf(message, sizeof(message), "[Server]: %s has joined #general (Process: %d)\n", username, getpid());
-    printf("%s", message);
-    log_message(message);
-    broadcast_room(message, -1, "general");
+/* Inherited state, received by the new binary before it creates its IPC objects */
+HandoffSession *inherited_sessions[MAX_CLIENTS];
+int inherited_fds[MAX_CLIENTS];
+int inherited_count = 0;
+char *inherited_history[MAX_RECENT_MESSAGES];
+int inherited_history_count = 0;
 
-    /* Message handling loop */
-    while ((bytes_read = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes_read] = '\0';
-        
-        /* Command handling */
-        if (strncmp(buffer, "/pm ", 4) == 0) {
-            char *cmd = buffer + 4;
-            char *space = strchr(cmd, ' ');
-            if (space) {
-                *space = '\0';
-                char *target_user = cmd;
-                char *pm_msg = space + 1;
-                pm_msg[strcspn(pm_msg, "\n")] = 0;
-                
-                if (send_private_message(target_user, pm_msg, username)) {
-                    char confirm[BUFFER_SIZE];
-                    snprintf(confirm, sizeof(confirm), "[PM to %s]: %s\n", target_user, pm_msg);
-                    send(client_fd, confirm, strlen(confirm), 0);
-                } else {
-                    char *queued = "[Server]: User offline. Message queued for delivery.\n";
-                    send(client_fd, queued, strlen(queued), 0);
-                }
-            }
+/* New binary: take the listener and sessions from the running server, or exit */
+void receive_handoff() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, UPGRADE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Takeover connect failed");
+        exit(1);
+    }
+    
+    HandoffHeader hello, reply;
+    int fd;
+    handoff_header(&hello, 0, 0);
+    if (handoff_send(sock, &hello, sizeof(hello), -1) < 0 ||
+        handoff_recv(sock, &reply, sizeof(reply), &fd) != sizeof(reply) || reply.kind != 1) {
+        fprintf(stderr, "Takeover refused by running server\n");
+        exit(1);
+    }
+    
+    size_t cap = sizeof(HandoffSession) + HANDOFF_MAX_PENDING;
+    char *record = malloc(cap);
+    if (!record) {
+        perror("malloc failed");
+        exit(1);
+    }
+    
+    server_fd_global = -1;
+    for (;;) {
+        ssize_t n = handoff_recv(sock, record, cap, &fd);
+        if (n < (ssize_t)sizeof(HandoffHeader)) {
+            fprintf(stderr, "Takeover aborted: running server hung up\n");
+            exit(1);
         }
-        else if (strncmp(buffer, "/help", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
-            /* Show help menu */
-            char help_menu[BUFFER_SIZE * 2];
-            snprintf(help_menu, sizeof(help_menu),
-                "\n╔════════════════════════════════════════════════════════════════╗\n"
-                "║                     AVAILABLE COMMANDS                         ║\n"
-                "╠════════════════════════════════════════════════════════════════╣\n"
-                "║                                                                ║\n"
-                "║  💬 MESSAGING:                                                 ║\n"
-                "║     • Type normally to send message to current room           ║\n"
-                "║     • /pm <user> <message>  - Send private message            ║\n"
-                "║                                                                ║\n"
-                "║  🏢 ROOMS:                                                     ║\n"
-                "║     • /room                 - Show current room               ║\n"
-                "║     • /join <roomname>      - Join/create a room              ║\n"
-                "║     • /rooms                - List all active rooms           ║\n"
-                "║     • /recent               - Show recent messages from memory ║\n"
-                "║                                                                ║\n"
-                "║  👥 USERS:                                                     ║\n"
-                "║     • /users                - List users in current room      ║\n"
-                "║                                                                ║\n"
-                "║  ℹ️  HELP:                                                      ║\n"
-                "║     • /help                 - Show this menu again            ║\n"
-                "║                                                                ║\n"
-                "╚════════════════════════════════════════════════════════════════╝\n\n");
-            send(client_fd, help_menu, strlen(help_menu), 0);
+        HandoffHeader *hdr = (HandoffHeader *)record;
+        if (hdr->magic != HANDOFF_MAGIC) continue;
+        
+        if (hdr->kind == 5) break;
+        if (hdr->kind == 3) {
+            server_fd_global = fd;
         }
-        else if (strncmp(buffer, "/recent", 7) == 0) {
-            /* Show recent messages from shared memory */
-            if (shm_buffer != NULL) {
-                pthread_mutex_lock(&shm_buffer->shm_lock);
-                char recent[BUFFER_SIZE * 2] = "\n[Recent Messages from Shared Memory]:\n";
-                int start = (shm_buffer->write_index - shm_buffer->message_count + MAX_RECENT_MESSAGES) % MAX_RECENT_MESSAGES;
-                for (int i = 0; i < shm_buffer->message_count; i++) {
-                    int idx = (start + i) % MAX_RECENT_MESSAGES;
-                    strcat(recent, shm_buffer->messages[idx]);
-                }
-                pthread_mutex_unlock(&shm_buffer->shm_lock);
-                send(client_fd, recent, strlen(recent), 0);
-            }
+        else if (hdr->kind == 7) {
+            ws_fd_global = fd;
         }
-        else if (strncmp(buffer, "/join ", 6) == 0) {
-            /* Join/create a room */
-            char room_name[ROOM_NAME_LEN];
-            char *room_str = buffer + 6;
-            room_str[strcspn(room_str, "\n")] = 0;
-            
-            if (strlen(room_str) > 0) {
-                pthread_mutex_lock(&shm_buffer->shm_lock);
-                if (client_index >= 0) {
-                    char old_room[ROOM_NAME_LEN];
-                    strcpy(old_room, shm_buffer->clients[client_index].room);
-                    strncpy(shm_buffer->clients[client_index].room, room_str, ROOM_NAME_LEN - 1);
-                    pthread_mutex_unlock(&shm_buffer->shm_lock);
-                    
-                    /* Notify room left */
-                    char leaving_msg[BUFFER_SIZE];
-                    snprintf(leaving_msg, sizeof(leaving_msg), 
-                        "[Server]: %s has left #%s\n", username, old_room);
-                    broadcast_room(leaving_msg, -1, old_room);
-                    
-                    /* Notify room joined */
-                    char joining_msg[BUFFER_SIZE];
-                    snprintf(joining_msg, sizeof(joining_msg), 
-                        "[Server]: %s has joined #%s\n", username, room_str);
-                    broadcast_room(joining_msg, -1, room_str);
-                    
-                    /* Confirm to user */
-                    char confirm[BUFFER_SIZE];
-                    snprintf(confirm, sizeof(confirm), 
-                        "[Server]: You are now in room #%s\n", room_str);
-                    send(client_fd, confirm, strlen(confirm), 0);
-                } else {
-                    pthread_mutex_unlock(&shm_buffer->shm_lock);
-                }
-            } else {
-                char *err = "[Server]: Room name cannot be empty.\n";
-                send(client_fd, err, strlen(err), 0);
-            }
+        else if (hdr->kind == 8) {
+            unix_fd_global = fd;
         }
-        else if (strncmp(buffer, "/room", 5) == 0 && (buffer[5] == '\n' || buffer[5] == '\0')) {
-            /* Show current room */
-            pthread_mutex_lock(&shm_buffer->shm_lock);
-            char current_room[ROOM_NAME_LEN];
-            if (client_index >= 0) {
-                strcpy(current_room, shm_buffer->clients[client_index].room);
-            } else {
-                strcpy(current_room, "unknown");
-            }
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            
-            char response[BUFFER_SIZE];
-            snprintf(response, sizeof(response), 
-                "[Server]: You are currently in room #%s\n", current_room);
-            send(client_fd, response, strlen(response), 0);
+        else if (hdr->kind == 9) {
+            http_fd_global = fd;
         }
-        else if (strncmp(buffer, "/rooms", 6) == 0 && (buffer[6] == '\n' || buffer[6] == '\0')) {
-            /* List all active rooms */
-            pthread_mutex_lock(&shm_buffer->shm_lock);
-            char rooms_list[BUFFER_SIZE * 2];
-            strcpy(rooms_list, "\n[Active Rooms]:\n");
-            
-            /* Count users per room */
-            char room_names[MAX_ROOMS][ROOM_NAME_LEN];
-            int room_counts[MAX_ROOMS] = {0};
-            int room_count = 0;
-            
-            for (int i = 0; i < shm_buffer->client_count; i++) {
-                int found = 0;
-                for (int j = 0; j < room_count; j++) {
-                    if (strcmp(room_names[j], shm_buffer->clients[i].room) == 0) {
-                        room_counts[j]++;
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found && room_count < MAX_ROOMS) {
-                    strcpy(room_names[room_count], shm_buffer->clients[i].room);
-                    room_counts[room_count]++;
-                    room_count++;
-                }
-            }
-            
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            
-            /* Display rooms */
-            for (int i = 0; i < room_count; i++) {
-                char room_info[BUFFER_SIZE];
-                snprintf(room_info, sizeof(room_info), 
-                    "  • #%s (%d user%s)\n", 
-                    room_names[i], 
-                    room_counts[i],
-                    room_counts[i] != 1 ? "s" : "");
-                strcat(rooms_list, room_info);
+        else if (hdr->kind == 6 && inherited_history_count < MAX_RECENT_MESSAGES) {
+            size_t len = (size_t)n - sizeof(HandoffHeader);
+            char *text = malloc(len + 1);
+            if (text) {
+                memcpy(text, record + sizeof(HandoffHeader), len);
+                text[len] = '\0';
+                inherited_history[inherited_history_count++] = text;
             }
-            
-            strcat(rooms_list, "\n");
-            send(client_fd, rooms_list, strlen(rooms_list), 0);
         }
-        else if (strncmp(buffer, "/users", 6) == 0 && (buffer[6] == '\n' || buffer[6] == '\0')) {
-            /* List users in current room */
-            pthread_mutex_lock(&shm_buffer->shm_lock);
-            char current_room[ROOM_NAME_LEN];
-            if (client_index >= 0) {
-                strcpy(current_room, shm_buffer->clients[client_index].room);
+        else if (hdr->kind == 4 && fd >= 0 && inherited_count < MAX_CLIENTS) {
+            HandoffSession *rec = (HandoffSession *)record;
+            size_t size = sizeof(HandoffSession) + rec->pending_len;
+            HandoffSession *copy = malloc(size);
+            if (copy && (size_t)n >= size) {
+                memcpy(copy, rec, size);
+                inherited_sessions[inherited_count] = copy;
+                inherited_fds[inherited_count++] = fd;
             } else {
-                strcpy(current_room, "general");
-            }
-            
-            char users_list[BUFFER_SIZE * 2];
-            snprintf(users_list, sizeof(users_list), 
-                "\n[Users in #%s]:\n", current_room);
-            
-            for (int i = 0; i < shm_buffer->client_count; i++) {
-                if (strcmp(shm_buffer->clients[i].room, current_room) == 0) {
-                    char user_info[BUFFER_SIZE];
-                    snprintf(user_info, sizeof(user_info), 
-                        "  • %s\n", shm_buffer->clients[i].username);
-                    strcat(users_list, user_info);
-                }
+                free(copy);
+                close(fd);
             }
-            
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            
-            strcat(users_list, "\n");
-            send(client_fd, users_list, strlen(users_list), 0);
         }
-        else {
-            /* Regular message */
-            char timestamp[20];
-            get_timestamp(timestamp, sizeof(timestamp));
-            
-            pthread_mutex_lock(&shm_buffer->shm_lock);
-            char current_room[ROOM_NAME_LEN];
-            strcpy(current_room, shm_buffer->clients[client_index].room);
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            
-            snprintf(message, sizeof(message), "%s [#%s] %s: %s", 
-                     timestamp, current_room, username, buffer);
-            
-            printf("%s", message);
-            log_message(message);
-            broadcast_room(message, client_fd, current_room);
+        else if (fd >= 0) {
+            close(fd);
         }
     }
+    free(record);
+    close(sock);
+    
+    if (server_fd_global < 0) {
+        fprintf(stderr, "Takeover aborted: no listening socket received\n");
+        exit(1);
+    }
+    printf("[Upgrade]: Inherited listener and %d sessions\n", inherited_count);
+}
 
-    /* Cleanup */
-    pthread_mutex_lock(&shm_buffer->shm_lock);
-    char leaving_user[50];
-    for (int i = 0; i < shm_buffer->client_count; i++) {
-        if (shm_buffer->clients[i].fd == client_fd) {
-            strncpy(leaving_user, shm_buffer->clients[i].username, sizeof(leaving_user) - 1);
-            for (int j = i; j < shm_buffer->client_count - 1; j++) {
-                shm_buffer->clients[j] = shm_buffer->clients[j + 1];
-            }
-            shm_buffer->client_count--;
-            break;
+/* New binary: refill history and fork a child for every inherited session */
+void resume_inherited_sessions(const sigset_t *child_mask) {
+    for (int i = 0; i < inherited_history_count; i++) {
+        write_to_shared_memory(inherited_history[i], strlen(inherited_history[i]));
+        free(inherited_history[i]);
+    }
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited_fds[i] >= parent_session_cap) {
+            close(inherited_fds[i]);
+        } else {
+            admit_connection(inherited_fds[i], child_mask, inherited_sessions[i],
+                             inherited_sessions[i]->websocket);
         }
+        free(inherited_sessions[i]);
     }
-    pthread_mutex_unlock(&shm_buffer->shm_lock);
-
-    snprintf(message, sizeof(message), "[Server]: %s has disconnected (Process: %d exiting)\n", leaving_user, getpid());
-    printf("%s", message);
-    log_message(message);
-    broadcast_all(message);
-
-    close(client_fd);
-    exit(0);  // Exit child process
+    inherited_history_count = 0;
+    inherited_count = 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
     printf("[DEBUG] Starting main()\n");
     fflush(stdout);
     
-    int client_fd;
-    struct sockaddr_in server_addr;
-    pid_t pid;
+    if (argc > 1 && strcmp(argv[1], "--takeover") == 0) {
+        takeover_mode = 1;
+    }
 
     /* Initialize mutex and log file */
     printf("[DEBUG] Initializing pthread mutex\n");
@@ -974,6 +6786,11 @@ int main() {
         perror("Failed to open log file");
     }
 
+    /* The running server must release its IPC names before we create ours */
+    if (takeover_mode) {
+        receive_handoff();
+    }
+
     /* Initialize IPC resources */
     printf("[DEBUG] Calling init_shared_memory()\n");
     fflush(stdout);
@@ -981,7 +6798,7 @@ int main() {
     
     /* Store parent PID in shared memory */
     parent_pid_global = getpid();
-    pthread_mutex_lock(&shm_buffer->shm_lock);
+    shm_lock_acquire();
     shm_buffer->parent_pid = parent_pid_global;
     pthread_mutex_unlock(&shm_buffer->shm_lock);
     
@@ -992,40 +6809,76 @@ int main() {
     printf("[DEBUG] Calling init_semaphore()\n");
     fflush(stdout);
     init_semaphore();
+    init_timers();
+    init_fanout_pool();
+    init_room_rings();
+    init_history();
+    init_snapshot();
+#if NETCHAT_TRACE
+    init_trace();
+#endif
+    init_monitor();
+    init_search();
+    init_log_rotation();
+    init_file_store();
 
     /* Setup signal handlers */
     signal(SIGINT, handle_shutdown);
     signal(SIGCHLD, handle_sigchld);  // Handle child termination
     signal(SIGUSR1, handle_broadcast_signal);  // Handle broadcast requests from children
 
-    server_fd_global = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd_global < 0) {
-        perror("Socket failed");
-        exit(1);
+    /* An inherited listener is already bound and listening */
+    if (!takeover_mode) {
+        server_fd_global = open_tcp_listener(PORT);
     }
-
-    int opt = 1;
-    setsockopt(server_fd_global, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
-    if (bind(server_fd_global, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        exit(1);
+    fcntl(server_fd_global, F_SETFL, fcntl(server_fd_global, F_GETFL) | O_NONBLOCK);
+    
+    /* Browser clients: RFC 6455 on a second port */
+    const char *env_ws_port = getenv("NETCHAT_WS_PORT");
+    int ws_port = env_ws_port ? atoi(env_ws_port) : WS_PORT;
+    if (ws_fd_global < 0 && ws_port > 0) {
+        ws_fd_global = open_tcp_listener(ws_port);
     }
-
-    if (listen(server_fd_global, 5) < 0) {
-        perror("Listen failed");
-        exit(1);
+    
+    /* Same-host clients and gateways: the same connection machinery without the TCP stack */
+    const char *env_unix_path = getenv("NETCHAT_UNIX_PATH");
+    if (env_unix_path) unix_path_global = env_unix_path;
+    if (unix_fd_global < 0 && unix_path_global[0] != '\0') {
+        unix_fd_global = open_unix_listener(unix_path_global);
+    }
+    
+    /* The web UI itself, so a browser needs nothing but this process to load it */
+    const char *env_http_port = getenv("NETCHAT_HTTP_PORT");
+    const char *env_http_root = getenv("NETCHAT_HTTP_ROOT");
+    int http_port = env_http_port ? atoi(env_http_port) : HTTP_PORT;
+    const char *http_root = env_http_root ? env_http_root : HTTP_ROOT;
+    if (http_fd_global < 0 && http_port > 0) {
+        http_fd_global = open_tcp_listener(http_port);
     }
+    if (http_fd_global >= 0) {
+        http_server = http_static_start(http_fd_global, http_root);
+        if (!http_server) {
+            printf("[HTTP]: %s is not a readable directory, web UI disabled\n", http_root);
+            close(http_fd_global);
+            http_fd_global = -1;
+        }
+    }
+    init_upgrade_socket();
 
     printf("\n");
     printf("╔════════════════════════════════════════════════════════════════╗\n");
     printf("║          NETCHAT SERVER (ENHANCED) - RUNNING                  ║\n");
     printf("╠════════════════════════════════════════════════════════════════╣\n");
     printf("║  Port: %d                                                     ║\n", PORT);
+    if (ws_fd_global >= 0) {
+        printf("║  WebSocket Port: %d                                           ║\n", ws_port);
+    }
+    if (unix_fd_global >= 0) {
+        printf("║  Unix Socket: %s                                  ║\n", unix_path_global);
+    }
+    if (http_server) {
+        printf("║  Web UI Port: %d                                              ║\n", http_port);
+    }
     printf("║  Max Clients: %d                                              ║\n", MAX_CLIENTS);
     printf("║  💾 Shared Memory: ENABLED                                    ║\n");
     printf("║  📨 Message Queue: ENABLED                                    ║\n");
@@ -1034,6 +6887,13 @@ int main() {
     printf("║  Press Ctrl+C for graceful shutdown                          ║\n");
     printf("╚════════════════════════════════════════════════════════════════╝\n\n");
     
+    if (http_server) {
+        int files;
+        size_t bytes, gzip_bytes;
+        http_static_preloaded(http_server, &files, &bytes, &gzip_bytes);
+        printf("[HTTP]: Cached %d files from %s (%zu KB, %zu KB gzipped)\n", files, http_root,
+               bytes / 1024, gzip_bytes / 1024);
+    }
     log_message("[Server]: Enhanced server started with IPC features\n");
     printf("[DEBUG] Entering accept loop\n");
     fflush(stdout);
@@ -1043,26 +6903,83 @@ int main() {
     sigemptyset(&empty_mask);
     sigemptyset(&block_mask);
     sigaddset(&block_mask, SIGUSR1);  // Block SIGUSR1 except during pselect
+    sigaddset(&block_mask, SIGCHLD);  // Reaping touches shm and fds: only while idle in pselect
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGUSR2);  // A trace dump waits for the loop too
     sigprocmask(SIG_BLOCK, &block_mask, NULL);
+    
+    if (takeover_mode) {
+        resume_inherited_sessions(&empty_mask);
+    }
 
+    uint64_t loop_start_ms = monotonic_ms();
+    
     while (server_running) {
         /* Process any pending broadcasts */
         if (broadcast_pending) {
             process_broadcasts();
         }
+#if NETCHAT_TRACE
+        if (trace_dump_requested) {
+            trace_dump_start();
+        }
+#endif
         
         /* Use pselect() with timeout - atomically unblocks signals */
-        fd_set read_fds;
+        fd_set read_fds, write_fds;
         struct timespec timeout;
         
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
         FD_SET(server_fd_global, &read_fds);
+        int max_fd = server_fd_global;
+        if (ws_fd_global >= 0) {
+            FD_SET(ws_fd_global, &read_fds);
+            if (ws_fd_global > max_fd) max_fd = ws_fd_global;
+        }
+        if (unix_fd_global >= 0) {
+            FD_SET(unix_fd_global, &read_fds);
+            if (unix_fd_global > max_fd) max_fd = unix_fd_global;
+        }
+        if (upgrade_listen_fd >= 0) {
+            FD_SET(upgrade_listen_fd, &read_fds);
+            if (upgrade_listen_fd > max_fd) max_fd = upgrade_listen_fd;
+        }
+        
+        /* Connections with queued output wait for writability, unless their child is
+           writing; it signals when done */
+        shm_lock_acquire();
+        for (int i = 0; i < shm_buffer->client_count; i++) {
+            int fd = shm_buffer->clients[i].fd;
+            if (fd < parent_session_cap && fd < FD_SETSIZE && parent_sessions[fd].out_len > 0 &&
+                !shm_buffer->clients[i].child_writing) {
+                FD_SET(fd, &write_fds);
+                if (fd > max_fd) max_fd = fd;
+            }
+        }
+        pthread_mutex_unlock(&shm_buffer->shm_lock);
         
-        timeout.tv_sec = 0;
-        timeout.tv_nsec = 100000000;  // 100ms timeout
+        /* Fire due timers, then sleep only until the next one is due */
+        uint64_t now_ms = monotonic_ms();
+        tw_advance(&timer_wheel, now_ms);
+        
+        /* Loop latency: busy time since pselect last returned. Kept without shm_lock,
+           so raised and taken atomically like the lane wait maximum. */
+        int busy_ms = (int)(monotonic_ms() - loop_start_ms);
+        int worst = __atomic_load_n(&shm_buffer->stats.loop_latency_ms, __ATOMIC_RELAXED);
+        while (busy_ms > worst && !__atomic_compare_exchange_n(&shm_buffer->stats.loop_latency_ms, &worst,
+                                                               busy_ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        int64_t wait_ms = tw_next_timeout_ms(&timer_wheel, now_ms);
+        if (wait_ms < 0 || wait_ms > MAX_POLL_WAIT_MS) {
+            wait_ms = MAX_POLL_WAIT_MS;
+        }
+        timeout.tv_sec = wait_ms / 1000;
+        timeout.tv_nsec = (wait_ms % 1000) * 1000000;
         
         /* pselect atomically unblocks signals during wait */
-        int select_result = pselect(server_fd_global + 1, &read_fds, NULL, NULL, &timeout, &empty_mask);
+        int select_result = pselect(max_fd + 1, &read_fds, &write_fds, NULL, &timeout, &empty_mask);
+        loop_start_ms = monotonic_ms();
         
         if (select_result < 0) {
             if (errno == EINTR) {
@@ -1079,83 +6996,26 @@ int main() {
             continue;
         }
         
-        /* Socket is ready - try to get semaphore */
-        printf("[DEBUG] Waiting for semaphore...\n");
-        fflush(stdout);
-        
-        /* Wait for semaphore (connection slot) */
-        if (sem_wait(connection_sem) == -1) {
-            perror("sem_wait failed");
-            continue;
-        }
-        
-        printf("[DEBUG] Got semaphore, calling accept...\n");
-        fflush(stdout);
-
-        client_fd = accept(server_fd_global, NULL, NULL);
-        
-        printf("[DEBUG] Accept returned fd=%d\n", client_fd);
-        fflush(stdout);
-        
-        if (client_fd < 0) {
-            if (server_running) {
-                perror("Accept failed");
-            }
-            sem_post(connection_sem);  // Release semaphore
-            continue;
-        }
-
-        pthread_mutex_lock(&shm_buffer->shm_lock);
-        
-        if (shm_buffer->client_count >= MAX_CLIENTS) {
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            char *full_msg = "Server full. Try again later.\n";
-            send(client_fd, full_msg, strlen(full_msg), 0);
-            close(client_fd);
-            sem_post(connection_sem);
-            continue;
+        shm_lock_acquire();
+        for (int fd = 0; fd <= max_fd; fd++) {
+            if (FD_ISSET(fd, &write_fds)) session_flush_output(&parent_sessions[fd]);
         }
-        
-        shm_buffer->clients[shm_buffer->client_count].fd = client_fd;
-        shm_buffer->clients[shm_buffer->client_count].authenticated = 0;
-        shm_buffer->clients[shm_buffer->client_count].process_id = 0;
-        strcpy(shm_buffer->clients[shm_buffer->client_count].room, "general");
-        shm_buffer->client_count++;
-        
         pthread_mutex_unlock(&shm_buffer->shm_lock);
-
-        /* Fork a child process to handle client */
-        pid = fork();
         
-        if (pid < 0) {
-            perror("Fork failed");
-            close(client_fd);
-            sem_post(connection_sem);
+        /* Listener is readable - drain the whole backlog in one batch */
+        if (FD_ISSET(server_fd_global, &read_fds)) {
+            accept_batch(server_fd_global, &empty_mask, 0);
         }
-        else if (pid == 0) {
-            /* Child process */
-            close(server_fd_global);  // Child doesn't need server socket
-            handle_client_process(client_fd);
-            /* Never reaches here - handle_client_process calls exit() */
+        if (ws_fd_global >= 0 && FD_ISSET(ws_fd_global, &read_fds)) {
+            accept_batch(ws_fd_global, &empty_mask, 1);
         }
-        else {
-            /* Parent process */
-            printf("[Server]: Forked child process %d for new client\n", pid);
-            
-            /* Update client's process ID */
-            pthread_mutex_lock(&shm_buffer->shm_lock);
-            for (int i = 0; i < shm_buffer->client_count; i++) {
-                if (shm_buffer->clients[i].fd == client_fd) {
-                    shm_buffer->clients[i].process_id = pid;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&shm_buffer->shm_lock);
-            
-            /* Parent keeps the socket open for broadcasting - child will close it when done */
-            
-            /* Release semaphore when child exits */
-            sem_post(connection_sem);
+        if (unix_fd_global >= 0 && FD_ISSET(unix_fd_global, &read_fds)) {
+            accept_batch(unix_fd_global, &empty_mask, 0);
+        }
+        
+        /* A new binary wants to take over; returns only if we refused */
+        if (upgrade_listen_fd >= 0 && FD_ISSET(upgrade_listen_fd, &read_fds)) {
+            perform_handoff();
         }
     }
 
@@ -1165,8 +7025,18 @@ int main() {
     cleanup_shared_memory();
     cleanup_message_queue();
     cleanup_semaphore();
+    if (monitor) monitor_remove(monitor_name);
     
     close(server_fd_global);
+    if (ws_fd_global >= 0) close(ws_fd_global);
+    if (unix_fd_global >= 0) {
+        close(unix_fd_global);
+        unlink(unix_path_global);
+    }
+    http_static_stop(http_server);
+    if (http_fd_global >= 0) close(http_fd_global);
+    search_index_close(search_index);
+    log_archive_close(log_archive);
     if (log_file) {
         fclose(log_file);
     }
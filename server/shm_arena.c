@@ -0,0 +1,151 @@
+#include "shm_arena.h"
+
+#include <string.h>
+
+#define REC_LIVE 1
+#define REC_FREE 2
+#define REC_PAD 3                    // Skips the rest of the ring up to its end
+
+typedef struct {
+    uint32_t gen;                    // Of the allocation; 0 for a pad
+    uint16_t len;                    // Payload bytes; for a pad, the bytes after its header
+    uint16_t state;
+} RecordHeader;
+
+_Static_assert(sizeof(RecordHeader) == ARENA_HEADER, "record header is 8 bytes");
+_Static_assert(sizeof(ShmArena) % ARENA_ALIGN == 0, "records start aligned right after the arena header");
+
+static uint8_t *arena_bytes(const ShmArena *a) {
+    return (uint8_t *)(a + 1);
+}
+
+static RecordHeader *header_at(const ShmArena *a, uint32_t off) {
+    return (RecordHeader *)(arena_bytes(a) + off);
+}
+
+uint32_t arena_record_size(uint32_t len) {
+    return (ARENA_HEADER + len + ARENA_ALIGN - 1) & ~(uint32_t)(ARENA_ALIGN - 1);
+}
+
+static uint32_t span(const RecordHeader *h) {
+    return h->state == REC_PAD ? (uint32_t)ARENA_HEADER + h->len : arena_record_size(h->len);
+}
+
+void arena_init(ShmArena *a, uint32_t capacity) {
+    memset(a, 0, sizeof(*a));
+    if (capacity > ARENA_MAX_BYTES) capacity = ARENA_MAX_BYTES;
+    a->capacity = capacity & ~(uint32_t)(ARENA_ALIGN - 1);
+}
+
+/* Move the tail past every freed record and pad in front of the oldest live one */
+static void reclaim(ShmArena *a) {
+    while (a->used > 0) {
+        RecordHeader *h = header_at(a, a->tail);
+        if (h->state == REC_LIVE) break;
+        uint32_t size = span(h);
+        a->tail += size;
+        a->used -= size;
+        if (a->tail >= a->capacity) a->tail = 0;
+    }
+    if (a->used == 0) a->head = a->tail = 0;  // Empty: start over at the front, in one piece
+}
+
+static void *place(ShmArena *a, uint32_t len, uint32_t reserve, ArenaRef *ref) {
+    uint32_t size = arena_record_size(len);
+    if (len > UINT16_MAX) return NULL;
+
+    /* Contiguous room at head; past the end of the ring it is a pad and the front */
+    uint32_t pad = 0;
+    if (a->used == 0) {
+        if (size > a->capacity) return NULL;
+    } else if (a->head > a->tail) {
+        if (size > a->capacity - a->head) {
+            pad = a->capacity - a->head;
+            if (size > a->tail) return NULL;
+        }
+    } else if (a->head == a->tail || size > a->tail - a->head) {
+        return NULL;
+    }
+    if ((uint64_t)a->used + pad + size + reserve > a->capacity) return NULL;
+
+    if (pad) {
+        RecordHeader *p = header_at(a, a->head);
+        p->gen = 0;
+        p->len = (uint16_t)(pad - ARENA_HEADER);
+        p->state = REC_PAD;
+        a->used += pad;
+        a->head = 0;
+    }
+
+    if (++a->gen == 0) a->gen = 1;
+    RecordHeader *h = header_at(a, a->head);
+    h->gen = a->gen;
+    h->len = (uint16_t)len;
+    h->state = REC_LIVE;
+    ref->off = a->head;
+    ref->gen = a->gen;
+
+    a->head += size;
+    if (a->head == a->capacity) a->head = 0;
+    a->used += size;
+    a->live++;
+    a->allocs++;
+    if (a->used > a->high_water) a->high_water = a->used;
+    return h + 1;
+}
+
+void *arena_alloc(ShmArena *a, uint32_t len, uint32_t reserve, ArenaRef *ref) {
+    void *p = place(a, len, reserve, ref);
+    if (!p) a->failures++;
+    return p;
+}
+
+void *arena_alloc_evict(ShmArena *a, uint32_t len, ArenaRef *ref) {
+    for (;;) {
+        void *p = place(a, len, 0, ref);
+        if (p) return p;
+        if (a->live == 0) {
+            a->failures++;
+            return NULL;
+        }
+        /* reclaim() leaves the oldest live record at the tail */
+        header_at(a, a->tail)->state = REC_FREE;
+        a->live--;
+        a->evictions++;
+        reclaim(a);
+    }
+}
+
+static RecordHeader *lookup(const ShmArena *a, ArenaRef ref) {
+    if (ref.gen == 0 || ref.off % ARENA_ALIGN != 0 || (uint64_t)ref.off + ARENA_HEADER > a->capacity) {
+        return NULL;
+    }
+    RecordHeader *h = header_at(a, ref.off);
+    if (h->gen != ref.gen || h->state != REC_LIVE || ref.off + arena_record_size(h->len) > a->capacity) {
+        return NULL;
+    }
+    return h;
+}
+
+void arena_free(ShmArena *a, ArenaRef ref) {
+    RecordHeader *h = lookup(a, ref);
+    if (!h) return;
+    h->state = REC_FREE;
+    a->live--;
+    reclaim(a);
+}
+
+void *arena_get(ShmArena *a, ArenaRef ref, uint32_t *len) {
+    RecordHeader *h = lookup(a, ref);
+    if (!h) return NULL;
+    if (len) *len = h->len;
+    return h + 1;
+}
+
+uint32_t arena_used(const ShmArena *a) {
+    return a->used;
+}
+
+void arena_reset_high_water(ShmArena *a) {
+    a->high_water = a->used;
+}
@@ -0,0 +1,77 @@
+#ifndef NETCHAT_SHM_ARENA_H
+#define NETCHAT_SHM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= SHARED-MEMORY ARENA =========
+ * Variable-length records in a fixed stretch of shared memory: an 8-byte
+ * header and exactly the payload, rounded up to 8 bytes. Records are cut
+ * from the head of a ring and the space comes back from its tail. One that
+ * would run past the end leaves a pad record there and starts again at
+ * the front. Records may be freed in any order, but the tail only moves
+ * past freed ones, so the oldest record still in use holds back
+ * everything after it. That suits queues and recent-history rings, where
+ * records die roughly in the order they were made.
+ *
+ * Every allocation takes the next value of the arena's generation counter
+ * and stamps it into the header. An ArenaRef is the record's offset and
+ * generation: arena_get() turns it back into the payload only while the
+ * record is live and has not been reused, so a reader holding an old
+ * reference never sees some newer message in its place.
+ *
+ * The arena is position-independent (offsets, no pointers) and does no
+ * locking: callers hold whatever lock guards the memory it lives in.
+ */
+
+#define ARENA_ALIGN 8
+#define ARENA_HEADER 8
+#define ARENA_MAX_BYTES 65536        // Record lengths are 16-bit
+
+typedef struct {
+    uint32_t off;
+    uint32_t gen;                // 0 never names a record
+} ArenaRef;
+
+/* Lay it out as the header immediately followed by its bytes, e.g.
+     ShmArena queue_arena;
+     uint8_t queue_bytes[QUEUE_ARENA_BYTES];
+   with sizeof(ShmArena) a multiple of 8 so nothing comes between. */
+typedef struct {
+    uint32_t capacity;           // Bytes after the header, a multiple of ARENA_ALIGN
+    uint32_t head;               // Where the next record goes
+    uint32_t tail;               // Oldest record not yet reclaimed
+    uint32_t used;               // Bytes from tail to head, pads and freed records included
+    uint32_t gen;                // Last generation handed out
+    uint32_t live;               // Records allocated and not freed
+    uint32_t high_water;         // Most bytes used since arena_reset_high_water()
+    uint32_t evictions;          // Records arena_alloc_evict() pushed out
+    uint64_t allocs;
+    uint64_t failures;           // Allocations refused for lack of room
+} ShmArena;
+
+/* An empty arena over the capacity bytes that follow a */
+void arena_init(ShmArena *a, uint32_t capacity);
+
+/* Room for len payload bytes, leaving at least reserve bytes free; NULL if
+   there is none. The record's reference goes to *ref. */
+void *arena_alloc(ShmArena *a, uint32_t len, uint32_t reserve, ArenaRef *ref);
+
+/* Like arena_alloc() with no reserve, but frees the oldest live records until it fits */
+void *arena_alloc_evict(ShmArena *a, uint32_t len, ArenaRef *ref);
+
+/* Release a record; a stale reference is ignored */
+void arena_free(ShmArena *a, ArenaRef ref);
+
+/* The payload, and its length in *len, while ref is live; NULL once it was freed or reused */
+void *arena_get(ShmArena *a, ArenaRef ref, uint32_t *len);
+
+/* Bytes the records now in the arena take, pads and not yet reclaimed ones included */
+uint32_t arena_used(const ShmArena *a);
+
+/* Bytes a record of len payload bytes takes */
+uint32_t arena_record_size(uint32_t len);
+
+void arena_reset_high_water(ShmArena *a);
+
+#endif
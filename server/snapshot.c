@@ -0,0 +1,261 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+
+/* ========= ON-DISK FORMAT ========= */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t length;             // Bytes after the header
+    uint64_t created;
+    uint32_t sections;
+    uint32_t crc;                // CRC-32 of those bytes
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t records;
+    uint64_t bytes;              // Of the records that follow
+} SectionHeader;
+
+/* ========= WRITER ========= */
+
+static void write_all(SnapshotWriter *w, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (w->fd >= 0 && len > 0) {
+        ssize_t n = write(w->fd, p, len);
+        if (n < 0) {
+            close(w->fd);
+            w->fd = -1;
+            return;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+static void flush_buffer(SnapshotWriter *w) {
+    write_all(w, w->buf, w->used);
+    w->used = 0;
+}
+
+/* Everything after the header goes through here */
+static void append(SnapshotWriter *w, const void *data, size_t len) {
+    w->length += len;
+    while (len > 0) {
+        size_t room = sizeof(w->buf) - w->used;
+        size_t n = len < room ? len : room;
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data = (const uint8_t *)data + n;
+        len -= n;
+        if (w->used == sizeof(w->buf)) flush_buffer(w);
+    }
+}
+
+int snapshot_begin(SnapshotWriter *w, const char *path) {
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    snprintf(w->tmp_path, sizeof(w->tmp_path), "%s.tmp", path);
+    w->fd = open(w->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) return -1;
+    w->length = 0;
+    w->section_at = 0;
+    w->section_count = 0;
+    w->used = 0;
+
+    SnapshotHeader header = { 0 };      // Filled in by snapshot_commit()
+    write_all(w, &header, sizeof(header));
+    return w->fd >= 0 ? 0 : -1;
+}
+
+/* Section headers are written as placeholders and patched once the records are in */
+static void end_section(SnapshotWriter *w) {
+    if (w->section_at == 0 || w->fd < 0) return;
+    flush_buffer(w);
+    SectionHeader sh = { w->section_type, w->section_records, w->section_bytes };
+    if (pwrite(w->fd, &sh, sizeof(sh), (off_t)w->section_at) != sizeof(sh)) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    w->section_at = 0;
+}
+
+void snapshot_section(SnapshotWriter *w, uint32_t type) {
+    end_section(w);
+    w->section_at = sizeof(SnapshotHeader) + w->length;
+    w->section_type = type;
+    w->section_records = 0;
+    w->section_bytes = 0;
+    w->section_count++;
+    SectionHeader sh = { type, 0, 0 };
+    append(w, &sh, sizeof(sh));
+}
+
+void snapshot_put(SnapshotWriter *w, const void *data, size_t len) {
+    append(w, data, len);
+    w->section_bytes += len;
+}
+
+void snapshot_record(SnapshotWriter *w) {
+    w->section_records++;
+}
+
+void snapshot_put_u16(SnapshotWriter *w, uint16_t v) {
+    snapshot_put(w, &v, sizeof(v));
+}
+
+void snapshot_put_u32(SnapshotWriter *w, uint32_t v) {
+    snapshot_put(w, &v, sizeof(v));
+}
+
+void snapshot_put_u64(SnapshotWriter *w, uint64_t v) {
+    snapshot_put(w, &v, sizeof(v));
+}
+
+void snapshot_put_str(SnapshotWriter *w, const char *s, size_t len) {
+    if (len > UINT16_MAX) len = UINT16_MAX;
+    snapshot_put_u16(w, (uint16_t)len);
+    snapshot_put(w, s, len);
+}
+
+int snapshot_commit(SnapshotWriter *w) {
+    end_section(w);
+    flush_buffer(w);
+    if (w->fd < 0) {
+        unlink(w->tmp_path);
+        return -1;
+    }
+
+    /* Read back for the CRC, section headers patched; the pages are still cached */
+    uint32_t crc = (uint32_t)crc32(0, NULL, 0);
+    uint64_t done = 0;
+    while (done < w->length) {
+        size_t n = w->length - done < sizeof(w->buf) ? (size_t)(w->length - done) : sizeof(w->buf);
+        if (pread(w->fd, w->buf, n, (off_t)(sizeof(SnapshotHeader) + done)) != (ssize_t)n) break;
+        crc = (uint32_t)crc32(crc, w->buf, (uInt)n);
+        done += n;
+    }
+
+    SnapshotHeader header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, w->length, (uint64_t)time(NULL),
+                              w->section_count, crc };
+    int ok = done == w->length &&
+             pwrite(w->fd, &header, sizeof(header), 0) == sizeof(header) &&
+             fsync(w->fd) == 0;
+    close(w->fd);
+    w->fd = -1;
+    if (!ok || rename(w->tmp_path, w->path) < 0) {
+        unlink(w->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t snapshot_file_crc(int fd, uint64_t from, uint64_t to) {
+    uint8_t buf[4096];
+    uint32_t crc = (uint32_t)crc32(0, NULL, 0);
+    while (from < to) {
+        size_t n = to - from < sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        if (pread(fd, buf, n, (off_t)from) != (ssize_t)n) return 0;
+        crc = (uint32_t)crc32(crc, buf, (uInt)n);
+        from += n;
+    }
+    return crc;
+}
+
+/* ========= READER ========= */
+
+int snapshot_open(const char *path, Snapshot *s) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const SnapshotHeader *h = base;
+    size_t size = (size_t)st.st_size;
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+        h->length != size - sizeof(SnapshotHeader) ||
+        (uint32_t)crc32(crc32(0, NULL, 0), (const Bytef *)base + sizeof(SnapshotHeader), (uInt)h->length) != h->crc) {
+        munmap(base, size);
+        return -1;
+    }
+    s->base = base;
+    s->size = size;
+    s->created = h->created;
+    s->sections = h->sections;
+    return 0;
+}
+
+void snapshot_close(Snapshot *s) {
+    if (s->base) munmap((void *)s->base, s->size);
+    memset(s, 0, sizeof(*s));
+}
+
+int snapshot_find(const Snapshot *s, uint32_t type, SnapCursor *records, uint32_t *count) {
+    const uint8_t *p = s->base + sizeof(SnapshotHeader);
+    const uint8_t *end = s->base + s->size;
+    for (uint32_t i = 0; s->base && i < s->sections && (size_t)(end - p) >= sizeof(SectionHeader); i++) {
+        SectionHeader sh;
+        memcpy(&sh, p, sizeof(sh));
+        p += sizeof(sh);
+        if (sh.bytes > (uint64_t)(end - p)) return 0;
+        if (sh.type == type) {
+            records->p = p;
+            records->end = p + sh.bytes;
+            *count = sh.records;
+            return 1;
+        }
+        p += sh.bytes;
+    }
+    return 0;
+}
+
+const void *snap_take(SnapCursor *c, size_t len) {
+    if ((size_t)(c->end - c->p) < len) {
+        c->p = c->end;
+        return NULL;
+    }
+    const void *at = c->p;
+    c->p += len;
+    return at;
+}
+
+int snap_u16(SnapCursor *c, uint16_t *v) {
+    const void *at = snap_take(c, sizeof(*v));
+    if (at) memcpy(v, at, sizeof(*v));
+    return at != NULL;
+}
+
+int snap_u32(SnapCursor *c, uint32_t *v) {
+    const void *at = snap_take(c, sizeof(*v));
+    if (at) memcpy(v, at, sizeof(*v));
+    return at != NULL;
+}
+
+int snap_u64(SnapCursor *c, uint64_t *v) {
+    const void *at = snap_take(c, sizeof(*v));
+    if (at) memcpy(v, at, sizeof(*v));
+    return at != NULL;
+}
+
+int snap_str(SnapCursor *c, const char **s, size_t *len) {
+    uint16_t n;
+    if (!snap_u16(c, &n)) return 0;
+    *s = snap_take(c, n);
+    *len = n;
+    return *s != NULL;
+}
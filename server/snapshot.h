@@ -0,0 +1,94 @@
+#ifndef NETCHAT_SNAPSHOT_H
+#define NETCHAT_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= STATE SNAPSHOT =========
+ * One file of typed sections: a header, then for every section its type,
+ * record count and byte length followed by the records, packed. The
+ * header carries the file's length and a CRC-32 of everything after it.
+ * A snapshot is written to <path>.tmp, synced and renamed into place, so
+ * readers only ever see a complete one.
+ *
+ * The writer buffers into its own struct and calls nothing but write(),
+ * fsync() and rename(): it is safe in a child forked from a threaded
+ * process, which is how the server writes snapshots while it keeps
+ * running. snapshot_open() maps a snapshot read-only and accepts it only
+ * if the magic, version, length and CRC all check out; records are then
+ * read in place through a SnapCursor.
+ *
+ * Integers are in host byte order: a snapshot is for warm restarts on
+ * the machine that wrote it, not for interchange.
+ */
+
+#define SNAPSHOT_MAGIC 0x4e43534e    // "NCSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BUFFER 65536
+
+typedef struct {
+    int fd;                      // -1 once the write failed
+    uint64_t length;             // Bytes after the header
+    uint64_t section_at;         // File offset of the open section's header
+    uint32_t section_type;
+    uint32_t section_count;
+    uint32_t section_records;
+    uint64_t section_bytes;
+    size_t used;
+    char tmp_path[512];
+    char path[512];
+    uint8_t buf[SNAPSHOT_BUFFER];
+} SnapshotWriter;
+
+typedef struct {
+    const uint8_t *base;
+    size_t size;
+    uint64_t created;            // Unix time it was written
+    uint32_t sections;
+} Snapshot;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} SnapCursor;
+
+/* Start a snapshot of path; 0, or -1 if the temporary file cannot be created */
+int snapshot_begin(SnapshotWriter *w, const char *path);
+
+/* Close the section before and open one; records follow with snapshot_put() */
+void snapshot_section(SnapshotWriter *w, uint32_t type);
+
+/* Bytes of the current record; snapshot_record() counts one finished */
+void snapshot_put(SnapshotWriter *w, const void *data, size_t len);
+void snapshot_record(SnapshotWriter *w);
+void snapshot_put_u16(SnapshotWriter *w, uint16_t v);
+void snapshot_put_u32(SnapshotWriter *w, uint32_t v);
+void snapshot_put_u64(SnapshotWriter *w, uint64_t v);
+
+/* A u16 length and the bytes; longer strings are cut at 65535 */
+void snapshot_put_str(SnapshotWriter *w, const char *s, size_t len);
+
+/* Finish, sync and move into place; 0, or -1 after removing the temporary file */
+int snapshot_commit(SnapshotWriter *w);
+
+/* CRC-32 of bytes [from, to) of a file, to tie a snapshot to a log it covers up to
+   to; 0 if they cannot all be read */
+uint32_t snapshot_file_crc(int fd, uint64_t from, uint64_t to);
+
+/* Map and validate the snapshot at path; -1 if it is missing or damaged */
+int snapshot_open(const char *path, Snapshot *s);
+void snapshot_close(Snapshot *s);
+
+/* The records of the first section of a type; 0 if the snapshot has none */
+int snapshot_find(const Snapshot *s, uint32_t type, SnapCursor *records, uint32_t *count);
+
+/* Take len bytes from a record: a pointer into the mapping, NULL past the section */
+const void *snap_take(SnapCursor *c, size_t len);
+int snap_u16(SnapCursor *c, uint16_t *v);
+int snap_u32(SnapCursor *c, uint32_t *v);
+int snap_u64(SnapCursor *c, uint64_t *v);
+
+/* A string written by snapshot_put_str(): not terminated, *len bytes at *s */
+int snap_str(SnapCursor *c, const char **s, size_t *len);
+
+#endif
@@ -0,0 +1,12 @@
+#include "thread_util.h"
+
+#include <signal.h>
+
+int thread_start_quiet(pthread_t *tid, void *(*fn)(void *), void *arg) {
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);  // Inherited by the new thread
+    int err = pthread_create(tid, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return err;
+}
@@ -0,0 +1,18 @@
+#ifndef NETCHAT_THREAD_UTIL_H
+#define NETCHAT_THREAD_UTIL_H
+
+#include <pthread.h>
+
+/* ========= HELPER THREADS =========
+ * The server is a signal-driven process: SIGCHLD, SIGUSR1 and the timer
+ * signals are handled on the main thread, which its loop expects. Helper
+ * threads (fan-out senders, the static web server, the log compressor,
+ * the search indexer) start with every signal blocked so the kernel
+ * never picks one of them to run a handler on.
+ */
+
+/* pthread_create() with every signal blocked in the new thread; the
+   caller's mask is left as it was. Returns pthread_create()'s result. */
+int thread_start_quiet(pthread_t *tid, void *(*fn)(void *), void *arg);
+
+#endif
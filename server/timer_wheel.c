@@ -0,0 +1,177 @@
+#include "timer_wheel.h"
+
+/* ========= LIST HELPERS ========= */
+
+static void list_init(TimerNode *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static int list_empty(const TimerNode *head) {
+    return head->next == head;
+}
+
+static void list_add_tail(TimerNode *head, TimerNode *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(TimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+/* Move every node from src onto dst (an empty local head) */
+static void list_splice(TimerNode *src, TimerNode *dst) {
+    list_init(dst);
+    if (list_empty(src)) return;
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    list_init(src);
+}
+
+/* ========= WHEEL ========= */
+
+void tw_init(TimerWheel *tw, uint64_t now_ms, uint32_t tick_ms) {
+    for (int level = 0; level < TW_LEVELS; level++) {
+        for (int slot = 0; slot < TW_SLOTS; slot++) {
+            list_init(&tw->slots[level][slot]);
+        }
+    }
+    tw->now_tick = 0;
+    tw->origin_ms = now_ms;
+    tw->tick_ms = tick_ms ? tick_ms : 1;
+    tw->armed = 0;
+}
+
+void tw_node_init(TimerNode *node) {
+    node->next = NULL;
+    node->prev = NULL;
+    node->expires = 0;
+    node->cb = NULL;
+    node->arg = NULL;
+}
+
+int tw_pending(const TimerNode *node) {
+    return node->next != NULL;
+}
+
+/* Pick the level whose span covers the distance to expiry */
+static void tw_place(TimerWheel *tw, TimerNode *node) {
+    uint64_t delta = node->expires > tw->now_tick ? node->expires - tw->now_tick : 0;
+    int level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >= ((uint64_t)1 << (TW_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    /* Beyond the top level's horizon: park in its farthest slot. expires is left
+       alone, so the cascade that empties that slot places the node again. */
+    uint64_t at = node->expires;
+    uint64_t horizon = (uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS);
+    if (delta >= horizon) {
+        at = tw->now_tick + horizon - 1;
+    }
+
+    int slot = (int)((at >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK);
+    list_add_tail(&tw->slots[level][slot], node);
+}
+
+void tw_arm(TimerWheel *tw, TimerNode *node, uint64_t delay_ms, timer_cb cb, void *arg) {
+    if (tw_pending(node)) {
+        list_unlink(node);
+        tw->armed--;
+    }
+
+    uint64_t ticks = (delay_ms + tw->tick_ms - 1) / tw->tick_ms;
+    if (ticks == 0) ticks = 1;
+
+    node->expires = tw->now_tick + ticks;
+    node->cb = cb;
+    node->arg = arg;
+    tw_place(tw, node);
+    tw->armed++;
+}
+
+void tw_cancel(TimerWheel *tw, TimerNode *node) {
+    if (!tw_pending(node)) return;
+    list_unlink(node);
+    tw->armed--;
+}
+
+/* Re-place the nodes of a higher-level slot now that it has come due */
+static void tw_cascade(TimerWheel *tw, int level, int slot) {
+    TimerNode pending;
+    list_splice(&tw->slots[level][slot], &pending);
+
+    while (!list_empty(&pending)) {
+        TimerNode *node = pending.next;
+        list_unlink(node);
+        tw_place(tw, node);
+    }
+}
+
+int tw_advance(TimerWheel *tw, uint64_t now_ms) {
+    if (now_ms < tw->origin_ms) return 0;
+
+    uint64_t target = (now_ms - tw->origin_ms) / tw->tick_ms;
+    int fired = 0;
+
+    while (tw->now_tick < target) {
+        /* Nothing armed: jump straight to the target tick */
+        if (tw->armed == 0) {
+            tw->now_tick = target;
+            break;
+        }
+
+        tw->now_tick++;
+
+        for (int level = 1; level < TW_LEVELS; level++) {
+            uint64_t below = tw->now_tick >> (TW_SLOT_BITS * (level - 1));
+            if ((below & TW_SLOT_MASK) != 0) break;
+            tw_cascade(tw, level, (int)((tw->now_tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK));
+        }
+
+        TimerNode due;
+        list_splice(&tw->slots[0][tw->now_tick & TW_SLOT_MASK], &due);
+
+        /* Pop one at a time: callbacks may re-arm or cancel other due nodes */
+        while (!list_empty(&due)) {
+            TimerNode *node = due.next;
+            list_unlink(node);
+            tw->armed--;
+            fired++;
+            if (node->cb) {
+                node->cb(node, node->arg);
+            }
+        }
+    }
+
+    return fired;
+}
+
+int64_t tw_next_timeout_ms(const TimerWheel *tw, uint64_t now_ms) {
+    if (tw->armed == 0) return -1;
+
+    uint64_t ticks = 0;
+    for (uint64_t i = 1; i <= TW_SLOTS; i++) {
+        if (!list_empty(&tw->slots[0][(tw->now_tick + i) & TW_SLOT_MASK])) {
+            ticks = i;
+            break;
+        }
+    }
+
+    /* Level 0 is empty: wake up at the next cascade boundary */
+    if (ticks == 0) {
+        ticks = TW_SLOTS - (tw->now_tick & TW_SLOT_MASK);
+    }
+
+    uint64_t due_ms = tw->origin_ms + (tw->now_tick + ticks) * tw->tick_ms;
+    return due_ms > now_ms ? (int64_t)(due_ms - now_ms) : 0;
+}
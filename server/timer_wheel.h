@@ -0,0 +1,54 @@
+#ifndef NETCHAT_TIMER_WHEEL_H
+#define NETCHAT_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= HIERARCHICAL TIMER WHEEL =========
+ * Four levels of 64 slots. Level 0 resolves single ticks, each higher
+ * level covers 64x the span of the one below and cascades down as the
+ * wheel turns. A timer beyond the top level's span waits in its farthest
+ * slot and is placed again each time that slot cascades. Timers are
+ * intrusive doubly-linked nodes, so arming and cancelling are O(1) and
+ * need no allocation.
+ */
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+typedef struct TimerNode TimerNode;
+typedef void (*timer_cb)(TimerNode *node, void *arg);
+
+struct TimerNode {
+    TimerNode *next;
+    TimerNode *prev;
+    uint64_t expires;  // Absolute tick
+    timer_cb cb;
+    void *arg;
+};
+
+typedef struct {
+    TimerNode slots[TW_LEVELS][TW_SLOTS];  // List heads (sentinels)
+    uint64_t now_tick;
+    uint64_t origin_ms;
+    uint32_t tick_ms;
+    size_t armed;
+} TimerWheel;
+
+void tw_init(TimerWheel *tw, uint64_t now_ms, uint32_t tick_ms);
+void tw_node_init(TimerNode *node);
+int tw_pending(const TimerNode *node);
+
+/* Arm (or re-arm) a node to fire delay_ms from the wheel's current time */
+void tw_arm(TimerWheel *tw, TimerNode *node, uint64_t delay_ms, timer_cb cb, void *arg);
+void tw_cancel(TimerWheel *tw, TimerNode *node);
+
+/* Run every timer due at or before now_ms; returns how many fired */
+int tw_advance(TimerWheel *tw, uint64_t now_ms);
+
+/* Milliseconds until the next timer may fire, or -1 when nothing is armed */
+int64_t tw_next_timeout_ms(const TimerWheel *tw, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#if NETCHAT_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_MASK (TRACE_RING_EVENTS - 1)
+
+_Static_assert((TRACE_RING_EVENTS & TRACE_MASK) == 0, "TRACE_RING_EVENTS is a power of two");
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t id;
+    uint16_t point;
+    uint16_t unused;
+    uint32_t arg;
+    uint32_t seq;                // Ring position + 1 once written, 0 while being written
+} TraceEvent;
+
+typedef struct {
+    int32_t pid;                 // Owner; 0 while free
+    int32_t tid;
+    char name[16];
+    uint64_t head;               // Events ever written
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+typedef struct {
+    int32_t parent_pid;          // Called trace_init()
+    uint32_t sample;
+    uint32_t next_id;
+    uint32_t unused;
+    uint64_t clock_base;         // trace_now() and CLOCK_MONOTONIC at trace_init(), to scale ticks
+    uint64_t mono_base_ns;
+    TraceRing rings[TRACE_RINGS];
+} TraceShared;
+
+static const struct {
+    const char *name;
+    const char *arg;             // What arg holds, NULL if nothing
+} trace_points[TP_COUNT] = {
+    [TP_RECV] = { "recv", "bytes" },
+    [TP_PARSE] = { "parse", NULL },
+    [TP_LOCK_WAIT] = { "shm_lock wait", NULL },
+    [TP_QUEUE] = { "queue_broadcast", "type" },
+    [TP_SIGNAL] = { "SIGUSR1", NULL },
+    [TP_QUEUED] = { "queued for parent", "lane" },
+    [TP_DELIVER] = { "deliver", "recipients" },
+    [TP_SEND] = { "send", "fd" },
+    [TP_BACKLOG] = { "send from lane", "fd" },
+};
+
+static TraceShared *trace_shm = NULL;
+static __thread TraceRing *trace_ring = NULL;
+static __thread const char *trace_label = NULL;
+static __thread uint32_t trace_countdown = 0;
+static __thread uint64_t recv_start = 0;
+static __thread uint64_t recv_end = 0;
+static __thread uint32_t recv_bytes = 0;
+static __thread uint64_t parse_start = 0;
+__thread uint32_t trace_current = 0;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return mono_ns();
+#endif
+}
+
+/* A forked child is a new writer: it must not keep writing its parent's ring */
+static void trace_after_fork(void) {
+    trace_ring = NULL;
+    trace_current = 0;
+    trace_countdown = 0;
+}
+
+int trace_init(uint32_t sample) {
+    void *mem = mmap(NULL, sizeof(TraceShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+    trace_shm = mem;
+    trace_shm->parent_pid = (int32_t)getpid();
+    trace_shm->sample = sample;
+    trace_shm->clock_base = trace_now();
+    trace_shm->mono_base_ns = mono_ns();
+    pthread_atfork(NULL, NULL, trace_after_fork);
+    return 0;
+}
+
+static void ring_label(TraceRing *r, int32_t pid, int32_t tid) {
+    const char *name = trace_label ? trace_label : tid == pid ? "main" : "worker";
+    snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+/* A free ring, else one whose process is gone; NULL when all are taken */
+static TraceRing *ring_claim(void) {
+    int32_t pid = (int32_t)getpid();
+    int32_t tid = (int32_t)gettid();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < TRACE_RINGS; i++) {
+            TraceRing *r = &trace_shm->rings[i];
+            int32_t owner = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+            if (pass == 0 ? owner != 0 : (owner == 0 || kill(owner, 0) == 0 || errno != ESRCH)) continue;
+            if (!__atomic_compare_exchange_n(&r->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            /* A dead owner's events must not be read as ours */
+            for (int e = 0; pass == 1 && e < TRACE_RING_EVENTS; e++) {
+                __atomic_store_n(&r->events[e].seq, 0, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);
+            r->tid = tid;
+            ring_label(r, pid, tid);
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void trace_name_thread(const char *name) {
+    trace_label = name;
+    if (trace_ring) ring_label(trace_ring, trace_ring->pid, trace_ring->tid);
+}
+
+void trace_span_at(uint32_t id, int point, uint64_t start, uint64_t end, uint32_t arg) {
+    if (!trace_shm) return;
+    if (!trace_ring && !(trace_ring = ring_claim())) return;
+
+    /* One writer per ring; the sequence number tells a reader whether it raced us */
+    TraceRing *r = trace_ring;
+    uint64_t pos = r->head;
+    TraceEvent *e = &r->events[pos & TRACE_MASK];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->start = start;
+    e->end = end > start ? end : start;
+    e->id = id;
+    e->point = (uint16_t)point;
+    e->arg = arg;
+    __atomic_store_n(&e->seq, (uint32_t)(pos + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_span(uint32_t id, int point, uint64_t start, uint32_t arg) {
+    trace_span_at(id, point, start, trace_now(), arg);
+}
+
+void trace_note_recv(uint64_t start, size_t bytes) {
+    recv_start = start;
+    recv_end = trace_now();
+    recv_bytes = (uint32_t)bytes;
+}
+
+void trace_sample(void) {
+    trace_current = 0;
+    if (!trace_shm || trace_shm->sample == 0) return;
+
+    /* Every process starts its count somewhere else, so first messages are not all traced */
+    if (trace_countdown == 0) trace_countdown = 1 + (uint32_t)getpid() % trace_shm->sample;
+    if (--trace_countdown > 0) return;
+    trace_countdown = trace_shm->sample;
+
+    uint32_t id = __atomic_add_fetch(&trace_shm->next_id, 1, __ATOMIC_RELAXED);
+    if (id == 0) id = __atomic_add_fetch(&trace_shm->next_id, 1, __ATOMIC_RELAXED);
+    trace_current = id;
+    if (recv_end) trace_span_at(id, TP_RECV, recv_start, recv_end, recv_bytes);
+    parse_start = trace_now();
+}
+
+void trace_note_parsed(uint64_t now) {
+    if (parse_start == 0) return;
+    trace_span_at(trace_current, TP_PARSE, parse_start, now, 0);
+    parse_start = 0;
+}
+
+/* ========= CHROME TRACE DUMP ========= */
+
+typedef struct {
+    TraceEvent e;
+    int32_t pid;
+    int32_t tid;
+} DumpEvent;
+
+typedef struct {
+    int fd;
+    size_t used;
+    char buf[65536];
+} DumpOut;
+
+static void out_flush(DumpOut *o) {
+    size_t done = 0;
+    while (o->fd >= 0 && done < o->used) {
+        ssize_t n = write(o->fd, o->buf + done, o->used - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(o->fd);
+            o->fd = -1;
+            break;
+        }
+        done += (size_t)n;
+    }
+    o->used = 0;
+}
+
+static void out_printf(DumpOut *o, const char *fmt, ...) {
+    if (o->used > sizeof(o->buf) - 512) out_flush(o);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->used, sizeof(o->buf) - o->used, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->used += (size_t)n < sizeof(o->buf) - o->used ? (size_t)n : sizeof(o->buf) - o->used - 1;
+}
+
+static int compare_journey(const void *a, const void *b) {
+    const DumpEvent *x = a;
+    const DumpEvent *y = b;
+    if (x->e.id != y->e.id) return x->e.id < y->e.id ? -1 : 1;
+    return (x->e.start > y->e.start) - (x->e.start < y->e.start);
+}
+
+/* Everything still in the rings, each event read only if its writer was not mid-way */
+static size_t collect(DumpEvent *out) {
+    size_t n = 0;
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        TraceRing *r = &trace_shm->rings[i];
+        int32_t pid = __atomic_load_n(&r->pid, __ATOMIC_ACQUIRE);
+        if (pid == 0) continue;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t pos = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (; pos < head; pos++) {
+            TraceEvent *e = &r->events[pos & TRACE_MASK];
+            uint32_t before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            out[n].e = *e;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            uint32_t after = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+            if (before != (uint32_t)(pos + 1) || after != before || out[n].e.point >= TP_COUNT) continue;
+            out[n].pid = pid;
+            out[n].tid = r->tid;
+            n++;
+        }
+    }
+    return n;
+}
+
+long trace_dump(const char *path) {
+    if (!trace_shm) return -1;
+    DumpEvent *events = malloc((size_t)TRACE_RINGS * TRACE_RING_EVENTS * sizeof(DumpEvent));
+    static DumpOut out;
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    out.used = 0;
+    if (!events || out.fd < 0) {
+        free(events);
+        if (out.fd >= 0) close(out.fd);
+        return -1;
+    }
+
+    /* Ticks to microseconds, over everything since trace_init() */
+    uint64_t ticks = trace_now() - trace_shm->clock_base;
+    uint64_t ns = mono_ns() - trace_shm->mono_base_ns;
+    double us_per_tick = ticks > 0 ? (double)ns / (double)ticks / 1000.0 : 0.001;
+    uint64_t base = trace_shm->clock_base;
+
+    size_t count = collect(events);
+    out_printf(&out, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"sample\":%u},\"traceEvents\":[\n",
+               trace_shm->sample);
+    int first = 1;
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        TraceRing *r = &trace_shm->rings[i];
+        if (r->pid == 0) continue;
+        out_printf(&out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %d\"}},\n"
+                   "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                   first ? "" : ",\n", r->pid, r->pid == trace_shm->parent_pid ? "parent" : "client", r->pid,
+                   r->pid, r->tid, r->name);
+        first = 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const DumpEvent *d = &events[i];
+        const char *arg = trace_points[d->e.point].arg;
+        out_printf(&out, "%s{\"name\":\"%s\",\"cat\":\"netchat\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{\"msg\":%u",
+                   first ? "" : ",\n", trace_points[d->e.point].name, (double)(d->e.start - base) * us_per_tick,
+                   (double)(d->e.end - d->e.start) * us_per_tick, d->pid, d->tid, d->e.id);
+        if (arg) out_printf(&out, ",\"%s\":%u", arg, d->e.arg);
+        out_printf(&out, "}}");
+        first = 0;
+    }
+
+    /* One flow per message, from its first event to its last, through the rest in time order */
+    qsort(events, count, sizeof(DumpEvent), compare_journey);
+    for (size_t i = 0; i < count;) {
+        size_t end = i;
+        while (end < count && events[end].e.id == events[i].e.id) end++;
+        for (size_t j = i; end - i > 1 && j < end; j++) {
+            const DumpEvent *d = &events[j];
+            const char *ph = j == i ? "s" : j + 1 == end ? "f" : "t";
+            out_printf(&out, ",\n{\"name\":\"message\",\"cat\":\"journey\",\"ph\":\"%s\",%s\"id\":%u,"
+                       "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                       ph, j + 1 == end ? "\"bp\":\"e\"," : "", d->e.id,
+                       (double)(d->e.start - base) * us_per_tick, d->pid, d->tid);
+        }
+        i = end;
+    }
+    out_printf(&out, "\n]}\n");
+    out_flush(&out);
+    free(events);
+    if (out.fd < 0) return -1;
+    close(out.fd);
+    return (long)count;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef NETCHAT_TRACE_H
+#define NETCHAT_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= HOT-PATH TRACING =========
+ * Trace points along a message's path from the sender's recv() to every
+ * recipient's send(). Each thread records into its own ring in a shared
+ * mapping the parent makes before it forks, so the parent, every client
+ * process and the fan-out senders all write to the same place without a
+ * lock: a ring has one writer, and a reader that loses a race with it sees
+ * a torn event's sequence number change and skips it.
+ *
+ * Only sampled messages are traced. The process that reads a message picks
+ * one in trace_sample() and gives it an id, which travels with the
+ * broadcast to the parent and from there to the output lanes, so every
+ * event of a message's journey carries the same id. Timestamps are the
+ * TSC on x86 (CLOCK_MONOTONIC elsewhere) and are converted to microseconds
+ * only by trace_dump(), which writes everything still in the rings as
+ * Chrome trace JSON (chrome://tracing, ui.perfetto.dev) with a flow arrow
+ * joining each message's events.
+ *
+ * Built with NETCHAT_TRACE=0 every TRACE_* macro compiles to nothing.
+ */
+
+#ifndef NETCHAT_TRACE
+#define NETCHAT_TRACE 1
+#endif
+
+#define TRACE_RINGS 64               // Threads that can trace at once
+#define TRACE_RING_EVENTS 2048       // Per ring, a power of two
+
+/* Where time goes; trace_dump() names them */
+enum {
+    TP_RECV,                         // The recv() that brought the message in
+    TP_PARSE,                        // From there to queueing its broadcast
+    TP_LOCK_WAIT,                    // Waiting for shm_lock to queue it
+    TP_QUEUE,                        // queue_broadcast(), lock wait included
+    TP_SIGNAL,                       // kill(SIGUSR1) to wake the parent
+    TP_QUEUED,                       // In the broadcast queue until the parent took it (cross-process)
+    TP_DELIVER,                      // The parent handing it to every recipient
+    TP_SEND,                         // One recipient's send(), straight to the socket
+    TP_BACKLOG,                      // One recipient's copy, from its output lane into the socket
+    TP_COUNT
+};
+
+#if NETCHAT_TRACE
+
+/* Message being handled by this thread; 0 while it is not sampled */
+extern __thread uint32_t trace_current;
+
+/* Map the rings; 1 in sample messages is traced, none for 0. Before any fork. */
+int trace_init(uint32_t sample);
+
+/* Label this thread's ring in the dump */
+void trace_name_thread(const char *name);
+
+/* Pick the message just read for tracing or not, and make it current */
+void trace_sample(void);
+
+uint64_t trace_now(void);
+
+/* One event of message id from start until now, or until end */
+void trace_span(uint32_t id, int point, uint64_t start, uint32_t arg);
+void trace_span_at(uint32_t id, int point, uint64_t start, uint64_t end, uint32_t arg);
+
+/* The recv() that returned data; the next trace_sample() reports it */
+void trace_note_recv(uint64_t start, size_t bytes);
+
+/* The current message is about to be queued: report its parse time once */
+void trace_note_parsed(uint64_t now);
+
+/* Write every event in the rings to path as Chrome trace JSON; events written or -1 */
+long trace_dump(const char *path);
+
+#define TRACE_STAMP(var) uint64_t var = trace_now()
+#define TRACE_NOW() trace_now()
+#define TRACE_SET(id) (trace_current = (id))
+#define TRACE_ID() trace_current
+#define TRACE_SAMPLE() trace_sample()
+#define TRACE_NAME(name) trace_name_thread(name)
+#define TRACE_SPAN(point, start, arg) \
+    do { if (trace_current) trace_span(trace_current, (point), (start), (uint32_t)(arg)); } while (0)
+#define TRACE_SPAN_ID(id, point, start, arg) \
+    do { if (id) trace_span((id), (point), (start), (uint32_t)(arg)); } while (0)
+#define TRACE_NOTE_RECV(start, bytes) trace_note_recv((start), (size_t)(bytes))
+#define TRACE_NOTE_PARSED(now) do { if (trace_current) trace_note_parsed(now); } while (0)
+
+#else
+
+#define TRACE_STAMP(var) do { } while (0)
+#define TRACE_NOW() 0u
+#define TRACE_SET(id) ((void)0)
+#define TRACE_ID() 0u
+#define TRACE_SAMPLE() ((void)0)
+#define TRACE_NAME(name) ((void)0)
+#define TRACE_SPAN(point, start, arg) ((void)0)
+#define TRACE_SPAN_ID(id, point, start, arg) ((void)0)
+#define TRACE_NOTE_RECV(start, bytes) ((void)0)
+#define TRACE_NOTE_PARSED(now) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "websocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_STATE_BASE 0          // Waiting for the first two header bytes
+#define WS_STATE_EXT 1           // Extended length and masking key
+#define WS_STATE_PAYLOAD 2
+
+/* ========= SHA-1 (handshake and file store) ========= */
+
+static uint32_t rol32(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static void sha1_block(Sha1 *s, const uint8_t *b) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)b[i * 4] << 24 | (uint32_t)b[i * 4 + 1] << 16 |
+               (uint32_t)b[i * 4 + 2] << 8 | (uint32_t)b[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = s->h[0], bb = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20)      { f = (bb & c) | (~bb & d);          k = 0x5A827999; }
+        else if (i < 40) { f = bb ^ c ^ d;                    k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (bb & c) | (bb & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = bb ^ c ^ d;                    k = 0xCA62C1D6; }
+        uint32_t t = rol32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol32(bb, 30);
+        bb = a;
+        a = t;
+    }
+    s->h[0] += a;
+    s->h[1] += bb;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+}
+
+void sha1_init(Sha1 *s) {
+    s->h[0] = 0x67452301;
+    s->h[1] = 0xEFCDAB89;
+    s->h[2] = 0x98BADCFE;
+    s->h[3] = 0x10325476;
+    s->h[4] = 0xC3D2E1F0;
+    s->total = 0;
+    s->used = 0;
+}
+
+void sha1_update(Sha1 *s, const uint8_t *data, size_t len) {
+    s->total += len;
+    while (len > 0) {
+        size_t n = 64 - s->used;
+        if (n > len) n = len;
+        memcpy(s->block + s->used, data, n);
+        s->used += n;
+        data += n;
+        len -= n;
+        if (s->used == 64) {
+            sha1_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+void sha1_final(Sha1 *s, uint8_t out[20]) {
+    uint64_t bits = s->total * 8;
+    uint8_t pad = 0x80;
+    sha1_update(s, &pad, 1);
+    pad = 0;
+    while (s->used != 56) sha1_update(s, &pad, 1);
+    uint8_t len_be[8];
+    for (int i = 0; i < 8; i++) len_be[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha1_update(s, len_be, 8);
+    for (int i = 0; i < 5; i++) {
+        out[i * 4] = (uint8_t)(s->h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(s->h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(s->h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)s->h[i];
+    }
+}
+
+static size_t base64_encode(const uint8_t *in, size_t len, char *out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        out[o++] = table[(v >> 18) & 63];
+        out[o++] = table[(v >> 12) & 63];
+        out[o++] = (i + 1 < len) ? table[(v >> 6) & 63] : '=';
+        out[o++] = (i + 2 < len) ? table[v & 63] : '=';
+    }
+    out[o] = '\0';
+    return o;
+}
+
+/* ========= HANDSHAKE ========= */
+
+size_t ws_handshake_response(const char *request, char *out, size_t cap) {
+    if (strncmp(request, "GET ", 4) != 0) return 0;
+    if (!strcasestr(request, "\r\nUpgrade: websocket")) return 0;
+
+    const char *key = strcasestr(request, "\r\nSec-WebSocket-Key:");
+    if (!key) return 0;
+    key += strlen("\r\nSec-WebSocket-Key:");
+    while (*key == ' ' || *key == '\t') key++;
+    size_t key_len = strcspn(key, " \t\r\n");
+    if (key_len == 0 || key_len > 64) return 0;
+
+    Sha1 s;
+    uint8_t digest[20];
+    char accept[32];
+    sha1_init(&s);
+    sha1_update(&s, (const uint8_t *)key, key_len);
+    sha1_update(&s, (const uint8_t *)WS_GUID, strlen(WS_GUID));
+    sha1_final(&s, digest);
+    base64_encode(digest, sizeof(digest), accept);
+
+    int n = snprintf(out, cap,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    return (n > 0 && (size_t)n < cap) ? (size_t)n : 0;
+}
+
+/* ========= FRAMES ========= */
+
+void ws_unmask(uint8_t *data, size_t len, const uint8_t mask[4], size_t phase) {
+    /* Key rotated to the payload offset and repeated; 16, 8 and 4 keep the phase */
+    uint8_t key[16];
+    for (int i = 0; i < 16; i++) key[i] = mask[(phase + i) & 3];
+
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i k = _mm_loadu_si128((const __m128i *)key);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+#endif
+    uint64_t k64;
+    memcpy(&k64, key, sizeof(k64));
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, sizeof(v));
+        v ^= k64;
+        memcpy(data + i, &v, sizeof(v));
+    }
+    for (; i < len; i++) data[i] ^= key[i & 3];
+}
+
+size_t ws_frame_header(uint8_t *out, int opcode, size_t len) {
+    out[0] = (uint8_t)(0x80 | (opcode & 0x0F));
+    if (len < 126) {
+        out[1] = (uint8_t)len;
+        return 2;
+    }
+    if (len <= 0xFFFF) {
+        out[1] = 126;
+        out[2] = (uint8_t)(len >> 8);
+        out[3] = (uint8_t)len;
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) out[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+    return 10;
+}
+
+void ws_parser_init(WsParser *p) {
+    memset(p, 0, sizeof(*p));
+    p->state = WS_STATE_BASE;
+    p->header_need = 2;
+}
+
+int ws_parser_partial(const WsParser *p) {
+    return p->state != WS_STATE_BASE || p->header_have > 0 || p->in_message;
+}
+
+static int is_control(int opcode) {
+    return opcode >= 0x8;
+}
+
+/* Header complete: validate and set up payload delivery */
+static int ws_begin_payload(WsParser *p) {
+    size_t pos = 2;
+    uint64_t len = p->header[1] & 0x7F;
+    if (len == 126) {
+        len = (uint64_t)p->header[2] << 8 | p->header[3];
+        pos = 4;
+    } else if (len == 127) {
+        len = 0;
+        for (int i = 0; i < 8; i++) len = len << 8 | p->header[2 + i];
+        pos = 10;
+    }
+    memcpy(p->mask, p->header + pos, 4);
+    p->payload_len = len;
+    p->payload_have = 0;
+
+    if (is_control(p->opcode)) {
+        if (!p->fin || len > WS_MAX_CONTROL) return WS_ERROR;
+        if (p->opcode != WS_OP_CLOSE && p->opcode != WS_OP_PING && p->opcode != WS_OP_PONG) return WS_ERROR;
+        return WS_NEED_MORE;
+    }
+
+    if (p->opcode == WS_OP_CONTINUATION) {
+        if (!p->in_message) return WS_ERROR;
+    } else if (p->opcode == WS_OP_TEXT || p->opcode == WS_OP_BINARY) {
+        if (p->in_message) return WS_ERROR;
+        p->message_opcode = p->opcode;
+        p->message_len = 0;
+    } else {
+        return WS_ERROR;
+    }
+
+    if (len > WS_MAX_MESSAGE - p->message_len) return WS_TOO_BIG;
+    return WS_NEED_MORE;
+}
+
+/* Payload complete: report it and rearm for the next header */
+static int ws_end_frame(WsParser *p) {
+    p->state = WS_STATE_BASE;
+    p->header_have = 0;
+    p->header_need = 2;
+
+    if (is_control(p->opcode)) {
+        p->control_opcode = p->opcode;
+        p->control_len = (size_t)p->payload_len;
+        return WS_CONTROL;
+    }
+
+    p->message_len += (size_t)p->payload_len;
+    if (!p->fin) {
+        p->in_message = 1;
+        return WS_NEED_MORE;
+    }
+    p->in_message = 0;
+    return WS_MESSAGE;
+}
+
+int ws_parse(WsParser *p, const uint8_t *data, size_t len, size_t *consumed) {
+    size_t i = 0;
+    int result = WS_NEED_MORE;
+
+    while (i < len || (p->state == WS_STATE_PAYLOAD && p->payload_have == p->payload_len)) {
+        if (p->state == WS_STATE_BASE || p->state == WS_STATE_EXT) {
+            while (p->header_have < p->header_need && i < len) {
+                p->header[p->header_have++] = data[i++];
+            }
+            if (p->header_have < p->header_need) break;
+
+            if (p->state == WS_STATE_BASE) {
+                if (p->header[0] & 0x70) { result = WS_ERROR; break; }      // No extensions negotiated
+                if (!(p->header[1] & 0x80)) { result = WS_ERROR; break; }   // Clients must mask
+                p->fin = (p->header[0] & 0x80) != 0;
+                p->opcode = p->header[0] & 0x0F;
+                size_t len7 = p->header[1] & 0x7F;
+                p->header_need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+                p->state = WS_STATE_EXT;
+                continue;
+            }
+
+            result = ws_begin_payload(p);
+            if (result != WS_NEED_MORE) break;
+            p->state = WS_STATE_PAYLOAD;
+        }
+
+        if (p->state == WS_STATE_PAYLOAD) {
+            size_t want = (size_t)(p->payload_len - p->payload_have);
+            size_t n = (len - i < want) ? len - i : want;
+            uint8_t *dst = is_control(p->opcode)
+                ? p->control + p->payload_have
+                : p->message + p->message_len + p->payload_have;
+
+            memcpy(dst, data + i, n);
+            ws_unmask(dst, n, p->mask, (size_t)(p->payload_have & 3));
+            p->payload_have += n;
+            i += n;
+
+            if (p->payload_have == p->payload_len) {
+                result = ws_end_frame(p);
+                if (result != WS_NEED_MORE) break;
+            }
+        }
+    }
+
+    *consumed = i;
+    return result;
+}
+
+/* ========= MINIMAL JSON ========= */
+
+size_t json_escape(char *out, size_t pos, size_t cap, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (pos + 7 > cap) break;  // Room for the longest escape plus a terminator
+        switch (c) {
+            case '"':  out[pos++] = '\\'; out[pos++] = '"'; break;
+            case '\\': out[pos++] = '\\'; out[pos++] = '\\'; break;
+            case '\n': out[pos++] = '\\'; out[pos++] = 'n'; break;
+            case '\r': out[pos++] = '\\'; out[pos++] = 'r'; break;
+            case '\t': out[pos++] = '\\'; out[pos++] = 't'; break;
+            default:
+                if (c < 0x20) {
+                    pos += (size_t)snprintf(out + pos, cap - pos, "\\u%04x", c);
+                } else {
+                    out[pos++] = (char)c;
+                }
+        }
+    }
+    return pos;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static size_t utf8_put(char *out, size_t pos, size_t cap, uint32_t cp) {
+    if (cp < 0x80) {
+        if (pos + 1 < cap) out[pos++] = (char)cp;
+    } else if (cp < 0x800) {
+        if (pos + 2 < cap) {
+            out[pos++] = (char)(0xC0 | (cp >> 6));
+            out[pos++] = (char)(0x80 | (cp & 0x3F));
+        }
+    } else if (cp < 0x10000) {
+        if (pos + 3 < cap) {
+            out[pos++] = (char)(0xE0 | (cp >> 12));
+            out[pos++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            out[pos++] = (char)(0x80 | (cp & 0x3F));
+        }
+    } else if (pos + 4 < cap) {
+        out[pos++] = (char)(0xF0 | (cp >> 18));
+        out[pos++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[pos++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[pos++] = (char)(0x80 | (cp & 0x3F));
+    }
+    return pos;
+}
+
+static int read_hex4(const char *p, const char *end, uint32_t *out) {
+    if (end - p < 4) return 0;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hex_value(p[i]);
+        if (h < 0) return 0;
+        v = v << 4 | (uint32_t)h;
+    }
+    *out = v;
+    return 1;
+}
+
+/* Start of the value for key, or NULL */
+static const char *json_find_value(const char *json, const char *end, const char *key) {
+    char pattern[64];
+    int plen = snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if (plen <= 0 || (size_t)plen >= sizeof(pattern)) return NULL;
+
+    const char *p = json;
+    while ((p = memmem(p, (size_t)(end - p), pattern, (size_t)plen)) != NULL) {
+        const char *q = p + plen;
+        p = q;
+        while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+        if (q >= end || *q != ':') continue;  // A value that happens to equal the key
+        q++;
+        while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+        return q < end ? q : NULL;
+    }
+    return NULL;
+}
+
+int json_get_bool(const char *json, size_t len, const char *key) {
+    const char *end = json + len;
+    const char *q = json_find_value(json, end, key);
+    return q && end - q >= 4 && memcmp(q, "true", 4) == 0;
+}
+
+int json_get_string(const char *json, size_t len, const char *key, char *out, size_t cap) {
+    if (cap == 0) return 0;
+    const char *end = json + len;
+    const char *q = json_find_value(json, end, key);
+    if (!q || *q != '"') return 0;
+    q++;
+
+    size_t o = 0;
+    while (q < end && *q != '"') {
+        if (*q != '\\') {
+            if (o + 1 < cap) out[o++] = *q;
+            q++;
+            continue;
+        }
+        if (++q >= end) return 0;
+        char esc = *q++;
+        switch (esc) {
+            case 'n': if (o + 1 < cap) out[o++] = '\n'; break;
+            case 'r': if (o + 1 < cap) out[o++] = '\r'; break;
+            case 't': if (o + 1 < cap) out[o++] = '\t'; break;
+            case 'b': if (o + 1 < cap) out[o++] = '\b'; break;
+            case 'f': if (o + 1 < cap) out[o++] = '\f'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!read_hex4(q, end, &cp)) return 0;
+                q += 4;
+                /* Surrogate pair */
+                uint32_t lo;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - q >= 6 && q[0] == '\\' && q[1] == 'u' &&
+                    read_hex4(q + 2, end, &lo) && lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    q += 6;
+                }
+                o = utf8_put(out, o, cap, cp);
+                break;
+            }
+            default: if (o + 1 < cap) out[o++] = esc; break;  // \" \\ \/
+        }
+    }
+    if (q >= end) return 0;
+    out[o] = '\0';
+    return 1;
+}
@@ -0,0 +1,98 @@
+#ifndef NETCHAT_WEBSOCKET_H
+#define NETCHAT_WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ========= RFC 6455 WEBSOCKET PROTOCOL =========
+ * Opening handshake, an incremental frame parser that accepts input in
+ * arbitrary pieces, payload unmasking (SSE2 when available), server-side
+ * frame headers and the small amount of JSON the chat events need.
+ * No I/O happens here; the server feeds bytes in and writes bytes out.
+ */
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+#define WS_MAX_MESSAGE 4096      // Largest reassembled data message we accept
+#define WS_MAX_CONTROL 125       // RFC 6455 limit for control frame payloads
+#define WS_MAX_HEADER 10         // Server frames are never masked
+
+/* ws_parse() results */
+#define WS_NEED_MORE 0
+#define WS_MESSAGE 1             // Complete text/binary message in message[]
+#define WS_CONTROL 2             // Complete ping/pong/close in control[]
+#define WS_ERROR -1              // Protocol violation: close with 1002
+#define WS_TOO_BIG -2            // Message exceeds WS_MAX_MESSAGE: close with 1009
+
+typedef struct {
+    int state;                   // Header, extended length, mask key or payload
+    uint8_t header[14];
+    size_t header_have;
+    size_t header_need;
+
+    int fin;
+    int opcode;
+    uint8_t mask[4];
+    uint64_t payload_len;
+    uint64_t payload_have;
+
+    int message_opcode;          // Opcode of the first fragment of a data message
+    int in_message;              // Between a non-FIN data frame and its final continuation
+    uint8_t message[WS_MAX_MESSAGE];
+    size_t message_len;
+
+    int control_opcode;
+    uint8_t control[WS_MAX_CONTROL];
+    size_t control_len;
+} WsParser;
+
+void ws_parser_init(WsParser *p);
+
+/* Consume up to len bytes; *consumed says how many. Stops after each complete message. */
+int ws_parse(WsParser *p, const uint8_t *data, size_t len, size_t *consumed);
+
+/* 1 while a frame is half-received */
+int ws_parser_partial(const WsParser *p);
+
+/* XOR payload bytes with the 4-byte key, starting at key offset 'phase' */
+void ws_unmask(uint8_t *data, size_t len, const uint8_t mask[4], size_t phase);
+
+/* Unmasked FIN frame header for a payload of len bytes; returns header length */
+size_t ws_frame_header(uint8_t *out, int opcode, size_t len);
+
+/* Handshake: find Sec-WebSocket-Key in a complete request and build the 101 reply.
+   Returns the reply length, or 0 if the request is not a valid upgrade. */
+size_t ws_handshake_response(const char *request, char *out, size_t cap);
+
+/* ========= SHA-1 =========
+ * Needed for Sec-WebSocket-Accept; the file store names uploads by it too.
+ */
+
+typedef struct {
+    uint32_t h[5];
+    uint64_t total;
+    uint8_t block[64];
+    size_t used;
+} Sha1;
+
+void sha1_init(Sha1 *s);
+void sha1_update(Sha1 *s, const uint8_t *data, size_t len);
+void sha1_final(Sha1 *s, uint8_t out[20]);
+
+/* ========= MINIMAL JSON ========= */
+
+/* Append s as a JSON string body (no quotes) with escaping; returns new length */
+size_t json_escape(char *out, size_t pos, size_t cap, const char *s, size_t len);
+
+/* Find "key":"value" anywhere in a flat object; unescapes into out. 1 if found. */
+int json_get_string(const char *json, size_t len, const char *key, char *out, size_t cap);
+
+/* 1 if "key":true appears in the object */
+int json_get_bool(const char *json, size_t len, const char *key);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../server/log_archive.h"
+
+/* netchat-log: read chat.log across rotations.
+
+   Prints the lines logged in a time window, oldest first, from the
+   compressed archives, the segments still waiting for the compressor and
+   the live chat.log. Only the archive chunks that overlap the window are
+   inflated.
+
+   Usage: ./tools/netchat-log [-d dir] [-l chat.log] [-f from] [-t to] [-D] [-i] [-v]
+          from/to: "YYYY-MM-DD[ HH:MM[:SS]]", "HH:MM[:SS]" (today),
+                   or "-30s", "-15m", "-2h", "-7d" before now
+          -D puts the date in front of every line
+          -i lists the archives and their time ranges instead
+          -v reports what was read on stderr
+   Run it where the server runs (server/ for make run-enhanced).
+*/
+
+#define DEFAULT_DIR "logs"
+#define DEFAULT_ACTIVE "chat.log"
+
+int show_date = 0;
+
+/* A time given on the command line; -1 if it is not one */
+time_t parse_time(const char *spec) {
+    time_t now = time(NULL);
+    if (spec[0] == '-') {
+        char *unit;
+        long n = strtol(spec + 1, &unit, 10);
+        if (unit == spec + 1 || n < 0) return -1;
+        switch (*unit) {
+            case 's': case '\0': return now - n;
+            case 'm': return now - n * 60;
+            case 'h': return now - n * 3600;
+            case 'd': return now - n * 86400;
+            default: return -1;
+        }
+    }
+
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    int hour = 0, min = 0, sec = 0;
+    if (sscanf(spec, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &hour, &min, &sec) >= 3) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+    } else if (sscanf(spec, "%2d:%2d:%2d", &hour, &min, &sec) < 2) {
+        return -1;
+    }
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_sec = sec;
+    return mktime(&tm);
+}
+
+void format_time(time_t t, char *out, size_t cap) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(out, cap, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+int print_line(time_t when, const char *line, size_t len, void *arg) {
+    (void)arg;
+    if (show_date) {
+        char date[16];
+        struct tm tm;
+        localtime_r(&when, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d ", &tm);
+        fputs(date, stdout);
+    }
+    fwrite(line, 1, len, stdout);
+    if (len == 0 || line[len - 1] != '\n') putchar('\n');
+    return ferror(stdout) ? 1 : 0;
+}
+
+int list_archives(const char *dir) {
+    LogArchiveEntry *entries;
+    int count = log_archive_list(dir, &entries);
+    if (count < 0) {
+        fprintf(stderr, "No archive index in %s/\n", dir);
+        return 1;
+    }
+    uint64_t raw = 0, gz = 0;
+    printf("%-22s %-19s   %-19s %10s %10s %7s\n", "segments", "first line", "last line", "raw MB", "gz MB",
+           "chunks");
+    for (int i = 0; i < count; i++) {
+        LogArchiveEntry *e = &entries[i];
+        char name[24], first[24], last[24];
+        if (e->first_seq == e->last_seq) snprintf(name, sizeof(name), "%06u", e->first_seq);
+        else snprintf(name, sizeof(name), "%06u-%06u", e->first_seq, e->last_seq);
+        format_time(e->first_time, first, sizeof(first));
+        format_time(e->last_time, last, sizeof(last));
+        printf("%-22s %s - %s %10.1f %10.1f %7u\n", name, first, last, e->raw_bytes / 1048576.0,
+               e->gz_bytes / 1048576.0, e->chunks);
+        raw += e->raw_bytes;
+        gz += e->gz_bytes;
+    }
+    printf("%d archives, %.1f MB of log in %.1f MB (%.1fx)\n", count, raw / 1048576.0, gz / 1048576.0,
+           gz ? (double)raw / (double)gz : 0.0);
+    free(entries);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = DEFAULT_DIR;
+    const char *active = DEFAULT_ACTIVE;
+    time_t from = 0, to = (time_t)LONG_MAX;
+    int list = 0, verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:l:f:t:Div")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 'l': active = optarg[0] ? optarg : NULL; break;
+            case 'f':
+            case 't': {
+                time_t t = parse_time(optarg);
+                if (t < 0) {
+                    fprintf(stderr, "Not a time: %s\n", optarg);
+                    return 1;
+                }
+                if (opt == 'f') from = t;
+                else to = t;
+                break;
+            }
+            case 'D': show_date = 1; break;
+            case 'i': list = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-d dir] [-l chat.log] [-f from] [-t to] [-D] [-i] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (list) return list_archives(dir);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    LogReadStats stats;
+    long lines = log_archive_read(dir, active, from, to, print_line, NULL, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fflush(stdout);
+    if (lines < 0) {
+        fprintf(stderr, "Cannot read the archive in %s/\n", dir);
+        return 1;
+    }
+    if (verbose) {
+        double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        fprintf(stderr, "%ld lines in %.1f ms: %d chunks inflated from %d archives (%.1f MB), "
+                        "%.1f MB read uncompressed\n",
+                lines, ms, stats.chunks, stats.archives, stats.inflated / 1048576.0, stats.scanned / 1048576.0);
+    }
+    return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../server/monitor.h"
+
+/* netchat-top: watch a running server.
+
+   Maps the server's monitor object read-only and, every interval, shows
+   connections, broadcast queue and backlog depths, per-lane write rates
+   with latency percentiles, shed messages, the busiest rooms and the
+   latest events. Rates and percentiles come from the difference between
+   two snapshots, so the server does no more work while this runs.
+
+   Usage: ./tools/netchat-top [-m name] [-i ms] [-n count] [-e events] [-b]
+          -m the monitor object (NETCHAT_MONITOR on the server; /netchat_monitor)
+          -i milliseconds between screens (1000)
+          -n stop after this many screens
+          -e events to show (10)
+          -b batch: no screen clearing, and only events new since the last screen
+   A restarted or upgraded server is picked up on the next screen.
+*/
+
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_EVENTS 10
+
+static const char *level_names[] = { "normal", "rejecting logins", "throttling", "shedding notices" };
+static const char *lane_names[MONITOR_LANES] = { "control", "bulk" };
+
+typedef struct {
+    const MonitorRoom *room;
+    double rate;
+} RoomRow;
+
+void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+void format_clock(uint64_t unix_ms, char *out, size_t cap) {
+    time_t t = (time_t)(unix_ms / 1000);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    size_t n = strftime(out, cap, "%H:%M:%S", &tm);
+    snprintf(out + n, cap - n, ".%03u", (unsigned)(unix_ms % 1000));
+}
+
+void format_uptime(uint64_t ms, char *out, size_t cap) {
+    uint64_t s = ms / 1000;
+    if (s >= 86400) snprintf(out, cap, "%llud%02lluh", (unsigned long long)(s / 86400),
+                             (unsigned long long)(s % 86400 / 3600));
+    else if (s >= 3600) snprintf(out, cap, "%lluh%02llum", (unsigned long long)(s / 3600),
+                                 (unsigned long long)(s % 3600 / 60));
+    else snprintf(out, cap, "%llum%02llus", (unsigned long long)(s / 60), (unsigned long long)(s % 60));
+}
+
+/* Upper bound of the histogram bucket holding the pct-th percentile of counts; "-" without samples */
+void format_percentile(const uint64_t *counts, uint64_t total, int pct, char *out, size_t cap) {
+    if (total == 0) {
+        snprintf(out, cap, "-");
+        return;
+    }
+    uint64_t want = (total * pct + 99) / 100, seen = 0;
+    for (int b = 0; b < MONITOR_LAT_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= want) {
+            if (b == MONITOR_LAT_BUCKETS - 1) snprintf(out, cap, ">%llus", (1ULL << (b - 1)) / 1000);
+            else snprintf(out, cap, "<%llums", 1ULL << b);
+            return;
+        }
+    }
+    snprintf(out, cap, "-");
+}
+
+int compare_rooms(const void *a, const void *b) {
+    const RoomRow *x = a, *y = b;
+    if (x->rate != y->rate) return x->rate < y->rate ? 1 : -1;
+    if (x->room->members != y->room->members) return x->room->members < y->room->members ? 1 : -1;
+    return strcmp(x->room->name, y->room->name);
+}
+
+/* Messages the room had in the earlier snapshot, or its current total if it is new */
+uint64_t room_before(const MonitorStats *prev, const MonitorRoom *room) {
+    for (uint32_t i = 0; i < prev->rooms && i < MONITOR_ROOMS; i++) {
+        if (strncmp(prev->room[i].name, room->name, MONITOR_ROOM_NAME) == 0) return prev->room[i].messages;
+    }
+    return room->messages;
+}
+
+void show_stats(const char *name, const MonitorStats *cur, const MonitorStats *prev) {
+    double secs = prev ? (double)(cur->published_ms - prev->published_ms) / 1000.0 : 0.0;
+    if (secs <= 0) prev = NULL;
+
+    char clock[16], uptime[16];
+    format_clock(cur->published_ms, clock, sizeof(clock));
+    format_uptime(cur->published_ms - cur->started_ms, uptime, sizeof(uptime));
+    int level = cur->overload_level >= 0 && cur->overload_level <= 3 ? cur->overload_level : 0;
+    printf("netchat-top  %s  pid %d  up %s  overload %d (%s)  %s\n\n", name, cur->pid, uptime,
+           cur->overload_level, level_names[level], clock);
+
+    printf("Connections  %u/%u  logged in %u  websocket %u  gateways %u (%u channels)\n",
+           cur->clients, cur->max_clients, cur->logged_in, cur->websocket, cur->gateways, cur->channels);
+    printf("Queue        %u/%u (control %u, bulk %u)  peak %u  arena %u/%u KB\n", cur->queue_depth,
+           cur->queue_slots, cur->lane_depth[0], cur->lane_depth[1], cur->queue_peak, cur->arena_used / 1024,
+           cur->arena_bytes / 1024);
+    printf("Backlog      %u connections, %llu KB (largest %llu KB)\n", cur->backlogged,
+           (unsigned long long)(cur->backlog_bytes / 1024), (unsigned long long)(cur->backlog_max / 1024));
+
+    for (int l = 0; l < MONITOR_LANES; l++) {
+        uint64_t counts[MONITOR_LAT_BUCKETS], total = 0;
+        for (int b = 0; b < MONITOR_LAT_BUCKETS; b++) {
+            counts[b] = cur->lane_wait[l][b] - (prev ? prev->lane_wait[l][b] : 0);
+            total += counts[b];
+        }
+        char p50[16], p90[16], p99[16];
+        format_percentile(counts, total, 50, p50, sizeof(p50));
+        format_percentile(counts, total, 90, p90, sizeof(p90));
+        format_percentile(counts, total, 99, p99, sizeof(p99));
+        printf("%-12s %-7s %9.1f writes/s  queued p50 %-7s p90 %-7s p99 %-7s\n", l == 0 ? "Output" : "",
+               lane_names[l], prev ? (cur->lane_writes[l] - prev->lane_writes[l]) / secs : 0.0, p50, p90, p99);
+    }
+
+    printf("Shed/s       rate-limited %.1f  queue full %.1f  room budget %.1f  notices %.1f  "
+           "slow consumers dropped %llu\n",
+           prev ? (cur->rate_limited - prev->rate_limited) / secs : 0.0,
+           prev ? (cur->queue_full_drops - prev->queue_full_drops) / secs : 0.0,
+           prev ? (cur->room_budget_drops - prev->room_budget_drops) / secs : 0.0,
+           prev ? (cur->notices_dropped - prev->notices_dropped) / secs : 0.0,
+           (unsigned long long)cur->slow_drops);
+
+    RoomRow rows[MONITOR_ROOMS];
+    uint32_t count = cur->rooms < MONITOR_ROOMS ? cur->rooms : MONITOR_ROOMS;
+    for (uint32_t i = 0; i < count; i++) {
+        rows[i].room = &cur->room[i];
+        rows[i].rate = prev ? (cur->room[i].messages - room_before(prev, &cur->room[i])) / secs : 0.0;
+    }
+    qsort(rows, count, sizeof(RoomRow), compare_rooms);
+    printf("\n%-30s %8s %10s %12s\n", "Room", "members", "msgs/s", "messages");
+    for (uint32_t i = 0; i < count; i++) {
+        printf("%-30.*s %8u %10.1f %12llu\n", MONITOR_ROOM_NAME, rows[i].room->name, rows[i].room->members,
+               rows[i].rate, (unsigned long long)rows[i].room->messages);
+    }
+}
+
+/* The last shown events, oldest first; from is the first ring position not yet shown */
+uint64_t show_events(const MonitorShared *m, uint64_t from, int limit) {
+    printf("\nEvents      ");
+    for (int t = 0; t < MON_EVENT_TYPES; t++) {
+        printf(" %s %llu", monitor_event_name(t),
+               (unsigned long long)__atomic_load_n(&m->event_counts[t], __ATOMIC_RELAXED));
+    }
+    putchar('\n');
+
+    uint64_t head = __atomic_load_n(&m->event_head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > (uint64_t)limit ? head - (uint64_t)limit : 0;
+    if (from > start) start = from;
+    for (uint64_t pos = start; pos < head; pos++) {
+        MonitorEvent e;
+        if (!monitor_read_event(m, pos, &e)) continue;  // Being written, or already overwritten
+        char clock[16];
+        format_clock(e.unix_ms, clock, sizeof(clock));
+        printf("  %s  %-10s %s\n", clock, monitor_event_name(e.type), e.text);
+    }
+    return head;
+}
+
+int main(int argc, char **argv) {
+    const char *name = MONITOR_NAME;
+    int interval = DEFAULT_INTERVAL_MS;
+    long screens = -1;
+    int events = DEFAULT_EVENTS;
+    int batch = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:i:n:e:b")) != -1) {
+        switch (opt) {
+            case 'm': name = optarg; break;
+            case 'i': interval = atoi(optarg); break;
+            case 'n': screens = atol(optarg); break;
+            case 'e': events = atoi(optarg); break;
+            case 'b': batch = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-m name] [-i ms] [-n count] [-e events] [-b]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (interval <= 0) interval = DEFAULT_INTERVAL_MS;
+    if (events < 0) events = 0;
+    if (events > MONITOR_EVENTS) events = MONITOR_EVENTS;
+
+    const MonitorShared *m = NULL;
+    uint64_t ino = 0, event_from = 0;
+    static MonitorStats cur, prev;
+    int have_prev = 0, waiting = 0;
+
+    while (screens != 0) {
+        /* A restarted server replaces the object: follow it */
+        if (m && monitor_current(name) != ino) {
+            monitor_detach(m);
+            m = NULL;
+        }
+        if (!m) {
+            m = monitor_attach(name, &ino);
+            have_prev = 0;
+            event_from = 0;
+            if (!m) {
+                if (!waiting) fprintf(stderr, "Waiting for a server to publish %s...\n", name);
+                waiting = 1;
+                sleep_ms(interval);
+                continue;
+            }
+            waiting = 0;
+        }
+
+        if (monitor_read(m, &cur) < 0) {
+            sleep_ms(interval);
+            continue;
+        }
+        if (cur.published_ms == 0) {  // Nothing published yet
+            sleep_ms(interval);
+            continue;
+        }
+
+        if (!batch) printf("\033[H\033[2J");
+        show_stats(name, &cur, have_prev ? &prev : NULL);
+        event_from = show_events(m, batch ? event_from : 0, events);
+        if (batch) putchar('\n');
+        fflush(stdout);
+
+        prev = cur;
+        have_prev = 1;
+        if (screens > 0) screens--;
+        if (screens != 0) sleep_ms(interval);
+    }
+    monitor_detach(m);
+    return 0;
+}